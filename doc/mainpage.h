@@ -6,6 +6,39 @@
  * libmtp is a library for the Media Transfer Protocol (MTP)
  * under various POSIX operating systems.
  *
+ * \section Threading
+ *
+ * When libmtp is built with POSIX threads, one device may be used from
+ * several threads at a time. Different devices are always independent.
+ *
+ * Every PTP transaction with a device is serialized by a per-device
+ * transaction lock, and a file transfer holds it from start to end.
+ * The object cache is protected by a reader/writer lock: queries that
+ * are answered from the cache, such as LIBMTP_Get_Folder_List(),
+ * LIBMTP_Get_Filelisting_With_Callback() and LIBMTP_Get_Filemetadata()
+ * on an object that is already cached, only read it and run in parallel
+ * with each other and with transfers. Calls that change the cache wait
+ * for the readers to finish. The same lock covers the storage list and
+ * the device information, which events may replace, inside libmtp. The
+ * device information is guarded by a lock of its own as well, which
+ * is taken wherever libmtp checks what the device supports.
+ * LIBMTP_Read_Event() waits on the interrupt
+ * endpoint without holding any lock, so a thread can wait for events
+ * while other threads use the device.
+ *
+ * A few things remain the caller's responsibility:
+ *
+ * - Callbacks (progress functions, data handlers, listing callbacks)
+ *   are called with the device locked and must not call back into
+ *   libmtp for the same device.
+ * - The storage list in <code>device-&gt;storage</code> is replaced by
+ *   LIBMTP_Get_Storage(), so an application must not read it directly
+ *   while that runs.
+ * - The error stack is shared by all threads using a device.
+ * - LIBMTP_Init() must be called before any other thread uses libmtp,
+ *   and LIBMTP_Release_Device() only once no other thread, including
+ *   one blocked in LIBMTP_Read_Event(), uses the device anymore.
+ *
  * \section License
  *
  * libmtp is available under the GNU Lesser General Public License,
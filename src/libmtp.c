@@ -57,6 +57,19 @@
 #ifdef _MSC_VER // For MSVC++
 #define USE_WINDOWS_IO_H
 #include <io.h>
+#include <direct.h>
+#include <sys/utime.h>
+#else
+#include <utime.h>
+#include <dirent.h>
+#endif
+
+/* MSVC does not have these */
+#ifndef S_ISDIR
+#define S_ISDIR(m) (((m) & S_IFMT) == S_IFDIR)
+#endif
+#ifndef S_ISREG
+#define S_ISREG(m) (((m) & S_IFMT) == S_IFREG)
 #endif
 
 
@@ -120,6 +133,35 @@ static filemap_t *g_filemap = NULL;
 // This holds the global property mapping table
 static propertymap_t *g_propertymap = NULL;
 
+// Secondary indexes over the object cache, see LIBMTP_Query_Objects()
+struct query_index_struct;
+// Settable properties per format, kept while sending a batch of files
+struct send_props_cache_struct;
+
+/*
+ * The parameters of a device together with the state libmtp keeps for
+ * it internally. The params pointer of a device points to one of these,
+ * which keeps this state out of the public device struct.
+ */
+typedef struct mtp_params_struct {
+  PTPParams ptp; /**< Must come first, params is also used as PTPParams */
+  int event_cache_update; /**< Whether events update the cache */
+  struct query_index_struct *query_index; /**< Secondary indexes over the cache */
+  LIBMTP_cache_fill_t cache_fill; /**< How the cache was last filled */
+  uint32_t cache_fill_msec; /**< How long filling the cache last took */
+  uint16_t *metadata_props; /**< Properties to fill the cache with, NULL for all */
+  int nrofmetadata_props; /**< Number of properties in metadata_props */
+  LIBMTP_progressfunc_t fill_callback; /**< Progress while filling the cache */
+  void const *fill_callback_data; /**< Data for fill_callback */
+  uint64_t fill_done; /**< Bytes received in the finished fill passes */
+  uint64_t fill_pass_total; /**< Bytes of the current fill pass */
+  int fill_passes_left; /**< Fill passes still to come after this one */
+  int folder_proplist_failed; /**< A folder could not be listed with one property list */
+} mtp_params_t;
+
+// The internal state of a device
+#define PRIV(device) ((mtp_params_t *) (device)->params)
+
 /*
  * Forward declarations of local (static) functions.
  */
@@ -136,11 +178,18 @@ static void add_ptp_error_to_errorstack(LIBMTP_mtpdevice_t *device,
 					uint16_t ptp_error,
 					char const * const error_text);
 static void flush_handles(LIBMTP_mtpdevice_t *device);
+static LIBMTP_file_t *obj2file_cached(LIBMTP_mtpdevice_t *device, PTPObject *ob);
 static void get_handles_recursively(LIBMTP_mtpdevice_t *device,
 				    PTPParams *params,
 				    uint32_t storageid,
 				    uint32_t parent);
+static int get_children_metadata_fast(LIBMTP_mtpdevice_t *device,
+				      uint32_t const storage,
+				      uint32_t const parent,
+				      PTPObject **children,
+				      uint32_t *nrofchildren);
 static void free_storage_list(LIBMTP_mtpdevice_t *device);
+static void free_query_index(struct query_index_struct *index);
 static int sort_storage_by(LIBMTP_mtpdevice_t *device, int const sortby);
 static uint32_t get_writeable_storageid(LIBMTP_mtpdevice_t *device,
 					uint64_t fitsize);
@@ -201,9 +250,36 @@ static int update_abstract_list(LIBMTP_mtpdevice_t *device,
 				uint16_t const objectformat,
 				uint32_t const * const tracks,
 				uint32_t const no_tracks);
-static int send_file_object_info(LIBMTP_mtpdevice_t *device, LIBMTP_file_t *filedata);
+static int send_file_object_info(LIBMTP_mtpdevice_t *device, LIBMTP_file_t *filedata,
+				 struct send_props_cache_struct *propcache);
+static int send_files(LIBMTP_mtpdevice_t *device,
+		      char const * const * const paths,
+		      LIBMTP_file_t * const * const filedata,
+		      uint32_t const nroffiles,
+		      LIBMTP_progressfunc_t const callback,
+		      void const * const data,
+		      int const updatecache);
+static int get_files(LIBMTP_mtpdevice_t *device,
+		     uint32_t const * const ids,
+		     uint32_t const nrofids,
+		     char const * const path,
+		     LIBMTP_openfunc_t const openfunc,
+		     void const * const opendata,
+		     LIBMTP_progressfunc_t const callback,
+		     LIBMTP_fileprogressfunc_t const filecallback,
+		     void const * const data,
+		     uint8_t * const fetched);
+static uint32_t create_folder(LIBMTP_mtpdevice_t *device, char *name,
+			      uint32_t parent_id, uint32_t storage_id);
 static void add_object_to_cache(LIBMTP_mtpdevice_t *device, uint32_t object_id);
 static void update_metadata_cache(LIBMTP_mtpdevice_t *device, uint32_t object_id);
+static void purge_objects_from_cache(PTPParams *params, uint8_t const * const doomed);
+static void purge_object_trees_from_cache(PTPParams *params, uint8_t * const doomed);
+static void remove_object_tree_from_cache(LIBMTP_mtpdevice_t *device, uint32_t object_id);
+static void remove_storage_from_cache(LIBMTP_mtpdevice_t *device, uint32_t storage_id);
+static void update_storage_info(LIBMTP_mtpdevice_t *device, uint32_t storage_id);
+static void update_device_info(LIBMTP_mtpdevice_t *device);
+static void invalidate_device_property(LIBMTP_mtpdevice_t *device, uint16_t propcode);
 static int set_object_filename(LIBMTP_mtpdevice_t *device,
 		uint32_t object_id,
 		uint16_t ptp_type,
@@ -1852,13 +1928,13 @@ LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Uncached(LIBMTP_raw_device_t *rawdevi
   // Non-cached by default
   mtp_device->cached = 0;
 
-  /* Create PTP params */
-  current_params = (PTPParams *) malloc(sizeof(PTPParams));
+  /* Create PTP params, along with the internal state of the device */
+  current_params = (PTPParams *) malloc(sizeof(mtp_params_t));
   if (current_params == NULL) {
     free(mtp_device);
     return NULL;
   }
-  memset(current_params, 0, sizeof(PTPParams));
+  memset(current_params, 0, sizeof(mtp_params_t));
   current_params->device_flags = rawdevice->device_entry.device_flags;
   current_params->nrofobjects = 0;
   current_params->objects = NULL;
@@ -1871,17 +1947,7 @@ LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Uncached(LIBMTP_raw_device_t *rawdevi
   current_params->error_func = LIBMTP_ptp_error;
   /* TODO: Will this always be little endian? */
   current_params->byteorder = PTP_DL_LE;
-  current_params->cd_locale_to_ucs2 = iconv_open("UCS-2LE", "UTF-8");
-  current_params->cd_ucs2_to_locale = iconv_open("UTF-8", "UCS-2LE");
-
-  if(current_params->cd_locale_to_ucs2 == (iconv_t) -1 ||
-     current_params->cd_ucs2_to_locale == (iconv_t) -1) {
-    LIBMTP_ERROR("LIBMTP PANIC: Cannot open iconv() converters to/from UCS-2!\n"
-	    "Too old stdlibc, glibc and libiconv?\n");
-    free(current_params);
-    free(mtp_device);
-    return NULL;
-  }
+  ptp_init_locks(current_params);
   mtp_device->params = current_params;
 
   /* Create usbinfo, this also opens the session */
@@ -1889,6 +1955,7 @@ LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Uncached(LIBMTP_raw_device_t *rawdevi
 			     current_params,
 			     &mtp_device->usbinfo);
   if (err != LIBMTP_ERROR_NONE) {
+    ptp_free_locks(current_params);
     free(current_params);
     free(mtp_device);
     return NULL;
@@ -1906,6 +1973,7 @@ LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Uncached(LIBMTP_raw_device_t *rawdevi
 
     /* Prevent memory leaks for this device */
     free(mtp_device->usbinfo);
+    ptp_free_locks(current_params);
     free(mtp_device->params);
     current_params = NULL;
     free(mtp_device);
@@ -2152,12 +2220,10 @@ LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device(LIBMTP_raw_device_t *rawdevice)
 int LIBMTP_Read_Event(LIBMTP_mtpdevice_t *device, LIBMTP_event_t *event, uint32_t *out1)
 {
   /*
-   * FIXME: Potential race-condition here, if client deallocs device
-   * while we're *not* waiting for input. As we'll be waiting for
-   * input most of the time, it's unlikely but still worth considering
-   * for improvement. Also we cannot affect the state of the cache etc
-   * unless we know we are the sole user on the device. A spinlock or
-   * mutex in the LIBMTP_mtpdevice_t is needed for this to work.
+   * Waiting for an event only uses the interrupt endpoint and holds no
+   * lock, so other threads can keep using the device meanwhile. Cache
+   * updates below take the cache lock like any other caller. The client
+   * must still not release the device while a thread is in here.
    */
   PTPParams *params = (PTPParams *) device->params;
   PTPContainer ptp_event;
@@ -2187,37 +2253,72 @@ int LIBMTP_Read_Event(LIBMTP_mtpdevice_t *device, LIBMTP_event_t *event, uint32_
       break;
     case PTP_EC_ObjectAdded:
       LIBMTP_INFO("Received event PTP_EC_ObjectAdded in session %u\n", session_id);
+      if (PRIV(device)->event_cache_update && device->cached) {
+        PTPObject *ob;
+
+        ptp_lock_cache(params, 1);
+        /* Objects we created ourselves are already in the cache */
+        if (ptp_object_find(params, param1, &ob) != PTP_RC_OK)
+          add_object_to_cache(device, param1);
+        ptp_unlock_cache(params);
+      }
       *event = LIBMTP_EVENT_OBJECT_ADDED;
       *out1 = param1;
       break;
     case PTP_EC_ObjectRemoved:
       LIBMTP_INFO("Received event PTP_EC_ObjectRemoved in session %u\n", session_id);
+      if (PRIV(device)->event_cache_update && device->cached) {
+        ptp_lock_cache(params, 1);
+        remove_object_tree_from_cache(device, param1);
+        ptp_unlock_cache(params);
+      }
       *event = LIBMTP_EVENT_OBJECT_REMOVED;
       *out1 = param1;
       break;
     case PTP_EC_StoreAdded:
       LIBMTP_INFO("Received event PTP_EC_StoreAdded in session %u\n", session_id);
-      /* TODO: rescan storages */
+      if (PRIV(device)->event_cache_update) {
+        ptp_lock_cache(params, 1);
+        LIBMTP_Get_Storage(device, LIBMTP_STORAGE_SORTBY_NOTSORTED);
+        if (device->cached) {
+          /* Drop any stale leftovers before walking the new storage */
+          remove_storage_from_cache(device, param1);
+          get_handles_recursively(device, params, param1, PTP_GOH_ROOT_PARENT);
+        }
+        ptp_unlock_cache(params);
+      }
       *event = LIBMTP_EVENT_STORE_ADDED;
       *out1 = param1;
       break;
     case PTP_EC_StoreRemoved:
       LIBMTP_INFO("Received event PTP_EC_StoreRemoved in session %u\n", session_id);
-      /* TODO: rescan storages */
+      if (PRIV(device)->event_cache_update) {
+        ptp_lock_cache(params, 1);
+        if (device->cached)
+          remove_storage_from_cache(device, param1);
+        LIBMTP_Get_Storage(device, LIBMTP_STORAGE_SORTBY_NOTSORTED);
+        ptp_unlock_cache(params);
+      }
       *event = LIBMTP_EVENT_STORE_REMOVED;
       *out1 = param1;
       break;
     case PTP_EC_DevicePropChanged:
       LIBMTP_INFO("Received event PTP_EC_DevicePropChanged in session %u\n", session_id);
-      /* TODO: update device properties */
+      if (PRIV(device)->event_cache_update)
+        invalidate_device_property(device, (uint16_t) param1);
       break;
     case PTP_EC_ObjectInfoChanged:
       LIBMTP_INFO("Received event PTP_EC_ObjectInfoChanged in session %u\n", session_id);
-      /* TODO: rescan object cache or just for this one object */
+      if (PRIV(device)->event_cache_update && device->cached) {
+        ptp_lock_cache(params, 1);
+        update_metadata_cache(device, param1);
+        ptp_unlock_cache(params);
+      }
       break;
     case PTP_EC_DeviceInfoChanged:
       LIBMTP_INFO("Received event PTP_EC_DeviceInfoChanged in session %u\n", session_id);
-      /* TODO: update device info */
+      if (PRIV(device)->event_cache_update)
+        update_device_info(device);
       break;
     case PTP_EC_RequestObjectTransfer:
       LIBMTP_INFO("Received event PTP_EC_RequestObjectTransfer in session %u\n", session_id);
@@ -2230,7 +2331,11 @@ int LIBMTP_Read_Event(LIBMTP_mtpdevice_t *device, LIBMTP_event_t *event, uint32_
       break;
     case PTP_EC_StorageInfoChanged :
       LIBMTP_INFO( "Received event PTP_EC_StorageInfoChanged in session %u\n", session_id);
-     /* TODO: update storage info */
+      if (PRIV(device)->event_cache_update) {
+        ptp_lock_cache(params, 1);
+        update_storage_info(device, param1);
+        ptp_unlock_cache(params);
+      }
       break;
     case PTP_EC_CaptureComplete :
       LIBMTP_INFO( "Received event PTP_EC_CaptureComplete in session %u\n", session_id);
@@ -2246,6 +2351,243 @@ int LIBMTP_Read_Event(LIBMTP_mtpdevice_t *device, LIBMTP_event_t *event, uint32_
   return 0;
 }
 
+/**
+ * This function controls whether LIBMTP_Read_Event() shall keep the
+ * object cache, the storage list and the device information up to date
+ * by itself as events arrive from the device. It is off by default, in
+ * which case events are only reported to the caller.
+ *
+ * When enabled, an added or changed object is fetched individually and
+ * put into the cache, a removed object is dropped from the cache along
+ * with everything below it, added and removed storages cause the storage
+ * list to be rescanned and changed storage info is refreshed in place.
+ * This removes the need to reopen or rescan the device just because a
+ * new picture was taken on it.
+ *
+ * The updates take the same locks as the rest of the library, so other
+ * threads may keep using the device while events are being handled.
+ * This includes the device information, which is replaced when the
+ * device reports a change: that holds the cache lock along with the
+ * device info lock that every check of a supported operation takes.
+ *
+ * @param device a pointer to the device to change event handling for.
+ * @param enable non-zero to update the cache from events, 0 to only
+ *        report events.
+ * @see LIBMTP_Read_Event()
+ */
+void LIBMTP_Set_Event_Cache_Update(LIBMTP_mtpdevice_t *device, int const enable)
+{
+  PRIV(device)->event_cache_update = enable ? 1 : 0;
+}
+
+/**
+ * This function puts a ceiling on the memory used to cache the extended
+ * metadata of objects, i.e. everything beyond the object info that is
+ * read from object property lists, such as track titles and artists.
+ * On devices with hundreds of thousands of objects these lists take up
+ * most of the cache.
+ *
+ * When the ceiling is passed, the least recently used property lists
+ * are dropped until a quarter of the allowance is free again. They are
+ * read back from the device, one object at a time, when needed. The
+ * object info (name, parent, storage, format, size and dates) is never
+ * dropped, so listings and LIBMTP_Query_Objects() stay fast. Devices
+ * that cannot retrieve the property list of a single object keep
+ * everything regardless.
+ *
+ * The memory is estimated from the property lists themselves, without
+ * the allocator overhead. The ceiling applies per device.
+ *
+ * @param device a pointer to the device to limit the cache of.
+ * @param bytes the ceiling in bytes, 0 for no ceiling, which is the
+ *        default.
+ */
+void LIBMTP_Set_Cache_Memory_Limit(LIBMTP_mtpdevice_t *device,
+				   uint64_t const bytes)
+{
+  PTPParams *params = (PTPParams *) device->params;
+
+  ptp_lock_cache(params, 1);
+  params->mtpprops_limit = bytes;
+  ptp_objects_trim_mtpprops(params, NULL);
+  ptp_unlock_cache(params);
+}
+
+/*
+ * The properties retrieved for the metadata profiles, see
+ * LIBMTP_Set_Metadata_Profile(). Every profile includes the minimal one.
+ */
+static const uint16_t minimal_metadata_props[] = {
+  PTP_OPC_ObjectFileName,
+  PTP_OPC_ParentObject,
+  PTP_OPC_StorageID,
+  PTP_OPC_ObjectFormat,
+  PTP_OPC_ObjectSize,
+  PTP_OPC_DateModified
+};
+static const uint16_t file_metadata_props[] = {
+  PTP_OPC_ProtectionStatus,
+  PTP_OPC_DateCreated,
+  PTP_OPC_Name
+};
+static const uint16_t track_metadata_props[] = {
+  PTP_OPC_Artist,
+  PTP_OPC_Composer,
+  PTP_OPC_Genre,
+  PTP_OPC_AlbumName,
+  PTP_OPC_OriginalReleaseDate,
+  PTP_OPC_Track,
+  PTP_OPC_Duration,
+  PTP_OPC_SampleRate,
+  PTP_OPC_NumberOfChannels,
+  PTP_OPC_AudioWAVECodec,
+  PTP_OPC_AudioBitRate,
+  PTP_OPC_BitRateType,
+  PTP_OPC_Rating,
+  PTP_OPC_UseCount
+};
+
+#define NROF_PROPS(props) (sizeof(props) / sizeof(props[0]))
+
+/**
+ * Append property codes to a property set, skipping duplicates.
+ * @param set the property set, large enough for all codes.
+ * @param nrofset the number of codes in the set, updated.
+ * @param props the codes to add.
+ * @param nrofprops the number of codes to add.
+ */
+static void add_metadata_props(uint16_t *set, int *nrofset,
+			       uint16_t const * const props,
+			       int const nrofprops)
+{
+  int i, j;
+
+  for (i = 0; i < nrofprops; i++) {
+    for (j = 0; j < *nrofset; j++) {
+      if (set[j] == props[i])
+	break;
+    }
+    if (j == *nrofset)
+      set[(*nrofset)++] = props[i];
+  }
+}
+
+/**
+ * This function selects which metadata is read for every object when
+ * the object cache of a device is filled. By default all properties of
+ * all objects are read in one go, including album art descriptors,
+ * lyrics and codec details that a file browser never shows. On devices
+ * with a lot of music that is several times more than a listing needs.
+ *
+ * With a profile other than <code>LIBMTP_METADATA_ALL</code> only the
+ * properties of the profile are requested, one property at a time for
+ * all objects. The metadata that is left out is read per object when
+ * it is asked for, e.g. by <code>LIBMTP_Get_Trackmetadata()</code>, so
+ * pick the profile that matches what the application lists. Devices
+ * that cannot retrieve a single property for all objects get all
+ * properties anyway.
+ *
+ * The cache of a device opened with <code>LIBMTP_Open_Raw_Device()</code>
+ * is filled when it is opened, so changing the profile refills it.
+ *
+ * @param device a pointer to the device to set the profile for.
+ * @param profile the profile to use.
+ * @param props additional properties to read with
+ *        <code>LIBMTP_METADATA_CUSTOM</code>, added to those of
+ *        <code>LIBMTP_METADATA_MINIMAL</code>. Ignored with the other
+ *        profiles, may be NULL.
+ * @param nrofprops the number of properties in <code>props</code>.
+ * @return 0 on success, any other value means failure.
+ */
+int LIBMTP_Set_Metadata_Profile(LIBMTP_mtpdevice_t *device,
+				LIBMTP_metadata_profile_t const profile,
+				LIBMTP_property_t const * const props,
+				int const nrofprops)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint16_t *set = NULL;
+  int nrofset = 0;
+  int i;
+
+  if (profile != LIBMTP_METADATA_ALL) {
+    int extra = (profile == LIBMTP_METADATA_CUSTOM && props != NULL) ?
+      nrofprops : 0;
+
+    set = malloc((NROF_PROPS(minimal_metadata_props) +
+		  NROF_PROPS(file_metadata_props) +
+		  NROF_PROPS(track_metadata_props) + extra) * sizeof(uint16_t));
+    if (set == NULL) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			      "LIBMTP_Set_Metadata_Profile(): out of memory.");
+      return -1;
+    }
+    add_metadata_props(set, &nrofset, minimal_metadata_props,
+		       NROF_PROPS(minimal_metadata_props));
+    if (profile == LIBMTP_METADATA_FILES ||
+	profile == LIBMTP_METADATA_TRACKS)
+      add_metadata_props(set, &nrofset, file_metadata_props,
+			 NROF_PROPS(file_metadata_props));
+    if (profile == LIBMTP_METADATA_TRACKS)
+      add_metadata_props(set, &nrofset, track_metadata_props,
+			 NROF_PROPS(track_metadata_props));
+    for (i = 0; i < extra; i++) {
+      uint16_t code = map_libmtp_property_to_ptp_property(props[i]);
+
+      if (code != 0)
+	add_metadata_props(set, &nrofset, &code, 1);
+    }
+  }
+
+  ptp_lock_cache(params, 1);
+  free(PRIV(device)->metadata_props);
+  PRIV(device)->metadata_props = set;
+  PRIV(device)->nrofmetadata_props = nrofset;
+  if (device->cached)
+    flush_handles(device);
+  ptp_unlock_cache(params);
+  return 0;
+}
+
+/**
+ * This function reports how large the object cache of a device is and
+ * how well it works, which helps sizing hosts with many devices and
+ * spotting devices that cannot list all their objects in one go and
+ * have to be walked folder by folder instead.
+ *
+ * The memory figures are estimates that leave out the allocator
+ * overhead. Gathering them walks the whole cache.
+ *
+ * @param device a pointer to the device to report on.
+ * @param stats a pointer to a statistics struct that will be filled in.
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Set_Cache_Memory_Limit()
+ */
+int LIBMTP_Get_Cache_Stats(LIBMTP_mtpdevice_t *device,
+			   LIBMTP_cache_stats_t * const stats)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint32_t i;
+
+  memset(stats, 0, sizeof(LIBMTP_cache_stats_t));
+  ptp_lock_cache(params, 0);
+  stats->objects = params->nrofobjects;
+  stats->object_bytes = (uint64_t) params->nrofobjects * sizeof(PTPObject);
+  for (i = 0; i < params->nrofobjects; i++) {
+    PTPObject *ob = &params->objects[i];
+
+    stats->proplist_bytes += ptp_object_mtpprops_size(ob);
+    if (ob->oi.Filename != NULL)
+      stats->string_bytes += strlen(ob->oi.Filename) + 1;
+    if (ob->oi.Keywords != NULL)
+      stats->string_bytes += strlen(ob->oi.Keywords) + 1;
+  }
+  ptp_get_want_stats(params, &stats->hits, &stats->misses, &stats->requests);
+  stats->fill = PRIV(device)->cache_fill;
+  stats->fill_msec = PRIV(device)->cache_fill_msec;
+  ptp_unlock_cache(params);
+  return 0;
+}
+
 /**
  * Recursive function that adds MTP devices to a linked list
  * @param devices a list of raw devices to have real devices created for.
@@ -2362,11 +2704,11 @@ void LIBMTP_Release_Device(LIBMTP_mtpdevice_t *device)
   close_device(ptp_usb, params);
   // Clear error stack
   LIBMTP_Clear_Errorstack(device);
-  // Free iconv() converters...
-  iconv_close(params->cd_locale_to_ucs2);
-  iconv_close(params->cd_ucs2_to_locale);
   free(ptp_usb);
+  free_query_index(PRIV(device)->query_index);
+  free(PRIV(device)->metadata_props);
   ptp_free_params(params);
+  ptp_free_locks(params);
   free(params);
   free_storage_list(device);
   // Free extension list...
@@ -2406,6 +2748,7 @@ static void add_error_to_errorstack(LIBMTP_mtpdevice_t *device,
   newerror->errornumber = errornumber;
   newerror->error_text = strdup(error_text);
   newerror->next = NULL;
+  ptp_lock_errors((PTPParams *) device->params);
   if (device->errorstack == NULL) {
     device->errorstack = newerror;
   } else {
@@ -2416,6 +2759,7 @@ static void add_error_to_errorstack(LIBMTP_mtpdevice_t *device,
     }
     tmp->next = newerror;
   }
+  ptp_unlock_errors((PTPParams *) device->params);
 }
 
 /**
@@ -2476,8 +2820,12 @@ void LIBMTP_Clear_Errorstack(LIBMTP_mtpdevice_t *device)
   if (device == NULL) {
     LIBMTP_ERROR("LIBMTP PANIC: Trying to clear the error stack of a NULL device!\n");
   } else {
-    LIBMTP_error_t *tmp = device->errorstack;
+    LIBMTP_error_t *tmp;
 
+    ptp_lock_errors((PTPParams *) device->params);
+    tmp = device->errorstack;
+    device->errorstack = NULL;
+    ptp_unlock_errors((PTPParams *) device->params);
     while (tmp != NULL) {
       LIBMTP_error_t *tmp2;
 
@@ -2488,7 +2836,6 @@ void LIBMTP_Clear_Errorstack(LIBMTP_mtpdevice_t *device)
       tmp = tmp->next;
       free(tmp2);
     }
-    device->errorstack = NULL;
   }
 }
 
@@ -2503,8 +2850,10 @@ void LIBMTP_Dump_Errorstack(LIBMTP_mtpdevice_t *device)
   if (device == NULL) {
     LIBMTP_ERROR("LIBMTP PANIC: Trying to dump the error stack of a NULL device!\n");
   } else {
-    LIBMTP_error_t *tmp = device->errorstack;
+    LIBMTP_error_t *tmp;
 
+    ptp_lock_errors((PTPParams *) device->params);
+    tmp = device->errorstack;
     while (tmp != NULL) {
       if (tmp->error_text != NULL) {
 	LIBMTP_ERROR("Error %d: %s\n", tmp->errornumber, tmp->error_text);
@@ -2513,237 +2862,940 @@ void LIBMTP_Dump_Errorstack(LIBMTP_mtpdevice_t *device)
       }
       tmp = tmp->next;
     }
+    ptp_unlock_errors((PTPParams *) device->params);
   }
 }
 
 /**
- * This command gets all handles and stuff by FAST directory retrieveal
- * which is available by getting all metadata for object
- * <code>0xffffffff</code> which simply means "all metadata for all objects".
- * This works on the vast majority of MTP devices (there ARE exceptions!)
- * and is quite quick. Check the error stack to see if there were
- * problems getting the metadata.
+ * Store one property from an object property list in an object.
+ * The properties that make up the PTP object info are stored there,
+ * all others are kept in the per-object property list. The object
+ * takes over the property value.
+ * @param device the device the object resides on.
+ * @param ob the object to store the property in.
+ * @param prop the property to store.
  * @return 0 if all was OK, -1 on failure.
  */
-static int get_all_metadata_fast(LIBMTP_mtpdevice_t *device)
+static int add_prop_to_object(LIBMTP_mtpdevice_t *device, PTPObject *ob,
+			      MTPProperties *prop)
 {
-  PTPParams      *params = (PTPParams *) device->params;
-  int		 cnt = 0;
-  int            i, j, nrofprops;
-  uint32_t	 lasthandle = 0xffffffff;
-  MTPProperties  *props = NULL;
-  MTPProperties  *prop;
-  uint16_t       ret;
-  int            oldtimeout;
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  switch (prop->property) {
+  case PTP_OPC_ParentObject:
+    ob->oi.ParentObject = prop->propval.u32;
+    ob->flags |= PTPOBJECT_PARENTOBJECT_LOADED;
+    break;
+  case PTP_OPC_ObjectFormat:
+    ob->oi.ObjectFormat = prop->propval.u16;
+    break;
+  case PTP_OPC_ObjectSize:
+    // The object info holds the full 64 bit size
+    if (device->object_bitsize == 64) {
+      ob->oi.ObjectCompressedSize = prop->propval.u64;
+    } else {
+      ob->oi.ObjectCompressedSize = prop->propval.u32;
+    }
+    break;
+  case PTP_OPC_StorageID:
+    ob->oi.StorageID = prop->propval.u32;
+    ob->flags |= PTPOBJECT_STORAGEID_LOADED;
+    break;
+  case PTP_OPC_ObjectFileName:
+    if (prop->propval.str != NULL) {
+      free(ob->oi.Filename);
+      ob->oi.Filename = prop->propval.str;
+      prop->propval.str = NULL;
+    }
+    break;
+  case PTP_OPC_DateModified:
+    /*
+     * Parse the date into the object info as well so that
+     * obj2file() sees it, but keep the property around.
+     */
+    if (prop->propval.str != NULL) {
+      ob->oi.ModificationDate =
+	ptp_parse_date((PTPParams *) device->params, prop->propval.str);
+    }
+    /* Fall through */
+  default: {
+    MTPProperties *newprops;
 
-  /*
-   * The follow request causes the device to generate
-   * a list of every file on the device and return it
-   * in a single response.
-   *
-   * Some slow devices as well as devices with very
-   * large file systems can easily take longer then
-   * the standard timeout value before it is able
-   * to return a response.
-   *
-   * Temporarly set timeout to allow working with
-   * widest range of devices.
-   */
-  get_usb_device_timeout(ptp_usb, &oldtimeout);
-  set_usb_device_timeout(ptp_usb, 60000);
+    /* Copy all of the other MTP oprierties into the per-object proplist */
+    if (ob->nrofmtpprops) {
+      newprops = realloc(ob->mtpprops,
+			 (ob->nrofmtpprops+1)*sizeof(MTPProperties));
+    } else {
+      newprops = calloc(1,sizeof(MTPProperties));
+    }
+    if (!newprops) {
+      ptp_destroy_object_prop(prop);
+      return -1;
+    }
+    ob->mtpprops = newprops;
+    memcpy(&ob->mtpprops[ob->nrofmtpprops], prop, sizeof(*prop));
+    ob->nrofmtpprops++;
+    ob->flags |= PTPOBJECT_MTPPROPLIST_LOADED;
+    return 0;
+  }
+  }
+  ptp_destroy_object_prop(prop);
+  return 0;
+}
 
-  ret = ptp_mtp_getobjectproplist(params, 0xffffffff, &props, &nrofprops);
-  set_usb_device_timeout(ptp_usb, oldtimeout);
+/**
+ * A set of object handles.
+ */
+typedef struct handle_set_struct {
+  uint32_t *slots; /**< Open addressed table, 0 marks a free slot */
+  uint32_t size; /**< Number of slots, a power of two */
+  uint32_t used; /**< Number of handles in the set */
+} handle_set_t;
 
-  if (ret == PTP_RC_MTP_Specification_By_Group_Unsupported) {
-    // What's the point in the device implementing this command if
-    // you cannot use it to get all props for AT LEAST one object?
-    // Well, whatever...
-    add_ptp_error_to_errorstack(device, ret, "get_all_metadata_fast(): "
-    "cannot retrieve all metadata for an object on this device.");
-    return -1;
+/**
+ * Looks for a handle in a set.
+ * @return the slot holding the handle, or the free slot to put it in.
+ */
+static uint32_t *handle_set_slot(handle_set_t const *set, uint32_t const handle)
+{
+  uint32_t i = (handle * 2654435761U) & (set->size - 1);
+
+  while (set->slots[i] != 0 && set->slots[i] != handle)
+    i = (i + 1) & (set->size - 1);
+  return &set->slots[i];
+}
+
+/**
+ * Tells whether a handle is in a set.
+ */
+static int handle_set_contains(handle_set_t const *set, uint32_t const handle)
+{
+  return set->used > 0 && *handle_set_slot(set, handle) == handle;
+}
+
+/**
+ * Adds a handle other than 0 to a set.
+ * @return 0 on success, -1 if out of memory.
+ */
+static int handle_set_add(handle_set_t *set, uint32_t const handle)
+{
+  uint32_t *slot;
+
+  // Keep the table at most half full
+  if ((set->used + 1) * 2 > set->size) {
+    handle_set_t grown;
+    uint32_t i;
+
+    grown.size = set->size ? set->size * 2 : 256;
+    grown.used = set->used;
+    grown.slots = calloc(grown.size, sizeof(uint32_t));
+    if (grown.slots == NULL)
+      return -1;
+    for (i = 0; i < set->size; i++) {
+      if (set->slots[i] != 0)
+	*handle_set_slot(&grown, set->slots[i]) = set->slots[i];
+    }
+    free(set->slots);
+    *set = grown;
   }
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "get_all_metadata_fast(): "
-    "could not get proplist of all objects.");
-    return -1;
+  slot = handle_set_slot(set, handle);
+  if (*slot == 0) {
+    *slot = handle;
+    set->used++;
   }
-  if (props == NULL && nrofprops != 0) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-			    "get_all_metadata_fast(): "
-			    "call to ptp_mtp_getobjectproplist() returned "
-			    "inconsistent results.");
-    return -1;
+  return 0;
+}
+
+static void handle_set_clear(handle_set_t *set)
+{
+  free(set->slots);
+  set->slots = NULL;
+  set->size = 0;
+  set->used = 0;
+}
+
+/**
+ * State of an object property list while it is being received, the
+ * properties of each object are collected until the next object
+ * starts.
+ */
+typedef struct metadata_stream_struct {
+  LIBMTP_mtpdevice_t *device; /**< The device being listed */
+  int cache; /**< Collect the objects in the object cache */
+  int nocharge; /**< Leave charging the cached property lists to the caller */
+  uint32_t cachesize; /**< Allocated size of the object cache while filling it */
+  int collect; /**< Collect the objects in the collected array */
+  PTPObject *ob; /**< The object currently being collected */
+  PTPObject scratch; /**< Holds the object when neither caching nor collecting */
+  PTPObject *collected; /**< Objects collected when not caching */
+  uint32_t nrofcollected; /**< Number of collected objects */
+  uint32_t collectedsize; /**< Allocated size of the collected array */
+  LIBMTP_filefunc_t callback; /**< Gets every completed file, may be NULL */
+  void const *data; /**< User data for the callback */
+  int allprops; /**< Every object comes with all its properties */
+  int buffered; /**< The records come sorted by object */
+  int interleaved; /**< The records turned out not to be grouped per object */
+  handle_set_t finished; /**< Objects completed so far */
+  handle_set_t delivered; /**< Objects handed to the callback so far */
+  PTPObject *unplaced; /**< Objects held back from the callback until placed */
+  uint32_t nrofunplaced; /**< Number of held back objects */
+  uint32_t unplacedsize; /**< Allocated size of the unplaced array */
+} metadata_stream_t;
+
+// The properties telling where an object is
+#define STREAM_PLACE_LOADED \
+  (PTPOBJECT_PARENTOBJECT_LOADED|PTPOBJECT_STORAGEID_LOADED)
+
+/**
+ * Hand a completed object from an object property list to the listing
+ * callback, unless it already got it.
+ * @param stream the property list stream.
+ * @param ob the object.
+ * @return PTP_RC_OK to continue, PTP_ERROR_CANCEL if the callback
+ *         cancelled the listing, PTP_RC_GeneralError if out of memory.
+ */
+static uint16_t deliver_streamed_object(metadata_stream_t *stream,
+					PTPObject *ob)
+{
+  LIBMTP_file_t *file;
+
+  if (stream->callback == NULL || ob->oi.ObjectFormat == PTP_OFC_Association ||
+      handle_set_contains(&stream->delivered, ob->oid))
+    return PTP_RC_OK;
+  // A list that has to be fetched again must not repeat any file
+  if (!stream->buffered && handle_set_add(&stream->delivered, ob->oid) != 0)
+    return PTP_RC_GeneralError;
+  file = obj2file_cached(stream->device, ob);
+  if (file != NULL && stream->callback(file, stream->data) != 0)
+    return PTP_ERROR_CANCEL;
+  return PTP_RC_OK;
+}
+
+/**
+ * Wrap up the object currently collected from an object property list
+ * and hand it to the listing callback, if any.
+ * @param stream the property list stream.
+ * @return PTP_RC_OK to continue, any other value to abort the transfer.
+ */
+static uint16_t finish_streamed_object(metadata_stream_t *stream)
+{
+  PTPObject *ob = stream->ob;
+  uint16_t ret = PTP_RC_OK;
+
+  if (ob == NULL)
+    return PTP_RC_OK;
+  if (!stream->buffered && stream->allprops &&
+      handle_set_add(&stream->finished, ob->oid) != 0)
+    return PTP_RC_GeneralError;
+  ob->flags |= PTPOBJECT_OBJECTINFO_LOADED;
+  if (!ob->oi.Filename) {
+    /* I have one such file on my Creative (Marcus) */
+    ob->oi.Filename = strdup("<null>");
   }
   /*
-   * We count the number of objects by counting the ObjectHandle
-   * references, whenever it changes we get a new object, when it's
-   * the same, it is just different properties of the same object.
+   * Some devices leave out where an object is even when asked for all
+   * properties. Its place is asked for once the list is done, and the
+   * callback waits for it until then.
    */
-  prop = props;
-  for (i=0;i<nrofprops;i++) {
-      if (lasthandle != prop->ObjectHandle) {
-	cnt++;
-	lasthandle = prop->ObjectHandle;
-      }
-      prop++;
-  }
-  lasthandle = 0xffffffff;
-  params->objects = calloc (cnt, sizeof(PTPObject));
-  prop = props;
-  i = -1;
-  for (j=0;j<nrofprops;j++) {
-    if (lasthandle != prop->ObjectHandle) {
-      if (i >= 0) {
-        params->objects[i].flags |= PTPOBJECT_OBJECTINFO_LOADED;
-	if (!params->objects[i].oi.Filename) {
-	  /* I have one such file on my Creative (Marcus) */
-	  params->objects[i].oi.Filename = strdup("<null>");
-	}
-      }
-      i++;
-      lasthandle = prop->ObjectHandle;
-      params->objects[i].oid = prop->ObjectHandle;
-    }
-    switch (prop->property) {
-    case PTP_OPC_ParentObject:
-      params->objects[i].oi.ParentObject = prop->propval.u32;
-      params->objects[i].flags |= PTPOBJECT_PARENTOBJECT_LOADED;
-      break;
-    case PTP_OPC_ObjectFormat:
-      params->objects[i].oi.ObjectFormat = prop->propval.u16;
-      break;
-    case PTP_OPC_ObjectSize:
-      // We loose precision here, up to 32 bits! However the commands that
-      // retrieve metadata for files and tracks will make sure that the
-      // PTP_OPC_ObjectSize is read in and duplicated again.
-      if (device->object_bitsize == 64) {
-	params->objects[i].oi.ObjectCompressedSize = (uint32_t) prop->propval.u64;
-      } else {
-	params->objects[i].oi.ObjectCompressedSize = prop->propval.u32;
-      }
-      break;
-    case PTP_OPC_StorageID:
-      params->objects[i].oi.StorageID = prop->propval.u32;
-      params->objects[i].flags |= PTPOBJECT_STORAGEID_LOADED;
-      break;
-    case PTP_OPC_ObjectFileName:
-      if (prop->propval.str != NULL)
-        params->objects[i].oi.Filename = strdup(prop->propval.str);
-      break;
-    default: {
-      MTPProperties *newprops;
-
-      /* Copy all of the other MTP oprierties into the per-object proplist */
-      if (params->objects[i].nrofmtpprops) {
-        newprops = realloc(params->objects[i].mtpprops,
-		(params->objects[i].nrofmtpprops+1)*sizeof(MTPProperties));
-      } else {
-        newprops = calloc(1,sizeof(MTPProperties));
+  if (stream->allprops &&
+      (ob->flags & STREAM_PLACE_LOADED) != STREAM_PLACE_LOADED) {
+    if (!stream->cache && !stream->collect) {
+      if (stream->nrofunplaced == stream->unplacedsize) {
+	uint32_t newsize = stream->unplacedsize ? stream->unplacedsize * 2 : 16;
+	PTPObject *tmp = realloc(stream->unplaced, newsize * sizeof(PTPObject));
+
+	if (tmp == NULL)
+	  return PTP_RC_GeneralError;
+	stream->unplaced = tmp;
+	stream->unplacedsize = newsize;
       }
-      if (!newprops) return 0; /* FIXME: error handling? */
-      params->objects[i].mtpprops = newprops;
-      memcpy(&params->objects[i].mtpprops[params->objects[i].nrofmtpprops],
-	     &props[j],sizeof(props[j]));
-      params->objects[i].nrofmtpprops++;
-      params->objects[i].flags |= PTPOBJECT_MTPPROPLIST_LOADED;
-      break;
-    }
+      stream->unplaced[stream->nrofunplaced++] = *ob;
+      stream->ob = NULL;
+      return PTP_RC_OK;
     }
-    prop++;
-  }
-  /* mark last entry also */
-  params->objects[i].flags |= PTPOBJECT_OBJECTINFO_LOADED;
-  params->nrofobjects = i+1;
-  free (props);
-  /* The device might not give the list in linear ascending order */
-  ptp_objects_sort (params);
-  return 0;
+  } else {
+    ret = deliver_streamed_object(stream, ob);
+  }
+  if (stream->cache) {
+    if (!stream->nocharge)
+      ptp_object_charge_mtpprops((PTPParams *) stream->device->params, ob);
+  } else if (!stream->collect)
+    ptp_free_object(ob);
+  stream->ob = NULL;
+  return ret;
 }
 
 /**
- * This function will recurse through all the directories on the device,
- * starting at the root directory, gathering metadata as it moves along.
- * It works better on some devices that will only return data for a
- * certain directory and does not respect the option to get all metadata
- * for all objects.
+ * Start a new object in the object cache while it is filled from a
+ * property list. Devices list their objects in handle order as a rule,
+ * so objects are appended to the cache, which then stays sorted without
+ * any searching, and the cache grows in steps rather than one object at
+ * a time. Any object out of order is inserted in its place instead.
+ * @param stream the property list stream.
+ * @param handle the handle of the object.
+ * @return a PTP_RC_* code.
  */
-static void get_handles_recursively(LIBMTP_mtpdevice_t *device,
-				    PTPParams *params,
-				    uint32_t storageid,
-				    uint32_t parent)
+static uint16_t append_streamed_object(metadata_stream_t *stream,
+				       uint32_t const handle)
 {
-  PTPObjectHandles currentHandles;
-  int i = 0;
-  uint16_t ret = ptp_getobjecthandles(params,
-                                      storageid,
-                                      PTP_GOH_ALL_FORMATS,
-                                      parent,
-                                      &currentHandles);
+  PTPParams *params = (PTPParams *) stream->device->params;
+  uint16_t ret;
 
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "get_handles_recursively(): could not get object handles.");
-    return;
-  }
+  if (params->nrofobjects == 0 ||
+      handle > params->objects[params->nrofobjects - 1].oid) {
+    if (params->nrofobjects >= stream->cachesize) {
+      uint32_t newsize = params->nrofobjects ? params->nrofobjects * 2 : 256;
+      PTPObject *tmp = realloc(params->objects, newsize * sizeof(PTPObject));
+
+      if (tmp == NULL)
+	return PTP_RC_GeneralError;
+      params->objects = tmp;
+      stream->cachesize = newsize;
+    }
+    stream->ob = &params->objects[params->nrofobjects++];
+    memset(stream->ob, 0, sizeof(PTPObject));
+    stream->ob->oid = handle;
+    return PTP_RC_OK;
+  }
+  // This leaves the cache at its exact size
+  ret = ptp_object_find_or_insert(params, handle, &stream->ob);
+  stream->cachesize = params->nrofobjects;
+  return ret;
+}
 
-  if (currentHandles.Handler == NULL || currentHandles.n == 0)
-    return;
+/**
+ * Receives the records of an object property list as they are decoded.
+ * The list normally comes grouped per object, so an object is complete
+ * when the first property of the next one arrives. An object that
+ * turns up again shows that the device interleaves the records of
+ * several objects instead, which aborts the transfer.
+ */
+static uint16_t metadata_stream_func(PTPParams *params, void *priv,
+				     MTPProperties *prop)
+{
+  metadata_stream_t *stream = (metadata_stream_t *) priv;
+  uint16_t ret;
 
-  // Now descend into any subdirectories found
-  for (i = 0; i < currentHandles.n; i++) {
-    PTPObject *ob;
-    ret = ptp_object_want(params,currentHandles.Handler[i],
-			  PTPOBJECT_OBJECTINFO_LOADED, &ob);
+  if (stream->ob == NULL || stream->ob->oid != prop->ObjectHandle) {
+    if (!stream->buffered && stream->allprops &&
+	handle_set_contains(&stream->finished, prop->ObjectHandle)) {
+      ptp_destroy_object_prop(prop);
+      stream->interleaved = 1;
+      return PTP_RC_GeneralError;
+    }
+    ret = finish_streamed_object(stream);
+    if (ret == PTP_RC_OK && prop->ObjectHandle == 0)
+      ret = PTP_RC_InvalidObjectHandle;
     if (ret == PTP_RC_OK) {
-      if (ob->oi.ObjectFormat == PTP_OFC_Association)
-        get_handles_recursively(device, params,
-				storageid, currentHandles.Handler[i]);
-    } else {
-      add_error_to_errorstack(device,
-			      LIBMTP_ERROR_CONNECTING,
-			      "Found a bad handle, trying to ignore it.");
+      if (stream->cache) {
+	ret = append_streamed_object(stream, prop->ObjectHandle);
+      } else if (stream->collect) {
+	if (stream->nrofcollected == stream->collectedsize) {
+	  uint32_t newsize = stream->collectedsize ? stream->collectedsize * 2 : 64;
+	  PTPObject *tmp = realloc(stream->collected, newsize * sizeof(PTPObject));
+
+	  if (tmp == NULL) {
+	    ptp_destroy_object_prop(prop);
+	    return PTP_RC_GeneralError;
+	  }
+	  stream->collected = tmp;
+	  stream->collectedsize = newsize;
+	}
+	stream->ob = &stream->collected[stream->nrofcollected++];
+	memset(stream->ob, 0, sizeof(PTPObject));
+	stream->ob->oid = prop->ObjectHandle;
+      } else {
+	stream->ob = &stream->scratch;
+	memset(stream->ob, 0, sizeof(PTPObject));
+	stream->ob->oid = prop->ObjectHandle;
+      }
+    }
+    if (ret != PTP_RC_OK) {
+      ptp_destroy_object_prop(prop);
+      // A broken handle is no reason to give up on the others
+      return ret == PTP_RC_InvalidObjectHandle ? PTP_RC_OK : ret;
     }
   }
-  free(currentHandles.Handler);
+  if (add_prop_to_object(stream->device, stream->ob, prop) != 0)
+    return PTP_RC_GeneralError;
+  return PTP_RC_OK;
 }
 
 /**
- * This function refresh the internal handle list whenever
- * the items stored inside the device is altered. On operations
- * that do not add or remove objects, this is typically not
- * called.
- * @param device a pointer to the MTP device to flush handles for.
+ * Free all objects in the object cache.
+ * @param params the PTP parameters holding the cache.
  */
-static void flush_handles(LIBMTP_mtpdevice_t *device)
+static void clear_object_cache(PTPParams *params)
 {
-  PTPParams *params = (PTPParams *) device->params;
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  int ret;
   uint32_t i;
 
-  if (!device->cached) {
+  if (params->objects == NULL)
     return;
-  }
+  for (i=0;i<params->nrofobjects;i++)
+    ptp_free_object (&params->objects[i]);
+  free(params->objects);
+  params->objects = NULL;
+  params->nrofobjects = 0;
+  params->mtpprops_size = 0;
+}
+
+/**
+ * Asks the device where an object from an object property list is,
+ * when the list left that out, and hands the object to the listing
+ * callback.
+ * @param stream the property list stream.
+ * @param ob the object.
+ * @return a PTP_RC_* code.
+ */
+static uint16_t place_streamed_object(metadata_stream_t *stream,
+				      PTPObject *ob)
+{
+  PTPParams *params = (PTPParams *) stream->device->params;
+  PTPObjectInfo oi;
+  uint16_t ret;
+
+  if ((ob->flags & STREAM_PLACE_LOADED) == STREAM_PLACE_LOADED)
+    return PTP_RC_OK;
+  // Only take the place, the list has the rest and 64 bit sizes
+  memset(&oi, 0, sizeof(oi));
+  ret = ptp_getobjectinfo(params, ob->oid, &oi);
+  if (ret == PTP_RC_OK) {
+    if (!(ob->flags & PTPOBJECT_PARENTOBJECT_LOADED))
+      ob->oi.ParentObject = oi.ParentObject == ob->oid ? 0 : oi.ParentObject;
+    if (!(ob->flags & PTPOBJECT_STORAGEID_LOADED))
+      ob->oi.StorageID = oi.StorageID;
+    ob->flags |= STREAM_PLACE_LOADED;
+  }
+  ptp_free_objectinfo(&oi);
+  if (ret != PTP_RC_OK)
+    return ret;
+  return deliver_streamed_object(stream, ob);
+}
+
+/**
+ * Completes the objects of an object property list that lacked their
+ * place, see finish_streamed_object().
+ * @param stream the property list stream.
+ * @return a PTP_RC_* code.
+ */
+static uint16_t place_streamed_objects(metadata_stream_t *stream)
+{
+  PTPParams *params = (PTPParams *) stream->device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) stream->device->usbinfo;
+  LIBMTP_progressfunc_t progress = ptp_usb->current_transfer_callback;
+  uint16_t ret = PTP_RC_OK;
+  uint32_t i;
+
+  if (!stream->allprops)
+    return PTP_RC_OK;
+  // These requests are not part of the progress of the list
+  ptp_usb->current_transfer_callback = NULL;
+  if (stream->cache) {
+    for (i = 0; i < params->nrofobjects && ret == PTP_RC_OK; i++)
+      ret = place_streamed_object(stream, &params->objects[i]);
+  } else if (stream->collect) {
+    for (i = 0; i < stream->nrofcollected && ret == PTP_RC_OK; i++)
+      ret = place_streamed_object(stream, &stream->collected[i]);
+  }
+  for (i = 0; i < stream->nrofunplaced; i++) {
+    if (ret == PTP_RC_OK)
+      ret = place_streamed_object(stream, &stream->unplaced[i]);
+    ptp_free_object(&stream->unplaced[i]);
+  }
+  free(stream->unplaced);
+  stream->unplaced = NULL;
+  stream->nrofunplaced = 0;
+  stream->unplacedsize = 0;
+  ptp_usb->current_transfer_callback = progress;
+  return ret;
+}
+
+/**
+ * The records of an object property list, collected to be sorted.
+ */
+typedef struct metadata_records_struct {
+  MTPProperties *props; /**< The records */
+  uint32_t nrofprops; /**< Number of records */
+  uint32_t size; /**< Allocated size of the props array */
+} metadata_records_t;
+
+static uint16_t collect_record_func(PTPParams *params, void *priv,
+				    MTPProperties *prop)
+{
+  metadata_records_t *records = (metadata_records_t *) priv;
+
+  if (records->nrofprops == records->size) {
+    uint32_t newsize = records->size ? records->size * 2 : 256;
+    MTPProperties *tmp = realloc(records->props, newsize * sizeof(MTPProperties));
+
+    if (tmp == NULL) {
+      ptp_destroy_object_prop(prop);
+      return PTP_RC_GeneralError;
+    }
+    records->props = tmp;
+    records->size = newsize;
+  }
+  records->props[records->nrofprops++] = *prop;
+  return PTP_RC_OK;
+}
+
+static int compare_records(const void *a, const void *b)
+{
+  uint32_t const x = ((MTPProperties const *) a)->ObjectHandle;
+  uint32_t const y = ((MTPProperties const *) b)->ObjectHandle;
+
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * This retrieves an object property list into a stream, decoding it
+ * while it is transferred. Should the device turn out to interleave the
+ * records of different objects, what was decoded is dropped and the
+ * list is requested again, this time buffered and sorted by object
+ * like ptp_mtp_getobjectproplist() does. Files already handed to the
+ * listing callback are not handed out again. Objects the list does not
+ * place in a folder and storage are asked for one by one afterwards.
+ * @param device a pointer to the device.
+ * @param stream the stream state, tells what to do with the objects.
+ *        When filling the cache, the cache must only hold what this
+ *        list brings in.
+ * @param handle the object to list, 0xffffffff for all.
+ * @param property the PTP property code to retrieve, 0xffffffff for
+ *        all properties.
+ * @param depth levels below the object to list, 0xffffffff for all.
+ * @return a PTP_RC_* code.
+ */
+static uint16_t get_metadata_stream(LIBMTP_mtpdevice_t *device,
+				    metadata_stream_t *stream,
+				    uint32_t const handle,
+				    uint32_t const property,
+				    uint32_t const depth)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  metadata_records_t records;
+  uint16_t ret;
+  uint32_t i;
+
+  stream->allprops = (property == 0xffffffffU);
+  stream->buffered = 0;
+  stream->interleaved = 0;
+  ret = ptp_mtp_getobjectproplist_stream(params, handle, property, depth,
+					 metadata_stream_func, stream);
+  // The last object is complete when the list ends
+  if (ret == PTP_RC_OK)
+    ret = finish_streamed_object(stream);
+  if (ret != PTP_RC_OK && stream->ob != NULL &&
+      !stream->cache && !stream->collect)
+    ptp_free_object(stream->ob);
+  stream->ob = NULL;
+  if (!stream->interleaved)
+    goto done;
+
+  /*
+   * Everything is decoded again from the sorted list, the objects
+   * completed so far only skip the callback they already went to.
+   */
+  LIBMTP_INFO("Object property list not grouped per object, "
+	      "getting it again sorted\n");
+  if (stream->cache) {
+    clear_object_cache(params);
+    stream->cachesize = 0;
+  } else if (stream->collect) {
+    for (i = 0; i < stream->nrofcollected; i++)
+      ptp_free_object(&stream->collected[i]);
+    stream->nrofcollected = 0;
+  }
+  for (i = 0; i < stream->nrofunplaced; i++)
+    ptp_free_object(&stream->unplaced[i]);
+  stream->nrofunplaced = 0;
+  memset(&records, 0, sizeof(records));
+  ret = ptp_mtp_getobjectproplist_stream(params, handle, property, depth,
+					 collect_record_func, &records);
+  if (ret == PTP_RC_OK) {
+    qsort(records.props, records.nrofprops, sizeof(MTPProperties),
+	  compare_records);
+    stream->buffered = 1;
+  }
+  for (i = 0; i < records.nrofprops; i++) {
+    MTPProperties *prop = &records.props[i];
+
+    if (ret != PTP_RC_OK)
+      ptp_destroy_object_prop(prop);
+    else
+      ret = metadata_stream_func(params, stream, prop);
+  }
+  free(records.props);
+  if (ret == PTP_RC_OK)
+    ret = finish_streamed_object(stream);
+  if (ret != PTP_RC_OK && stream->ob != NULL &&
+      !stream->cache && !stream->collect)
+    ptp_free_object(stream->ob);
+  stream->ob = NULL;
+
+ done:
+  if (ret == PTP_RC_OK)
+    ret = place_streamed_objects(stream);
+  for (i = 0; i < stream->nrofunplaced; i++)
+    ptp_free_object(&stream->unplaced[i]);
+  free(stream->unplaced);
+  stream->unplaced = NULL;
+  stream->nrofunplaced = 0;
+  stream->unplacedsize = 0;
+  handle_set_clear(&stream->finished);
+  handle_set_clear(&stream->delivered);
+  return ret;
+}
+
+/*
+ * Timeouts for getting the object property list of all objects, in
+ * milliseconds. When the objects can be counted the device gets some
+ * time per object on top of its normal timeout, otherwise it gets a
+ * fixed time which suits most devices.
+ */
+#define METADATA_TIMEOUT_UNCOUNTED  60000
+#define METADATA_TIMEOUT_PER_OBJECT 2
+
+/**
+ * Works out how long to wait for the device to build the object
+ * property list of all objects, from a count of the objects.
+ * @param device a pointer to the device.
+ * @param timeout the normal timeout of the device.
+ * @return the timeout to use in milliseconds.
+ */
+static int get_all_metadata_timeout(LIBMTP_mtpdevice_t *device,
+				    int const timeout)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint32_t numobjects;
+  uint64_t total;
+
+  if (!ptp_operation_issupported(params, PTP_OC_GetNumObjects) ||
+      ptp_getnumobjects(params, PTP_GOH_ALL_STORAGE, PTP_GOH_ALL_FORMATS,
+			PTP_GOH_ALL_ASSOCS, &numobjects) != PTP_RC_OK)
+    return METADATA_TIMEOUT_UNCOUNTED;
+  total = (uint64_t) timeout +
+    (uint64_t) numobjects * METADATA_TIMEOUT_PER_OBJECT;
+  if (total > INT_MAX)
+    return INT_MAX;
+  return (int) total;
+}
+
+/**
+ * Reports the progress of filling the cache. A fill with a metadata
+ * profile takes one pass per property, so the bytes of all passes are
+ * added up and the passes to come are estimated from the current one,
+ * which keeps the progress from starting over on every pass.
+ */
+static int report_fill_progress(uint64_t const sent, uint64_t const total,
+				void const * const data)
+{
+  mtp_params_t *priv = PRIV((LIBMTP_mtpdevice_t const *) data);
+
+  priv->fill_pass_total = total;
+  return priv->fill_callback(priv->fill_done + sent,
+			     priv->fill_done +
+			     total * (1 + priv->fill_passes_left),
+			     priv->fill_callback_data);
+}
+
+/**
+ * This retrieves the object property list of all objects on the device
+ * and decodes it while it is still being transferred, see
+ * get_all_metadata_fast().
+ * @param device a pointer to the device to list.
+ * @param stream the stream state, tells what to do with the objects.
+ * @param property the PTP property code to retrieve, 0xffffffff for
+ *        all properties.
+ * @return a PTP_RC_* code.
+ */
+static uint16_t stream_all_metadata(LIBMTP_mtpdevice_t *device,
+				    metadata_stream_t *stream,
+				    uint32_t const property)
+{
+  PTPParams      *params = (PTPParams *) device->params;
+  PTP_USB        *ptp_usb = (PTP_USB*) device->usbinfo;
+  uint16_t       ret;
+  int            oldtimeout;
+
+  /*
+   * The follow request causes the device to generate
+   * a list of every file on the device and return it
+   * in a single response.
+   *
+   * Some slow devices as well as devices with very
+   * large file systems can easily take longer then
+   * the standard timeout value before it is able
+   * to return a response.
+   *
+   * Temporarly set a timeout that grows with the number
+   * of objects, so large devices get the time they need
+   * and a hung small one is noticed early. The timeout
+   * and the progress state are shared with other threads,
+   * so hold on to the transaction lock.
+   */
+  ptp_lock_transactions(params);
+  get_usb_device_timeout(ptp_usb, &oldtimeout);
+  set_usb_device_timeout(ptp_usb,
+			 get_all_metadata_timeout(device, oldtimeout));
+
+  // The size of the list is only known once it starts arriving
+  ptp_usb->callback_active = 0;
+  ptp_usb->current_transfer_total = 0;
+  ptp_usb->current_transfer_complete = 0;
+  if (PRIV(device)->fill_callback != NULL) {
+    PRIV(device)->fill_pass_total = 0;
+    ptp_usb->current_transfer_callback = report_fill_progress;
+    ptp_usb->current_transfer_callback_data = device;
+  }
+
+  ret = get_metadata_stream(device, stream, 0xffffffff, property, 0xffffffff);
+  PRIV(device)->fill_done += PRIV(device)->fill_pass_total;
+
+  ptp_usb->callback_active = 0;
+  ptp_usb->current_transfer_callback = NULL;
+  ptp_usb->current_transfer_callback_data = NULL;
+  set_usb_device_timeout(ptp_usb, oldtimeout);
+  ptp_unlock_transactions(params);
+  return ret;
+}
 
-  if (params->objects != NULL) {
-    for (i=0;i<params->nrofobjects;i++)
-      ptp_free_object (&params->objects[i]);
+/**
+ * This command gets all handles and stuff by FAST directory retrieveal
+ * which is available by getting all metadata for object
+ * <code>0xffffffff</code> which simply means "all metadata for all objects".
+ * This works on the vast majority of MTP devices (there ARE exceptions!)
+ * and is quite quick. Check the error stack to see if there were
+ * problems getting the metadata.
+ *
+ * The list is decoded into the object cache as it arrives, so the
+ * complete response never needs to be held in memory.
+ * @return 0 if all was OK, 1 if the progress callback cancelled it,
+ *         -1 on failure.
+ */
+static int get_all_metadata_fast(LIBMTP_mtpdevice_t *device)
+{
+  PTPParams      *params = (PTPParams *) device->params;
+  metadata_stream_t stream;
+  uint16_t       ret = PTP_RC_OK;
+  uint32_t       i;
+
+  memset(&stream, 0, sizeof(stream));
+  stream.device = device;
+  stream.cache = 1;
+  stream.cachesize = params->nrofobjects;
+  PRIV(device)->fill_done = 0;
+  PRIV(device)->fill_passes_left = 0;
+  if (PRIV(device)->metadata_props != NULL) {
+    // Every pass adds to the same lists, so charge them once at the end
+    stream.nocharge = 1;
+    for (i = 0; i < PRIV(device)->nrofmetadata_props; i++) {
+      PRIV(device)->fill_passes_left = PRIV(device)->nrofmetadata_props - 1 - i;
+      ret = stream_all_metadata(device, &stream, PRIV(device)->metadata_props[i]);
+      if (ret != PTP_RC_OK)
+	break;
+    }
+    stream.nocharge = 0;
+    PRIV(device)->fill_passes_left = 0;
+    if (ret == PTP_RC_OK) {
+      // The objects only got some of their properties
+      for (i = 0; i < params->nrofobjects; i++) {
+	params->objects[i].flags &= ~PTPOBJECT_MTPPROPLIST_LOADED;
+	ptp_object_charge_mtpprops(params, &params->objects[i]);
+      }
+    } else if (ret != PTP_ERROR_CANCEL) {
+      // Not every device takes a property code, so get everything
+      add_ptp_error_to_errorstack(device, ret, "get_all_metadata_fast(): "
+      "could not get the selected properties, getting all of them.");
+      clear_object_cache(params);
+      stream.cachesize = 0;
+    }
+  }
+  if (PRIV(device)->metadata_props == NULL ||
+      (ret != PTP_RC_OK && ret != PTP_ERROR_CANCEL))
+    ret = stream_all_metadata(device, &stream, 0xffffffffU);
+  // Give back what the growth steps left unused
+  if (params->nrofobjects == 0) {
     free(params->objects);
     params->objects = NULL;
-    params->nrofobjects = 0;
+  } else if (params->nrofobjects < stream.cachesize) {
+    PTPObject *tmp = realloc(params->objects,
+			     params->nrofobjects * sizeof(PTPObject));
+
+    if (tmp != NULL)
+      params->objects = tmp;
+  }
+
+  if (ret == PTP_RC_MTP_Specification_By_Group_Unsupported) {
+    // What's the point in the device implementing this command if
+    // you cannot use it to get all props for AT LEAST one object?
+    // Well, whatever...
+    add_ptp_error_to_errorstack(device, ret, "get_all_metadata_fast(): "
+    "cannot retrieve all metadata for an object on this device.");
+    clear_object_cache(params);
+    return -1;
+  }
+  if (ret == PTP_ERROR_CANCEL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED,
+			    "get_all_metadata_fast(): listing cancelled.");
+    clear_object_cache(params);
+    return 1;
+  }
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "get_all_metadata_fast(): "
+    "could not get proplist of all objects.");
+    // Don't leave a partial cache around, fall back on other methods
+    clear_object_cache(params);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * This puts the contents of a folder into the cache with one object
+ * property list request of depth one, then descends into the
+ * subfolders found.
+ * @param device a pointer to the device.
+ * @param storageid the storage to walk, PTP_GOH_ALL_STORAGE for all.
+ * @param parent the folder, PTP_GOH_ROOT_PARENT for the root folder.
+ * @return 0 on success, -1 if the device could not list the folder
+ *         this way.
+ */
+static int get_folder_recursively_fast(LIBMTP_mtpdevice_t *device,
+				       uint32_t storageid,
+				       uint32_t parent)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTPObject *children = NULL;
+  uint32_t nrofchildren = 0;
+  uint32_t nroffolders = 0;
+  uint32_t i;
+
+  if (get_children_metadata_fast(device,
+				 storageid == PTP_GOH_ALL_STORAGE ? 0 : storageid,
+				 parent, &children, &nrofchildren) != 0)
+    return -1;
+
+  for (i = 0; i < nrofchildren; i++) {
+    PTPObject *ob;
+
+    if (ptp_object_find(params, children[i].oid, &ob) == PTP_RC_OK) {
+      ptp_object_uncharge_mtpprops(params, ob);
+      ptp_free_object(ob);
+    } else if (ptp_object_find_or_insert(params, children[i].oid, &ob) != PTP_RC_OK) {
+      ptp_free_object(&children[i]);
+      continue;
+    }
+    *ob = children[i];
+    ptp_object_charge_mtpprops(params, ob);
+    // Only the handles of the subfolders are needed from here on
+    if (ob->oi.ObjectFormat == PTP_OFC_Association)
+      children[nroffolders++].oid = ob->oid;
+  }
+  for (i = 0; i < nroffolders; i++)
+    get_handles_recursively(device, params, storageid, children[i].oid);
+  free(children);
+  return 0;
+}
+
+/**
+ * This function will recurse through all the directories on the device,
+ * starting at the root directory, gathering metadata as it moves along.
+ * It works better on some devices that will only return data for a
+ * certain directory and does not respect the option to get all metadata
+ * for all objects.
+ *
+ * Where the device can list the properties of a single folder, that is
+ * used to get each folder with a single request. Otherwise the object
+ * info of every object is retrieved one at a time, and once the device
+ * has refused a folder that is done for the rest of the walk.
+ */
+static void get_handles_recursively(LIBMTP_mtpdevice_t *device,
+				    PTPParams *params,
+				    uint32_t storageid,
+				    uint32_t parent)
+{
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  PTPObjectHandles currentHandles;
+  int i = 0;
+  uint16_t ret;
+
+  if (ptp_operation_issupported(params,PTP_OC_MTP_GetObjPropList)
+      && !FLAG_BROKEN_MTPGETOBJPROPLIST(ptp_usb)
+      && !PRIV(device)->folder_proplist_failed) {
+    if (get_folder_recursively_fast(device, storageid, parent) == 0)
+      return;
+    PRIV(device)->folder_proplist_failed = 1;
+  }
+
+  ret = ptp_getobjecthandles(params,
+                                      storageid,
+                                      PTP_GOH_ALL_FORMATS,
+                                      parent,
+                                      &currentHandles);
+
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "get_handles_recursively(): could not get object handles.");
+    return;
+  }
+
+  if (currentHandles.Handler == NULL || currentHandles.n == 0)
+    return;
+
+  // Now descend into any subdirectories found
+  for (i = 0; i < currentHandles.n; i++) {
+    PTPObject *ob;
+    ret = ptp_object_want(params,currentHandles.Handler[i],
+			  PTPOBJECT_OBJECTINFO_LOADED, &ob);
+    if (ret == PTP_RC_OK) {
+      if (ob->oi.ObjectFormat == PTP_OFC_Association)
+        get_handles_recursively(device, params,
+				storageid, currentHandles.Handler[i]);
+    } else {
+      add_error_to_errorstack(device,
+			      LIBMTP_ERROR_CONNECTING,
+			      "Found a bad handle, trying to ignore it.");
+    }
+  }
+  free(currentHandles.Handler);
+}
+
+/**
+ * This function refresh the internal handle list whenever
+ * the items stored inside the device is altered. On operations
+ * that do not add or remove objects, this is typically not
+ * called.
+ * @param device a pointer to the MTP device to flush handles for.
+ */
+static void flush_handles(LIBMTP_mtpdevice_t *device)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  uint64_t start;
+  int ret;
+  uint32_t i;
+
+  if (!device->cached) {
+    return;
   }
 
+  clear_object_cache(params);
+  start = get_time_msec();
+  PRIV(device)->cache_fill = LIBMTP_CACHE_FILL_NONE;
+
   if (ptp_operation_issupported(params,PTP_OC_MTP_GetObjPropList)
       && !FLAG_BROKEN_MTPGETOBJPROPLIST(ptp_usb)
       && !FLAG_BROKEN_MTPGETOBJPROPLIST_ALL(ptp_usb)) {
-    // Use the fast method. Ignore return value for now.
+    // Use the fast method.
     ret = get_all_metadata_fast(device);
+    if (ret == 0)
+      PRIV(device)->cache_fill = LIBMTP_CACHE_FILL_PROPLIST;
+    // Cancelled by the progress callback, so leave the cache empty
+    if (ret == 1)
+      return;
   }
 
   // If the previous failed or returned no objects, use classic
   // methods instead.
   if (params->nrofobjects == 0) {
+    PRIV(device)->folder_proplist_failed = 0;
     // Get all the handles using just standard commands.
     if (device->storage == NULL) {
       get_handles_recursively(device, params,
@@ -2759,6 +3811,10 @@ static void flush_handles(LIBMTP_mtpdevice_t *device)
 	storage = storage->next;
       }
     }
+    // An empty device that was listed all right is still a fast fill
+    if (params->nrofobjects != 0 ||
+	PRIV(device)->cache_fill == LIBMTP_CACHE_FILL_NONE)
+      PRIV(device)->cache_fill = LIBMTP_CACHE_FILL_RECURSIVE;
   }
 
   /*
@@ -2832,6 +3888,7 @@ static void flush_handles(LIBMTP_mtpdevice_t *device)
       device->default_text_folder = ob->oid;
     }
   }
+  PRIV(device)->cache_fill_msec = (uint32_t) (get_time_msec() - start);
 }
 
 /**
@@ -3007,16 +4064,20 @@ static int get_suggested_storage_id(LIBMTP_mtpdevice_t *device,
   PTPParams *params = (PTPParams *) device->params;
   PTPObject *ob;
   uint16_t ret;
+  int store;
 
+  ptp_lock_cache(params, 1);
   ret = ptp_object_want(params, parent_id, PTPOBJECT_MTPPROPLIST_LOADED, &ob);
   if ((ret != PTP_RC_OK) || (ob->oi.StorageID == 0)) {
     add_ptp_error_to_errorstack(device, ret, "get_suggested_storage_id(): "
 				"could not get storage id from parent id.");
-    return get_writeable_storageid(device, fitsize);
+    store = get_writeable_storageid(device, fitsize);
   } else {
     /* OK we know the parent storage, then use that */
-    return ob->oi.StorageID;
+    store = ob->oi.StorageID;
   }
+  ptp_unlock_cache(params);
+  return store;
 }
 
 /**
@@ -3079,9 +4140,12 @@ void LIBMTP_Dump_Device_Info(LIBMTP_mtpdevice_t *device)
   int i;
   PTPParams *params = (PTPParams *) device->params;
   PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  LIBMTP_devicestorage_t *storage = device->storage;
+  LIBMTP_devicestorage_t *storage;
   LIBMTP_device_extension_t *tmpext = device->extensions;
 
+  // Keeps the device info and storage list from being replaced
+  ptp_lock_cache(params, 0);
+  storage = device->storage;
   printf("USB low-level info:\n");
   dump_usbinfo(ptp_usb);
   /* Print out some verbose information */
@@ -3468,6 +4532,7 @@ void LIBMTP_Dump_Device_Info(LIBMTP_mtpdevice_t *device)
 	 device->default_album_folder);
   printf("   Default text folder: 0x%08x\n",
 	 device->default_text_folder);
+  ptp_unlock_cache(params);
 }
 
 /**
@@ -3507,9 +4572,11 @@ char *LIBMTP_Get_Manufacturername(LIBMTP_mtpdevice_t *device)
   char *retmanuf = NULL;
   PTPParams *params = (PTPParams *) device->params;
 
+  ptp_lock_info(params);
   if (params->deviceinfo.Manufacturer != NULL) {
     retmanuf = strdup(params->deviceinfo.Manufacturer);
   }
+  ptp_unlock_info(params);
   return retmanuf;
 }
 
@@ -3526,9 +4593,11 @@ char *LIBMTP_Get_Modelname(LIBMTP_mtpdevice_t *device)
   char *retmodel = NULL;
   PTPParams *params = (PTPParams *) device->params;
 
+  ptp_lock_info(params);
   if (params->deviceinfo.Model != NULL) {
     retmodel = strdup(params->deviceinfo.Model);
   }
+  ptp_unlock_info(params);
   return retmodel;
 }
 
@@ -3544,9 +4613,11 @@ char *LIBMTP_Get_Serialnumber(LIBMTP_mtpdevice_t *device)
   char *retnumber = NULL;
   PTPParams *params = (PTPParams *) device->params;
 
+  ptp_lock_info(params);
   if (params->deviceinfo.SerialNumber != NULL) {
     retnumber = strdup(params->deviceinfo.SerialNumber);
   }
+  ptp_unlock_info(params);
   return retnumber;
 }
 
@@ -3563,9 +4634,11 @@ char *LIBMTP_Get_Deviceversion(LIBMTP_mtpdevice_t *device)
   char *retversion = NULL;
   PTPParams *params = (PTPParams *) device->params;
 
+  ptp_lock_info(params);
   if (params->deviceinfo.DeviceVersion != NULL) {
     retversion = strdup(params->deviceinfo.DeviceVersion);
   }
+  ptp_unlock_info(params);
   return retversion;
 }
 
@@ -3918,30 +4991,34 @@ int LIBMTP_Get_Supported_Filetypes(LIBMTP_mtpdevice_t *device, uint16_t ** const
   PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
   uint16_t *localtypes;
   uint16_t localtypelen;
+  uint32_t nrofformats;
   uint32_t i;
 
   // This is more memory than needed if there are unknown types, but what the heck.
-  localtypes = (uint16_t *) malloc(params->deviceinfo.ImageFormats_len * sizeof(uint16_t));
+  ptp_lock_info(params);
+  nrofformats = params->deviceinfo.ImageFormats_len;
+  localtypes = (uint16_t *) malloc(nrofformats * sizeof(uint16_t));
   localtypelen = 0;
 
-  for (i=0;i<params->deviceinfo.ImageFormats_len;i++) {
+  for (i=0;i<nrofformats;i++) {
     uint16_t localtype = map_ptp_type_to_libmtp_type(params->deviceinfo.ImageFormats[i]);
     if (localtype != LIBMTP_FILETYPE_UNKNOWN) {
       localtypes[localtypelen] = localtype;
       localtypelen++;
     }
   }
+  ptp_unlock_info(params);
   // The forgotten Ogg support on YP-10 and others...
   if (FLAG_OGG_IS_UNKNOWN(ptp_usb)) {
     localtypes = (uint16_t *) realloc(localtypes,
-		(params->deviceinfo.ImageFormats_len+1) * sizeof(uint16_t));
+		(nrofformats+1) * sizeof(uint16_t));
     localtypes[localtypelen] = LIBMTP_FILETYPE_OGG;
     localtypelen++;
   }
   // The forgotten FLAC support on Cowon iAudio S9 and others...
   if (FLAG_FLAC_IS_UNKNOWN(ptp_usb)) {
     localtypes = (uint16_t *) realloc(localtypes,
-		(params->deviceinfo.ImageFormats_len+1) * sizeof(uint16_t));
+		(nrofformats+1) * sizeof(uint16_t));
     localtypes[localtypelen] = LIBMTP_FILETYPE_FLAC;
     localtypelen++;
   }
@@ -4008,6 +5085,10 @@ int LIBMTP_Check_Capability(LIBMTP_mtpdevice_t *device, LIBMTP_devicecap_t cap)
  * do not put a reference to any <code>char *</code> field. instead
  * <code>strncpy()</code> it!
  *
+ * The list is replaced without regard to other threads reading
+ * <code>device-&gt;storage</code>, so do not call this while another
+ * thread may be looking at the list.
+ *
  * @param device a pointer to the device to get the storage for.
  * @param sortby an integer that determines the sorting of the storage list.
  *        Valid sort methods are defined in libmtp.h with beginning with
@@ -4025,15 +5106,20 @@ int LIBMTP_Get_Storage(LIBMTP_mtpdevice_t *device, int const sortby)
   LIBMTP_devicestorage_t *storage = NULL;
   LIBMTP_devicestorage_t *storageprev = NULL;
 
+  ptp_lock_cache(params, 1);
   if (device->storage != NULL)
     free_storage_list(device);
 
   // if (!ptp_operation_issupported(params,PTP_OC_GetStorageIDs))
   //   return -1;
-  if (ptp_getstorageids (params, &storageIDs) != PTP_RC_OK)
+  if (ptp_getstorageids (params, &storageIDs) != PTP_RC_OK) {
+    ptp_unlock_cache(params);
     return -1;
-  if (storageIDs.n < 1)
+  }
+  if (storageIDs.n < 1) {
+    ptp_unlock_cache(params);
     return -1;
+  }
 
   if (!ptp_operation_issupported(params,PTP_OC_GetStorageInfo)) {
     for (i = 0; i < storageIDs.n; i++) {
@@ -4060,6 +5146,7 @@ int LIBMTP_Get_Storage(LIBMTP_mtpdevice_t *device, int const sortby)
       storageprev = storage;
     }
     free(storageIDs.Storage);
+    ptp_unlock_cache(params);
     return 1;
   } else {
     for (i = 0; i < storageIDs.n; i++) {
@@ -4071,6 +5158,7 @@ int LIBMTP_Get_Storage(LIBMTP_mtpdevice_t *device, int const sortby)
 	if (device->storage != NULL) {
           free_storage_list(device);
 	}
+	ptp_unlock_cache(params);
 	return -1;
       }
 
@@ -4101,6 +5189,7 @@ int LIBMTP_Get_Storage(LIBMTP_mtpdevice_t *device, int const sortby)
 
     sort_storage_by(device,sortby);
     free(storageIDs.Storage);
+    ptp_unlock_cache(params);
     return 0;
   }
 }
@@ -4159,11 +5248,11 @@ void LIBMTP_destroy_file_t(LIBMTP_file_t *file)
 
 /**
  * Helper function that takes one PTP object and creates a
- * LIBMTP_file_t metadata entry.
+ * LIBMTP_file_t metadata entry. This only uses what is already
+ * known about the object and never talks to the device.
  */
-static LIBMTP_file_t *obj2file(LIBMTP_mtpdevice_t *device, PTPObject *ob)
+static LIBMTP_file_t *obj2file_cached(LIBMTP_mtpdevice_t *device, PTPObject *ob)
 {
-  PTPParams *params = (PTPParams *) device->params;
   PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
   LIBMTP_file_t *file;
   int i;
@@ -4228,19 +5317,49 @@ static LIBMTP_file_t *obj2file(LIBMTP_mtpdevice_t *device, PTPObject *ob)
 	break;
       }
     }
-  } else if (ptp_operation_issupported(params,PTP_OC_MTP_GetObjectPropsSupported)) {
-    uint16_t *props = NULL;
-    uint32_t propcnt = 0;
-    int ret;
+  }
 
-    // First see which properties can be retrieved for this object format
-    ret = ptp_mtp_getobjectpropssupported(params, map_libmtp_type_to_ptp_type(file->filetype), &propcnt, &props);
-    if (ret != PTP_RC_OK) {
-      add_ptp_error_to_errorstack(device, ret, "obj2file: call to ptp_mtp_getobjectpropssupported() failed.");
-      // Silently fall through.
-    } else {
-      for (i = 0; i < propcnt; i++) {
-	switch (props[i]) {
+  return file;
+}
+
+/**
+ * Tells whether obj2file() has to ask the device about an object,
+ * which may add to the cache and so needs the cache locked exclusively.
+ */
+static int obj2file_needs_device(LIBMTP_mtpdevice_t *device, PTPObject *ob)
+{
+  return ob->mtpprops == NULL &&
+    ptp_operation_issupported((PTPParams *) device->params,
+			      PTP_OC_MTP_GetObjectPropsSupported);
+}
+
+/**
+ * This creates a file struct from a cached object, asking the device
+ * for the exact object size if there is no property list at hand.
+ * @param device the device the object resides on.
+ * @param ob the object to convert.
+ * @return a newly allocated file struct.
+ */
+static LIBMTP_file_t *obj2file(LIBMTP_mtpdevice_t *device, PTPObject *ob)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  LIBMTP_file_t *file;
+  int i;
+
+  file = obj2file_cached(device, ob);
+  if (obj2file_needs_device(device, ob)) {
+    uint16_t *props = NULL;
+    uint32_t propcnt = 0;
+    int ret;
+
+    // First see which properties can be retrieved for this object format
+    ret = ptp_mtp_getobjectpropssupported(params, map_libmtp_type_to_ptp_type(file->filetype), &propcnt, &props);
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, ret, "obj2file: call to ptp_mtp_getobjectpropssupported() failed.");
+      // Silently fall through.
+    } else {
+      for (i = 0; i < propcnt; i++) {
+	switch (props[i]) {
 	case PTP_OPC_ObjectSize:
 	  if (device->object_bitsize == 64) {
 	    file->filesize = get_u64_from_object(device, file->item_id, PTP_OPC_ObjectSize, 0);
@@ -4259,6 +5378,82 @@ static LIBMTP_file_t *obj2file(LIBMTP_mtpdevice_t *device, PTPObject *ob)
   return file;
 }
 
+/**
+ * Locks the object cache exclusively, filling it first if that has not
+ * been done yet.
+ * @param device the device to lock the cache of.
+ * @param callback a function to be called with the bytes of metadata
+ *        received while filling the cache, or NULL.
+ * @param data user-defined pointer passed on to the callback.
+ */
+static void lock_filled_cache(LIBMTP_mtpdevice_t *device,
+			      LIBMTP_progressfunc_t const callback,
+			      void const * const data)
+{
+  PTPParams *params = (PTPParams *) device->params;
+
+  ptp_lock_cache(params, 1);
+  // Get all the handles if we haven't already done that
+  if (params->nrofobjects == 0) {
+    // Only the holder of the exclusive lock gets to fill the cache
+    PRIV(device)->fill_callback = callback;
+    PRIV(device)->fill_callback_data = data;
+    flush_handles(device);
+    PRIV(device)->fill_callback = NULL;
+    PRIV(device)->fill_callback_data = NULL;
+  }
+}
+
+/**
+ * Locks the object cache for a listing, filling the cache first if
+ * that has not been done yet. The cache is left locked shared when it
+ * was already filled, and exclusively otherwise.
+ * @param device the device to lock the cache of.
+ * @param callback a function to be called with the bytes of metadata
+ *        received while filling the cache, or NULL.
+ * @param data user-defined pointer passed on to the callback.
+ */
+static void lock_cache_for_listing(LIBMTP_mtpdevice_t *device,
+				   LIBMTP_progressfunc_t const callback,
+				   void const * const data)
+{
+  PTPParams *params = (PTPParams *) device->params;
+
+  ptp_lock_cache(params, 0);
+  if (params->nrofobjects != 0)
+    return;
+  ptp_unlock_cache(params);
+  lock_filled_cache(device, callback, data);
+}
+
+/**
+ * Locks the object cache for a listing of files made with obj2file(),
+ * like lock_cache_for_listing(). Since obj2file() adds to the cache for
+ * objects without a property list on some devices, the cache is only
+ * left locked shared when none of the files needs that.
+ * @param device the device to lock the cache of.
+ * @param callback a function to be called with the bytes of metadata
+ *        received while filling the cache, or NULL.
+ * @param data user-defined pointer passed on to the callback.
+ */
+static void lock_cache_for_file_listing(LIBMTP_mtpdevice_t *device,
+					LIBMTP_progressfunc_t const callback,
+					void const * const data)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint32_t i;
+
+  ptp_lock_cache(params, 0);
+  for (i = 0; i < params->nrofobjects; i++) {
+    if (params->objects[i].oi.ObjectFormat != PTP_OFC_Association &&
+	obj2file_needs_device(device, &params->objects[i]))
+      break;
+  }
+  if (params->nrofobjects != 0 && i == params->nrofobjects)
+    return;
+  ptp_unlock_cache(params);
+  lock_filled_cache(device, callback, data);
+}
 
 /**
  * This function retrieves the metadata for a single file off
@@ -4281,9 +5476,31 @@ static LIBMTP_file_t *obj2file(LIBMTP_mtpdevice_t *device, PTPObject *ob)
 LIBMTP_file_t *LIBMTP_Get_Filemetadata(LIBMTP_mtpdevice_t *device, uint32_t const fileid)
 {
   PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  LIBMTP_file_t *file = NULL;
   uint16_t ret;
   PTPObject *ob;
 
+  /*
+   * Objects that are already complete in the cache are served under
+   * the shared lock, so that this runs in parallel with transfers.
+   * Anything that needs the device may add to the cache, so that takes
+   * the exclusive lock.
+   */
+  ptp_lock_cache(params, 0);
+  if (ptp_object_find(params, fileid, &ob) == PTP_RC_OK &&
+      (ob->flags & PTPOBJECT_OBJECTINFO_LOADED) &&
+      ((ob->flags & PTPOBJECT_MTPPROPLIST_LOADED) ||
+       FLAG_BROKEN_MTPGETOBJPROPLIST(ptp_usb) ||
+       !ptp_operation_issupported(params,PTP_OC_MTP_GetObjPropList)) &&
+      !obj2file_needs_device(device, ob)) {
+    file = obj2file_cached(device, ob);
+    ptp_unlock_cache(params);
+    return file;
+  }
+  ptp_unlock_cache(params);
+
+  ptp_lock_cache(params, 1);
   // Get all the handles if we haven't already done that
   // (Only on cached devices.)
   if (device->cached && params->nrofobjects == 0) {
@@ -4291,10 +5508,10 @@ LIBMTP_file_t *LIBMTP_Get_Filemetadata(LIBMTP_mtpdevice_t *device, uint32_t cons
   }
 
   ret = ptp_object_want(params, fileid, PTPOBJECT_OBJECTINFO_LOADED|PTPOBJECT_MTPPROPLIST_LOADED, &ob);
-  if (ret != PTP_RC_OK)
-    return NULL;
-
-  return obj2file(device, ob);
+  if (ret == PTP_RC_OK)
+    file = obj2file(device, ob);
+  ptp_unlock_cache(params);
+  return file;
 }
 
 /**
@@ -4335,6 +5552,10 @@ LIBMTP_file_t *LIBMTP_Get_Filelisting(LIBMTP_mtpdevice_t *device)
  * trees by calls to <code>LIBMTP_Get_Storage()</code> and/or
  * <code>LIBMTP_Get_Folder_List()</code> first.
  *
+ * If the metadata has to be read from the device first, the callback
+ * is called with the number of bytes of metadata received so far while
+ * that happens, and then with the number of files listed.
+ *
  * @param device a pointer to the device to get the file listing for.
  * @param callback a function to be called during the tracklisting retrieveal
  *        for displaying progress bars etc, or NULL if you don't want
@@ -4359,10 +5580,7 @@ LIBMTP_file_t *LIBMTP_Get_Filelisting_With_Callback(LIBMTP_mtpdevice_t *device,
   LIBMTP_file_t *curfile = NULL;
   PTPParams *params = (PTPParams *) device->params;
 
-  // Get all the handles if we haven't already done that
-  if (params->nrofobjects == 0) {
-    flush_handles(device);
-  }
+  lock_cache_for_file_listing(device, callback, data);
 
   for (i = 0; i < params->nrofobjects; i++) {
     LIBMTP_file_t *file;
@@ -4398,1345 +5616,1796 @@ LIBMTP_file_t *LIBMTP_Get_Filelisting_With_Callback(LIBMTP_mtpdevice_t *device,
     // double progressPercent = (double)i*(double)100.0 / (double)params->handles.n;
 
   } // Handle counting loop
+  ptp_unlock_cache(params);
   return retfiles;
 }
 
 /**
- * This function retrieves the contents of a certain folder
- * with id parent on a certain storage on a certain device.
- * The result contains both files and folders.
- * The device used with this operations must have been opened with
- * LIBMTP_Open_Raw_Device_Uncached() or it will fail.
+ * This function lists all files on the device, handing each file to
+ * a callback as soon as it is known instead of returning a list in
+ * the end.
  *
- * NOTE: the request will always perform I/O with the device.
- * @param device a pointer to the MTP device to report info from.
- * @param storage a storage on the device to report info from. If
- *        0 is passed in, the files for the given parent will be
- *        searched across all available storages.
- * @param parent the parent folder id.
+ * On an uncached device the object property list is decoded while the
+ * device is still sending it, so the first files arrive almost at once
+ * even on devices with very many files, and the complete listing is
+ * never held in memory. On a cached device the files are taken from
+ * the cache. Devices that cannot list all objects in one go are only
+ * supported when cached.
+ *
+ * The callback must not use the device, since a transfer may be in
+ * progress when it is called.
+ *
+ * @param device a pointer to the device to get the file listing for.
+ * @param callback a function called for every file. The file belongs
+ *        to the callback and shall be destroyed with
+ *        <code>LIBMTP_destroy_file_t()</code>. Returning anything but
+ *        0 from the callback cancels the listing.
+ * @param data a user-defined pointer that is passed along to
+ *        the callback.
+ * @return 0 on success, any other value means failure or that the
+ *        listing was cancelled.
+ * @see LIBMTP_Get_Filelisting_With_Callback()
  */
-LIBMTP_file_t * LIBMTP_Get_Files_And_Folders(LIBMTP_mtpdevice_t *device,
-			     uint32_t const storage,
-			     uint32_t const parent)
+int LIBMTP_Get_Filelisting_Streamed(LIBMTP_mtpdevice_t *device,
+				    LIBMTP_filefunc_t const callback,
+				    void const * const data)
 {
   PTPParams *params = (PTPParams *) device->params;
   PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  LIBMTP_file_t *retfiles = NULL;
-  LIBMTP_file_t *curfile = NULL;
-  PTPObjectHandles currentHandles;
-  uint32_t storageid;
+  metadata_stream_t stream;
   uint16_t ret;
-  int i = 0;
+  uint32_t i;
 
   if (device->cached) {
-    // This function is only supposed to be used by devices
-    // opened as uncached!
-    LIBMTP_ERROR("tried to use %s on a cached device!\n",
-		 __func__);
-    return NULL;
+    lock_cache_for_file_listing(device, NULL, NULL);
+    for (i = 0; i < params->nrofobjects; i++) {
+      LIBMTP_file_t *file;
+      PTPObject *ob = &params->objects[i];
+
+      if (ob->oi.ObjectFormat == PTP_OFC_Association)
+	continue;
+      file = obj2file(device, ob);
+      if (file == NULL)
+	continue;
+      if (callback(file, data) != 0) {
+	ptp_unlock_cache(params);
+	add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED,
+				"LIBMTP_Get_Filelisting_Streamed(): "
+				"listing cancelled.");
+	return -1;
+      }
+    }
+    ptp_unlock_cache(params);
+    return 0;
   }
 
-  if (FLAG_BROKEN_GET_OBJECT_PROPVAL(ptp_usb)) {
-    // These devices cannot handle the commands needed for
-    // Uncached access!
-    LIBMTP_ERROR("tried to use %s on an unsupported device, "
-		 "this command does not work on all devices "
-		 "due to missing low-level support to read "
-		 "information on individual tracks\n",
-		 __func__);
-    return NULL;
+  if (!ptp_operation_issupported(params,PTP_OC_MTP_GetObjPropList)
+      || FLAG_BROKEN_MTPGETOBJPROPLIST(ptp_usb)
+      || FLAG_BROKEN_MTPGETOBJPROPLIST_ALL(ptp_usb)) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Get_Filelisting_Streamed(): "
+			    "this device cannot list all objects at once.");
+    return -1;
   }
 
-  if (storage == 0)
-    storageid = PTP_GOH_ALL_STORAGE;
-  else
-    storageid = storage;
+  memset(&stream, 0, sizeof(stream));
+  stream.device = device;
+  stream.cache = 0;
+  stream.callback = callback;
+  stream.data = data;
+  ret = stream_all_metadata(device, &stream, 0xffffffffU);
+  if (ret == PTP_ERROR_CANCEL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED,
+			    "LIBMTP_Get_Filelisting_Streamed(): "
+			    "listing cancelled.");
+    return -1;
+  }
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret,
+				"LIBMTP_Get_Filelisting_Streamed(): "
+				"could not get proplist of all objects.");
+    return -1;
+  }
+  return 0;
+}
 
-  ret = ptp_getobjecthandles(params,
-			     storageid,
-			     PTP_GOH_ALL_FORMATS,
-			     parent,
-			     &currentHandles);
+/**
+ * Tells whether a cached object resides directly in a certain folder.
+ * @param ob the object to check.
+ * @param storage the storage of the folder, 0 for any storage.
+ * @param parent the folder, 0 for the root folder.
+ * @return 1 if the object is in the folder, 0 otherwise.
+ */
+static int object_in_folder(PTPObject *ob, uint32_t const storage,
+			    uint32_t const parent)
+{
+  if (!(ob->flags & PTPOBJECT_PARENTOBJECT_LOADED))
+    return 0;
+  if (storage != 0 && (ob->flags & PTPOBJECT_STORAGEID_LOADED) &&
+      ob->oi.StorageID != storage)
+    return 0;
+  // Some devices put root objects below 0xffffffff
+  if (parent == 0 || parent == 0xffffffffU)
+    return ob->oi.ParentObject == 0 || ob->oi.ParentObject == 0xffffffffU;
+  return ob->oi.ParentObject == parent;
+}
+
+static int compare_handles(const void *a, const void *b)
+{
+  uint32_t const x = *(uint32_t const *) a;
+  uint32_t const y = *(uint32_t const *) b;
 
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Retrieve the metadata of all objects directly below a folder with
+ * a single object property list request of depth one.
+ * @param device a pointer to the device.
+ * @param storage the storage of the folder, 0 for any storage.
+ * @param parent the folder, 0 for the root folder.
+ * @param children returns a newly allocated array of the objects
+ *        found, these are not in the cache.
+ * @param nrofchildren returns the number of objects found.
+ * @return 0 on success, -1 if the device could not do this.
+ */
+static int get_children_metadata_fast(LIBMTP_mtpdevice_t *device,
+				      uint32_t const storage,
+				      uint32_t const parent,
+				      PTPObject **children,
+				      uint32_t *nrofchildren)
+{
+  metadata_stream_t stream;
+  uint16_t ret;
+  uint32_t i;
+  uint32_t kept = 0;
+
+  memset(&stream, 0, sizeof(stream));
+  stream.device = device;
+  stream.collect = 1;
+  ret = get_metadata_stream(device, &stream,
+			    parent == 0xffffffffU ? 0 : parent,
+			    0xffffffffU, 1);
+  for (i = 0; i < stream.nrofcollected; i++) {
+    PTPObject *ob = &stream.collected[i];
+
+    if (ret == PTP_RC_OK && object_in_folder(ob, storage, parent)) {
+      stream.collected[kept++] = *ob;
+    } else {
+      ptp_free_object(ob);
+    }
+  }
   if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret,
-		"LIBMTP_Get_Files_And_Folders(): could not get object handles.");
-    return NULL;
+    for (i = 0; i < kept; i++)
+      ptp_free_object(&stream.collected[i]);
+    free(stream.collected);
+    return -1;
   }
+  *children = stream.collected;
+  *nrofchildren = kept;
+  return 0;
+}
 
-  if (currentHandles.Handler == NULL || currentHandles.n == 0)
-    return NULL;
+/**
+ * Reconcile the cached contents of one folder with the device.
+ * @param device a pointer to the device.
+ * @param storage the storage of the folder, 0 for any storage.
+ * @param parent the folder, 0 for the root folder.
+ * @param depth levels of folders to refresh, negative for all.
+ * @return 0 on success, -1 on failure.
+ */
+static int refresh_folder(LIBMTP_mtpdevice_t *device,
+			  uint32_t const storage,
+			  uint32_t const parent,
+			  int const depth)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  PTPObject *children = NULL;
+  uint32_t nrofchildren = 0;
+  uint32_t *handles = NULL;
+  uint32_t nrofhandles = 0;
+  uint32_t *folders = NULL;
+  uint8_t *newfolder = NULL;
+  uint32_t nroffolders = 0;
+  uint8_t *doomed;
+  int vanished = 0;
+  int retval = 0;
+  uint32_t i;
+  uint16_t ret;
 
-  for (i = 0; i < currentHandles.n; i++) {
-    LIBMTP_file_t *file;
+  if (ptp_operation_issupported(params,PTP_OC_MTP_GetObjPropList)
+      && !FLAG_BROKEN_MTPGETOBJPROPLIST(ptp_usb)
+      && get_children_metadata_fast(device, storage, parent,
+				    &children, &nrofchildren) == 0) {
+    nrofhandles = nrofchildren;
+    if (nrofhandles > 0)
+      handles = malloc(nrofhandles * sizeof(uint32_t));
+  } else {
+    PTPObjectHandles currentHandles;
 
-    // Get metadata for one file, if it fails, try next file
-    file = LIBMTP_Get_Filemetadata(device, currentHandles.Handler[i]);
-    if (file == NULL)
-      continue;
+    ret = ptp_getobjecthandles(params,
+			       storage == 0 ? PTP_GOH_ALL_STORAGE : storage,
+			       PTP_GOH_ALL_FORMATS,
+			       parent == 0 ? PTP_GOH_ROOT_PARENT : parent,
+			       &currentHandles);
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, ret, "LIBMTP_Refresh_Folder(): "
+				  "could not get object handles.");
+      return -1;
+    }
+    handles = currentHandles.Handler;
+    nrofhandles = currentHandles.n;
+  }
+  if (nrofhandles > 0) {
+    folders = malloc(nrofhandles * sizeof(uint32_t));
+    newfolder = malloc(nrofhandles * sizeof(uint8_t));
+    if (handles == NULL || folders == NULL || newfolder == NULL) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			      "LIBMTP_Refresh_Folder(): out of memory.");
+      for (i = 0; i < nrofchildren; i++)
+	ptp_free_object(&children[i]);
+      free(children);
+      free(handles);
+      free(folders);
+      free(newfolder);
+      return -1;
+    }
+  }
 
-    // Add track to a list that will be returned afterwards.
-    if (curfile == NULL) {
-      curfile = file;
-      retfiles = file;
+  /* Update or add the objects that are there now, in place */
+  for (i = 0; i < nrofhandles; i++) {
+    PTPObject *ob;
+    int isnew = 0;
+
+    if (children != NULL) {
+      handles[i] = children[i].oid;
+      if (ptp_object_find(params, handles[i], &ob) == PTP_RC_OK) {
+	ptp_object_uncharge_mtpprops(params, ob);
+	ptp_free_object(ob);
+      } else if (ptp_object_find_or_insert(params, handles[i], &ob) == PTP_RC_OK) {
+	isnew = 1;
+      } else {
+	ptp_free_object(&children[i]);
+	continue;
+      }
+      *ob = children[i];
+      ptp_object_charge_mtpprops(params, ob);
     } else {
-      curfile->next = file;
-      curfile = file;
+      if (ptp_object_find(params, handles[i], &ob) == PTP_RC_OK) {
+	// Drop what we know and read it anew
+	ptp_object_uncharge_mtpprops(params, ob);
+	ptp_free_object(ob);
+      } else {
+	isnew = 1;
+      }
+      ret = ptp_object_want(params, handles[i], PTPOBJECT_OBJECTINFO_LOADED, &ob);
+      if (ret != PTP_RC_OK) {
+	add_error_to_errorstack(device, LIBMTP_ERROR_CONNECTING,
+				"Found a bad handle, trying to ignore it.");
+	ptp_remove_object_from_cache(params, handles[i]);
+	continue;
+      }
+    }
+    if (ob->oi.Filename == NULL)
+      ob->oi.Filename = strdup("<null>");
+    if (ob->oi.Keywords == NULL)
+      ob->oi.Keywords = strdup("<null>");
+    if (ob->oi.ObjectFormat == PTP_OFC_Association) {
+      folders[nroffolders] = ob->oid;
+      newfolder[nroffolders] = isnew;
+      nroffolders++;
+    }
+  }
+  free(children);
+
+  /* Drop whatever is no longer there, along with its contents */
+  if (nrofhandles > 1)
+    qsort(handles, nrofhandles, sizeof(uint32_t), compare_handles);
+  doomed = calloc(params->nrofobjects ? params->nrofobjects : 1, sizeof(uint8_t));
+  if (doomed != NULL) {
+    for (i = 0; i < params->nrofobjects; i++) {
+      PTPObject *ob = &params->objects[i];
+
+      if (object_in_folder(ob, storage, parent) &&
+	  (nrofhandles == 0 ||
+	   bsearch(&ob->oid, handles, nrofhandles, sizeof(uint32_t),
+		   compare_handles) == NULL)) {
+	doomed[i] = 1;
+	vanished = 1;
+      }
     }
+    if (vanished)
+      purge_object_trees_from_cache(params, doomed);
+    free(doomed);
   }
+  free(handles);
 
-  free(currentHandles.Handler);
+  /*
+   * Descend as deep as we were asked to. Folders we did not know
+   * about before have nothing cached below them, so those are always
+   * walked completely.
+   */
+  for (i = 0; i < nroffolders; i++) {
+    int subdepth;
 
-  // Return a pointer to the original first file
-  // in the big list.
-  return retfiles;
+    if (depth < 0 || newfolder[i])
+      subdepth = -1;
+    else if (depth > 1)
+      subdepth = depth - 1;
+    else
+      continue;
+    if (refresh_folder(device, storage, folders[i], subdepth) != 0)
+      retval = -1;
+  }
+  free(folders);
+  free(newfolder);
+  return retval;
 }
 
-
 /**
- * This creates a new track metadata structure and allocates memory
- * for it. Notice that if you add strings to this structure they
- * will be freed by the corresponding <code>LIBMTP_destroy_track_t</code>
- * operation later, so be careful of using strdup() when assigning
- * strings, e.g.:
+ * This function brings the cached contents of a single folder up to
+ * date with the device, instead of flushing and rereading the whole
+ * cache. New objects are added, objects that are gone are removed
+ * along with their contents and the metadata of the other objects is
+ * read anew. Where the device supports it, the contents of a folder
+ * are retrieved in a single request.
  *
- * <pre>
- * LIBMTP_track_t *track = LIBMTP_new_track_t();
- * track->title = strdup(titlestr);
- * ....
- * LIBMTP_destroy_track_t(track);
- * </pre>
+ * This is useful when another application or the user on the device
+ * itself may have changed a folder that is being shown.
  *
- * @return a pointer to the newly allocated metadata structure.
- * @see LIBMTP_destroy_track_t()
+ * The device used with this operations must have been opened with
+ * LIBMTP_Open_Raw_Device() as the uncached devices have nothing to
+ * refresh.
+ *
+ * @param device a pointer to the device.
+ * @param storage the storage of the folder. If 0 is passed in, the
+ *        folder is refreshed across all storages.
+ * @param parent the folder to refresh, 0 for the root folder.
+ * @param depth how many levels of folders to refresh: 1 for only the
+ *        objects directly in <code>parent</code>, 2 to include the
+ *        contents of its subfolders and so on, or a negative value
+ *        for the whole subtree. Folders that were not in the cache
+ *        before are always read completely.
+ * @return 0 on success, any other value means failure.
  */
-LIBMTP_track_t *LIBMTP_new_track_t(void)
+int LIBMTP_Refresh_Folder(LIBMTP_mtpdevice_t *device,
+			  uint32_t const storage,
+			  uint32_t const parent,
+			  int const depth)
 {
-  LIBMTP_track_t *new = (LIBMTP_track_t *) malloc(sizeof(LIBMTP_track_t));
-  if (new == NULL) {
-    return NULL;
+  PTPParams *params = (PTPParams *) device->params;
+  int ret;
+
+  if (!device->cached) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Refresh_Folder(): "
+			    "only cached devices can be refreshed.");
+    return -1;
   }
-  new->item_id = 0;
-  new->parent_id = 0;
-  new->storage_id = 0;
-  new->title = NULL;
-  new->artist = NULL;
-  new->composer = NULL;
-  new->album = NULL;
-  new->genre = NULL;
-  new->date = NULL;
-  new->filename = NULL;
-  new->duration = 0;
-  new->tracknumber = 0;
-  new->filesize = 0;
-  new->filetype = LIBMTP_FILETYPE_UNKNOWN;
-  new->samplerate = 0;
-  new->nochannels = 0;
-  new->wavecodec = 0;
-  new->bitrate = 0;
-  new->bitratetype = 0;
-  new->rating = 0;
-  new->usecount = 0;
-  new->modificationdate = 0;
-  new->next = NULL;
-  return new;
+  if (depth == 0)
+    return 0;
+  ptp_lock_cache(params, 1);
+  ret = refresh_folder(device, storage, parent, depth);
+  ptp_unlock_cache(params);
+  return ret;
 }
 
+/*
+ * Keys of the secondary indexes kept over the object cache for
+ * LIBMTP_Query_Objects().
+ */
+#define QUERY_KEY_NAME     0
+#define QUERY_KEY_SIZE     1
+#define QUERY_KEY_MODIFIED 2
+#define QUERY_KEY_PARENT   3
+#define QUERY_KEY_FORMAT   4
+#define QUERY_NROFKEYS     5
+
 /**
- * This destroys a track metadata structure and deallocates the memory
- * used by it, including any strings. Never use a track metadata
- * structure again after calling this function on it.
- * @param track the track metadata to destroy.
- * @see LIBMTP_new_track_t()
+ * One entry of a secondary index: the key of a cached object and the
+ * object ID. Names are copies owned by the index, so an index entry
+ * never points into the cache.
  */
-void LIBMTP_destroy_track_t(LIBMTP_track_t *track)
+typedef struct query_entry_struct {
+  union {
+    char const *name;
+    uint64_t number;
+  } key;
+  uint32_t handle;
+} query_entry_t;
+
+/**
+ * The secondary indexes of a device. Each index is built the first
+ * time a query needs it and all of them are dropped as soon as the
+ * cache generation changes, since the keys they store may then be
+ * stale. Objects are looked up by ID, so a stale index can at worst
+ * give a wrong candidate range, never a dangling object.
+ */
+typedef struct query_index_struct {
+  unsigned int generation;
+  uint32_t nrofobjects;
+  query_entry_t *entries[QUERY_NROFKEYS];
+  char *names; /**< The copied keys of the name index */
+} query_index_t;
+
+/**
+ * Frees the secondary indexes of a device.
+ * @param index the indexes to free, may be NULL.
+ */
+static void free_query_index(struct query_index_struct *index)
 {
-  if (track == NULL) {
+  int i;
+
+  if (index == NULL)
     return;
-  }
-  if (track->title != NULL)
-    free(track->title);
-  if (track->artist != NULL)
-    free(track->artist);
-  if (track->composer != NULL)
-    free(track->composer);
-  if (track->album != NULL)
-    free(track->album);
-  if (track->genre != NULL)
-    free(track->genre);
-  if (track->date != NULL)
-    free(track->date);
-  if (track->filename != NULL)
-    free(track->filename);
-  free(track);
-  return;
+  for (i = 0; i < QUERY_NROFKEYS; i++)
+    free(index->entries[i]);
+  free(index->names);
+  free(index);
 }
 
 /**
- * This function maps and copies a property onto the track metadata if applicable.
+ * Returns the size of a cached object, preferring the 64 bit
+ * ObjectSize property over the 32 bit object info field when the
+ * property list has been cached.
  */
-static void pick_property_to_track_metadata(LIBMTP_mtpdevice_t *device, MTPProperties *prop, LIBMTP_track_t *track)
+static uint64_t get_cached_object_size(LIBMTP_mtpdevice_t *device,
+				       PTPObject *ob)
 {
-  switch (prop->property) {
-  case PTP_OPC_Name:
-    if (prop->propval.str != NULL)
-      track->title = strdup(prop->propval.str);
-    else
-      track->title = NULL;
-    break;
-  case PTP_OPC_Artist:
-    if (prop->propval.str != NULL)
-      track->artist = strdup(prop->propval.str);
-    else
-      track->artist = NULL;
-    break;
-  case PTP_OPC_Composer:
-    if (prop->propval.str != NULL)
-      track->composer = strdup(prop->propval.str);
-    else
-      track->composer = NULL;
-    break;
-  case PTP_OPC_Duration:
-    track->duration = prop->propval.u32;
-    break;
-  case PTP_OPC_Track:
-    track->tracknumber = prop->propval.u16;
-    break;
-  case PTP_OPC_Genre:
-    if (prop->propval.str != NULL)
-      track->genre = strdup(prop->propval.str);
-    else
-      track->genre = NULL;
-    break;
-  case PTP_OPC_AlbumName:
-    if (prop->propval.str != NULL)
-      track->album = strdup(prop->propval.str);
-    else
-      track->album = NULL;
-    break;
-  case PTP_OPC_OriginalReleaseDate:
-    if (prop->propval.str != NULL)
-      track->date = strdup(prop->propval.str);
-    else
-      track->date = NULL;
-    break;
-    // These are, well not so important.
-  case PTP_OPC_SampleRate:
-    track->samplerate = prop->propval.u32;
-    break;
-  case PTP_OPC_NumberOfChannels:
-    track->nochannels = prop->propval.u16;
-    break;
-  case PTP_OPC_AudioWAVECodec:
-    track->wavecodec = prop->propval.u32;
-    break;
-  case PTP_OPC_AudioBitRate:
-    track->bitrate = prop->propval.u32;
-    break;
-  case PTP_OPC_BitRateType:
-    track->bitratetype = prop->propval.u16;
-    break;
-  case PTP_OPC_Rating:
-    track->rating = prop->propval.u16;
-    break;
-  case PTP_OPC_UseCount:
-    track->usecount = prop->propval.u32;
-    break;
-  case PTP_OPC_ObjectSize:
-    if (device->object_bitsize == 64) {
-      track->filesize = prop->propval.u64;
-    } else {
-      track->filesize = prop->propval.u32;
+  MTPProperties *prop = ob->mtpprops;
+  int i;
+
+  for (i = 0; i < ob->nrofmtpprops; i++, prop++) {
+    if (prop->property == PTP_OPC_ObjectSize) {
+      if (device->object_bitsize == 64)
+	return prop->propval.u64;
+      return prop->propval.u32;
     }
-    break;
+  }
+  return ob->oi.ObjectCompressedSize;
+}
+
+/**
+ * Returns the modification date of a cached object, falling back to
+ * the DateModified property when the object info has no date.
+ */
+static time_t get_cached_object_date(LIBMTP_mtpdevice_t *device,
+				     PTPObject *ob)
+{
+  MTPProperties *prop = ob->mtpprops;
+  int i;
+
+  if (ob->oi.ModificationDate != 0)
+    return ob->oi.ModificationDate;
+  for (i = 0; i < ob->nrofmtpprops; i++, prop++) {
+    if (prop->property == PTP_OPC_DateModified &&
+	prop->propval.str != NULL)
+      return ptp_parse_date((PTPParams *) device->params, prop->propval.str);
+  }
+  return 0;
+}
+
+/**
+ * Returns the numeric key of a cached object. The root folder is
+ * reported as 0 even by devices that use 0xffffffff for it.
+ */
+static uint64_t get_query_number(LIBMTP_mtpdevice_t *device,
+				 PTPObject *ob, int const key)
+{
+  switch (key) {
+  case QUERY_KEY_SIZE:
+    return get_cached_object_size(device, ob);
+  case QUERY_KEY_MODIFIED:
+    // Dates before the epoch sort first
+    return (uint64_t) (int64_t) get_cached_object_date(device, ob) ^
+      0x8000000000000000ULL;
+  case QUERY_KEY_PARENT:
+    if (ob->oi.ParentObject == 0xffffffffU)
+      return 0;
+    return ob->oi.ParentObject;
+  case QUERY_KEY_FORMAT:
+    return ob->oi.ObjectFormat;
   default:
-    break;
+    return 0;
   }
 }
 
+static int compare_query_names(const void *a, const void *b)
+{
+  query_entry_t const *ea = (query_entry_t const *) a;
+  query_entry_t const *eb = (query_entry_t const *) b;
+  int cmp = strcmp(ea->key.name, eb->key.name);
+
+  if (cmp != 0)
+    return cmp;
+  // Ties keep the object ID order
+  return (ea->handle > eb->handle) - (ea->handle < eb->handle);
+}
+
+static int compare_query_numbers(const void *a, const void *b)
+{
+  query_entry_t const *ea = (query_entry_t const *) a;
+  query_entry_t const *eb = (query_entry_t const *) b;
+
+  if (ea->key.number != eb->key.number)
+    return ea->key.number < eb->key.number ? -1 : 1;
+  return (ea->handle > eb->handle) - (ea->handle < eb->handle);
+}
+
 /**
- * This function retrieves the track metadata for a track
- * given by a unique ID.
- * @param device a pointer to the device to get the track metadata off.
- * @param trackid the unique ID of the track.
- * @param objectformat the object format of this track, so we know what it supports.
- * @param track a metadata set to fill in.
+ * Fills in an index entry from a cached object. A name key still
+ * points into the cache, the caller copies it if the entry outlives
+ * the cache lock.
  */
-static void get_track_metadata(LIBMTP_mtpdevice_t *device, uint16_t objectformat,
-			       LIBMTP_track_t *track)
+static void set_query_key(LIBMTP_mtpdevice_t *device, query_entry_t *entry,
+			  PTPObject *ob, int const key)
+{
+  entry->handle = ob->oid;
+  if (key == QUERY_KEY_NAME)
+    entry->key.name = ob->oi.Filename ? ob->oi.Filename : "";
+  else
+    entry->key.number = get_query_number(device, ob, key);
+}
+
+/**
+ * Sorts index entries on a key.
+ */
+static void sort_query_entries(query_entry_t *entries, uint32_t const n,
+			       int const key)
+{
+  qsort(entries, n, sizeof(query_entry_t),
+	key == QUERY_KEY_NAME ? compare_query_names : compare_query_numbers);
+}
+
+/**
+ * Returns one secondary index of a device, building it if needed.
+ * The caller must hold the cache lock and the index lock.
+ * @param device the device to get the index of.
+ * @param key the QUERY_KEY_* to get the index for.
+ * @return the entries of all cached objects ordered on the key,
+ *         or NULL if out of memory.
+ */
+static query_entry_t *get_query_index(LIBMTP_mtpdevice_t *device,
+				      int const key)
 {
-  uint16_t ret;
   PTPParams *params = (PTPParams *) device->params;
+  query_index_t *index = (query_index_t *) PRIV(device)->query_index;
+  query_entry_t *entries;
   uint32_t i;
-  MTPProperties *prop;
-  PTPObject *ob;
 
-  /*
-   * If we have a cached, large set of metadata, then use it!
-   */
-  ret = ptp_object_want(params, track->item_id, PTPOBJECT_MTPPROPLIST_LOADED, &ob);
-  if (ob->mtpprops) {
-    prop = ob->mtpprops;
-    for (i=0;i<ob->nrofmtpprops;i++,prop++)
-      pick_property_to_track_metadata(device, prop, track);
-  } else {
-    uint16_t *props = NULL;
-    uint32_t propcnt = 0;
+  if (index != NULL && (index->generation != params->cache_generation ||
+			index->nrofobjects != params->nrofobjects)) {
+    free_query_index(index);
+    index = NULL;
+    PRIV(device)->query_index = NULL;
+  }
+  if (index == NULL) {
+    index = (query_index_t *) calloc(1, sizeof(query_index_t));
+    if (index == NULL)
+      return NULL;
+    index->generation = params->cache_generation;
+    index->nrofobjects = params->nrofobjects;
+    PRIV(device)->query_index = index;
+  }
+  if (index->entries[key] != NULL)
+    return index->entries[key];
 
-    // First see which properties can be retrieved for this object format
-    ret = ptp_mtp_getobjectpropssupported(params, map_libmtp_type_to_ptp_type(track->filetype), &propcnt, &props);
-    if (ret != PTP_RC_OK) {
-      add_ptp_error_to_errorstack(device, ret, "get_track_metadata(): call to ptp_mtp_getobjectpropssupported() failed.");
-      // Just bail out for now, nothing is ever set.
-      return;
-    } else {
-      for (i=0;i<propcnt;i++) {
-	switch (props[i]) {
-	case PTP_OPC_Name:
-	  track->title = get_string_from_object(device, track->item_id, PTP_OPC_Name);
-	  break;
-	case PTP_OPC_Artist:
-	  track->artist = get_string_from_object(device, track->item_id, PTP_OPC_Artist);
-	  break;
-	case PTP_OPC_Composer:
-	  track->composer = get_string_from_object(device, track->item_id, PTP_OPC_Composer);
-	  break;
-	case PTP_OPC_Duration:
-	  track->duration = get_u32_from_object(device, track->item_id, PTP_OPC_Duration, 0);
-	  break;
-	case PTP_OPC_Track:
-	  track->tracknumber = get_u16_from_object(device, track->item_id, PTP_OPC_Track, 0);
-	  break;
-	case PTP_OPC_Genre:
-	  track->genre = get_string_from_object(device, track->item_id, PTP_OPC_Genre);
-	  break;
-	case PTP_OPC_AlbumName:
-	  track->album = get_string_from_object(device, track->item_id, PTP_OPC_AlbumName);
-	  break;
-	case PTP_OPC_OriginalReleaseDate:
-	  track->date = get_string_from_object(device, track->item_id, PTP_OPC_OriginalReleaseDate);
-	  break;
-	  // These are, well not so important.
-	case PTP_OPC_SampleRate:
-	  track->samplerate = get_u32_from_object(device, track->item_id, PTP_OPC_SampleRate, 0);
-	  break;
-	case PTP_OPC_NumberOfChannels:
-	  track->nochannels = get_u16_from_object(device, track->item_id, PTP_OPC_NumberOfChannels, 0);
-	  break;
-	case PTP_OPC_AudioWAVECodec:
-	  track->wavecodec = get_u32_from_object(device, track->item_id, PTP_OPC_AudioWAVECodec, 0);
-	  break;
-	case PTP_OPC_AudioBitRate:
-	  track->bitrate = get_u32_from_object(device, track->item_id, PTP_OPC_AudioBitRate, 0);
-	  break;
-	case PTP_OPC_BitRateType:
-	  track->bitratetype = get_u16_from_object(device, track->item_id, PTP_OPC_BitRateType, 0);
-	  break;
-	case PTP_OPC_Rating:
-	  track->rating = get_u16_from_object(device, track->item_id, PTP_OPC_Rating, 0);
-	  break;
-	case PTP_OPC_UseCount:
-	  track->usecount = get_u32_from_object(device, track->item_id, PTP_OPC_UseCount, 0);
-	  break;
-	case PTP_OPC_ObjectSize:
-	  if (device->object_bitsize == 64) {
-	    track->filesize = get_u64_from_object(device, track->item_id, PTP_OPC_ObjectSize, 0);
-	  } else {
-	    track->filesize = (uint64_t) get_u32_from_object(device, track->item_id, PTP_OPC_ObjectSize, 0);
-	  }
-	  break;
-	}
-      }
-      free(props);
+  // An empty cache still needs a non-NULL index
+  entries = (query_entry_t *) malloc((params->nrofobjects + 1) *
+				     sizeof(query_entry_t));
+  if (entries == NULL)
+    return NULL;
+  for (i = 0; i < params->nrofobjects; i++)
+    set_query_key(device, &entries[i], &params->objects[i], key);
+  if (key == QUERY_KEY_NAME) {
+    size_t total = 0;
+    char *name;
+
+    for (i = 0; i < params->nrofobjects; i++)
+      total += strlen(entries[i].key.name) + 1;
+    free(index->names);
+    index->names = (char *) malloc(total + 1);
+    if (index->names == NULL) {
+      free(entries);
+      return NULL;
+    }
+    name = index->names;
+    for (i = 0; i < params->nrofobjects; i++) {
+      size_t len = strlen(entries[i].key.name) + 1;
+
+      memcpy(name, entries[i].key.name, len);
+      entries[i].key.name = name;
+      name += len;
     }
   }
+  sort_query_entries(entries, params->nrofobjects, key);
+  index->entries[key] = entries;
+  return entries;
 }
 
 /**
- * THIS FUNCTION IS DEPRECATED. PLEASE UPDATE YOUR CODE IN ORDER
- * NOT TO USE IT.
- * @see LIBMTP_Get_Tracklisting_With_Callback()
+ * A range of candidate entries in one secondary index. A key of -1
+ * stands for the whole cache in object ID order.
  */
-LIBMTP_track_t *LIBMTP_Get_Tracklisting(LIBMTP_mtpdevice_t *device)
+typedef struct query_range_struct {
+  query_entry_t *entries;
+  int key;
+  uint32_t first;
+  uint32_t last;
+} query_range_t;
+
+/**
+ * Finds the first index entry with a numeric key of at least
+ * <code>value</code>.
+ */
+static uint32_t query_lower_bound(query_entry_t const *entries,
+				  uint32_t const n, uint64_t const value)
 {
-  LIBMTP_INFO("WARNING: LIBMTP_Get_Tracklisting() is deprecated.\n");
-  LIBMTP_INFO("WARNING: please update your code to use LIBMTP_Get_Tracklisting_With_Callback()\n");
-  return LIBMTP_Get_Tracklisting_With_Callback(device, NULL, NULL);
+  uint32_t lo = 0;
+  uint32_t hi = n;
+
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+
+    if (entries[mid].key.number < value)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
 }
 
 /**
- * This returns a long list of all tracks available on the current MTP device.
- * Tracks include multimedia objects, both music tracks and video tracks.
- * Typical usage:
- *
- * <pre>
- * LIBMTP_track_t *tracklist;
- *
- * tracklist = LIBMTP_Get_Tracklisting_With_Callback(device, callback, data);
- * while (tracklist != NULL) {
- *   LIBMTP_track_t *tmp;
- *
- *   // Do something on each element in the list here...
- *   tmp = tracklist;
- *   tracklist = tracklist->next;
- *   LIBMTP_destroy_track_t(tmp);
- * }
- * </pre>
- *
- * If you want to group your track listing by storage (per storage unit) or
- * arrange tracks into folders, you must dereference the <code>storage_id</code>
- * and/or <code>parent_id</code> field of the returned <code>LIBMTP_track_t</code>
- * struct. To arrange by folders or files you typically have to create the proper
- * trees by calls to <code>LIBMTP_Get_Storage()</code> and/or
- * <code>LIBMTP_Get_Folder_List()</code> first.
- *
- * @param device a pointer to the device to get the track listing for.
- * @param callback a function to be called during the tracklisting retrieveal
- *        for displaying progress bars etc, or NULL if you don't want
- *        any callbacks.
- * @param data a user-defined pointer that is passed along to
- *        the <code>progress</code> function in order to
- *        pass along some user defined data to the progress
- *        updates. If not used, set this to NULL.
- * @return a list of tracks that can be followed using the <code>next</code>
- *        field of the <code>LIBMTP_track_t</code> data structure.
- *        Each of the metadata tags must be freed after use, and may
- *        contain only partial metadata information, i.e. one or several
- *        fields may be NULL or 0.
- * @see LIBMTP_Get_Trackmetadata()
+ * Finds the range of name index entries starting with
+ * <code>prefix</code>.
  */
-LIBMTP_track_t *LIBMTP_Get_Tracklisting_With_Callback(LIBMTP_mtpdevice_t *device,
-                                                      LIBMTP_progressfunc_t const callback,
-                                                      void const * const data)
+static void query_prefix_range(query_entry_t const *entries,
+			       uint32_t const n,
+			       char const * const prefix,
+			       size_t const prefixlen,
+			       uint32_t *first, uint32_t *last)
 {
-	return LIBMTP_Get_Tracklisting_With_Callback_For_Storage(device, 0, callback, data);
-}
+  uint32_t lo = 0;
+  uint32_t hi = n;
+
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+
+    if (strncmp(entries[mid].key.name, prefix, prefixlen) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  *first = lo;
+  hi = n;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
 
+    if (strncmp(entries[mid].key.name, prefix, prefixlen) <= 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  *last = lo;
+}
 
 /**
- * This returns a long list of all tracks available on the current MTP device.
- * Tracks include multimedia objects, both music tracks and video tracks.
- * Typical usage:
- *
- * <pre>
- * LIBMTP_track_t *tracklist;
- *
- * tracklist = LIBMTP_Get_Tracklisting_With_Callback_For_Storage(device, storage_id, callback, data);
- * while (tracklist != NULL) {
- *   LIBMTP_track_t *tmp;
- *
- *   // Do something on each element in the list here...
- *   tmp = tracklist;
- *   tracklist = tracklist->next;
- *   LIBMTP_destroy_track_t(tmp);
- * }
- * </pre>
- *
- * If you want to group your track listing by storage (per storage unit) or
- * arrange tracks into folders, you must dereference the <code>storage_id</code>
- * and/or <code>parent_id</code> field of the returned <code>LIBMTP_track_t</code>
- * struct. To arrange by folders or files you typically have to create the proper
- * trees by calls to <code>LIBMTP_Get_Storage()</code> and/or 
- * <code>LIBMTP_Get_Folder_List()</code> first.
- *
- * @param device a pointer to the device to get the track listing for.
- * @param storage_id ID of device storage (if null, no filter)
- * @param callback a function to be called during the tracklisting retrieveal
- *        for displaying progress bars etc, or NULL if you don't want
- *        any callbacks.
- * @param data a user-defined pointer that is passed along to
- *        the <code>progress</code> function in order to
- *        pass along some user defined data to the progress
- *        updates. If not used, set this to NULL.
- * @return a list of tracks that can be followed using the <code>next</code>
- *        field of the <code>LIBMTP_track_t</code> data structure.
- *        Each of the metadata tags must be freed after use, and may
- *        contain only partial metadata information, i.e. one or several
- *        fields may be NULL or 0.
- * @see LIBMTP_Get_Trackmetadata()
+ * Matches a filename against a pattern where '*' matches any run of
+ * characters and '?' matches a single character.
+ * @return 1 if the name matches, 0 otherwise.
  */
-LIBMTP_track_t *LIBMTP_Get_Tracklisting_With_Callback_For_Storage(LIBMTP_mtpdevice_t *device, uint32_t const storage_id,
-                                                      LIBMTP_progressfunc_t const callback,
-                                                      void const * const data)
+static int match_query_name(char const *pattern, char const *name)
 {
-  uint32_t i = 0;
-  LIBMTP_track_t *retracks = NULL;
-  LIBMTP_track_t *curtrack = NULL;
-  PTPParams *params = (PTPParams *) device->params;
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  char const *star = NULL;
+  char const *resume = NULL;
 
-  // Get all the handles if we haven't already done that
-  if (params->nrofobjects == 0) {
-    flush_handles(device);
+  while (*name != '\0') {
+    if (*pattern == '*') {
+      star = pattern++;
+      resume = name;
+    } else if (*pattern == '?' || *pattern == *name) {
+      pattern++;
+      name++;
+    } else if (star != NULL) {
+      // Let the last star swallow one more character
+      pattern = star + 1;
+      name = ++resume;
+    } else {
+      return 0;
+    }
   }
+  while (*pattern == '*')
+    pattern++;
+  return *pattern == '\0';
+}
 
-  for (i = 0; i < params->nrofobjects; i++) {
-    LIBMTP_track_t *track;
-    PTPObject *ob;
-    LIBMTP_filetype_t mtptype;
-
-    if (callback != NULL)
-      callback(i, params->nrofobjects, data);
-
-    ob = &params->objects[i];
-    mtptype = map_ptp_type_to_libmtp_type(ob->oi.ObjectFormat);
+/**
+ * Replaces a candidate range with a narrower one.
+ */
+static void narrow_query_range(query_range_t *range, query_entry_t *entries,
+			       int const key, uint32_t const first,
+			       uint32_t last)
+{
+  if (last < first)
+    last = first;
+  if (range->key == -1 || last - first < range->last - range->first) {
+    range->entries = entries;
+    range->key = key;
+    range->first = first;
+    range->last = last;
+  }
+}
 
-    // Ignore stuff we don't know how to handle...
-    // TODO: get this list as an intersection of the sets
-    // supported by the device and the from the device and
-    // all known track files?
-    if (!LIBMTP_FILETYPE_IS_TRACK(mtptype) &&
-	// This row lets through undefined files for examination since they may be forgotten OGG files.
-	(ob->oi.ObjectFormat != PTP_OFC_Undefined ||
-	 (!FLAG_IRIVER_OGG_ALZHEIMER(ptp_usb) &&
-	  !FLAG_OGG_IS_UNKNOWN(ptp_usb) &&
-	  !FLAG_FLAC_IS_UNKNOWN(ptp_usb)))
-	) {
-      //printf("Not a music track (name: %s format: %d), skipping...\n", oi->Filename, oi->ObjectFormat);
-      continue;
-    }
+/**
+ * Narrows a candidate range down to the objects with a numeric key
+ * within <code>lo</code> to <code>hi</code>, both inclusive.
+ * @return 0 on success, -1 if out of memory.
+ */
+static int narrow_query_numbers(LIBMTP_mtpdevice_t *device,
+				query_range_t *range, int const key,
+				uint64_t const lo, uint64_t const hi)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  query_entry_t *entries = get_query_index(device, key);
+  uint32_t last;
 
-	// Ignore stuff that isn't into the storage device
-	if ((storage_id != 0) && (ob->oi.StorageID != storage_id ))
-		continue;
+  if (entries == NULL)
+    return -1;
+  if (hi == 0xffffffffffffffffULL)
+    last = params->nrofobjects;
+  else
+    last = query_lower_bound(entries, params->nrofobjects, hi + 1);
+  narrow_query_range(range, entries, key,
+		     query_lower_bound(entries, params->nrofobjects, lo),
+		     last);
+  return 0;
+}
 
-    // Allocate a new track type
-    track = LIBMTP_new_track_t();
+/**
+ * Checks a cached object against all the criteria of a query.
+ * @return 1 if the object matches, 0 otherwise.
+ */
+static int match_query(LIBMTP_mtpdevice_t *device,
+		       LIBMTP_query_t const * const query,
+		       uint16_t const format, PTPObject *ob)
+{
+  if ((query->match & LIBMTP_QUERY_MATCH_FILETYPE) &&
+      ob->oi.ObjectFormat != format)
+    return 0;
+  if ((query->match & LIBMTP_QUERY_MATCH_STORAGE) &&
+      ob->oi.StorageID != query->storage_id)
+    return 0;
+  if ((query->match & LIBMTP_QUERY_MATCH_PARENT) &&
+      get_query_number(device, ob, QUERY_KEY_PARENT) != query->parent_id)
+    return 0;
+  if (query->match & LIBMTP_QUERY_MATCH_SIZE) {
+    uint64_t size = get_cached_object_size(device, ob);
 
-    // This is some sort of unique ID so we can keep track of the track.
-    track->item_id = ob->oid;
-    track->parent_id = ob->oi.ParentObject;
-    track->storage_id = ob->oi.StorageID;
-    track->modificationdate = ob->oi.ModificationDate;
+    if (size < query->min_size ||
+	(query->max_size != 0 && size > query->max_size))
+      return 0;
+  }
+  if (query->match & LIBMTP_QUERY_MATCH_MODIFIED) {
+    time_t date = get_cached_object_date(device, ob);
 
-    track->filetype = mtptype;
+    if (date < query->modified_after ||
+	(query->modified_before != 0 && date >= query->modified_before))
+      return 0;
+  }
+  if ((query->match & LIBMTP_QUERY_MATCH_NAME) &&
+      !match_query_name(query->name,
+			ob->oi.Filename ? ob->oi.Filename : ""))
+    return 0;
+  return 1;
+}
 
-    // Original file-specific properties
-    track->filesize = ob->oi.ObjectCompressedSize;
-    if (ob->oi.Filename != NULL) {
-      track->filename = strdup(ob->oi.Filename);
-    }
+/**
+ * Narrows a candidate range down with every query criterion that has
+ * an index. The storage criterion has too few distinct values to be
+ * worth one. The caller must hold the cache lock and the index lock.
+ * @return 0 on success, -1 if out of memory.
+ */
+static int get_query_range(LIBMTP_mtpdevice_t *device,
+			   LIBMTP_query_t const * const query,
+			   uint16_t const format,
+			   query_range_t *range)
+{
+  PTPParams *params = (PTPParams *) device->params;
 
-    get_track_metadata(device, ob->oi.ObjectFormat, track);
+  range->entries = NULL;
+  range->key = -1;
+  range->first = 0;
+  range->last = params->nrofobjects;
 
-    /*
-     * A special quirk for iriver devices that doesn't quite
-     * remember that some files marked as "unknown" type are
-     * actually OGG or FLAC files. We look at the filename extension
-     * and see if it happens that this was atleast named "ogg" or "flac"
-     * and fall back on this heuristic approach in that case,
-     * for these bugged devices only.
-     */
-    if (track->filetype == LIBMTP_FILETYPE_UNKNOWN &&
-	track->filename != NULL) {
-      if ((FLAG_IRIVER_OGG_ALZHEIMER(ptp_usb) ||
-	   FLAG_OGG_IS_UNKNOWN(ptp_usb)) &&
-	  has_ogg_extension(track->filename))
-	track->filetype = LIBMTP_FILETYPE_OGG;
-      else if (FLAG_FLAC_IS_UNKNOWN(ptp_usb) &&
-	       has_flac_extension(track->filename))
-	track->filetype = LIBMTP_FILETYPE_FLAC;
-      else {
-	// This was not an OGG/FLAC file so discard it and continue
-	LIBMTP_destroy_track_t(track);
-	continue;
-      }
-    }
+  if ((query->match & LIBMTP_QUERY_MATCH_PARENT) &&
+      narrow_query_numbers(device, range, QUERY_KEY_PARENT,
+			   query->parent_id, query->parent_id) != 0)
+    return -1;
+  if ((query->match & LIBMTP_QUERY_MATCH_FILETYPE) &&
+      narrow_query_numbers(device, range, QUERY_KEY_FORMAT,
+			   format, format) != 0)
+    return -1;
+  if ((query->match & LIBMTP_QUERY_MATCH_SIZE) &&
+      narrow_query_numbers(device, range, QUERY_KEY_SIZE, query->min_size,
+			   query->max_size == 0 ? 0xffffffffffffffffULL :
+			   query->max_size) != 0)
+    return -1;
+  if (query->match & LIBMTP_QUERY_MATCH_MODIFIED) {
+    uint64_t lo = (uint64_t) (int64_t) query->modified_after ^
+      0x8000000000000000ULL;
+    uint64_t hi = 0xffffffffffffffffULL;
+
+    // A superset is fine here, every candidate is matched in full later
+    if (query->modified_before != 0)
+      hi = ((uint64_t) (int64_t) query->modified_before ^
+	    0x8000000000000000ULL) - 1;
+    if (narrow_query_numbers(device, range, QUERY_KEY_MODIFIED,
+			     lo, hi) != 0)
+      return -1;
+  }
+  if (query->match & LIBMTP_QUERY_MATCH_NAME) {
+    size_t prefixlen = strcspn(query->name, "*?");
+    query_entry_t *entries;
+    uint32_t first;
+    uint32_t last;
 
-    // Add track to a list that will be returned afterwards.
-    if (retracks == NULL) {
-      retracks = track;
-      curtrack = track;
-    } else {
-      curtrack->next = track;
-      curtrack = track;
+    if (prefixlen > 0) {
+      entries = get_query_index(device, QUERY_KEY_NAME);
+      if (entries == NULL)
+	return -1;
+      query_prefix_range(entries, params->nrofobjects, query->name,
+			 prefixlen, &first, &last);
+      narrow_query_range(range, entries, QUERY_KEY_NAME, first, last);
     }
-
-    // Call listing callback
-    // double progressPercent = (double)i*(double)100.0 / (double)params->handles.n;
-
-  } // Handle counting loop
-  return retracks;
+  }
+  return 0;
 }
 
 /**
- * This function retrieves the metadata for a single track off
- * the device.
+ * This function searches the object cache for the objects matching a
+ * set of criteria, such as all JPEG files in a certain folder that are
+ * larger than a megabyte. Unlike walking the result of
+ * <code>LIBMTP_Get_Filelisting()</code> this does not copy the
+ * metadata of every object: the criteria are looked up in indexes kept
+ * over the cache, which are built on first use and rebuilt whenever
+ * the cache changes, and only the matching object IDs are returned.
  *
- * Do not call this function repeatedly! The track handles are linearly
- * searched O(n) and the call may involve (slow) USB traffic, so use
- * <code>LIBMTP_Get_Tracklisting()</code> and cache the tracks, preferably
- * as an efficient data structure such as a hash list.
+ * The metadata of a result can then be retrieved with
+ * <code>LIBMTP_Get_Filemetadata()</code>. Sizes are taken from what
+ * the cache holds, so on devices without object property list support
+ * files larger than 4GB are compared on the 32 bit object info size.
  *
- * @param device a pointer to the device to get the track metadata from.
- * @param trackid the object ID of the track that you want the metadata for.
- * @return a track metadata entry on success or NULL on failure.
- * @see LIBMTP_Get_Tracklisting()
+ * @param device a pointer to the device to query.
+ * @param query the criteria, result order and result limit.
+ * @param handles a pointer to an array of object IDs that will be
+ *        allocated and filled in with the matching objects. The caller
+ *        has to free this array. It is set to NULL if nothing matched.
+ * @param count a pointer to the number of object IDs in the array.
+ * @return 0 on success, any other value means failure.
  */
-LIBMTP_track_t *LIBMTP_Get_Trackmetadata(LIBMTP_mtpdevice_t *device, uint32_t const trackid)
+int LIBMTP_Query_Objects(LIBMTP_mtpdevice_t *device,
+			 LIBMTP_query_t const * const query,
+			 uint32_t ** const handles,
+			 uint32_t * const count)
 {
   PTPParams *params = (PTPParams *) device->params;
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  PTPObject *ob;
-  LIBMTP_track_t *track;
-  LIBMTP_filetype_t mtptype;
-  uint16_t ret;
-
-  // Get all the handles if we haven't already done that
-  if (params->nrofobjects == 0)
-    flush_handles(device);
+  query_range_t range;
+  query_entry_t *matches = NULL;
+  uint32_t nrofmatches = 0;
+  uint32_t limit;
+  uint32_t i;
+  uint16_t format = 0;
+  int sortkey = -1;
+  int ordered;
 
-  ret = ptp_object_want (params, trackid, PTPOBJECT_OBJECTINFO_LOADED, &ob);
-  if (ret != PTP_RC_OK)
-    return NULL;
+  *handles = NULL;
+  *count = 0;
+  if ((query->match & LIBMTP_QUERY_MATCH_NAME) && query->name == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Query_Objects(): no name to match.");
+    return -1;
+  }
+  if (query->match & LIBMTP_QUERY_MATCH_FILETYPE)
+    format = map_libmtp_type_to_ptp_type(query->filetype);
+  switch (query->sortby) {
+  case LIBMTP_QUERY_SORTBY_NAME:
+    sortkey = QUERY_KEY_NAME;
+    break;
+  case LIBMTP_QUERY_SORTBY_SIZE:
+    sortkey = QUERY_KEY_SIZE;
+    break;
+  case LIBMTP_QUERY_SORTBY_MODIFIED:
+    sortkey = QUERY_KEY_MODIFIED;
+    break;
+  default:
+    break;
+  }
 
-  mtptype = map_ptp_type_to_libmtp_type(ob->oi.ObjectFormat);
-
-  // Ignore stuff we don't know how to handle...
-  if (!LIBMTP_FILETYPE_IS_TRACK(mtptype) &&
-      /*
-       * This row lets through undefined files for examination
-       * since they may be forgotten OGG or FLAC files.
-       */
-      (ob->oi.ObjectFormat != PTP_OFC_Undefined ||
-       (!FLAG_IRIVER_OGG_ALZHEIMER(ptp_usb) &&
-	!FLAG_OGG_IS_UNKNOWN(ptp_usb) &&
-	!FLAG_FLAC_IS_UNKNOWN(ptp_usb)))
-      ) {
-    //printf("Not a music track (name: %s format: %d), skipping...\n", oi->Filename, oi->ObjectFormat);
-    return NULL;
-  }
-
-  // Allocate a new track type
-  track = LIBMTP_new_track_t();
-
-  // This is some sort of unique ID so we can keep track of the track.
-  track->item_id = ob->oid;
-  track->parent_id = ob->oi.ParentObject;
-  track->storage_id = ob->oi.StorageID;
-  track->modificationdate = ob->oi.ModificationDate;
-
-  track->filetype = mtptype;
-
-  // Original file-specific properties
-  track->filesize = ob->oi.ObjectCompressedSize;
-  if (ob->oi.Filename != NULL) {
-    track->filename = strdup(ob->oi.Filename);
-  }
+  lock_cache_for_listing(device, NULL, NULL);
+  ptp_lock_index(params);
+  if (get_query_range(device, query, format, &range) != 0)
+    goto oom;
+  // Without a narrower range, walk the index of the sort key instead
+  if (range.key == -1 && sortkey != -1) {
+    range.entries = get_query_index(device, sortkey);
+    if (range.entries == NULL)
+      goto oom;
+    range.key = sortkey;
+  }
 
   /*
-   * A special quirk for devices that doesn't quite
-   * remember that some files marked as "unknown" type are
-   * actually OGG or FLAC files. We look at the filename extension
-   * and see if it happens that this was atleast named "ogg"
-   * and fall back on this heuristic approach in that case,
-   * for these bugged devices only.
+   * The cache itself is in object ID order and an index is in the order
+   * of its key: when that is the requested order the walk can stop as
+   * soon as the limit is reached, otherwise all matches are sorted.
    */
-  if (track->filetype == LIBMTP_FILETYPE_UNKNOWN &&
-      track->filename != NULL) {
-    if ((FLAG_IRIVER_OGG_ALZHEIMER(ptp_usb) ||
-	 FLAG_OGG_IS_UNKNOWN(ptp_usb)) &&
-	has_ogg_extension(track->filename))
-      track->filetype = LIBMTP_FILETYPE_OGG;
-    else if (FLAG_FLAC_IS_UNKNOWN(ptp_usb) &&
-	     has_flac_extension(track->filename))
-      track->filetype = LIBMTP_FILETYPE_FLAC;
-    else {
-      // This was not an OGG/FLAC file so discard it
-      LIBMTP_destroy_track_t(track);
-      return NULL;
+  ordered = (range.key == sortkey);
+  limit = range.last - range.first;
+  if (ordered && query->limit != 0 && query->limit < limit)
+    limit = query->limit;
+  if (limit > 0) {
+    matches = (query_entry_t *) malloc(limit * sizeof(query_entry_t));
+    if (matches == NULL)
+      goto oom;
+  }
+  for (i = 0; i < range.last - range.first && nrofmatches < limit; i++) {
+    uint32_t n = (ordered && query->descending) ?
+      range.last - 1 - i : range.first + i;
+    PTPObject *ob = &params->objects[n];
+
+    if (range.entries != NULL &&
+	ptp_object_find(params, range.entries[n].handle, &ob) != PTP_RC_OK)
+      continue;
+    if (!match_query(device, query, format, ob))
+      continue;
+    // The names of the matches are only used under the cache lock
+    set_query_key(device, &matches[nrofmatches], ob,
+		  sortkey == -1 ? QUERY_KEY_PARENT : sortkey);
+    if (sortkey == -1)
+      matches[nrofmatches].key.number = ob->oid;
+    nrofmatches++;
+  }
+  if (!ordered) {
+    // Without a sort key the keys hold the object IDs
+    sort_query_entries(matches, nrofmatches,
+		       sortkey == -1 ? QUERY_KEY_PARENT : sortkey);
+    if (query->descending) {
+      for (i = 0; i < nrofmatches / 2; i++) {
+	query_entry_t tmp = matches[i];
+
+	matches[i] = matches[nrofmatches - 1 - i];
+	matches[nrofmatches - 1 - i] = tmp;
+      }
     }
+    if (query->limit != 0 && nrofmatches > query->limit)
+      nrofmatches = query->limit;
   }
-  get_track_metadata(device, ob->oi.ObjectFormat, track);
-  return track;
-}
 
-/**
- * This is a manual conversion from MTPDataGetFunc to PTPDataGetFunc
- * to isolate the internal type.
- */
-static uint16_t get_func_wrapper(PTPParams* params, void* priv, unsigned long wantlen, unsigned char *data, unsigned long *gotlen)
-{
-  MTPDataHandler *handler = (MTPDataHandler *)priv;
-  uint16_t ret;
-  uint32_t local_gotlen = 0;
-  ret = handler->getfunc(params, handler->priv, wantlen, data, &local_gotlen);
-  *gotlen = local_gotlen;
-  switch (ret)
-  {
-    case LIBMTP_HANDLER_RETURN_OK:
-      return PTP_RC_OK;
-    case LIBMTP_HANDLER_RETURN_ERROR:
-      return PTP_ERROR_IO;
-    case LIBMTP_HANDLER_RETURN_CANCEL:
-      return PTP_ERROR_CANCEL;
-    default:
-      return PTP_ERROR_IO;
+  if (nrofmatches > 0) {
+    *handles = (uint32_t *) malloc(nrofmatches * sizeof(uint32_t));
+    if (*handles == NULL) {
+      free(matches);
+      goto oom;
+    }
+    for (i = 0; i < nrofmatches; i++)
+      (*handles)[i] = matches[i].handle;
+    *count = nrofmatches;
   }
+  free(matches);
+  ptp_unlock_index(params);
+  ptp_unlock_cache(params);
+  return 0;
+
+ oom:
+  ptp_unlock_index(params);
+  ptp_unlock_cache(params);
+  add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			  "LIBMTP_Query_Objects(): out of memory.");
+  return -1;
 }
 
 /**
- * This is a manual conversion from MTPDataPutFunc to PTPDataPutFunc
- * to isolate the internal type.
+ * This function retrieves the contents of a certain folder
+ * with id parent on a certain storage on a certain device.
+ * The result contains both files and folders.
+ * The device used with this operations must have been opened with
+ * LIBMTP_Open_Raw_Device_Uncached() or it will fail.
+ *
+ * NOTE: the request will always perform I/O with the device. Devices
+ * that support object property lists are asked for the metadata of
+ * the whole folder at once, others are asked object by object.
+ * @param device a pointer to the MTP device to report info from.
+ * @param storage a storage on the device to report info from. If
+ *        0 is passed in, the files for the given parent will be
+ *        searched across all available storages.
+ * @param parent the parent folder id.
  */
-static uint16_t put_func_wrapper(PTPParams* params, void* priv, unsigned long sendlen, unsigned char *data, unsigned long *putlen)
+LIBMTP_file_t * LIBMTP_Get_Files_And_Folders(LIBMTP_mtpdevice_t *device,
+			     uint32_t const storage,
+			     uint32_t const parent)
 {
-  MTPDataHandler *handler = (MTPDataHandler *)priv;
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  LIBMTP_file_t *retfiles = NULL;
+  LIBMTP_file_t *curfile = NULL;
+  PTPObjectHandles currentHandles;
+  uint32_t storageid;
   uint16_t ret;
-  uint32_t local_putlen = 0;
-  ret = handler->putfunc(params, handler->priv, sendlen, data, &local_putlen);
-  *putlen = local_putlen;
-  switch (ret)
-  {
-    case LIBMTP_HANDLER_RETURN_OK:
-      return PTP_RC_OK;
-    case LIBMTP_HANDLER_RETURN_ERROR:
-      return PTP_ERROR_IO;
-    case LIBMTP_HANDLER_RETURN_CANCEL:
-      return PTP_ERROR_CANCEL;
-    default:
-      return PTP_ERROR_IO;
+  int i = 0;
+
+  if (device->cached) {
+    // This function is only supposed to be used by devices
+    // opened as uncached!
+    LIBMTP_ERROR("tried to use %s on a cached device!\n",
+		 __func__);
+    return NULL;
   }
-}
 
-/**
- * This gets a file off the device to a local file identified
- * by a filename.
- * @param device a pointer to the device to get the track from.
- * @param id the file ID of the file to retrieve.
- * @param path a filename to use for the retrieved file.
- * @param callback a progress indicator function or NULL to ignore.
- * @param data a user-defined pointer that is passed along to
- *             the <code>progress</code> function in order to
- *             pass along some user defined data to the progress
- *             updates. If not used, set this to NULL.
- * @return 0 if the transfer was successful, any other value means
- *           failure.
- * @see LIBMTP_Get_File_To_File_Descriptor()
- */
-int LIBMTP_Get_File_To_File(LIBMTP_mtpdevice_t *device, uint32_t const id,
-			 char const * const path, LIBMTP_progressfunc_t const callback,
-			 void const * const data)
-{
-  int fd = -1;
-  int ret;
+  if (FLAG_BROKEN_GET_OBJECT_PROPVAL(ptp_usb)) {
+    // These devices cannot handle the commands needed for
+    // Uncached access!
+    LIBMTP_ERROR("tried to use %s on an unsupported device, "
+		 "this command does not work on all devices "
+		 "due to missing low-level support to read "
+		 "information on individual tracks\n",
+		 __func__);
+    return NULL;
+  }
 
-  // Sanity check
-  if (path == NULL) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File(): Bad arguments, path was NULL.");
-    return -1;
+  /*
+   * Where the device supports it, get all the metadata of the folder
+   * contents in a single object property list request, instead of
+   * one or more requests per object.
+   */
+  if (ptp_operation_issupported(params,PTP_OC_MTP_GetObjPropList)
+      && !FLAG_BROKEN_MTPGETOBJPROPLIST(ptp_usb)) {
+    PTPObject *children = NULL;
+    uint32_t nrofchildren = 0;
+    uint32_t j;
+
+    if (get_children_metadata_fast(device, storage, parent,
+				   &children, &nrofchildren) == 0) {
+      for (j = 0; j < nrofchildren; j++) {
+	LIBMTP_file_t *file = obj2file_cached(device, &children[j]);
+
+	ptp_free_object(&children[j]);
+	if (file == NULL)
+	  continue;
+	if (curfile == NULL) {
+	  curfile = file;
+	  retfiles = file;
+	} else {
+	  curfile->next = file;
+	  curfile = file;
+	}
+      }
+      free(children);
+      return retfiles;
+    }
   }
 
-  // Open file
-#ifdef __WIN32__
-#ifdef USE_WINDOWS_IO_H
-  if ( (fd = _open(path, O_RDWR|O_CREAT|O_TRUNC|O_BINARY,_S_IREAD)) == -1 ) {
-#else
-  if ( (fd = open(path, O_RDWR|O_CREAT|O_TRUNC|O_BINARY,S_IRWXU)) == -1 ) {
-#endif
-#else
-  if ( (fd = open(path, O_RDWR|O_CREAT|O_TRUNC,S_IRWXU|S_IRGRP)) == -1) {
-#endif
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File(): Could not create file.");
-    return -1;
+  if (storage == 0)
+    storageid = PTP_GOH_ALL_STORAGE;
+  else
+    storageid = storage;
+
+  ret = ptp_getobjecthandles(params,
+			     storageid,
+			     PTP_GOH_ALL_FORMATS,
+			     parent,
+			     &currentHandles);
+
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret,
+		"LIBMTP_Get_Files_And_Folders(): could not get object handles.");
+    return NULL;
   }
 
-  ret = LIBMTP_Get_File_To_File_Descriptor(device, id, fd, callback, data);
+  if (currentHandles.Handler == NULL || currentHandles.n == 0)
+    return NULL;
 
-  // Close file
-  close(fd);
+  for (i = 0; i < currentHandles.n; i++) {
+    LIBMTP_file_t *file;
 
-  // Delete partial file.
-  if (ret == -1) {
-    unlink(path);
+    // Get metadata for one file, if it fails, try next file
+    file = LIBMTP_Get_Filemetadata(device, currentHandles.Handler[i]);
+    if (file == NULL)
+      continue;
+
+    // Add track to a list that will be returned afterwards.
+    if (curfile == NULL) {
+      curfile = file;
+      retfiles = file;
+    } else {
+      curfile->next = file;
+      curfile = file;
+    }
   }
 
-  return ret;
+  free(currentHandles.Handler);
+
+  // Return a pointer to the original first file
+  // in the big list.
+  return retfiles;
 }
 
+
 /**
- * This gets a file off the device to a file identified
- * by a file descriptor.
+ * This creates a new track metadata structure and allocates memory
+ * for it. Notice that if you add strings to this structure they
+ * will be freed by the corresponding <code>LIBMTP_destroy_track_t</code>
+ * operation later, so be careful of using strdup() when assigning
+ * strings, e.g.:
  *
- * This function can potentially be used for streaming
- * files off the device for playback or broadcast for example,
- * by downloading the file into a stream sink e.g. a socket.
+ * <pre>
+ * LIBMTP_track_t *track = LIBMTP_new_track_t();
+ * track->title = strdup(titlestr);
+ * ....
+ * LIBMTP_destroy_track_t(track);
+ * </pre>
  *
- * @param device a pointer to the device to get the file from.
- * @param id the file ID of the file to retrieve.
- * @param fd a local file descriptor to write the file to.
- * @param callback a progress indicator function or NULL to ignore.
- * @param data a user-defined pointer that is passed along to
- *             the <code>progress</code> function in order to
- *             pass along some user defined data to the progress
- *             updates. If not used, set this to NULL.
- * @return 0 if the transfer was successful, any other value means
- *           failure.
- * @see LIBMTP_Get_File_To_File()
+ * @return a pointer to the newly allocated metadata structure.
+ * @see LIBMTP_destroy_track_t()
  */
-int LIBMTP_Get_File_To_File_Descriptor(LIBMTP_mtpdevice_t *device,
-					uint32_t const id,
-					int const fd,
-					LIBMTP_progressfunc_t const callback,
-					void const * const data)
+LIBMTP_track_t *LIBMTP_new_track_t(void)
 {
-  uint16_t ret;
-  PTPParams *params = (PTPParams *) device->params;
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  PTPObject *ob;
-
-  ret = ptp_object_want (params, id, PTPOBJECT_OBJECTINFO_LOADED, &ob);
-  if (ret != PTP_RC_OK) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Descriptor(): Could not get object info.");
-    return -1;
-  }
-  if (ob->oi.ObjectFormat == PTP_OFC_Association) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Descriptor(): Bad object format.");
-    return -1;
+  LIBMTP_track_t *new = (LIBMTP_track_t *) malloc(sizeof(LIBMTP_track_t));
+  if (new == NULL) {
+    return NULL;
   }
+  new->item_id = 0;
+  new->parent_id = 0;
+  new->storage_id = 0;
+  new->title = NULL;
+  new->artist = NULL;
+  new->composer = NULL;
+  new->album = NULL;
+  new->genre = NULL;
+  new->date = NULL;
+  new->filename = NULL;
+  new->duration = 0;
+  new->tracknumber = 0;
+  new->filesize = 0;
+  new->filetype = LIBMTP_FILETYPE_UNKNOWN;
+  new->samplerate = 0;
+  new->nochannels = 0;
+  new->wavecodec = 0;
+  new->bitrate = 0;
+  new->bitratetype = 0;
+  new->rating = 0;
+  new->usecount = 0;
+  new->modificationdate = 0;
+  new->next = NULL;
+  return new;
+}
 
-  // Callbacks
-  ptp_usb->callback_active = 1;
-  ptp_usb->current_transfer_total = ob->oi.ObjectCompressedSize+
-    PTP_USB_BULK_HDR_LEN+sizeof(uint32_t); // Request length, one parameter
-  ptp_usb->current_transfer_complete = 0;
-  ptp_usb->current_transfer_callback = callback;
-  ptp_usb->current_transfer_callback_data = data;
-
-  ret = ptp_getobject_tofd(params, id, fd);
-
-  ptp_usb->callback_active = 0;
-  ptp_usb->current_transfer_callback = NULL;
-  ptp_usb->current_transfer_callback_data = NULL;
-
-  if (ret == PTP_ERROR_CANCEL) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED, "LIBMTP_Get_File_From_File_Descriptor(): Cancelled transfer.");
-    return -1;
-  }
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_File_To_File_Descriptor(): Could not get file from device.");
-    return -1;
+/**
+ * This destroys a track metadata structure and deallocates the memory
+ * used by it, including any strings. Never use a track metadata
+ * structure again after calling this function on it.
+ * @param track the track metadata to destroy.
+ * @see LIBMTP_new_track_t()
+ */
+void LIBMTP_destroy_track_t(LIBMTP_track_t *track)
+{
+  if (track == NULL) {
+    return;
   }
-
-  return 0;
+  if (track->title != NULL)
+    free(track->title);
+  if (track->artist != NULL)
+    free(track->artist);
+  if (track->composer != NULL)
+    free(track->composer);
+  if (track->album != NULL)
+    free(track->album);
+  if (track->genre != NULL)
+    free(track->genre);
+  if (track->date != NULL)
+    free(track->date);
+  if (track->filename != NULL)
+    free(track->filename);
+  free(track);
+  return;
 }
 
 /**
- * This gets a file off the device and calls put_func
- * with chunks of data
- *
- * @param device a pointer to the device to get the file from.
- * @param id the file ID of the file to retrieve.
- * @param put_func the function to call when we have data.
- * @param priv the user-defined pointer that is passed to
- *             <code>put_func</code>.
- * @param callback a progress indicator function or NULL to ignore.
- * @param data a user-defined pointer that is passed along to
- *             the <code>progress</code> function in order to
- *             pass along some user defined data to the progress
- *             updates. If not used, set this to NULL.
- * @return 0 if the transfer was successful, any other value means
- *           failure.
+ * This function maps and copies a property onto the track metadata if applicable.
  */
-int LIBMTP_Get_File_To_Handler(LIBMTP_mtpdevice_t *device,
-					uint32_t const id,
-					MTPDataPutFunc put_func,
-          void * priv,
-					LIBMTP_progressfunc_t const callback,
-					void const * const data)
+static void pick_property_to_track_metadata(LIBMTP_mtpdevice_t *device, MTPProperties *prop, LIBMTP_track_t *track)
 {
-  PTPObject *ob;
-  uint16_t ret;
-  PTPParams *params = (PTPParams *) device->params;
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-
-  ret = ptp_object_want (params, id, PTPOBJECT_OBJECTINFO_LOADED, &ob);
-  if (ret != PTP_RC_OK) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Descriptor(): Could not get object info.");
-    return -1;
-  }
-  if (ob->oi.ObjectFormat == PTP_OFC_Association) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Descriptor(): Bad object format.");
-    return -1;
+  switch (prop->property) {
+  case PTP_OPC_Name:
+    if (prop->propval.str != NULL)
+      track->title = strdup(prop->propval.str);
+    else
+      track->title = NULL;
+    break;
+  case PTP_OPC_Artist:
+    if (prop->propval.str != NULL)
+      track->artist = strdup(prop->propval.str);
+    else
+      track->artist = NULL;
+    break;
+  case PTP_OPC_Composer:
+    if (prop->propval.str != NULL)
+      track->composer = strdup(prop->propval.str);
+    else
+      track->composer = NULL;
+    break;
+  case PTP_OPC_Duration:
+    track->duration = prop->propval.u32;
+    break;
+  case PTP_OPC_Track:
+    track->tracknumber = prop->propval.u16;
+    break;
+  case PTP_OPC_Genre:
+    if (prop->propval.str != NULL)
+      track->genre = strdup(prop->propval.str);
+    else
+      track->genre = NULL;
+    break;
+  case PTP_OPC_AlbumName:
+    if (prop->propval.str != NULL)
+      track->album = strdup(prop->propval.str);
+    else
+      track->album = NULL;
+    break;
+  case PTP_OPC_OriginalReleaseDate:
+    if (prop->propval.str != NULL)
+      track->date = strdup(prop->propval.str);
+    else
+      track->date = NULL;
+    break;
+    // These are, well not so important.
+  case PTP_OPC_SampleRate:
+    track->samplerate = prop->propval.u32;
+    break;
+  case PTP_OPC_NumberOfChannels:
+    track->nochannels = prop->propval.u16;
+    break;
+  case PTP_OPC_AudioWAVECodec:
+    track->wavecodec = prop->propval.u32;
+    break;
+  case PTP_OPC_AudioBitRate:
+    track->bitrate = prop->propval.u32;
+    break;
+  case PTP_OPC_BitRateType:
+    track->bitratetype = prop->propval.u16;
+    break;
+  case PTP_OPC_Rating:
+    track->rating = prop->propval.u16;
+    break;
+  case PTP_OPC_UseCount:
+    track->usecount = prop->propval.u32;
+    break;
+  case PTP_OPC_ObjectSize:
+    if (device->object_bitsize == 64) {
+      track->filesize = prop->propval.u64;
+    } else {
+      track->filesize = prop->propval.u32;
+    }
+    break;
+  default:
+    break;
   }
+}
 
-  // Callbacks
-  ptp_usb->callback_active = 1;
-  ptp_usb->current_transfer_total = ob->oi.ObjectCompressedSize+
-    PTP_USB_BULK_HDR_LEN+sizeof(uint32_t); // Request length, one parameter
-  ptp_usb->current_transfer_complete = 0;
-  ptp_usb->current_transfer_callback = callback;
-  ptp_usb->current_transfer_callback_data = data;
-
-  MTPDataHandler mtp_handler;
-  mtp_handler.getfunc = NULL;
-  mtp_handler.putfunc = put_func;
-  mtp_handler.priv = priv;
+/**
+ * A property to retrieve along with the datatype it has.
+ */
+typedef struct propdatatype_struct {
+  uint16_t property;
+  uint16_t datatype;
+} propdatatype_t;
 
-  PTPDataHandler handler;
-  handler.getfunc = NULL;
-  handler.putfunc = put_func_wrapper;
-  handler.priv = &mtp_handler;
+/*
+ * The properties that make up the track metadata, datatype 0 stands
+ * for the object size which depends on the device.
+ */
+static const propdatatype_t track_props[] = {
+  { PTP_OPC_Name, PTP_DTC_STR },
+  { PTP_OPC_Artist, PTP_DTC_STR },
+  { PTP_OPC_Composer, PTP_DTC_STR },
+  { PTP_OPC_Duration, PTP_DTC_UINT32 },
+  { PTP_OPC_Track, PTP_DTC_UINT16 },
+  { PTP_OPC_Genre, PTP_DTC_STR },
+  { PTP_OPC_AlbumName, PTP_DTC_STR },
+  { PTP_OPC_OriginalReleaseDate, PTP_DTC_STR },
+  { PTP_OPC_SampleRate, PTP_DTC_UINT32 },
+  { PTP_OPC_NumberOfChannels, PTP_DTC_UINT16 },
+  { PTP_OPC_AudioWAVECodec, PTP_DTC_UINT32 },
+  { PTP_OPC_AudioBitRate, PTP_DTC_UINT32 },
+  { PTP_OPC_BitRateType, PTP_DTC_UINT16 },
+  { PTP_OPC_Rating, PTP_DTC_UINT16 },
+  { PTP_OPC_UseCount, PTP_DTC_UINT32 },
+  { PTP_OPC_ObjectSize, 0 }
+};
+
+/**
+ * This retrieves a set of properties of one object with one request
+ * per property, for when the device cannot hand out the property list
+ * of the object. PTP does not allow a second request before the first
+ * is answered, so the requests are issued back to back while holding
+ * on to the device, keeping other threads from getting in between.
+ * @param device a pointer to the device the object is on.
+ * @param object_id the object to get the properties of.
+ * @param wanted the properties of interest.
+ * @param nrofwanted the number of properties of interest.
+ * @param supported the properties the device supports for the object.
+ * @param nrofsupported the number of supported properties.
+ * @param values returns a newly allocated property list with the
+ *        properties that were both wanted and supported, to be freed
+ *        with ptp_destroy_object_prop_list().
+ * @return the number of properties in the list.
+ */
+static int get_object_props_individually(LIBMTP_mtpdevice_t *device,
+					 uint32_t const object_id,
+					 propdatatype_t const * const wanted,
+					 int const nrofwanted,
+					 uint16_t const * const supported,
+					 uint32_t const nrofsupported,
+					 MTPProperties **values)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  int nrofvalues = 0;
+  uint32_t i;
+  int j;
 
-  ret = ptp_getobject_to_handler(params, id, &handler);
+  *values = NULL;
+  ptp_lock_transactions(params);
+  for (i = 0; i < nrofsupported; i++) {
+    MTPProperties *prop;
+    uint16_t datatype;
+    uint16_t ret;
 
-  ptp_usb->callback_active = 0;
-  ptp_usb->current_transfer_callback = NULL;
-  ptp_usb->current_transfer_callback_data = NULL;
+    for (j = 0; j < nrofwanted; j++) {
+      if (wanted[j].property == supported[i])
+	break;
+    }
+    if (j == nrofwanted)
+      continue;
+    datatype = wanted[j].datatype;
+    if (datatype == 0)
+      datatype = device->object_bitsize == 64 ? PTP_DTC_UINT64 : PTP_DTC_UINT32;
 
-  if (ret == PTP_ERROR_CANCEL) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED, "LIBMTP_Get_File_From_File_Descriptor(): Cancelled transfer.");
-    return -1;
-  }
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_File_To_File_Descriptor(): Could not get file from device.");
-    return -1;
+    prop = ptp_get_new_object_prop_entry(values, &nrofvalues);
+    if (prop == NULL)
+      break;
+    prop->ObjectHandle = object_id;
+    prop->property = supported[i];
+    prop->datatype = datatype;
+    ret = ptp_mtp_getobjectpropvalue(params, object_id, supported[i],
+				     &prop->propval, datatype);
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, ret, "get_object_props_individually(): "
+				  "could not get object property.");
+      // Leave a zeroed value, like the single value getters do
+      memset(&prop->propval, 0, sizeof(prop->propval));
+    }
   }
-
-  return 0;
+  ptp_unlock_transactions(params);
+  return nrofvalues;
 }
 
-
 /**
- * This gets a track off the device to a file identified
- * by a filename. This is actually just a wrapper for the
- * \c LIBMTP_Get_Track_To_File() function.
- * @param device a pointer to the device to get the track from.
- * @param id the track ID of the track to retrieve.
- * @param path a filename to use for the retrieved track.
- * @param callback a progress indicator function or NULL to ignore.
- * @param data a user-defined pointer that is passed along to
- *             the <code>progress</code> function in order to
- *             pass along some user defined data to the progress
- *             updates. If not used, set this to NULL.
- * @return 0 if the transfer was successful, any other value means
- *           failure.
- * @see LIBMTP_Get_Track_To_File_Descriptor()
+ * This function retrieves the track metadata for a track
+ * given by a unique ID.
+ * @param device a pointer to the device to get the track metadata off.
+ * @param trackid the unique ID of the track.
+ * @param objectformat the object format of this track, so we know what it supports.
+ * @param track a metadata set to fill in.
  */
-int LIBMTP_Get_Track_To_File(LIBMTP_mtpdevice_t *device, uint32_t const id,
-			 char const * const path, LIBMTP_progressfunc_t const callback,
-			 void const * const data)
+static void get_track_metadata(LIBMTP_mtpdevice_t *device, uint16_t objectformat,
+			       LIBMTP_track_t *track)
 {
-  // This is just a wrapper
-  return LIBMTP_Get_File_To_File(device, id, path, callback, data);
+  uint16_t ret;
+  PTPParams *params = (PTPParams *) device->params;
+  uint32_t i;
+  MTPProperties *prop;
+  PTPObject *ob;
+
+  /*
+   * If we have a cached, large set of metadata, then use it!
+   */
+  ret = ptp_object_want(params, track->item_id, PTPOBJECT_MTPPROPLIST_LOADED, &ob);
+  if (ob->mtpprops) {
+    prop = ob->mtpprops;
+    for (i=0;i<ob->nrofmtpprops;i++,prop++)
+      pick_property_to_track_metadata(device, prop, track);
+  } else {
+    uint16_t *props = NULL;
+    uint32_t propcnt = 0;
+    MTPProperties *values = NULL;
+    int nrofvalues;
+
+    // First see which properties can be retrieved for this object format
+    ret = ptp_mtp_getobjectpropssupported(params, map_libmtp_type_to_ptp_type(track->filetype), &propcnt, &props);
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, ret, "get_track_metadata(): call to ptp_mtp_getobjectpropssupported() failed.");
+      // Just bail out for now, nothing is ever set.
+      return;
+    }
+    nrofvalues = get_object_props_individually(device, track->item_id,
+					       track_props,
+					       sizeof(track_props) / sizeof(track_props[0]),
+					       props, propcnt, &values);
+    for (i = 0; i < nrofvalues; i++)
+      pick_property_to_track_metadata(device, &values[i], track);
+    ptp_destroy_object_prop_list(values, nrofvalues);
+    free(props);
+  }
 }
 
 /**
- * This gets a track off the device to a file identified
- * by a file descriptor. This is actually just a wrapper for
- * the \c LIBMTP_Get_File_To_File_Descriptor() function.
- * @param device a pointer to the device to get the track from.
- * @param id the track ID of the track to retrieve.
- * @param fd a file descriptor to write the track to.
- * @param callback a progress indicator function or NULL to ignore.
- * @param data a user-defined pointer that is passed along to
- *             the <code>progress</code> function in order to
- *             pass along some user defined data to the progress
- *             updates. If not used, set this to NULL.
- * @return 0 if the transfer was successful, any other value means
- *           failure.
- * @see LIBMTP_Get_Track_To_File()
+ * THIS FUNCTION IS DEPRECATED. PLEASE UPDATE YOUR CODE IN ORDER
+ * NOT TO USE IT.
+ * @see LIBMTP_Get_Tracklisting_With_Callback()
  */
-int LIBMTP_Get_Track_To_File_Descriptor(LIBMTP_mtpdevice_t *device,
-					uint32_t const id,
-					int const fd,
-					LIBMTP_progressfunc_t const callback,
-					void const * const data)
+LIBMTP_track_t *LIBMTP_Get_Tracklisting(LIBMTP_mtpdevice_t *device)
 {
-  // This is just a wrapper
-  return LIBMTP_Get_File_To_File_Descriptor(device, id, fd, callback, data);
+  LIBMTP_INFO("WARNING: LIBMTP_Get_Tracklisting() is deprecated.\n");
+  LIBMTP_INFO("WARNING: please update your code to use LIBMTP_Get_Tracklisting_With_Callback()\n");
+  return LIBMTP_Get_Tracklisting_With_Callback(device, NULL, NULL);
 }
 
 /**
- * This gets a track off the device to a handler function.
- * This is actually just a wrapper for
- * the \c LIBMTP_Get_File_To_Handler() function.
- * @param device a pointer to the device to get the track from.
- * @param id the track ID of the track to retrieve.
- * @param put_func the function to call when we have data.
- * @param priv the user-defined pointer that is passed to
- *             <code>put_func</code>.
- * @param callback a progress indicator function or NULL to ignore.
+ * This returns a long list of all tracks available on the current MTP device.
+ * Tracks include multimedia objects, both music tracks and video tracks.
+ * Typical usage:
+ *
+ * <pre>
+ * LIBMTP_track_t *tracklist;
+ *
+ * tracklist = LIBMTP_Get_Tracklisting_With_Callback(device, callback, data);
+ * while (tracklist != NULL) {
+ *   LIBMTP_track_t *tmp;
+ *
+ *   // Do something on each element in the list here...
+ *   tmp = tracklist;
+ *   tracklist = tracklist->next;
+ *   LIBMTP_destroy_track_t(tmp);
+ * }
+ * </pre>
+ *
+ * If you want to group your track listing by storage (per storage unit) or
+ * arrange tracks into folders, you must dereference the <code>storage_id</code>
+ * and/or <code>parent_id</code> field of the returned <code>LIBMTP_track_t</code>
+ * struct. To arrange by folders or files you typically have to create the proper
+ * trees by calls to <code>LIBMTP_Get_Storage()</code> and/or
+ * <code>LIBMTP_Get_Folder_List()</code> first.
+ *
+ * @param device a pointer to the device to get the track listing for.
+ * @param callback a function to be called during the tracklisting retrieveal
+ *        for displaying progress bars etc, or NULL if you don't want
+ *        any callbacks.
  * @param data a user-defined pointer that is passed along to
- *             the <code>progress</code> function in order to
- *             pass along some user defined data to the progress
- *             updates. If not used, set this to NULL.
- * @return 0 if the transfer was successful, any other value means
- *           failure.
+ *        the <code>progress</code> function in order to
+ *        pass along some user defined data to the progress
+ *        updates. If not used, set this to NULL.
+ * @return a list of tracks that can be followed using the <code>next</code>
+ *        field of the <code>LIBMTP_track_t</code> data structure.
+ *        Each of the metadata tags must be freed after use, and may
+ *        contain only partial metadata information, i.e. one or several
+ *        fields may be NULL or 0.
+ * @see LIBMTP_Get_Trackmetadata()
  */
-int LIBMTP_Get_Track_To_Handler(LIBMTP_mtpdevice_t *device,
-					uint32_t const id,
-					MTPDataPutFunc put_func,
-          void * priv,
-					LIBMTP_progressfunc_t const callback,
-					void const * const data)
+LIBMTP_track_t *LIBMTP_Get_Tracklisting_With_Callback(LIBMTP_mtpdevice_t *device,
+                                                      LIBMTP_progressfunc_t const callback,
+                                                      void const * const data)
 {
-  // This is just a wrapper
-  return LIBMTP_Get_File_To_Handler(device, id, put_func, priv, callback, data);
+	return LIBMTP_Get_Tracklisting_With_Callback_For_Storage(device, 0, callback, data);
 }
 
+
 /**
- * This function sends a track from a local file to an
- * MTP device. A filename and a set of metadata must be
- * given as input.
- * @param device a pointer to the device to send the track to.
- * @param path the filename of a local file which will be sent.
- * @param metadata a track metadata set to be written along with the file.
- *        After this call the field <code>metadata-&gt;item_id</code>
- *        will contain the new track ID. Other fields such
- *        as the <code>metadata-&gt;filename</code>, <code>metadata-&gt;parent_id</code>
- *        or <code>metadata-&gt;storage_id</code> may also change during this
- *        operation due to device restrictions, so do not rely on the
- *        contents of this struct to be preserved in any way.
- *        <ul>
- *        <li><code>metadata-&gt;parent_id</code> should be set to the parent
- *        (e.g. folder) to store this track in. Since some
- *        devices are a bit picky about where files
- *        are placed, a default folder will be chosen if libmtp
- *        has detected one for the current filetype and this
- *        parameter is set to 0. If this is 0 and no default folder
- *        can be found, the file will be stored in the root folder.
- *        <li><code>metadata-&gt;storage_id</code> should be set to the
- *        desired storage (e.g. memory card or whatever your device
- *        presents) to store this track in. Setting this to 0 will store
- *        the track on the primary storage.
- *        </ul>
- * @param callback a progress indicator function or NULL to ignore.
+ * This returns a long list of all tracks available on the current MTP device.
+ * Tracks include multimedia objects, both music tracks and video tracks.
+ * Typical usage:
+ *
+ * <pre>
+ * LIBMTP_track_t *tracklist;
+ *
+ * tracklist = LIBMTP_Get_Tracklisting_With_Callback_For_Storage(device, storage_id, callback, data);
+ * while (tracklist != NULL) {
+ *   LIBMTP_track_t *tmp;
+ *
+ *   // Do something on each element in the list here...
+ *   tmp = tracklist;
+ *   tracklist = tracklist->next;
+ *   LIBMTP_destroy_track_t(tmp);
+ * }
+ * </pre>
+ *
+ * If you want to group your track listing by storage (per storage unit) or
+ * arrange tracks into folders, you must dereference the <code>storage_id</code>
+ * and/or <code>parent_id</code> field of the returned <code>LIBMTP_track_t</code>
+ * struct. To arrange by folders or files you typically have to create the proper
+ * trees by calls to <code>LIBMTP_Get_Storage()</code> and/or 
+ * <code>LIBMTP_Get_Folder_List()</code> first.
+ *
+ * If the metadata has to be read from the device first, the callback
+ * is called with the number of bytes of metadata received so far while
+ * that happens, and then with the number of objects examined.
+ *
+ * @param device a pointer to the device to get the track listing for.
+ * @param storage_id ID of device storage (if null, no filter)
+ * @param callback a function to be called during the tracklisting retrieveal
+ *        for displaying progress bars etc, or NULL if you don't want
+ *        any callbacks.
  * @param data a user-defined pointer that is passed along to
- *             the <code>progress</code> function in order to
- *             pass along some user defined data to the progress
- *             updates. If not used, set this to NULL.
- * @return 0 if the transfer was successful, any other value means
- *           failure.
- * @see LIBMTP_Send_Track_From_File_Descriptor()
- * @see LIBMTP_Send_File_From_File()
- * @see LIBMTP_Delete_Object()
+ *        the <code>progress</code> function in order to
+ *        pass along some user defined data to the progress
+ *        updates. If not used, set this to NULL.
+ * @return a list of tracks that can be followed using the <code>next</code>
+ *        field of the <code>LIBMTP_track_t</code> data structure.
+ *        Each of the metadata tags must be freed after use, and may
+ *        contain only partial metadata information, i.e. one or several
+ *        fields may be NULL or 0.
+ * @see LIBMTP_Get_Trackmetadata()
  */
-int LIBMTP_Send_Track_From_File(LIBMTP_mtpdevice_t *device,
-			 char const * const path, LIBMTP_track_t * const metadata,
-                         LIBMTP_progressfunc_t const callback,
-			 void const * const data)
+LIBMTP_track_t *LIBMTP_Get_Tracklisting_With_Callback_For_Storage(LIBMTP_mtpdevice_t *device, uint32_t const storage_id,
+                                                      LIBMTP_progressfunc_t const callback,
+                                                      void const * const data)
 {
-  int fd;
-  int ret;
+  uint32_t i = 0;
+  LIBMTP_track_t *retracks = NULL;
+  LIBMTP_track_t *curtrack = NULL;
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
 
-  // Sanity check
-  if (path == NULL) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Send_Track_From_File(): Bad arguments, path was NULL.");
-    return -1;
+  ptp_lock_cache(params, 1);
+  // Get all the handles if we haven't already done that
+  if (params->nrofobjects == 0) {
+    PRIV(device)->fill_callback = callback;
+    PRIV(device)->fill_callback_data = data;
+    flush_handles(device);
+    PRIV(device)->fill_callback = NULL;
+    PRIV(device)->fill_callback_data = NULL;
   }
 
-  // Open file
-#ifdef __WIN32__
-#ifdef USE_WINDOWS_IO_H
-  if ( (fd = _open(path, O_RDONLY|O_BINARY)) == -1 ) {
-#else
-  if ( (fd = open(path, O_RDONLY|O_BINARY)) == -1 ) {
-#endif
-#else
-  if ( (fd = open(path, O_RDONLY)) == -1) {
-#endif
-    LIBMTP_ERROR("LIBMTP_Send_Track_From_File(): Could not open source file \"%s\"\n", path);
-    return -1;
-  }
+  for (i = 0; i < params->nrofobjects; i++) {
+    LIBMTP_track_t *track;
+    PTPObject *ob;
+    LIBMTP_filetype_t mtptype;
 
-  ret = LIBMTP_Send_Track_From_File_Descriptor(device, fd, metadata, callback, data);
+    if (callback != NULL)
+      callback(i, params->nrofobjects, data);
 
-  // Close file.
-#ifdef USE_WINDOWS_IO_H
-  _close(fd);
-#else
-  close(fd);
-#endif
+    ob = &params->objects[i];
+    mtptype = map_ptp_type_to_libmtp_type(ob->oi.ObjectFormat);
 
-  return ret;
-}
+    // Ignore stuff we don't know how to handle...
+    // TODO: get this list as an intersection of the sets
+    // supported by the device and the from the device and
+    // all known track files?
+    if (!LIBMTP_FILETYPE_IS_TRACK(mtptype) &&
+	// This row lets through undefined files for examination since they may be forgotten OGG files.
+	(ob->oi.ObjectFormat != PTP_OFC_Undefined ||
+	 (!FLAG_IRIVER_OGG_ALZHEIMER(ptp_usb) &&
+	  !FLAG_OGG_IS_UNKNOWN(ptp_usb) &&
+	  !FLAG_FLAC_IS_UNKNOWN(ptp_usb)))
+	) {
+      //printf("Not a music track (name: %s format: %d), skipping...\n", oi->Filename, oi->ObjectFormat);
+      continue;
+    }
 
+	// Ignore stuff that isn't into the storage device
+	if ((storage_id != 0) && (ob->oi.StorageID != storage_id ))
+		continue;
 
+    // Allocate a new track type
+    track = LIBMTP_new_track_t();
 
-/**
- * This helper function checks if a filename already exists on the device
- * @param PTPParams*
- * @param string representing the filename
- * @return 0 if the filename doesn't exist, -1 if it does
- */
-static int check_filename_exists(PTPParams* params, char const * const filename)
-{
-  int i;
+    // This is some sort of unique ID so we can keep track of the track.
+    track->item_id = ob->oid;
+    track->parent_id = ob->oi.ParentObject;
+    track->storage_id = ob->oi.StorageID;
+    track->modificationdate = ob->oi.ModificationDate;
 
-  for (i = 0; i < params->nrofobjects; i++) {
-    char *fname = params->objects[i].oi.Filename;
-    if ((fname != NULL) && (strcmp(filename, fname) == 0))
-    {
-      return -1;
+    track->filetype = mtptype;
+
+    // Original file-specific properties
+    track->filesize = ob->oi.ObjectCompressedSize;
+    if (ob->oi.Filename != NULL) {
+      track->filename = strdup(ob->oi.Filename);
     }
-  }
 
-  return 0;
-}
+    get_track_metadata(device, ob->oi.ObjectFormat, track);
 
-/**
- * This helper function returns a unique filename, with a random string before the extension
- * @param string representing the original filename
- * @return a string representing the unique filename
- */
-static char *generate_unique_filename(PTPParams* params, char const * const filename)
-{
-  int suffix;
-  char * extension_position;
+    /*
+     * A special quirk for iriver devices that doesn't quite
+     * remember that some files marked as "unknown" type are
+     * actually OGG or FLAC files. We look at the filename extension
+     * and see if it happens that this was atleast named "ogg" or "flac"
+     * and fall back on this heuristic approach in that case,
+     * for these bugged devices only.
+     */
+    if (track->filetype == LIBMTP_FILETYPE_UNKNOWN &&
+	track->filename != NULL) {
+      if ((FLAG_IRIVER_OGG_ALZHEIMER(ptp_usb) ||
+	   FLAG_OGG_IS_UNKNOWN(ptp_usb)) &&
+	  has_ogg_extension(track->filename))
+	track->filetype = LIBMTP_FILETYPE_OGG;
+      else if (FLAG_FLAC_IS_UNKNOWN(ptp_usb) &&
+	       has_flac_extension(track->filename))
+	track->filetype = LIBMTP_FILETYPE_FLAC;
+      else {
+	// This was not an OGG/FLAC file so discard it and continue
+	LIBMTP_destroy_track_t(track);
+	continue;
+      }
+    }
 
-  if (check_filename_exists(params, filename))
-  {
-    extension_position = strrchr(filename,'.');
+    // Add track to a list that will be returned afterwards.
+    if (retracks == NULL) {
+      retracks = track;
+      curtrack = track;
+    } else {
+      curtrack->next = track;
+      curtrack = track;
+    }
 
-    char basename[extension_position - filename + 1];
-    strncpy(basename, filename, extension_position - filename);
-    basename[extension_position - filename] = '\0';
+    // Call listing callback
+    // double progressPercent = (double)i*(double)100.0 / (double)params->handles.n;
 
-    suffix = 1;
-    char newname[ strlen(basename) + 6 + strlen(extension_position)];
-    sprintf(newname, "%s_%d%s", basename, suffix, extension_position);
-    while ((check_filename_exists(params, newname)) && (suffix < 1000000)) {
-      suffix++;
-      sprintf(newname, "%s_%d%s", basename, suffix, extension_position);
-    }
-  return strdup(newname);
-  }
-  else
-  {
-    return strdup(filename);
-  }
+  } // Handle counting loop
+  ptp_unlock_cache(params);
+  return retracks;
 }
 
 /**
- * This function sends a track from a file descriptor to an
- * MTP device. A filename and a set of metadata must be
- * given as input.
- * @param device a pointer to the device to send the track to.
- * @param fd the filedescriptor for a local file which will be sent.
- * @param metadata a track metadata set to be written along with the file.
- *        After this call the field <code>metadata-&gt;item_id</code>
- *        will contain the new track ID. Other fields such
- *        as the <code>metadata-&gt;filename</code>, <code>metadata-&gt;parent_id</code>
- *        or <code>metadata-&gt;storage_id</code> may also change during this
- *        operation due to device restrictions, so do not rely on the
- *        contents of this struct to be preserved in any way.
- *        <ul>
- *        <li><code>metadata-&gt;parent_id</code> should be set to the parent
- *        (e.g. folder) to store this track in. Since some
- *        devices are a bit picky about where files
- *        are placed, a default folder will be chosen if libmtp
- *        has detected one for the current filetype and this
- *        parameter is set to 0. If this is 0 and no default folder
- *        can be found, the file will be stored in the root folder.
- *        <li><code>metadata-&gt;storage_id</code> should be set to the
- *        desired storage (e.g. memory card or whatever your device
- *        presents) to store this track in. Setting this to 0 will store
- *        the track on the primary storage.
- *        </ul>
- * @param callback a progress indicator function or NULL to ignore.
- * @param data a user-defined pointer that is passed along to
- *             the <code>progress</code> function in order to
- *             pass along some user defined data to the progress
- *             updates. If not used, set this to NULL.
- * @return 0 if the transfer was successful, any other value means
- *           failure.
- * @see LIBMTP_Send_Track_From_File()
- * @see LIBMTP_Delete_Object()
+ * This function retrieves the metadata for a single track off
+ * the device.
+ *
+ * Do not call this function repeatedly! The track handles are linearly
+ * searched O(n) and the call may involve (slow) USB traffic, so use
+ * <code>LIBMTP_Get_Tracklisting()</code> and cache the tracks, preferably
+ * as an efficient data structure such as a hash list.
+ *
+ * @param device a pointer to the device to get the track metadata from.
+ * @param trackid the object ID of the track that you want the metadata for.
+ * @return a track metadata entry on success or NULL on failure.
+ * @see LIBMTP_Get_Tracklisting()
  */
-int LIBMTP_Send_Track_From_File_Descriptor(LIBMTP_mtpdevice_t *device,
-			 int const fd, LIBMTP_track_t * const metadata,
-                         LIBMTP_progressfunc_t const callback,
-			 void const * const data)
+LIBMTP_track_t *LIBMTP_Get_Trackmetadata(LIBMTP_mtpdevice_t *device, uint32_t const trackid)
 {
-  int subcall_ret;
-  LIBMTP_file_t filedata;
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
   PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  PTPObject *ob;
+  LIBMTP_track_t *track;
+  LIBMTP_filetype_t mtptype;
+  uint16_t ret;
 
-  // Sanity check, is this really a track?
-  if (!LIBMTP_FILETYPE_IS_TRACK(metadata->filetype)) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-			    "LIBMTP_Send_Track_From_File_Descriptor(): "
-			    "I don't think this is actually a track, strange filetype...");
-  }
+  ptp_lock_cache(params, 1);
+  // Get all the handles if we haven't already done that
+  if (params->nrofobjects == 0)
+    flush_handles(device);
 
-  // Wrap around the file transfer function
-  filedata.item_id = metadata->item_id;
-  filedata.parent_id = metadata->parent_id;
-  filedata.storage_id = metadata->storage_id;
-  if FLAG_UNIQUE_FILENAMES(ptp_usb) {
-    filedata.filename = generate_unique_filename(params, metadata->filename);
-  }
-  else {
-    filedata.filename = metadata->filename;
+  ret = ptp_object_want (params, trackid, PTPOBJECT_OBJECTINFO_LOADED, &ob);
+  if (ret != PTP_RC_OK) {
+    ptp_unlock_cache(params);
+    return NULL;
   }
-  filedata.filesize = metadata->filesize;
-  filedata.filetype = metadata->filetype;
-  filedata.next = NULL;
 
-  subcall_ret = LIBMTP_Send_File_From_File_Descriptor(device,
-						      fd,
-						      &filedata,
-						      callback,
-						      data);
+  mtptype = map_ptp_type_to_libmtp_type(ob->oi.ObjectFormat);
 
-  if (subcall_ret != 0) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-			    "LIBMTP_Send_Track_From_File_Descriptor(): "
-			    "subcall to LIBMTP_Send_File_From_File_Descriptor failed.");
-    // We used to delete the file here, but don't... It might be OK after all.
-    // (void) LIBMTP_Delete_Object(device, metadata->item_id);
-    return -1;
+  // Ignore stuff we don't know how to handle...
+  if (!LIBMTP_FILETYPE_IS_TRACK(mtptype) &&
+      /*
+       * This row lets through undefined files for examination
+       * since they may be forgotten OGG or FLAC files.
+       */
+      (ob->oi.ObjectFormat != PTP_OFC_Undefined ||
+       (!FLAG_IRIVER_OGG_ALZHEIMER(ptp_usb) &&
+	!FLAG_OGG_IS_UNKNOWN(ptp_usb) &&
+	!FLAG_FLAC_IS_UNKNOWN(ptp_usb)))
+      ) {
+    //printf("Not a music track (name: %s format: %d), skipping...\n", oi->Filename, oi->ObjectFormat);
+    ptp_unlock_cache(params);
+    return NULL;
   }
 
-  // Pick up new item (and parent, storage) ID
-  metadata->item_id = filedata.item_id;
-  metadata->parent_id = filedata.parent_id;
-  metadata->storage_id = filedata.storage_id;
-
-  // Set track metadata for the new fine track
-  subcall_ret = LIBMTP_Update_Track_Metadata(device, metadata);
-  if (subcall_ret != 0) {
-    // Subcall will add error to errorstack
-    // We used to delete the file here, but don't... It might be OK after all.
-    // (void) LIBMTP_Delete_Object(device, metadata->item_id);
-    return -1;
-  }
+  // Allocate a new track type
+  track = LIBMTP_new_track_t();
 
-  // note we don't need to update the cache here because LIBMTP_Send_File_From_File_Descriptor
-  // has added the object handle and LIBMTP_Update_Track_Metadata has added the metadata.
+  // This is some sort of unique ID so we can keep track of the track.
+  track->item_id = ob->oid;
+  track->parent_id = ob->oi.ParentObject;
+  track->storage_id = ob->oi.StorageID;
+  track->modificationdate = ob->oi.ModificationDate;
 
-  return 0;
-}
+  track->filetype = mtptype;
 
-/**
- * This function sends a track from a handler function to an
- * MTP device. A filename and a set of metadata must be
- * given as input.
- * @param device a pointer to the device to send the track to.
- * @param get_func the function to call when we have data.
- * @param priv the user-defined pointer that is passed to
- *             <code>get_func</code>.
- * @param metadata a track metadata set to be written along with the file.
- *        After this call the field <code>metadata-&gt;item_id</code>
- *        will contain the new track ID. Other fields such
- *        as the <code>metadata-&gt;filename</code>, <code>metadata-&gt;parent_id</code>
- *        or <code>metadata-&gt;storage_id</code> may also change during this
- *        operation due to device restrictions, so do not rely on the
- *        contents of this struct to be preserved in any way.
- *        <ul>
- *        <li><code>metadata-&gt;parent_id</code> should be set to the parent
- *        (e.g. folder) to store this track in. Since some
- *        devices are a bit picky about where files
- *        are placed, a default folder will be chosen if libmtp
- *        has detected one for the current filetype and this
- *        parameter is set to 0. If this is 0 and no default folder
- *        can be found, the file will be stored in the root folder.
- *        <li><code>metadata-&gt;storage_id</code> should be set to the
- *        desired storage (e.g. memory card or whatever your device
- *        presents) to store this track in. Setting this to 0 will store
- *        the track on the primary storage.
- *        </ul>
- * @param callback a progress indicator function or NULL to ignore.
- * @param data a user-defined pointer that is passed along to
- *             the <code>progress</code> function in order to
- *             pass along some user defined data to the progress
- *             updates. If not used, set this to NULL.
- * @return 0 if the transfer was successful, any other value means
- *           failure.
- * @see LIBMTP_Send_Track_From_File()
- * @see LIBMTP_Delete_Object()
- */
-int LIBMTP_Send_Track_From_Handler(LIBMTP_mtpdevice_t *device,
-			 MTPDataGetFunc get_func, void * priv, LIBMTP_track_t * const metadata,
-                         LIBMTP_progressfunc_t const callback,
-			 void const * const data)
-{
-  int subcall_ret;
-  LIBMTP_file_t filedata;
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  PTPParams *params = (PTPParams *) device->params;
-
-  // Sanity check, is this really a track?
-  if (!LIBMTP_FILETYPE_IS_TRACK(metadata->filetype)) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-			    "LIBMTP_Send_Track_From_Handler(): "
-			    "I don't think this is actually a track, strange filetype...");
+  // Original file-specific properties
+  track->filesize = ob->oi.ObjectCompressedSize;
+  if (ob->oi.Filename != NULL) {
+    track->filename = strdup(ob->oi.Filename);
   }
 
-  // Wrap around the file transfer function
-  filedata.item_id = metadata->item_id;
-  filedata.parent_id = metadata->parent_id;
-  filedata.storage_id = metadata->storage_id;
-  if FLAG_UNIQUE_FILENAMES(ptp_usb) {
-    filedata.filename = generate_unique_filename(params, metadata->filename);
-  }
-  else {
-    filedata.filename = metadata->filename;
+  /*
+   * A special quirk for devices that doesn't quite
+   * remember that some files marked as "unknown" type are
+   * actually OGG or FLAC files. We look at the filename extension
+   * and see if it happens that this was atleast named "ogg"
+   * and fall back on this heuristic approach in that case,
+   * for these bugged devices only.
+   */
+  if (track->filetype == LIBMTP_FILETYPE_UNKNOWN &&
+      track->filename != NULL) {
+    if ((FLAG_IRIVER_OGG_ALZHEIMER(ptp_usb) ||
+	 FLAG_OGG_IS_UNKNOWN(ptp_usb)) &&
+	has_ogg_extension(track->filename))
+      track->filetype = LIBMTP_FILETYPE_OGG;
+    else if (FLAG_FLAC_IS_UNKNOWN(ptp_usb) &&
+	     has_flac_extension(track->filename))
+      track->filetype = LIBMTP_FILETYPE_FLAC;
+    else {
+      // This was not an OGG/FLAC file so discard it
+      LIBMTP_destroy_track_t(track);
+      ptp_unlock_cache(params);
+      return NULL;
+    }
   }
-  filedata.filesize = metadata->filesize;
-  filedata.filetype = metadata->filetype;
-  filedata.next = NULL;
-
-  subcall_ret = LIBMTP_Send_File_From_Handler(device,
-					      get_func,
-					      priv,
-					      &filedata,
-					      callback,
-					      data);
+  get_track_metadata(device, ob->oi.ObjectFormat, track);
+  ptp_unlock_cache(params);
+  return track;
+}
 
-  if (subcall_ret != 0) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-			    "LIBMTP_Send_Track_From_Handler(): "
-			    "subcall to LIBMTP_Send_File_From_Handler failed.");
-    // We used to delete the file here, but don't... It might be OK after all.
-    // (void) LIBMTP_Delete_Object(device, metadata->item_id);
-    return -1;
+/**
+ * This is a manual conversion from MTPDataGetFunc to PTPDataGetFunc
+ * to isolate the internal type.
+ */
+static uint16_t get_func_wrapper(PTPParams* params, void* priv, unsigned long wantlen, unsigned char *data, unsigned long *gotlen)
+{
+  MTPDataHandler *handler = (MTPDataHandler *)priv;
+  uint16_t ret;
+  uint32_t local_gotlen = 0;
+  ret = handler->getfunc(params, handler->priv, wantlen, data, &local_gotlen);
+  *gotlen = local_gotlen;
+  switch (ret)
+  {
+    case LIBMTP_HANDLER_RETURN_OK:
+      return PTP_RC_OK;
+    case LIBMTP_HANDLER_RETURN_ERROR:
+      return PTP_ERROR_IO;
+    case LIBMTP_HANDLER_RETURN_CANCEL:
+      return PTP_ERROR_CANCEL;
+    default:
+      return PTP_ERROR_IO;
   }
+}
 
-  // Pick up new item (and parent, storage) ID
-  metadata->item_id = filedata.item_id;
-  metadata->parent_id = filedata.parent_id;
-  metadata->storage_id = filedata.storage_id;
-
-  // Set track metadata for the new fine track
-  subcall_ret = LIBMTP_Update_Track_Metadata(device, metadata);
-  if (subcall_ret != 0) {
-    // Subcall will add error to errorstack
-    // We used to delete the file here, but don't... It might be OK after all.
-    // (void) LIBMTP_Delete_Object(device, metadata->item_id);
-    return -1;
+/**
+ * This is a manual conversion from MTPDataPutFunc to PTPDataPutFunc
+ * to isolate the internal type.
+ */
+static uint16_t put_func_wrapper(PTPParams* params, void* priv, unsigned long sendlen, unsigned char *data, unsigned long *putlen)
+{
+  MTPDataHandler *handler = (MTPDataHandler *)priv;
+  uint16_t ret;
+  uint32_t local_putlen = 0;
+  ret = handler->putfunc(params, handler->priv, sendlen, data, &local_putlen);
+  *putlen = local_putlen;
+  switch (ret)
+  {
+    case LIBMTP_HANDLER_RETURN_OK:
+      return PTP_RC_OK;
+    case LIBMTP_HANDLER_RETURN_ERROR:
+      return PTP_ERROR_IO;
+    case LIBMTP_HANDLER_RETURN_CANCEL:
+      return PTP_ERROR_CANCEL;
+    default:
+      return PTP_ERROR_IO;
   }
-
-  // note we don't need to update the cache here because LIBMTP_Send_File_From_File_Descriptor
-  // has added the object handle and LIBMTP_Update_Track_Metadata has added the metadata.
-
-  return 0;
 }
 
 /**
- * This function sends a local file to an MTP device.
- * A filename and a set of metadata must be
- * given as input.
- * @param device a pointer to the device to send the track to.
- * @param path the filename of a local file which will be sent.
- * @param filedata a file metadata set to be written along with the file.
- *        After this call the field <code>filedata-&gt;item_id</code>
- *        will contain the new file ID. Other fields such
- *        as the <code>filedata-&gt;filename</code>, <code>filedata-&gt;parent_id</code>
- *        or <code>filedata-&gt;storage_id</code> may also change during this
- *        operation due to device restrictions, so do not rely on the
- *        contents of this struct to be preserved in any way.
- *        <ul>
- *        <li><code>filedata-&gt;parent_id</code> should be set to the parent
- *        (e.g. folder) to store this file in. If this is 0,
- *        the file will be stored in the root folder.
- *        <li><code>filedata-&gt;storage_id</code> should be set to the
- *        desired storage (e.g. memory card or whatever your device
- *        presents) to store this file in. Setting this to 0 will store
- *        the file on the primary storage.
- *        </ul>
+ * This gets a file off the device to a local file identified
+ * by a filename.
+ * @param device a pointer to the device to get the track from.
+ * @param id the file ID of the file to retrieve.
+ * @param path a filename to use for the retrieved file.
  * @param callback a progress indicator function or NULL to ignore.
  * @param data a user-defined pointer that is passed along to
  *             the <code>progress</code> function in order to
@@ -5744,76 +7413,178 @@ int LIBMTP_Send_Track_From_Handler(LIBMTP_mtpdevice_t *device,
  *             updates. If not used, set this to NULL.
  * @return 0 if the transfer was successful, any other value means
  *           failure.
- * @see LIBMTP_Send_File_From_File_Descriptor()
- * @see LIBMTP_Delete_Object()
+ * @see LIBMTP_Get_File_To_File_Descriptor()
  */
-int LIBMTP_Send_File_From_File(LIBMTP_mtpdevice_t *device,
-			       char const * const path, LIBMTP_file_t * const filedata,
-			       LIBMTP_progressfunc_t const callback,
-			       void const * const data)
+int LIBMTP_Get_File_To_File(LIBMTP_mtpdevice_t *device, uint32_t const id,
+			 char const * const path, LIBMTP_progressfunc_t const callback,
+			 void const * const data)
 {
-  int fd;
+  int fd = -1;
   int ret;
 
   // Sanity check
   if (path == NULL) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Send_File_From_File(): Bad arguments, path was NULL.");
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File(): Bad arguments, path was NULL.");
     return -1;
   }
 
   // Open file
 #ifdef __WIN32__
 #ifdef USE_WINDOWS_IO_H
-  if ( (fd = _open(path, O_RDONLY|O_BINARY)) == -1 ) {
+  if ( (fd = _open(path, O_RDWR|O_CREAT|O_TRUNC|O_BINARY,_S_IREAD)) == -1 ) {
 #else
-  if ( (fd = open(path, O_RDONLY|O_BINARY)) == -1 ) {
+  if ( (fd = open(path, O_RDWR|O_CREAT|O_TRUNC|O_BINARY,S_IRWXU)) == -1 ) {
 #endif
 #else
-  if ( (fd = open(path, O_RDONLY)) == -1) {
+  if ( (fd = open(path, O_RDWR|O_CREAT|O_TRUNC,S_IRWXU|S_IRGRP)) == -1) {
 #endif
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Send_File_From_File(): Could not open source file.");
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File(): Could not create file.");
     return -1;
   }
 
-  ret = LIBMTP_Send_File_From_File_Descriptor(device, fd, filedata, callback, data);
+  ret = LIBMTP_Get_File_To_File_Descriptor(device, id, fd, callback, data);
 
-  // Close file.
-#ifdef USE_WINDOWS_IO_H
-  _close(fd);
-#else
+  // Close file
   close(fd);
-#endif
+
+  // Delete partial file.
+  if (ret == -1) {
+    unlink(path);
+  }
 
   return ret;
 }
 
+/*
+ * How much of a file LIBMTP_Get_File_To_File_Resumable() asks for at a
+ * time. Progress is kept after each chunk.
+ */
+#define RESUME_CHUNK_SIZE (8*1024*1024)
+
+/*
+ * How much of the end of a partial file is compared with the object
+ * before the transfer is resumed.
+ */
+#define RESUME_CHECK_SIZE 4096
+
 /**
- * This function sends a generic file from a file descriptor to an
- * MTP device. A filename and a set of metadata must be
- * given as input.
- *
- * This can potentially be used for sending in a stream of unknown
- * length. Send music files with
- * <code>LIBMTP_Send_Track_From_File_Descriptor()</code>
- *
- * @param device a pointer to the device to send the file to.
- * @param fd the filedescriptor for a local file which will be sent.
- * @param filedata a file metadata set to be written along with the file.
- *        After this call the field <code>filedata-&gt;item_id</code>
- *        will contain the new file ID. Other fields such
- *        as the <code>filedata-&gt;filename</code>, <code>filedata-&gt;parent_id</code>
- *        or <code>filedata-&gt;storage_id</code> may also change during this
- *        operation due to device restrictions, so do not rely on the
- *        contents of this struct to be preserved in any way.
- *        <ul>
- *        <li><code>filedata-&gt;parent_id</code> should be set to the parent
- *        (e.g. folder) to store this file in. If this is 0,
- *        the file will be stored in the root folder.
- *        <li><code>filedata-&gt;storage_id</code> should be set to the
- *        desired storage (e.g. memory card or whatever your device
- *        presents) to store this file in. Setting this to 0 will store
- *        the file on the primary storage.
- *        </ul>
+ * Returns the name of the file that tells which object a partial file
+ * belongs to, which is the name of the file with ".mtpresume" added.
+ * @return the name, to be freed by the caller, or NULL if out of memory.
+ */
+static char *get_resume_info_path(char const * const path)
+{
+  size_t len = strlen(path);
+  char *infopath = malloc(len + sizeof(".mtpresume"));
+
+  if (infopath == NULL)
+    return NULL;
+  memcpy(infopath, path, len);
+  memcpy(infopath + len, ".mtpresume", sizeof(".mtpresume"));
+  return infopath;
+}
+
+/**
+ * Checks whether the partial file of a resumable transfer was left by
+ * an earlier try on the same object: same object ID, same size and
+ * same modification date.
+ * @return 1 if it was, 0 otherwise.
+ */
+static int check_resume_info(char const * const infopath, uint32_t const id,
+			     uint64_t const filesize, time_t const date)
+{
+  FILE *f = fopen(infopath, "r");
+  unsigned int oldid;
+  unsigned long long oldsize;
+  long long olddate;
+  int ret = 0;
+
+  if (f == NULL)
+    return 0;
+  if (fscanf(f, "%u %llu %lld", &oldid, &oldsize, &olddate) == 3 &&
+      oldid == id && oldsize == filesize && olddate == (long long) date)
+    ret = 1;
+  fclose(f);
+  return ret;
+}
+
+/**
+ * Records which object a partial file belongs to.
+ * @return 0 on success, -1 on failure.
+ */
+static int write_resume_info(char const * const infopath, uint32_t const id,
+			     uint64_t const filesize, time_t const date)
+{
+  FILE *f = fopen(infopath, "w");
+  int ret = 0;
+
+  if (f == NULL)
+    return -1;
+  if (fprintf(f, "%u %llu %lld\n", (unsigned int) id,
+	      (unsigned long long) filesize, (long long) date) < 0)
+    ret = -1;
+  if (fclose(f) != 0)
+    ret = -1;
+  return ret;
+}
+
+/**
+ * Compares the end of a partial file with the same bytes of the
+ * object on the device.
+ * @return 1 if they are the same, 0 otherwise.
+ */
+static int check_resume_tail(LIBMTP_mtpdevice_t *device, uint32_t const id,
+			     int const fd, uint64_t const offset)
+{
+  unsigned char local[RESUME_CHECK_SIZE];
+  unsigned char *remote = NULL;
+  unsigned int got = 0;
+  uint32_t want = RESUME_CHECK_SIZE;
+  uint32_t done = 0;
+  int ret = 0;
+
+  if (offset < want)
+    want = offset;
+  if (want == 0)
+    return 1;
+  if (lseek(fd, offset - want, SEEK_SET) == (off_t) -1)
+    return 0;
+  while (done < want) {
+    ssize_t n = read(fd, local + done, want - done);
+
+    if (n <= 0)
+      return 0;
+    done += n;
+  }
+  if (LIBMTP_GetPartialObject(device, id, offset - want, want,
+			      &remote, &got) == 0 &&
+      got >= want && memcmp(local, remote, want) == 0)
+    ret = 1;
+  free(remote);
+  return ret;
+}
+
+/**
+ * This gets a file off the device to a local file identified by a
+ * filename, like <code>LIBMTP_Get_File_To_File()</code>, but an
+ * interrupted transfer can be resumed by calling this function again.
+ *
+ * The file is retrieved in large chunks and whatever has arrived is
+ * kept when the transfer fails or is cancelled. While the local file
+ * is incomplete, a file with the same name and ".mtpresume" added
+ * records the ID, size and modification date of the object. On the
+ * next call the transfer continues from the end of the local file if
+ * that record still matches the object, the local file is not larger
+ * than the object and its last bytes are the same as on the device.
+ * Otherwise it starts over. The record is removed once the file is
+ * complete.
+ *
+ * Resuming needs a device that can send parts of an object. Other
+ * devices get the whole file every time.
+ *
+ * @param device a pointer to the device to get the file from.
+ * @param id the file ID of the file to retrieve.
+ * @param path a filename to use for the retrieved file.
  * @param callback a progress indicator function or NULL to ignore.
  * @param data a user-defined pointer that is passed along to
  *             the <code>progress</code> function in order to
@@ -5821,116 +7592,159 @@ int LIBMTP_Send_File_From_File(LIBMTP_mtpdevice_t *device,
  *             updates. If not used, set this to NULL.
  * @return 0 if the transfer was successful, any other value means
  *           failure.
- * @see LIBMTP_Send_File_From_File()
- * @see LIBMTP_Send_Track_From_File_Descriptor()
- * @see LIBMTP_Delete_Object()
+ * @see LIBMTP_Get_File_To_File()
  */
-int LIBMTP_Send_File_From_File_Descriptor(LIBMTP_mtpdevice_t *device,
-			 int const fd, LIBMTP_file_t * const filedata,
-                         LIBMTP_progressfunc_t const callback,
-			 void const * const data)
+int LIBMTP_Get_File_To_File_Resumable(LIBMTP_mtpdevice_t *device,
+				      uint32_t const id,
+				      char const * const path,
+				      LIBMTP_progressfunc_t const callback,
+				      void const * const data)
 {
-  uint16_t ret;
   PTPParams *params = (PTPParams *) device->params;
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  LIBMTP_file_t *newfilemeta;
-  int oldtimeout;
-  int timeout;
+  LIBMTP_file_t *file;
+  struct stat st;
+  char *infopath;
+  uint64_t filesize;
+  uint64_t offset = 0;
+  time_t date;
+  int fd;
+  int ret = 0;
 
-  if (send_file_object_info(device, filedata))
-  {
-    // no need to output an error since send_file_object_info will already have done so
+  // Sanity check
+  if (path == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Resumable(): Bad arguments, path was NULL.");
     return -1;
   }
 
-  // Callbacks
-  ptp_usb->callback_active = 1;
-  // The callback will deactivate itself after this amount of data has been sent
-  // One BULK header for the request, one for the data phase. No parameters to the request.
-  ptp_usb->current_transfer_total = filedata->filesize+PTP_USB_BULK_HDR_LEN*2;
-  ptp_usb->current_transfer_complete = 0;
-  ptp_usb->current_transfer_callback = callback;
-  ptp_usb->current_transfer_callback_data = data;
-
-  /*
-   * We might need to increase the timeout here, files can be pretty
-   * large. Take the default timeout and add the calculated time for
-   * this transfer
-   */
-  get_usb_device_timeout(ptp_usb, &oldtimeout);
-  timeout = oldtimeout +
-    (ptp_usb->current_transfer_total / guess_usb_speed(ptp_usb)) * 1000;
-  set_usb_device_timeout(ptp_usb, timeout);
-
-  ret = ptp_sendobject_fromfd(params, fd, filedata->filesize);
+  file = LIBMTP_Get_Filemetadata(device, id);
+  if (file == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Resumable(): Could not get object info.");
+    return -1;
+  }
+  filesize = file->filesize;
+  date = file->modificationdate;
+  LIBMTP_destroy_file_t(file);
 
-  ptp_usb->callback_active = 0;
-  ptp_usb->current_transfer_callback = NULL;
-  ptp_usb->current_transfer_callback_data = NULL;
-  set_usb_device_timeout(ptp_usb, oldtimeout);
+  if (!ptp_operation_issupported(params, PTP_OC_ANDROID_GetPartialObject64) &&
+      (!ptp_operation_issupported(params, PTP_OC_GetPartialObject) ||
+       filesize > 0xFFFFFFFFU)) {
+    // There is no way to get the file piece by piece
+    return LIBMTP_Get_File_To_File(device, id, path, callback, data);
+  }
 
-  if (ret == PTP_ERROR_CANCEL) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED, "LIBMTP_Send_File_From_File_Descriptor(): Cancelled transfer.");
+  infopath = get_resume_info_path(path);
+  if (infopath == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION, "LIBMTP_Get_File_To_File_Resumable(): out of memory.");
     return -1;
   }
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Send_File_From_File_Descriptor(): "
-				"Could not send object.");
+
+  // Open file, keeping what is already there
+#ifdef __WIN32__
+#ifdef USE_WINDOWS_IO_H
+  if ( (fd = _open(path, O_RDWR|O_CREAT|O_BINARY,_S_IREAD)) == -1 ) {
+#else
+  if ( (fd = open(path, O_RDWR|O_CREAT|O_BINARY,S_IRWXU)) == -1 ) {
+#endif
+#else
+  if ( (fd = open(path, O_RDWR|O_CREAT,S_IRWXU|S_IRGRP)) == -1) {
+#endif
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Resumable(): Could not create file.");
+    free(infopath);
     return -1;
   }
 
-  add_object_to_cache(device, filedata->item_id);
-
-  /*
-   * Get the device-assigned parent_id from the cache.
-   * The operation that adds it to the cache will
-   * look it up from the device, so we get the new
-   * parent_id from the cache.
-   */
-  newfilemeta = LIBMTP_Get_Filemetadata(device, filedata->item_id);
-  if (newfilemeta != NULL) {
-    filedata->parent_id = newfilemeta->parent_id;
-    filedata->storage_id = newfilemeta->storage_id;
-    LIBMTP_destroy_file_t(newfilemeta);
+  // Only continue a file that was left by an earlier try on this object
+  if (fstat(fd, &st) == 0 && (uint64_t) st.st_size <= filesize &&
+      check_resume_info(infopath, id, filesize, date) &&
+      check_resume_tail(device, id, fd, st.st_size)) {
+    offset = st.st_size;
   } else {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-			    "LIBMTP_Send_File_From_File_Descriptor(): "
-			    "Could not retrieve updated metadata.");
+    close(fd);
+#ifdef __WIN32__
+#ifdef USE_WINDOWS_IO_H
+    fd = _open(path, O_RDWR|O_CREAT|O_TRUNC|O_BINARY,_S_IREAD);
+#else
+    fd = open(path, O_RDWR|O_CREAT|O_TRUNC|O_BINARY,S_IRWXU);
+#endif
+#else
+    fd = open(path, O_RDWR|O_CREAT|O_TRUNC,S_IRWXU|S_IRGRP);
+#endif
+    if (fd == -1) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Resumable(): Could not create file.");
+      free(infopath);
+      return -1;
+    }
+    if (write_resume_info(infopath, id, filesize, date) != 0) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Resumable(): Could not record the object of the file.");
+      close(fd);
+      free(infopath);
+      return -1;
+    }
+  }
+  if (lseek(fd, offset, SEEK_SET) == (off_t) -1) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Resumable(): Could not seek in file.");
+    close(fd);
+    free(infopath);
     return -1;
   }
 
-  return 0;
+  while (offset < filesize) {
+    unsigned char *chunk = NULL;
+    unsigned int got = 0;
+    unsigned int written = 0;
+    uint32_t want = RESUME_CHUNK_SIZE;
+
+    if (filesize - offset < want)
+      want = filesize - offset;
+    if (LIBMTP_GetPartialObject(device, id, offset, want, &chunk, &got) != 0 ||
+	got == 0) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Resumable(): Could not get file from device.");
+      free(chunk);
+      ret = -1;
+      break;
+    }
+    if (got > want)
+      got = want;
+    while (written < got) {
+      ssize_t n = write(fd, chunk + written, got - written);
+
+      if (n <= 0)
+	break;
+      written += n;
+    }
+    free(chunk);
+    offset += written;
+    if (written < got) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_STORAGE_FULL, "LIBMTP_Get_File_To_File_Resumable(): Could not write file.");
+      ret = -1;
+      break;
+    }
+    if (callback != NULL && callback(offset, filesize, data) != 0) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED, "LIBMTP_Get_File_To_File_Resumable(): Cancelled transfer.");
+      ret = -1;
+      break;
+    }
+  }
+
+  close(fd);
+  // A complete file no longer needs to be matched with the object
+  if (ret == 0)
+    unlink(infopath);
+  free(infopath);
+  return ret;
 }
 
 /**
- * This function sends a generic file from a handler function to an
- * MTP device. A filename and a set of metadata must be
- * given as input.
+ * This gets a file off the device to a file identified
+ * by a file descriptor.
  *
- * This can potentially be used for sending in a stream of unknown
- * length. Send music files with
- * <code>LIBMTP_Send_Track_From_Handler()</code>
+ * This function can potentially be used for streaming
+ * files off the device for playback or broadcast for example,
+ * by downloading the file into a stream sink e.g. a socket.
  *
- * @param device a pointer to the device to send the file to.
- * @param get_func the function to call to get data to write
- * @param priv a user-defined pointer that is passed along to
- *        <code>get_func</code>. If not used, this is set to NULL.
- * @param filedata a file metadata set to be written along with the file.
- *        After this call the field <code>filedata-&gt;item_id</code>
- *        will contain the new file ID. Other fields such
- *        as the <code>filedata-&gt;filename</code>, <code>filedata-&gt;parent_id</code>
- *        or <code>filedata-&gt;storage_id</code> may also change during this
- *        operation due to device restrictions, so do not rely on the
- *        contents of this struct to be preserved in any way.
- *        <ul>
- *        <li><code>filedata-&gt;parent_id</code> should be set to the parent
- *        (e.g. folder) to store this file in. If this is 0,
- *        the file will be stored in the root folder.
- *        <li><code>filedata-&gt;storage_id</code> should be set to the
- *        desired storage (e.g. memory card or whatever your device
- *        presents) to store this file in. Setting this to 0 will store
- *        the file on the primary storage.
- *        </ul>
+ * @param device a pointer to the device to get the file from.
+ * @param id the file ID of the file to retrieve.
+ * @param fd a local file descriptor to write the file to.
  * @param callback a progress indicator function or NULL to ignore.
  * @param data a user-defined pointer that is passed along to
  *             the <code>progress</code> function in order to
@@ -5938,77 +7752,60 @@ int LIBMTP_Send_File_From_File_Descriptor(LIBMTP_mtpdevice_t *device,
  *             updates. If not used, set this to NULL.
  * @return 0 if the transfer was successful, any other value means
  *           failure.
- * @see LIBMTP_Send_File_From_File()
- * @see LIBMTP_Send_Track_From_File_Descriptor()
- * @see LIBMTP_Delete_Object()
+ * @see LIBMTP_Get_File_To_File()
  */
-int LIBMTP_Send_File_From_Handler(LIBMTP_mtpdevice_t *device,
-			 MTPDataGetFunc get_func, void * priv, LIBMTP_file_t * const filedata,
-       LIBMTP_progressfunc_t const callback, void const * const data)
+int LIBMTP_Get_File_To_File_Descriptor(LIBMTP_mtpdevice_t *device,
+					uint32_t const id,
+					int const fd,
+					LIBMTP_progressfunc_t const callback,
+					void const * const data)
 {
   uint16_t ret;
   PTPParams *params = (PTPParams *) device->params;
   PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  LIBMTP_file_t *newfilemeta;
+  PTPObject *ob;
+  uint16_t format;
+  uint64_t size;
 
-  if (send_file_object_info(device, filedata))
-  {
-    // no need to output an error since send_file_object_info will already have done so
+  ptp_lock_cache(params, 1);
+  ret = ptp_object_want (params, id, PTPOBJECT_OBJECTINFO_LOADED, &ob);
+  if (ret != PTP_RC_OK) {
+    ptp_unlock_cache(params);
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Descriptor(): Could not get object info.");
+    return -1;
+  }
+  format = ob->oi.ObjectFormat;
+  size = ob->oi.ObjectCompressedSize;
+  ptp_unlock_cache(params);
+  if (format == PTP_OFC_Association) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Descriptor(): Bad object format.");
     return -1;
   }
 
+  // The progress state is shared, so keep other transactions out
+  ptp_lock_transactions(params);
+
   // Callbacks
   ptp_usb->callback_active = 1;
-  // The callback will deactivate itself after this amount of data has been sent
-  // One BULK header for the request, one for the data phase. No parameters to the request.
-  ptp_usb->current_transfer_total = filedata->filesize+PTP_USB_BULK_HDR_LEN*2;
+  ptp_usb->current_transfer_total = size+
+    PTP_USB_BULK_HDR_LEN+sizeof(uint32_t); // Request length, one parameter
   ptp_usb->current_transfer_complete = 0;
   ptp_usb->current_transfer_callback = callback;
   ptp_usb->current_transfer_callback_data = data;
 
-  MTPDataHandler mtp_handler;
-  mtp_handler.getfunc = get_func;
-  mtp_handler.putfunc = NULL;
-  mtp_handler.priv = priv;
-
-  PTPDataHandler handler;
-  handler.getfunc = get_func_wrapper;
-  handler.putfunc = NULL;
-  handler.priv = &mtp_handler;
-
-  ret = ptp_sendobject_from_handler(params, &handler, filedata->filesize);
+  ret = ptp_getobject_tofd(params, id, fd);
 
   ptp_usb->callback_active = 0;
   ptp_usb->current_transfer_callback = NULL;
   ptp_usb->current_transfer_callback_data = NULL;
+  ptp_unlock_transactions(params);
 
   if (ret == PTP_ERROR_CANCEL) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED, "LIBMTP_Send_File_From_Handler(): Cancelled transfer.");
+    add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED, "LIBMTP_Get_File_From_File_Descriptor(): Cancelled transfer.");
     return -1;
   }
   if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Send_File_From_Handler(): "
-				"Could not send object.");
-    return -1;
-  }
-
-  add_object_to_cache(device, filedata->item_id);
-
-  /*
-   * Get the device-assined parent_id from the cache.
-   * The operation that adds it to the cache will
-   * look it up from the device, so we get the new
-   * parent_id from the cache.
-   */
-  newfilemeta = LIBMTP_Get_Filemetadata(device, filedata->item_id);
-  if (newfilemeta != NULL) {
-    filedata->parent_id = newfilemeta->parent_id;
-    filedata->storage_id = newfilemeta->storage_id;
-    LIBMTP_destroy_file_t(newfilemeta);
-  } else {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-			    "LIBMTP_Send_File_From_Handler(): "
-			    "Could not retrieve updated metadata.");
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_File_To_File_Descriptor(): Could not get file from device.");
     return -1;
   }
 
@@ -6016,3011 +7813,6411 @@ int LIBMTP_Send_File_From_Handler(LIBMTP_mtpdevice_t *device,
 }
 
 /**
- * This function sends the file object info, ready for sendobject
- * @param device a pointer to the device to send the file to.
- * @param filedata a file metadata set to be written along with the file.
- * @return 0 if the transfer was successful, any other value means
- *           failure.
- */
-static int send_file_object_info(LIBMTP_mtpdevice_t *device, LIBMTP_file_t *filedata)
-{
-  PTPParams *params = (PTPParams *) device->params;
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  uint32_t store;
-  int use_primary_storage = 1;
-  uint16_t of = map_libmtp_type_to_ptp_type(filedata->filetype);
-  LIBMTP_devicestorage_t *storage;
-  uint32_t localph = filedata->parent_id;
+ * This gets a file off the device and calls put_func
+ * with chunks of data
+ *
+ * @param device a pointer to the device to get the file from.
+ * @param id the file ID of the file to retrieve.
+ * @param put_func the function to call when we have data.
+ * @param priv the user-defined pointer that is passed to
+ *             <code>put_func</code>.
+ * @param callback a progress indicator function or NULL to ignore.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function in order to
+ *             pass along some user defined data to the progress
+ *             updates. If not used, set this to NULL.
+ * @return 0 if the transfer was successful, any other value means
+ *           failure.
+ */
+int LIBMTP_Get_File_To_Handler(LIBMTP_mtpdevice_t *device,
+					uint32_t const id,
+					MTPDataPutFunc put_func,
+          void * priv,
+					LIBMTP_progressfunc_t const callback,
+					void const * const data)
+{
+  PTPObject *ob;
   uint16_t ret;
-  int i;
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  uint16_t format;
+  uint64_t size;
 
-#if 0
-  // Sanity check: no zerolength files on some devices?
-  // If the zerolength files cause problems on some devices,
-  // then add a bug flag for this.
-  if (filedata->filesize == 0) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "send_file_object_info(): "
-			    "File of zero size.");
+  ptp_lock_cache(params, 1);
+  ret = ptp_object_want (params, id, PTPOBJECT_OBJECTINFO_LOADED, &ob);
+  if (ret != PTP_RC_OK) {
+    ptp_unlock_cache(params);
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Descriptor(): Could not get object info.");
     return -1;
   }
-#endif
-  if (filedata->storage_id != 0) {
-    store = filedata->storage_id;
-  } else {
-    store = get_suggested_storage_id(device, filedata->filesize, localph);
+  format = ob->oi.ObjectFormat;
+  size = ob->oi.ObjectCompressedSize;
+  ptp_unlock_cache(params);
+  if (format == PTP_OFC_Association) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Descriptor(): Bad object format.");
+    return -1;
   }
 
-  // Detect if something non-primary is in use.
-  storage = device->storage;
-  if (storage != NULL && store != storage->id) {
-    use_primary_storage = 0;
-  }
+  // The progress state is shared, so keep other transactions out
+  ptp_lock_transactions(params);
 
-  /*
-   * If no destination folder was given, look up a default
-   * folder if possible. Perhaps there is some way of retrieveing
-   * the default folder for different forms of content, what
-   * do I know, we use a fixed list in lack of any better method.
-   * Some devices obviously need to have their files in certain
-   * folders in order to find/display them at all (hello Creative),
-   * so we have to have a method for this. We only do this if the
-   * primary storage is in use.
-   */
+  // Callbacks
+  ptp_usb->callback_active = 1;
+  ptp_usb->current_transfer_total = size+
+    PTP_USB_BULK_HDR_LEN+sizeof(uint32_t); // Request length, one parameter
+  ptp_usb->current_transfer_complete = 0;
+  ptp_usb->current_transfer_callback = callback;
+  ptp_usb->current_transfer_callback_data = data;
 
-  if (localph == 0 && use_primary_storage) {
-    if (LIBMTP_FILETYPE_IS_AUDIO(filedata->filetype)) {
-      localph = device->default_music_folder;
-    } else if (LIBMTP_FILETYPE_IS_VIDEO(filedata->filetype)) {
-      localph = device->default_video_folder;
-    } else if (of == PTP_OFC_EXIF_JPEG ||
-	       of == PTP_OFC_JP2 ||
-	       of == PTP_OFC_JPX ||
-	       of == PTP_OFC_JFIF ||
-	       of == PTP_OFC_TIFF ||
-	       of == PTP_OFC_TIFF_IT ||
-	       of == PTP_OFC_BMP ||
-	       of == PTP_OFC_GIF ||
-	       of == PTP_OFC_PICT ||
-	       of == PTP_OFC_PNG ||
-	       of == PTP_OFC_MTP_WindowsImageFormat) {
-      localph = device->default_picture_folder;
-    } else if (of == PTP_OFC_MTP_vCalendar1 ||
-	       of == PTP_OFC_MTP_vCalendar2 ||
-	       of == PTP_OFC_MTP_UndefinedContact ||
-	       of == PTP_OFC_MTP_vCard2 ||
-	       of == PTP_OFC_MTP_vCard3 ||
-	       of == PTP_OFC_MTP_UndefinedCalendarItem) {
-      localph = device->default_organizer_folder;
-    } else if (of == PTP_OFC_Text) {
-      localph = device->default_text_folder;
-    }
-  }
+  MTPDataHandler mtp_handler;
+  mtp_handler.getfunc = NULL;
+  mtp_handler.putfunc = put_func;
+  mtp_handler.priv = priv;
 
-  // Here we wire the type to unknown on bugged, but
-  // Ogg or FLAC-supportive devices.
-  if (FLAG_OGG_IS_UNKNOWN(ptp_usb) && of == PTP_OFC_MTP_OGG) {
-    of = PTP_OFC_Undefined;
-  }
-  if (FLAG_FLAC_IS_UNKNOWN(ptp_usb) && of == PTP_OFC_MTP_FLAC) {
-    of = PTP_OFC_Undefined;
-  }
+  PTPDataHandler handler;
+  handler.getfunc = NULL;
+  handler.putfunc = put_func_wrapper;
+  handler.priv = &mtp_handler;
 
-  if (ptp_operation_issupported(params, PTP_OC_MTP_SendObjectPropList) &&
-      !FLAG_BROKEN_SEND_OBJECT_PROPLIST(ptp_usb)) {
-    /*
-     * MTP enhanched does it this way (from a sniff):
-     * -> PTP_OC_MTP_SendObjectPropList (0x9808):
-     *    20 00 00 00 01 00 08 98 1B 00 00 00 01 00 01 00
-     *    FF FF FF FF 00 30 00 00 00 00 00 00 12 5E 00 00
-     *    Length: 0x00000020
-     *    Type:   0x0001 PTP_USB_CONTAINER_COMMAND
-     *    Code:   0x9808
-     *    Transaction ID: 0x0000001B
-     *    Param1: 0x00010001 <- store
-     *    Param2: 0xffffffff <- parent handle (-1 ?)
-     *    Param3: 0x00003000 <- file type PTP_OFC_Undefined - we don't know about PDF files
-     *    Param4: 0x00000000 <- file length MSB (-0x0c header len)
-     *    Param5: 0x00005e12 <- file length LSB (-0x0c header len)
-     *
-     * -> PTP_OC_MTP_SendObjectPropList (0x9808):
-     *    46 00 00 00 02 00 08 98 1B 00 00 00 03 00 00 00
-     *    00 00 00 00 07 DC FF FF 0D 4B 00 53 00 30 00 36 - dc07 = file name
-     *    00 30 00 33 00 30 00 36 00 2E 00 70 00 64 00 66
-     *    00 00 00 00 00 00 00 03 DC 04 00 00 00 00 00 00 - dc03 = protection status
-     *    00 4F DC 02 00 01                               - dc4f = non consumable
-     *    Length: 0x00000046
-     *    Type:   0x0002 PTP_USB_CONTAINER_DATA
-     *    Code:   0x9808
-     *    Transaction ID: 0x0000001B
-     *    Metadata....
-     *    0x00000003 <- Number of metadata items
-     *    0x00000000 <- Object handle, set to 0x00000000 since it is unknown!
-     *    0xdc07     <- metadata type: file name
-     *    0xffff     <- metadata type: string
-     *    0x0d       <- number of (uint16_t) characters
-     *    4b 53 30 36 30 33 30 36 2e 50 64 66 00 "KS060306.pdf", null terminated
-     *    0x00000000 <- Object handle, set to 0x00000000 since it is unknown!
-     *    0xdc03     <- metadata type: protection status
-     *    0x0004     <- metadata type: uint16_t
-     *    0x0000     <- not protected
-     *    0x00000000 <- Object handle, set to 0x00000000 since it is unknown!
-     *    0xdc4f     <- non consumable
-     *    0x0002     <- metadata type: uint8_t
-     *    0x01       <- non-consumable (this device cannot display PDF)
-     *
-     * <- Read 0x18 bytes back
-     *    18 00 00 00 03 00 01 20 1B 00 00 00 01 00 01 00
-     *    00 00 00 00 01 40 00 00
-     *    Length: 0x000000018
-     *    Type:   0x0003 PTP_USB_CONTAINER_RESPONSE
-     *    Code:   0x2001 PTP_OK
-     *    Transaction ID: 0x0000001B
-     *    Param1: 0x00010001 <- store
-     *    Param2: 0x00000000 <- parent handle
-     *    Param3: 0x00004001 <- new file/object ID
-     *
-     * -> PTP_OC_SendObject (0x100d)
-     *    0C 00 00 00 01 00 0D 10 1C 00 00 00
-     * -> ... all the bytes ...
-     * <- Read 0x0c bytes back
-     *    0C 00 00 00 03 00 01 20 1C 00 00 00
-     *    ... Then update metadata one-by one, actually (instead of sending it first!) ...
-     */
-    MTPProperties *props = NULL;
-    int nrofprops = 0;
-    MTPProperties *prop = NULL;
-    uint16_t *properties = NULL;
-    uint32_t propcnt = 0;
+  ret = ptp_getobject_to_handler(params, id, &handler);
 
-    // default parent handle
-    if (localph == 0)
-      localph = 0xFFFFFFFFU; // Set to -1
+  ptp_usb->callback_active = 0;
+  ptp_usb->current_transfer_callback = NULL;
+  ptp_usb->current_transfer_callback_data = NULL;
+  ptp_unlock_transactions(params);
 
-    // Must be 0x00000000U for new objects
-    filedata->item_id = 0x00000000U;
+  if (ret == PTP_ERROR_CANCEL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED, "LIBMTP_Get_File_From_File_Descriptor(): Cancelled transfer.");
+    return -1;
+  }
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_File_To_File_Descriptor(): Could not get file from device.");
+    return -1;
+  }
 
-    ret = ptp_mtp_getobjectpropssupported(params, of, &propcnt, &properties);
+  return 0;
+}
 
-    for (i=0;i<propcnt;i++) {
-      PTPObjectPropDesc opd;
+/*
+ * An object to get in LIBMTP_Get_Files(). The objects are sorted by
+ * where they are on the device before they are fetched.
+ */
+typedef struct get_entry_struct {
+  LIBMTP_file_t *file; /**< Metadata from the cache */
+  uint32_t index; /**< Position of the object in the array of IDs */
+} get_entry_t;
 
-      ret = ptp_mtp_getobjectpropdesc(params, properties[i], of, &opd);
-      if (ret != PTP_RC_OK) {
-	add_ptp_error_to_errorstack(device, ret, "send_file_object_info(): "
-				"could not get property description.");
-      } else if (opd.GetSet) {
-	switch (properties[i]) {
-	case PTP_OPC_ObjectFileName:
-	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
-	  prop->ObjectHandle = filedata->item_id;
-	  prop->property = PTP_OPC_ObjectFileName;
-	  prop->datatype = PTP_DTC_STR;
-	  if (filedata->filename != NULL) {
-	    prop->propval.str = strdup(filedata->filename);
-	    if (FLAG_ONLY_7BIT_FILENAMES(ptp_usb)) {
-	      strip_7bit_from_utf8(prop->propval.str);
-	    }
-	  }
-	  break;
-	case PTP_OPC_ProtectionStatus:
-	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
-	  prop->ObjectHandle = filedata->item_id;
-	  prop->property = PTP_OPC_ProtectionStatus;
-	  prop->datatype = PTP_DTC_UINT16;
-	  prop->propval.u16 = 0x0000U; /* Not protected */
-	  break;
-	case PTP_OPC_NonConsumable:
-	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
-	  prop->ObjectHandle = filedata->item_id;
-	  prop->property = PTP_OPC_NonConsumable;
-	  prop->datatype = PTP_DTC_UINT8;
-	  prop->propval.u8 = 0x00; /* It is supported, then it is consumable */
-	  break;
-	case PTP_OPC_Name:
-	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
-	  prop->ObjectHandle = filedata->item_id;
-	  prop->property = PTP_OPC_Name;
-	  prop->datatype = PTP_DTC_STR;
-	  if (filedata->filename != NULL)
-	    prop->propval.str = strdup(filedata->filename);
-	  break;
-	case PTP_OPC_DateModified:
-	  // Tag with current time if that is supported
-	  if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
-	    prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
-	    prop->ObjectHandle = filedata->item_id;
-	    prop->property = PTP_OPC_DateModified;
-	    prop->datatype = PTP_DTC_STR;
-	    prop->propval.str = get_iso8601_stamp();
-	    filedata->modificationdate = time(NULL);
-	  }
-	  break;
-	}
-      }
-      ptp_free_objectpropdesc(&opd);
-    }
-    free(properties);
+/*
+ * Progress of a whole LIBMTP_Get_Files() batch, wrapped around the
+ * progress of each single transfer.
+ */
+typedef struct get_progress_struct {
+  LIBMTP_progressfunc_t callback; /**< Callback for the whole batch */
+  LIBMTP_fileprogressfunc_t filecallback; /**< Callback for each file */
+  void const *data; /**< Data for the callbacks of the caller */
+  uint32_t id; /**< The object being fetched */
+  uint64_t received; /**< Bytes in the objects already fetched */
+  uint64_t filesize; /**< Size of the object being fetched */
+  uint64_t total; /**< Bytes in all objects */
+} get_progress_t;
+
+/**
+ * Orders objects by storage, then by folder and last by handle, which
+ * is close to the order in which devices lay them out.
+ */
+static int compare_get_entries(const void *a, const void *b)
+{
+  LIBMTP_file_t const *x = ((get_entry_t const *) a)->file;
+  LIBMTP_file_t const *y = ((get_entry_t const *) b)->file;
+
+  if (x->storage_id != y->storage_id)
+    return x->storage_id < y->storage_id ? -1 : 1;
+  if (x->parent_id != y->parent_id)
+    return x->parent_id < y->parent_id ? -1 : 1;
+  if (x->item_id != y->item_id)
+    return x->item_id < y->item_id ? -1 : 1;
+  return 0;
+}
 
-    ret = ptp_mtp_sendobjectproplist(params, &store, &localph, &filedata->item_id,
-				     of, filedata->filesize, props, nrofprops);
+/**
+ * Passes the progress of a single transfer on as the progress of one
+ * file and of the whole batch.
+ */
+static int get_files_progress(uint64_t const sent, uint64_t const total,
+			      void const * const data)
+{
+  get_progress_t const *progress = (get_progress_t const *) data;
+  uint64_t overhead = 0;
+  uint64_t got = 0;
 
-    /* Free property list */
-    ptp_destroy_object_prop_list(props, nrofprops);
+  // The transfer counts the request and the bulk headers too
+  if (total > progress->filesize)
+    overhead = total - progress->filesize;
+  if (sent > overhead)
+    got = sent - overhead;
+  if (got > progress->filesize)
+    got = progress->filesize;
 
-    if (ret != PTP_RC_OK) {
-      add_ptp_error_to_errorstack(device, ret, "send_file_object_info():"
-				  "Could not send object property list.");
-      if (ret == PTP_RC_AccessDenied) {
-	add_ptp_error_to_errorstack(device, ret, "ACCESS DENIED.");
-      }
-      return -1;
-    }
-  } else if (ptp_operation_issupported(params,PTP_OC_SendObjectInfo)) {
-    PTPObjectInfo new_file;
-
-    memset(&new_file, 0, sizeof(PTPObjectInfo));
+  if (progress->filecallback != NULL &&
+      progress->filecallback(progress->id, got, progress->filesize,
+			     progress->data) != 0)
+    return 1;
+  if (progress->callback != NULL &&
+      progress->callback(progress->received + got, progress->total,
+			 progress->data) != 0)
+    return 1;
+  return 0;
+}
 
-    new_file.Filename = filedata->filename;
-    if (FLAG_ONLY_7BIT_FILENAMES(ptp_usb)) {
-      strip_7bit_from_utf8(new_file.Filename);
-    }
-    if (filedata->filesize > 0xFFFFFFFFL) {
-      // This is a kludge in the MTP standard for large files.
-      new_file.ObjectCompressedSize = (uint32_t) 0xFFFFFFFF;
-    } else {
-      new_file.ObjectCompressedSize = (uint32_t) filedata->filesize;
-    }
-    new_file.ObjectFormat = of;
-    new_file.StorageID = store;
-    new_file.ParentObject = localph;
-    new_file.ModificationDate = time(NULL);
+/**
+ * Checks that a name from the device can be used as a local file name
+ * without pointing outside the directory it is created in.
+ * @param name the name.
+ * @return 1 if the name can be used, 0 otherwise.
+ */
+static int is_local_filename(char const * const name)
+{
+  if (name == NULL || name[0] == '\0' ||
+      strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+      strchr(name, '/') != NULL)
+    return 0;
+#ifdef __WIN32__
+  if (strchr(name, '\\') != NULL)
+    return 0;
+#endif
+  return 1;
+}
 
-    // Create the object
-    ret = ptp_sendobjectinfo(params, &store, &localph, &filedata->item_id, &new_file);
+/**
+ * Creates the local file an object is written to by
+ * <code>LIBMTP_Get_Files()</code>. The files of a batch all go into
+ * one directory, so a file that already exists is not overwritten,
+ * it may be another file of the same batch.
+ * @param device a pointer to the device the object is on.
+ * @param path the directory to create the file in.
+ * @param file the object.
+ * @param fullpath the name of the created file is returned here
+ *        and must be freed by the caller.
+ * @return a file descriptor or -1 on failure.
+ */
+static int create_get_destination(LIBMTP_mtpdevice_t *device,
+				  char const * const path,
+				  LIBMTP_file_t const * const file,
+				  char **fullpath)
+{
+  int fd;
 
-    if (ret != PTP_RC_OK) {
-      add_ptp_error_to_errorstack(device, ret, "send_file_object_info(): "
-				  "Could not send object info.");
-      if (ret == PTP_RC_AccessDenied) {
-	add_ptp_error_to_errorstack(device, ret, "ACCESS DENIED.");
-      }
-      return -1;
-    }
-    // NOTE: the char* pointers inside new_file are not copies so don't
-    // try to destroy this objectinfo!
+  *fullpath = NULL;
+  if (!is_local_filename(file->filename)) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_Files(): Bad file name on device.");
+    return -1;
   }
+  *fullpath = malloc(strlen(path) + strlen(file->filename) + 2);
+  if (*fullpath == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION, "LIBMTP_Get_Files(): out of memory.");
+    return -1;
+  }
+  sprintf(*fullpath, "%s/%s", path, file->filename);
 
-  // Now there IS an object with this parent handle.
-  filedata->parent_id = localph;
-
-  return 0;
+#ifdef __WIN32__
+#ifdef USE_WINDOWS_IO_H
+  if ( (fd = _open(*fullpath, O_RDWR|O_CREAT|O_EXCL|O_BINARY,_S_IREAD)) == -1 ) {
+#else
+  if ( (fd = open(*fullpath, O_RDWR|O_CREAT|O_EXCL|O_BINARY,S_IRWXU)) == -1 ) {
+#endif
+#else
+  if ( (fd = open(*fullpath, O_RDWR|O_CREAT|O_EXCL,S_IRWXU|S_IRGRP)) == -1) {
+#endif
+    if (errno == EEXIST)
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_Files(): File already exists, not overwriting it.");
+    else
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_Files(): Could not create file.");
+    free(*fullpath);
+    *fullpath = NULL;
+    return -1;
+  }
+  return fd;
 }
 
 /**
- * This function updates the MTP track object metadata on a
- * single file identified by an object ID.
- * @param device a pointer to the device to update the track
- *        metadata on.
- * @param metadata a track metadata set to be written to the file.
- *        notice that the <code>track_id</code> field of the
- *        metadata structure must be correct so that the
- *        function can update the right file. If some properties
- *        of this metadata are set to NULL (strings) or 0
- *        (numerical values) they will be discarded and the
- *        track will not be tagged with these blank values.
- * @return 0 on success, any other value means failure. If some
- *        or all of the properties fail to update we will still
- *        return success. On some devices (notably iRiver T30)
- *        properties that exist cannot be updated.
+ * This gets many files off the device at once, e.g. when copying all
+ * pictures off a camera. It does the same as calling
+ * <code>LIBMTP_Get_File_To_File()</code> for each file, but:
+ * <ul>
+ * <li>The files are fetched by storage and folder, in the order of
+ *     their handles, rather than in the order they are given in.
+ *     Devices tend to store objects that way, so this saves them a lot
+ *     of seeking in their own flash.
+ * <li>The metadata of all files is looked up in one go up front, from
+ *     the cache where possible.
+ * </ul>
+ *
+ * Each file is written to a local file named like the file on the
+ * device in the directory <code>path</code>. Existing files are never
+ * overwritten: a file whose name is taken, for example by a file of
+ * the same name from another folder of the batch, is not retrieved.
+ * To put the files elsewhere, give an <code>openfunc</code> which is
+ * asked for a file descriptor to write each file to instead. The
+ * descriptor is closed when the file is done.
+ *
+ * If a file cannot be retrieved, the others are still retrieved and
+ * the failure is reported on the error stack. Partial files created
+ * in <code>path</code> are removed.
+ *
+ * @param device a pointer to the device to get the files from.
+ * @param ids an array of the file IDs of the files to retrieve.
+ * @param nrofids the number of files in <code>ids</code>.
+ * @param path the directory to create the local files in, or NULL
+ *        if <code>openfunc</code> is given.
+ * @param openfunc a function returning a file descriptor to write a
+ *        file to, or -1 to skip that file. If this is NULL the files
+ *        are created in <code>path</code>.
+ * @param callback a progress indicator function for the whole batch
+ *        or NULL to ignore. It is called with the number of bytes
+ *        retrieved so far and the total for all files.
+ * @param filecallback a progress indicator function for each file or
+ *        NULL to ignore. It is called with the file ID and the
+ *        number of bytes of that file retrieved so far, a file has
+ *        arrived when this equals its size.
+ * @param data a user-defined pointer that is passed along to
+ *             <code>openfunc</code> and the progress functions in
+ *             order to pass along some user defined data. If not used,
+ *             set this to NULL.
+ * @return 0 if all files were retrieved, any other value means that
+ *           at least one file was not retrieved. Returning anything
+ *           but 0 from a progress function cancels the rest of the
+ *           batch.
+ * @see LIBMTP_Get_File_To_File()
  */
-int LIBMTP_Update_Track_Metadata(LIBMTP_mtpdevice_t *device,
-				 LIBMTP_track_t const * const metadata)
+int LIBMTP_Get_Files(LIBMTP_mtpdevice_t *device,
+		     uint32_t const * const ids,
+		     uint32_t const nrofids,
+		     char const * const path,
+		     LIBMTP_openfunc_t const openfunc,
+		     LIBMTP_progressfunc_t const callback,
+		     LIBMTP_fileprogressfunc_t const filecallback,
+		     void const * const data)
+{
+  return get_files(device, ids, nrofids, path, openfunc, data,
+		   callback, filecallback, data, NULL);
+}
+
+/**
+ * Gets a batch of files, see <code>LIBMTP_Get_Files()</code>.
+ * @param opendata the user-defined pointer passed to
+ *        <code>openfunc</code>.
+ * @param fetched if not NULL, the entry for each file in
+ *        <code>ids</code> that was retrieved in full is set to 1.
+ */
+static int get_files(LIBMTP_mtpdevice_t *device,
+		     uint32_t const * const ids,
+		     uint32_t const nrofids,
+		     char const * const path,
+		     LIBMTP_openfunc_t const openfunc,
+		     void const * const opendata,
+		     LIBMTP_progressfunc_t const callback,
+		     LIBMTP_fileprogressfunc_t const filecallback,
+		     void const * const data,
+		     uint8_t * const fetched)
 {
-  uint16_t ret;
   PTPParams *params = (PTPParams *) device->params;
   PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  get_entry_t *entries;
+  uint32_t nrofentries = 0;
+  get_progress_t progress;
+  int retval = 0;
   uint32_t i;
-  uint16_t *properties = NULL;
-  uint32_t propcnt = 0;
+  uint16_t ret;
 
-  // First see which properties can be set on this file format and apply accordingly
-  // i.e only try to update this metadata for object tags that exist on the current player.
-  ret = ptp_mtp_getobjectpropssupported(params, map_libmtp_type_to_ptp_type(metadata->filetype), &propcnt, &properties);
-  if (ret != PTP_RC_OK) {
-    // Just bail out for now, nothing is ever set.
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-			    "could not retrieve supported object properties.");
+  if (nrofids == 0)
+    return 0;
+  if (ids == NULL || (path == NULL && openfunc == NULL)) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_Files(): Bad arguments.");
+    return -1;
+  }
+  entries = malloc(nrofids * sizeof(get_entry_t));
+  if (entries == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			    "LIBMTP_Get_Files(): out of memory.");
     return -1;
   }
-  if (ptp_operation_issupported(params, PTP_OC_MTP_SetObjPropList) &&
-      !FLAG_BROKEN_SET_OBJECT_PROPLIST(ptp_usb)) {
-    MTPProperties *props = NULL;
-    MTPProperties *prop = NULL;
-    int nrofprops = 0;
 
-    for (i=0;i<propcnt;i++) {
-      PTPObjectPropDesc opd;
+  progress.callback = callback;
+  progress.filecallback = filecallback;
+  progress.data = data;
+  progress.received = 0;
+  progress.total = 0;
 
-      ret = ptp_mtp_getobjectpropdesc(params, properties[i], map_libmtp_type_to_ptp_type(metadata->filetype), &opd);
-      if (ret != PTP_RC_OK) {
-	add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				"could not get property description.");
-      } else if (opd.GetSet) {
-	switch (properties[i]) {
-	case PTP_OPC_Name:
-	  if (metadata->title == NULL)
-	    break;
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_Name;
-	  prop->datatype = PTP_DTC_STR;
-	  prop->propval.str = strdup(metadata->title);
-	  break;
-	case PTP_OPC_AlbumName:
-	  if (metadata->album == NULL)
-	    break;
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_AlbumName;
-	  prop->datatype = PTP_DTC_STR;
-	  prop->propval.str = strdup(metadata->album);
-	  break;
-	case PTP_OPC_Artist:
-	  if (metadata->artist == NULL)
-	    break;
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_Artist;
-	  prop->datatype = PTP_DTC_STR;
-	  prop->propval.str = strdup(metadata->artist);
-	  break;
-	case PTP_OPC_Composer:
-	  if (metadata->composer == NULL)
-	    break;
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_Composer;
-	  prop->datatype = PTP_DTC_STR;
-	  prop->propval.str = strdup(metadata->composer);
-	  break;
-	case PTP_OPC_Genre:
-	  if (metadata->genre == NULL)
-	    break;
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_Genre;
-	  prop->datatype = PTP_DTC_STR;
-	  prop->propval.str = strdup(metadata->genre);
-	  break;
-	case PTP_OPC_Duration:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_Duration;
-	  prop->datatype = PTP_DTC_UINT32;
-	  prop->propval.u32 = adjust_u32(metadata->duration, &opd);
-	  break;
-	case PTP_OPC_Track:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_Track;
-	  prop->datatype = PTP_DTC_UINT16;
-	  prop->propval.u16 = adjust_u16(metadata->tracknumber, &opd);
-	  break;
-	case PTP_OPC_OriginalReleaseDate:
-	  if (metadata->date == NULL)
-	    break;
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_OriginalReleaseDate;
-	  prop->datatype = PTP_DTC_STR;
-	  prop->propval.str = strdup(metadata->date);
-	  break;
-	case PTP_OPC_SampleRate:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_SampleRate;
-	  prop->datatype = PTP_DTC_UINT32;
-	  prop->propval.u32 = adjust_u32(metadata->samplerate, &opd);
-	  break;
-	case PTP_OPC_NumberOfChannels:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_NumberOfChannels;
-	  prop->datatype = PTP_DTC_UINT16;
-	  prop->propval.u16 = adjust_u16(metadata->nochannels, &opd);
-	  break;
-	case PTP_OPC_AudioWAVECodec:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_AudioWAVECodec;
-	  prop->datatype = PTP_DTC_UINT32;
-	  prop->propval.u32 = adjust_u32(metadata->wavecodec, &opd);
-	  break;
-	case PTP_OPC_AudioBitRate:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_AudioBitRate;
-	  prop->datatype = PTP_DTC_UINT32;
-	  prop->propval.u32 = adjust_u32(metadata->bitrate, &opd);
-	  break;
-	case PTP_OPC_BitRateType:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_BitRateType;
-	  prop->datatype = PTP_DTC_UINT16;
-	  prop->propval.u16 = adjust_u16(metadata->bitratetype, &opd);
-	  break;
-	case PTP_OPC_Rating:
-	  // TODO: shall this be set for rating 0?
-	  if (metadata->rating == 0)
-	    break;
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_Rating;
-	  prop->datatype = PTP_DTC_UINT16;
-	  prop->propval.u16 = adjust_u16(metadata->rating, &opd);
-	  break;
-	case PTP_OPC_UseCount:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_UseCount;
-	  prop->datatype = PTP_DTC_UINT32;
-	  prop->propval.u32 = adjust_u32(metadata->usecount, &opd);
-	  break;
-	case PTP_OPC_DateModified:
-	  if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
-	    // Tag with current time if that is supported
-	    prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	    prop->ObjectHandle = metadata->item_id;
-	    prop->property = PTP_OPC_DateModified;
-	    prop->datatype = PTP_DTC_STR;
-	    prop->propval.str = get_iso8601_stamp();
-	  }
-	  break;
-	default:
-	  break;
-	}
-      }
-      ptp_free_objectpropdesc(&opd);
-    }
-
-    // NOTE: File size is not updated, this should not change anyway.
-    // neither will we change the filename.
-
-    ret = ptp_mtp_setobjectproplist(params, props, nrofprops);
-
-    ptp_destroy_object_prop_list(props, nrofprops);
+  ptp_lock_cache(params, 1);
+  for (i = 0; i < nrofids; i++) {
+    PTPObject *ob;
 
+    ret = ptp_object_want(params, ids[i], PTPOBJECT_OBJECTINFO_LOADED, &ob);
     if (ret != PTP_RC_OK) {
-      // TODO: return error of which property we couldn't set
-      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-			      "could not set object property list.");
-      free(properties);
-      return -1;
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_Files(): Could not get object info.");
+      retval = -1;
+      continue;
     }
+    if (ob->oi.ObjectFormat == PTP_OFC_Association) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_Files(): Bad object format.");
+      retval = -1;
+      continue;
+    }
+    entries[nrofentries].file = obj2file_cached(device, ob);
+    entries[nrofentries].index = i;
+    progress.total += entries[nrofentries].file->filesize;
+    nrofentries++;
+  }
+  ptp_unlock_cache(params);
+  qsort(entries, nrofentries, sizeof(get_entry_t), compare_get_entries);
 
-  } else if (ptp_operation_issupported(params,PTP_OC_MTP_SetObjectPropValue)) {
-    for (i=0;i<propcnt;i++) {
-      PTPObjectPropDesc opd;
-
-      ret = ptp_mtp_getobjectpropdesc(params, properties[i], map_libmtp_type_to_ptp_type(metadata->filetype), &opd);
-      if (ret != PTP_RC_OK) {
-	add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				"could not get property description.");
-      } else if (opd.GetSet) {
-	switch (properties[i]) {
-	case PTP_OPC_Name:
-	  // Update title
-	  ret = set_object_string(device, metadata->item_id, PTP_OPC_Name, metadata->title);
-	  if (ret != 0) {
-	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				    "could not set track title.");
-	  }
-	  break;
-	case PTP_OPC_AlbumName:
-	  // Update album
-	  ret = set_object_string(device, metadata->item_id, PTP_OPC_AlbumName, metadata->album);
-	  if (ret != 0) {
-	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				    "could not set track album name.");
-	  }
-	  break;
-	case PTP_OPC_Artist:
-	  // Update artist
-	  ret = set_object_string(device, metadata->item_id, PTP_OPC_Artist, metadata->artist);
-	  if (ret != 0) {
-	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				    "could not set track artist name.");
-	  }
-	  break;
-	case PTP_OPC_Composer:
-	  // Update composer
-	  ret = set_object_string(device, metadata->item_id, PTP_OPC_Composer, metadata->composer);
-	  if (ret != 0) {
-	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				    "could not set track composer name.");
-	  }
-	  break;
-	case PTP_OPC_Genre:
-	  // Update genre (but only if valid)
-	  if (metadata->genre) {
-	    ret = set_object_string(device, metadata->item_id, PTP_OPC_Genre, metadata->genre);
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
-				      "could not set genre.");
-	    }
-	  }
-	  break;
-	case PTP_OPC_Duration:
-	  // Update duration
-	  if (metadata->duration != 0) {
-	    ret = set_object_u32(device, metadata->item_id, PTP_OPC_Duration, adjust_u32(metadata->duration, &opd));
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				      "could not set track duration.");
-	    }
-	  }
-	  break;
-	case PTP_OPC_Track:
-	  // Update track number.
-	  if (metadata->tracknumber != 0) {
-	    ret = set_object_u16(device, metadata->item_id, PTP_OPC_Track, adjust_u16(metadata->tracknumber, &opd));
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				      "could not set track tracknumber.");
-	    }
-	  }
-	  break;
-	case PTP_OPC_OriginalReleaseDate:
-	  // Update creation datetime
-	  // The date can be zero, but some devices do not support setting zero
-	  // dates (and it seems that a zero date should never be set anyway)
-	  if (metadata->date) {
-	    ret = set_object_string(device, metadata->item_id, PTP_OPC_OriginalReleaseDate, metadata->date);
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				      "could not set track release date.");
-	    }
-	  }
-	  break;
-	  // These are, well not so important.
-	case PTP_OPC_SampleRate:
-	  // Update sample rate
-	  if (metadata->samplerate != 0) {
-	    ret = set_object_u32(device, metadata->item_id, PTP_OPC_SampleRate, adjust_u32(metadata->samplerate, &opd));
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				      "could not set samplerate.");
-	    }
-	  }
-	  break;
-	case PTP_OPC_NumberOfChannels:
-	  // Update number of channels
-	  if (metadata->nochannels != 0) {
-	    ret = set_object_u16(device, metadata->item_id, PTP_OPC_NumberOfChannels, adjust_u16(metadata->nochannels, &opd));
-	  if (ret != 0) {
-	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				    "could not set number of channels.");
-	  }
-	}
-	  break;
-	case PTP_OPC_AudioWAVECodec:
-	  // Update WAVE codec
-	  if (metadata->wavecodec != 0) {
-	    ret = set_object_u32(device, metadata->item_id, PTP_OPC_AudioWAVECodec, adjust_u32(metadata->wavecodec, &opd));
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				      "could not set WAVE codec.");
-	    }
-	  }
-	  break;
-	case PTP_OPC_AudioBitRate:
-	  // Update bitrate
-	  if (metadata->bitrate != 0) {
-	    ret = set_object_u32(device, metadata->item_id, PTP_OPC_AudioBitRate, adjust_u32(metadata->bitrate, &opd));
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				      "could not set bitrate.");
-	  }
-	  }
-	  break;
-	case PTP_OPC_BitRateType:
-	  // Update bitrate type
-	  if (metadata->bitratetype != 0) {
-	    ret = set_object_u16(device, metadata->item_id, PTP_OPC_BitRateType, adjust_u16(metadata->bitratetype, &opd));
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				      "could not set bitratetype.");
-	    }
-	  }
-	  break;
-	case PTP_OPC_Rating:
-	  // Update user rating
-	  // TODO: shall this be set for rating 0?
-	  if (metadata->rating != 0) {
-	    ret = set_object_u16(device, metadata->item_id, PTP_OPC_Rating, adjust_u16(metadata->rating, &opd));
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				      "could not set user rating.");
-	    }
-	  }
-	  break;
-	case PTP_OPC_UseCount:
-	  // Update use count, set even to zero if desired.
-	  ret = set_object_u32(device, metadata->item_id, PTP_OPC_UseCount, adjust_u32(metadata->usecount, &opd));
-	  if (ret != 0) {
-	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				  "could not set use count.");
-	  }
-	  break;
-	case PTP_OPC_DateModified:
-	  if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
-	    // Update modification time if supported
-	    char *tmpstamp = get_iso8601_stamp();
-	    ret = set_object_string(device, metadata->item_id, PTP_OPC_DateModified, tmpstamp);
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				      "could not set modification date.");
-	    }
-	    free(tmpstamp);
-	  }
-	  break;
+  for (i = 0; i < nrofentries; i++) {
+    LIBMTP_file_t *file = entries[i].file;
+    char *fullpath = NULL;
+    int fd;
 
-	  // NOTE: File size is not updated, this should not change anyway.
-	  // neither will we change the filename.
-	default:
-	  break;
-	}
-      }
-      ptp_free_objectpropdesc(&opd);
+    if (openfunc != NULL)
+      fd = openfunc(file, opendata);
+    else
+      fd = create_get_destination(device, path, file, &fullpath);
+    if (fd == -1) {
+      retval = -1;
+      progress.received += file->filesize;
+      continue;
     }
-  } else {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-                            "Your device doesn't seem to support any known way of setting metadata.");
-    free(properties);
-    return -1;
-  }
 
-  // update cached object properties if metadata cache exists
-  update_metadata_cache(device, metadata->item_id);
+    // The progress state is shared, so keep other transactions out
+    ptp_lock_transactions(params);
+    progress.id = file->item_id;
+    progress.filesize = file->filesize;
+    ptp_usb->callback_active = 1;
+    ptp_usb->current_transfer_total = file->filesize+
+      PTP_USB_BULK_HDR_LEN+sizeof(uint32_t); // Request length, one parameter
+    ptp_usb->current_transfer_complete = 0;
+    if (callback != NULL || filecallback != NULL)
+      ptp_usb->current_transfer_callback = get_files_progress;
+    ptp_usb->current_transfer_callback_data = &progress;
 
-  free(properties);
+    ret = ptp_getobject_tofd(params, file->item_id, fd);
 
-  return 0;
-}
+    ptp_usb->callback_active = 0;
+    ptp_usb->current_transfer_callback = NULL;
+    ptp_usb->current_transfer_callback_data = NULL;
+    ptp_unlock_transactions(params);
 
-/**
- * This function deletes a single file, track, playlist, folder or
- * any other object off the MTP device, identified by the object ID.
- *
- * If you delete a folder, there is no guarantee that the device will
- * really delete all the files that were in that folder, rather it is
- * expected that they will not be deleted, and will turn up in object
- * listings with parent set to a non-existant object ID. The safe way
- * to do this is to recursively delete all files (and folders) contained
- * in the folder, then the folder itself.
- *
- * @param device a pointer to the device to delete the object from.
- * @param object_id the object to delete.
- * @return 0 on success, any other value means failure.
- */
-int LIBMTP_Delete_Object(LIBMTP_mtpdevice_t *device,
-			 uint32_t object_id)
-{
-  uint16_t ret;
-  PTPParams *params = (PTPParams *) device->params;
+#ifdef USE_WINDOWS_IO_H
+    _close(fd);
+#else
+    close(fd);
+#endif
+    progress.received += file->filesize;
 
-  ret = ptp_deleteobject(params, object_id, 0);
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Delete_Object(): could not delete object.");
-    return -1;
+    if (ret != PTP_RC_OK) {
+      // Delete partial file.
+      if (fullpath != NULL)
+	unlink(fullpath);
+      retval = -1;
+    } else if (fetched != NULL) {
+      fetched[entries[i].index] = 1;
+    }
+    free(fullpath);
+    if (ret == PTP_ERROR_CANCEL) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED, "LIBMTP_Get_Files(): Cancelled transfer.");
+      break;
+    }
+    if (ret != PTP_RC_OK)
+      add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Files(): Could not get file from device.");
   }
 
-  return 0;
+  for (i = 0; i < nrofentries; i++)
+    LIBMTP_destroy_file_t(entries[i].file);
+  free(entries);
+  return retval;
 }
 
+
 /**
- * Internal function to update an object filename property.
+ * This gets a track off the device to a file identified
+ * by a filename. This is actually just a wrapper for the
+ * \c LIBMTP_Get_Track_To_File() function.
+ * @param device a pointer to the device to get the track from.
+ * @param id the track ID of the track to retrieve.
+ * @param path a filename to use for the retrieved track.
+ * @param callback a progress indicator function or NULL to ignore.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function in order to
+ *             pass along some user defined data to the progress
+ *             updates. If not used, set this to NULL.
+ * @return 0 if the transfer was successful, any other value means
+ *           failure.
+ * @see LIBMTP_Get_Track_To_File_Descriptor()
  */
-static int set_object_filename(LIBMTP_mtpdevice_t *device,
-			       uint32_t object_id, uint16_t ptp_type,
-			       const char **newname_ptr)
+int LIBMTP_Get_Track_To_File(LIBMTP_mtpdevice_t *device, uint32_t const id,
+			 char const * const path, LIBMTP_progressfunc_t const callback,
+			 void const * const data)
 {
-  PTPParams             *params = (PTPParams *) device->params;
-  PTP_USB               *ptp_usb = (PTP_USB*) device->usbinfo;
-  PTPObjectPropDesc     opd;
-  uint16_t              ret;
-  char                  *newname;
+  // This is just a wrapper
+  return LIBMTP_Get_File_To_File(device, id, path, callback, data);
+}
 
-  // See if we can modify the filename on this kind of files.
-  ret = ptp_mtp_getobjectpropdesc(params, PTP_OPC_ObjectFileName, ptp_type, &opd);
-  if (ret != PTP_RC_OK) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "set_object_filename(): "
-			    "could not get property description.");
-    return -1;
-  }
+/**
+ * This gets a track off the device to a file identified
+ * by a file descriptor. This is actually just a wrapper for
+ * the \c LIBMTP_Get_File_To_File_Descriptor() function.
+ * @param device a pointer to the device to get the track from.
+ * @param id the track ID of the track to retrieve.
+ * @param fd a file descriptor to write the track to.
+ * @param callback a progress indicator function or NULL to ignore.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function in order to
+ *             pass along some user defined data to the progress
+ *             updates. If not used, set this to NULL.
+ * @return 0 if the transfer was successful, any other value means
+ *           failure.
+ * @see LIBMTP_Get_Track_To_File()
+ */
+int LIBMTP_Get_Track_To_File_Descriptor(LIBMTP_mtpdevice_t *device,
+					uint32_t const id,
+					int const fd,
+					LIBMTP_progressfunc_t const callback,
+					void const * const data)
+{
+  // This is just a wrapper
+  return LIBMTP_Get_File_To_File_Descriptor(device, id, fd, callback, data);
+}
 
-  if (!opd.GetSet) {
-    ptp_free_objectpropdesc(&opd);
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "set_object_filename(): "
-            " property is not settable.");
-    // TODO: we COULD actually upload/download the object here, if we feel
-    //       like wasting time for the user.
-    return -1;
-  }
+/**
+ * This gets a track off the device to a handler function.
+ * This is actually just a wrapper for
+ * the \c LIBMTP_Get_File_To_Handler() function.
+ * @param device a pointer to the device to get the track from.
+ * @param id the track ID of the track to retrieve.
+ * @param put_func the function to call when we have data.
+ * @param priv the user-defined pointer that is passed to
+ *             <code>put_func</code>.
+ * @param callback a progress indicator function or NULL to ignore.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function in order to
+ *             pass along some user defined data to the progress
+ *             updates. If not used, set this to NULL.
+ * @return 0 if the transfer was successful, any other value means
+ *           failure.
+ */
+int LIBMTP_Get_Track_To_Handler(LIBMTP_mtpdevice_t *device,
+					uint32_t const id,
+					MTPDataPutFunc put_func,
+          void * priv,
+					LIBMTP_progressfunc_t const callback,
+					void const * const data)
+{
+  // This is just a wrapper
+  return LIBMTP_Get_File_To_Handler(device, id, put_func, priv, callback, data);
+}
 
-  newname = strdup(*newname_ptr);
+/**
+ * This function sends a track from a local file to an
+ * MTP device. A filename and a set of metadata must be
+ * given as input.
+ * @param device a pointer to the device to send the track to.
+ * @param path the filename of a local file which will be sent.
+ * @param metadata a track metadata set to be written along with the file.
+ *        After this call the field <code>metadata-&gt;item_id</code>
+ *        will contain the new track ID. Other fields such
+ *        as the <code>metadata-&gt;filename</code>, <code>metadata-&gt;parent_id</code>
+ *        or <code>metadata-&gt;storage_id</code> may also change during this
+ *        operation due to device restrictions, so do not rely on the
+ *        contents of this struct to be preserved in any way.
+ *        <ul>
+ *        <li><code>metadata-&gt;parent_id</code> should be set to the parent
+ *        (e.g. folder) to store this track in. Since some
+ *        devices are a bit picky about where files
+ *        are placed, a default folder will be chosen if libmtp
+ *        has detected one for the current filetype and this
+ *        parameter is set to 0. If this is 0 and no default folder
+ *        can be found, the file will be stored in the root folder.
+ *        <li><code>metadata-&gt;storage_id</code> should be set to the
+ *        desired storage (e.g. memory card or whatever your device
+ *        presents) to store this track in. Setting this to 0 will store
+ *        the track on the primary storage.
+ *        </ul>
+ * @param callback a progress indicator function or NULL to ignore.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function in order to
+ *             pass along some user defined data to the progress
+ *             updates. If not used, set this to NULL.
+ * @return 0 if the transfer was successful, any other value means
+ *           failure.
+ * @see LIBMTP_Send_Track_From_File_Descriptor()
+ * @see LIBMTP_Send_File_From_File()
+ * @see LIBMTP_Delete_Object()
+ */
+int LIBMTP_Send_Track_From_File(LIBMTP_mtpdevice_t *device,
+			 char const * const path, LIBMTP_track_t * const metadata,
+                         LIBMTP_progressfunc_t const callback,
+			 void const * const data)
+{
+  int fd;
+  int ret;
 
-  if (FLAG_ONLY_7BIT_FILENAMES(ptp_usb)) {
-    strip_7bit_from_utf8(newname);
+  // Sanity check
+  if (path == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Send_Track_From_File(): Bad arguments, path was NULL.");
+    return -1;
   }
 
-  if (ptp_operation_issupported(params, PTP_OC_MTP_SetObjPropList) &&
-      !FLAG_BROKEN_SET_OBJECT_PROPLIST(ptp_usb)) {
-    MTPProperties *props = NULL;
-    MTPProperties *prop = NULL;
-    int nrofprops = 0;
-
-    prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-    prop->ObjectHandle = object_id;
-    prop->property = PTP_OPC_ObjectFileName;
-    prop->datatype = PTP_DTC_STR;
-    prop->propval.str = newname;
-
-    ret = ptp_mtp_setobjectproplist(params, props, nrofprops);
-
-    ptp_destroy_object_prop_list(props, nrofprops);
-
-    if (ret != PTP_RC_OK) {
-        add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "set_object_filename(): "
-              " could not set object property list.");
-        ptp_free_objectpropdesc(&opd);
-        return -1;
-    }
-  } else if (ptp_operation_issupported(params, PTP_OC_MTP_SetObjectPropValue)) {
-    ret = set_object_string(device, object_id, PTP_OPC_ObjectFileName, newname);
-    if (ret != 0) {
-      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "set_object_filename(): "
-              " could not set object filename.");
-      ptp_free_objectpropdesc(&opd);
-      return -1;
-    }
-  } else {
-    free(newname);
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "set_object_filename(): "
-              " your device doesn't seem to support any known way of setting metadata.");
-    ptp_free_objectpropdesc(&opd);
+  // Open file
+#ifdef __WIN32__
+#ifdef USE_WINDOWS_IO_H
+  if ( (fd = _open(path, O_RDONLY|O_BINARY)) == -1 ) {
+#else
+  if ( (fd = open(path, O_RDONLY|O_BINARY)) == -1 ) {
+#endif
+#else
+  if ( (fd = open(path, O_RDONLY)) == -1) {
+#endif
+    LIBMTP_ERROR("LIBMTP_Send_Track_From_File(): Could not open source file \"%s\"\n", path);
     return -1;
   }
 
-  ptp_free_objectpropdesc(&opd);
+  ret = LIBMTP_Send_Track_From_File_Descriptor(device, fd, metadata, callback, data);
 
-  // update cached object properties if metadata cache exists
-  update_metadata_cache(device, object_id);
+  // Close file.
+#ifdef USE_WINDOWS_IO_H
+  _close(fd);
+#else
+  close(fd);
+#endif
 
-  return 0;
+  return ret;
 }
 
+
+
 /**
- * This function renames a single file.
- * This simply means that the PTP_OPC_ObjectFileName property
- * is updated, if this is supported by the device.
- *
- * @param device a pointer to the device that contains the file.
- * @param file the file metadata of the file to rename.
- *        On success, the filename member is updated. Be aware, that
- *        this name can be different than newname depending of device restrictions.
- * @param newname the new filename for this object.
- * @return 0 on success, any other value means failure.
+ * This helper function checks if a filename already exists on the device
+ * @param PTPParams*
+ * @param string representing the filename
+ * @return 0 if the filename doesn't exist, -1 if it does
  */
-int LIBMTP_Set_File_Name(LIBMTP_mtpdevice_t *device,
-                   LIBMTP_file_t *file, const char *newname)
+static int check_filename_exists(PTPParams* params, char const * const filename)
 {
-  int         ret;
-
-  ret = set_object_filename(device, file->item_id,
-			    map_libmtp_type_to_ptp_type(file->filetype),
-			    &newname);
+  int i;
+  int retval = 0;
 
-  if (ret != 0) {
-    return ret;
+  ptp_lock_cache(params, 0);
+  for (i = 0; i < params->nrofobjects; i++) {
+    char *fname = params->objects[i].oi.Filename;
+    if ((fname != NULL) && (strcmp(filename, fname) == 0))
+    {
+      retval = -1;
+      break;
+    }
   }
+  ptp_unlock_cache(params);
 
-  free(file->filename);
-  file->filename = strdup(newname);
-  return ret;
+  return retval;
 }
 
 /**
- * This function renames a single folder.
- * This simply means that the PTP_OPC_ObjectFileName property
- * is updated, if this is supported by the device.
- *
- * @param device a pointer to the device that contains the file.
- * @param folder the folder metadata of the folder to rename.
- *        On success, the name member is updated. Be aware, that
- *        this name can be different than newname depending of device restrictions.
- * @param newname the new name for this object.
- * @return 0 on success, any other value means failure.
+ * This helper function returns a unique filename, with a random string before the extension
+ * @param string representing the original filename
+ * @return a string representing the unique filename
  */
-int LIBMTP_Set_Folder_Name(LIBMTP_mtpdevice_t *device,
-                   LIBMTP_folder_t *folder, const char* newname)
+static char *generate_unique_filename(PTPParams* params, char const * const filename)
 {
-  int ret;
+  int suffix;
+  char * extension_position;
 
-  ret = set_object_filename(device, folder->folder_id,
-			    PTP_OFC_Association,
-			    &newname);
+  if (check_filename_exists(params, filename))
+  {
+    extension_position = strrchr(filename,'.');
 
-  if (ret != 0) {
-    return ret;
-    }
+    char basename[extension_position - filename + 1];
+    strncpy(basename, filename, extension_position - filename);
+    basename[extension_position - filename] = '\0';
 
-  free(folder->name);
-  folder->name = strdup(newname);
-  return ret;
-}
-
-/**
- * This function renames a single track.
- * This simply means that the PTP_OPC_ObjectFileName property
- * is updated, if this is supported by the device.
- *
- * @param device a pointer to the device that contains the file.
- * @param track the track metadata of the track to rename.
- *        On success, the filename member is updated. Be aware, that
- *        this name can be different than newname depending of device restrictions.
- * @param newname the new filename for this object.
- * @return 0 on success, any other value means failure.
- */
-int LIBMTP_Set_Track_Name(LIBMTP_mtpdevice_t *device,
-                   LIBMTP_track_t *track, const char* newname)
-{
-  int         ret;
-
-  ret = set_object_filename(device, track->item_id,
-			    map_libmtp_type_to_ptp_type(track->filetype),
-			    &newname);
-
-  if (ret != 0) {
-    return ret;
+    suffix = 1;
+    char newname[ strlen(basename) + 6 + strlen(extension_position)];
+    sprintf(newname, "%s_%d%s", basename, suffix, extension_position);
+    while ((check_filename_exists(params, newname)) && (suffix < 1000000)) {
+      suffix++;
+      sprintf(newname, "%s_%d%s", basename, suffix, extension_position);
+    }
+  return strdup(newname);
+  }
+  else
+  {
+    return strdup(filename);
   }
-
-  free(track->filename);
-  track->filename = strdup(newname);
-  return ret;
 }
 
 /**
- * This function renames a single playlist object file holder.
- * This simply means that the <code>PTP_OPC_ObjectFileName</code>
- * property is updated, if this is supported by the device.
- * The playlist filename should nominally end with an extension
- * like ".pla".
- *
- * NOTE: if you want to change the metadata the device display
- * about a playlist you must <i>not</i> use this function,
- * use <code>LIBMTP_Update_Playlist()</code> instead!
- *
- * @param device a pointer to the device that contains the file.
- * @param playlist the playlist metadata of the playlist to rename.
- *        On success, the name member is updated. Be aware, that
- *        this name can be different than newname depending of device restrictions.
- * @param newname the new name for this object.
- * @return 0 on success, any other value means failure.
- * @see LIBMTP_Update_Playlist()
+ * This function sends a track from a file descriptor to an
+ * MTP device. A filename and a set of metadata must be
+ * given as input.
+ * @param device a pointer to the device to send the track to.
+ * @param fd the filedescriptor for a local file which will be sent.
+ * @param metadata a track metadata set to be written along with the file.
+ *        After this call the field <code>metadata-&gt;item_id</code>
+ *        will contain the new track ID. Other fields such
+ *        as the <code>metadata-&gt;filename</code>, <code>metadata-&gt;parent_id</code>
+ *        or <code>metadata-&gt;storage_id</code> may also change during this
+ *        operation due to device restrictions, so do not rely on the
+ *        contents of this struct to be preserved in any way.
+ *        <ul>
+ *        <li><code>metadata-&gt;parent_id</code> should be set to the parent
+ *        (e.g. folder) to store this track in. Since some
+ *        devices are a bit picky about where files
+ *        are placed, a default folder will be chosen if libmtp
+ *        has detected one for the current filetype and this
+ *        parameter is set to 0. If this is 0 and no default folder
+ *        can be found, the file will be stored in the root folder.
+ *        <li><code>metadata-&gt;storage_id</code> should be set to the
+ *        desired storage (e.g. memory card or whatever your device
+ *        presents) to store this track in. Setting this to 0 will store
+ *        the track on the primary storage.
+ *        </ul>
+ * @param callback a progress indicator function or NULL to ignore.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function in order to
+ *             pass along some user defined data to the progress
+ *             updates. If not used, set this to NULL.
+ * @return 0 if the transfer was successful, any other value means
+ *           failure.
+ * @see LIBMTP_Send_Track_From_File()
+ * @see LIBMTP_Delete_Object()
  */
-int LIBMTP_Set_Playlist_Name(LIBMTP_mtpdevice_t *device,
-                   LIBMTP_playlist_t *playlist, const char* newname)
+int LIBMTP_Send_Track_From_File_Descriptor(LIBMTP_mtpdevice_t *device,
+			 int const fd, LIBMTP_track_t * const metadata,
+                         LIBMTP_progressfunc_t const callback,
+			 void const * const data)
 {
-  int ret;
+  int subcall_ret;
+  LIBMTP_file_t filedata;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  PTPParams *params = (PTPParams *) device->params;
 
-  ret = set_object_filename(device, playlist->playlist_id,
-			    PTP_OFC_MTP_AbstractAudioVideoPlaylist,
-			    &newname);
+  // Sanity check, is this really a track?
+  if (!LIBMTP_FILETYPE_IS_TRACK(metadata->filetype)) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Send_Track_From_File_Descriptor(): "
+			    "I don't think this is actually a track, strange filetype...");
+  }
 
-  if (ret != 0) {
-    return ret;
+  // Wrap around the file transfer function
+  filedata.item_id = metadata->item_id;
+  filedata.parent_id = metadata->parent_id;
+  filedata.storage_id = metadata->storage_id;
+  if FLAG_UNIQUE_FILENAMES(ptp_usb) {
+    filedata.filename = generate_unique_filename(params, metadata->filename);
+  }
+  else {
+    filedata.filename = metadata->filename;
   }
+  filedata.filesize = metadata->filesize;
+  filedata.filetype = metadata->filetype;
+  filedata.next = NULL;
 
-  free(playlist->name);
-  playlist->name = strdup(newname);
-  return ret;
-}
+  subcall_ret = LIBMTP_Send_File_From_File_Descriptor(device,
+						      fd,
+						      &filedata,
+						      callback,
+						      data);
 
-/**
- * This function renames a single album.
- * This simply means that the <code>PTP_OPC_ObjectFileName</code>
- * property is updated, if this is supported by the device.
- * The album filename should nominally end with an extension
- * like ".alb".
- *
- * NOTE: if you want to change the metadata the device display
- * about a playlist you must <i>not</i> use this function,
- * use <code>LIBMTP_Update_Album()</code> instead!
- *
- * @param device a pointer to the device that contains the file.
- * @param album the album metadata of the album to rename.
- *        On success, the name member is updated. Be aware, that
- *        this name can be different than newname depending of device restrictions.
- * @param newname the new name for this object.
- * @return 0 on success, any other value means failure.
- * @see LIBMTP_Update_Album()
- */
-int LIBMTP_Set_Album_Name(LIBMTP_mtpdevice_t *device,
-                   LIBMTP_album_t *album, const char* newname)
-{
-  int ret;
+  if (subcall_ret != 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Send_Track_From_File_Descriptor(): "
+			    "subcall to LIBMTP_Send_File_From_File_Descriptor failed.");
+    // We used to delete the file here, but don't... It might be OK after all.
+    // (void) LIBMTP_Delete_Object(device, metadata->item_id);
+    return -1;
+  }
 
-  ret = set_object_filename(device, album->album_id,
-			    PTP_OFC_MTP_AbstractAudioAlbum,
-			    &newname);
+  // Pick up new item (and parent, storage) ID
+  metadata->item_id = filedata.item_id;
+  metadata->parent_id = filedata.parent_id;
+  metadata->storage_id = filedata.storage_id;
 
-  if (ret != 0) {
-    return ret;
+  // Set track metadata for the new fine track
+  subcall_ret = LIBMTP_Update_Track_Metadata(device, metadata);
+  if (subcall_ret != 0) {
+    // Subcall will add error to errorstack
+    // We used to delete the file here, but don't... It might be OK after all.
+    // (void) LIBMTP_Delete_Object(device, metadata->item_id);
+    return -1;
   }
 
-  free(album->name);
-  album->name = strdup(newname);
-  return ret;
+  // note we don't need to update the cache here because LIBMTP_Send_File_From_File_Descriptor
+  // has added the object handle and LIBMTP_Update_Track_Metadata has added the metadata.
+
+  return 0;
 }
 
 /**
- * THIS FUNCTION IS DEPRECATED. PLEASE UPDATE YOUR CODE IN ORDER
- * NOT TO USE IT.
- *
- * @see LIBMTP_Set_File_Name()
- * @see LIBMTP_Set_Track_Name()
- * @see LIBMTP_Set_Folder_Name()
- * @see LIBMTP_Set_Playlist_Name()
- * @see LIBMTP_Set_Album_Name()
+ * This function sends a track from a handler function to an
+ * MTP device. A filename and a set of metadata must be
+ * given as input.
+ * @param device a pointer to the device to send the track to.
+ * @param get_func the function to call when we have data.
+ * @param priv the user-defined pointer that is passed to
+ *             <code>get_func</code>.
+ * @param metadata a track metadata set to be written along with the file.
+ *        After this call the field <code>metadata-&gt;item_id</code>
+ *        will contain the new track ID. Other fields such
+ *        as the <code>metadata-&gt;filename</code>, <code>metadata-&gt;parent_id</code>
+ *        or <code>metadata-&gt;storage_id</code> may also change during this
+ *        operation due to device restrictions, so do not rely on the
+ *        contents of this struct to be preserved in any way.
+ *        <ul>
+ *        <li><code>metadata-&gt;parent_id</code> should be set to the parent
+ *        (e.g. folder) to store this track in. Since some
+ *        devices are a bit picky about where files
+ *        are placed, a default folder will be chosen if libmtp
+ *        has detected one for the current filetype and this
+ *        parameter is set to 0. If this is 0 and no default folder
+ *        can be found, the file will be stored in the root folder.
+ *        <li><code>metadata-&gt;storage_id</code> should be set to the
+ *        desired storage (e.g. memory card or whatever your device
+ *        presents) to store this track in. Setting this to 0 will store
+ *        the track on the primary storage.
+ *        </ul>
+ * @param callback a progress indicator function or NULL to ignore.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function in order to
+ *             pass along some user defined data to the progress
+ *             updates. If not used, set this to NULL.
+ * @return 0 if the transfer was successful, any other value means
+ *           failure.
+ * @see LIBMTP_Send_Track_From_File()
+ * @see LIBMTP_Delete_Object()
  */
-int LIBMTP_Set_Object_Filename(LIBMTP_mtpdevice_t *device,
-                   uint32_t object_id, char* newname)
+int LIBMTP_Send_Track_From_Handler(LIBMTP_mtpdevice_t *device,
+			 MTPDataGetFunc get_func, void * priv, LIBMTP_track_t * const metadata,
+                         LIBMTP_progressfunc_t const callback,
+			 void const * const data)
 {
-  int             ret;
-  LIBMTP_file_t   *file;
-
-  file = LIBMTP_Get_Filemetadata(device, object_id);
+  int subcall_ret;
+  LIBMTP_file_t filedata;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  PTPParams *params = (PTPParams *) device->params;
 
-  if (file == NULL) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Set_Object_Filename(): "
-			    "could not get file metadata for target object.");
-    return -1;
+  // Sanity check, is this really a track?
+  if (!LIBMTP_FILETYPE_IS_TRACK(metadata->filetype)) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Send_Track_From_Handler(): "
+			    "I don't think this is actually a track, strange filetype...");
   }
 
-  ret = set_object_filename(device, object_id, map_libmtp_type_to_ptp_type(file->filetype), (const char **) &newname);
-
-  free(file);
-
-  return ret;
-}
-
-/**
- * Helper function. This indicates if a track exists on the device
- * @param device a pointer to the device to get the track from.
- * @param id the track ID of the track to retrieve.
- * @return TRUE (!=0) if the track exists, FALSE (0) if not
- */
-int LIBMTP_Track_Exists(LIBMTP_mtpdevice_t *device,
-           uint32_t const id)
-{
-  PTPParams *params = (PTPParams *) device->params;
-  uint16_t ret;
-  PTPObject *ob;
-
-  ret = ptp_object_want (params, id, 0, &ob);
-  if (ret == PTP_RC_OK)
-      return -1;
-  return 0;
-}
-
-/**
- * This creates a new folder structure and allocates memory
- * for it. Notice that if you add strings to this structure they
- * will be freed by the corresponding <code>LIBMTP_folder_track_t</code>
- * operation later, so be careful of using strdup() when assigning
- * strings, e.g.:
- *
- * @return a pointer to the newly allocated folder structure.
- * @see LIBMTP_destroy_folder_t()
- */
-LIBMTP_folder_t *LIBMTP_new_folder_t(void)
-{
-  LIBMTP_folder_t *new = (LIBMTP_folder_t *) malloc(sizeof(LIBMTP_folder_t));
-  if (new == NULL) {
-    return NULL;
+  // Wrap around the file transfer function
+  filedata.item_id = metadata->item_id;
+  filedata.parent_id = metadata->parent_id;
+  filedata.storage_id = metadata->storage_id;
+  if FLAG_UNIQUE_FILENAMES(ptp_usb) {
+    filedata.filename = generate_unique_filename(params, metadata->filename);
   }
-  new->folder_id = 0;
-  new->parent_id = 0;
-  new->storage_id = 0;
-  new->name = NULL;
-  new->sibling = NULL;
-  new->child = NULL;
-  return new;
-}
+  else {
+    filedata.filename = metadata->filename;
+  }
+  filedata.filesize = metadata->filesize;
+  filedata.filetype = metadata->filetype;
+  filedata.next = NULL;
 
-/**
- * This recursively deletes the memory for a folder structure.
- * This shall typically be called on a top-level folder list to
- * detsroy the entire folder tree.
- *
- * @param folder folder structure to destroy
- * @see LIBMTP_new_folder_t()
- */
-void LIBMTP_destroy_folder_t(LIBMTP_folder_t *folder)
-{
+  subcall_ret = LIBMTP_Send_File_From_Handler(device,
+					      get_func,
+					      priv,
+					      &filedata,
+					      callback,
+					      data);
 
-  if(folder == NULL) {
-     return;
+  if (subcall_ret != 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Send_Track_From_Handler(): "
+			    "subcall to LIBMTP_Send_File_From_Handler failed.");
+    // We used to delete the file here, but don't... It might be OK after all.
+    // (void) LIBMTP_Delete_Object(device, metadata->item_id);
+    return -1;
   }
 
-  //Destroy from the bottom up
-  if(folder->child != NULL) {
-     LIBMTP_destroy_folder_t(folder->child);
-  }
+  // Pick up new item (and parent, storage) ID
+  metadata->item_id = filedata.item_id;
+  metadata->parent_id = filedata.parent_id;
+  metadata->storage_id = filedata.storage_id;
 
-  if(folder->sibling != NULL) {
-    LIBMTP_destroy_folder_t(folder->sibling);
+  // Set track metadata for the new fine track
+  subcall_ret = LIBMTP_Update_Track_Metadata(device, metadata);
+  if (subcall_ret != 0) {
+    // Subcall will add error to errorstack
+    // We used to delete the file here, but don't... It might be OK after all.
+    // (void) LIBMTP_Delete_Object(device, metadata->item_id);
+    return -1;
   }
 
-  if(folder->name != NULL) {
-    free(folder->name);
-  }
+  // note we don't need to update the cache here because LIBMTP_Send_File_From_File_Descriptor
+  // has added the object handle and LIBMTP_Update_Track_Metadata has added the metadata.
 
-  free(folder);
+  return 0;
 }
 
 /**
- * Helper function. Returns a folder structure for a
- * specified id.
- *
- * @param folderlist list of folders to search
- * @id id of folder to look for
- * @return a folder or NULL if not found
+ * This function sends a local file to an MTP device.
+ * A filename and a set of metadata must be
+ * given as input.
+ * @param device a pointer to the device to send the track to.
+ * @param path the filename of a local file which will be sent.
+ * @param filedata a file metadata set to be written along with the file.
+ *        After this call the field <code>filedata-&gt;item_id</code>
+ *        will contain the new file ID. Other fields such
+ *        as the <code>filedata-&gt;filename</code>, <code>filedata-&gt;parent_id</code>
+ *        or <code>filedata-&gt;storage_id</code> may also change during this
+ *        operation due to device restrictions, so do not rely on the
+ *        contents of this struct to be preserved in any way.
+ *        <ul>
+ *        <li><code>filedata-&gt;parent_id</code> should be set to the parent
+ *        (e.g. folder) to store this file in. If this is 0,
+ *        the file will be stored in the root folder.
+ *        <li><code>filedata-&gt;storage_id</code> should be set to the
+ *        desired storage (e.g. memory card or whatever your device
+ *        presents) to store this file in. Setting this to 0 will store
+ *        the file on the primary storage.
+ *        </ul>
+ * @param callback a progress indicator function or NULL to ignore.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function in order to
+ *             pass along some user defined data to the progress
+ *             updates. If not used, set this to NULL.
+ * @return 0 if the transfer was successful, any other value means
+ *           failure.
+ * @see LIBMTP_Send_File_From_File_Descriptor()
+ * @see LIBMTP_Delete_Object()
  */
-LIBMTP_folder_t *LIBMTP_Find_Folder(LIBMTP_folder_t *folderlist, uint32_t id)
+int LIBMTP_Send_File_From_File(LIBMTP_mtpdevice_t *device,
+			       char const * const path, LIBMTP_file_t * const filedata,
+			       LIBMTP_progressfunc_t const callback,
+			       void const * const data)
 {
-  LIBMTP_folder_t *ret = NULL;
+  int fd;
+  int ret;
 
-  if(folderlist == NULL) {
-    return NULL;
+  // Sanity check
+  if (path == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Send_File_From_File(): Bad arguments, path was NULL.");
+    return -1;
   }
 
-  if(folderlist->folder_id == id) {
-    return folderlist;
+  // Open file
+#ifdef __WIN32__
+#ifdef USE_WINDOWS_IO_H
+  if ( (fd = _open(path, O_RDONLY|O_BINARY)) == -1 ) {
+#else
+  if ( (fd = open(path, O_RDONLY|O_BINARY)) == -1 ) {
+#endif
+#else
+  if ( (fd = open(path, O_RDONLY)) == -1) {
+#endif
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Send_File_From_File(): Could not open source file.");
+    return -1;
   }
 
-  if(folderlist->sibling) {
-    ret = LIBMTP_Find_Folder(folderlist->sibling, id);
-  }
+  ret = LIBMTP_Send_File_From_File_Descriptor(device, fd, filedata, callback, data);
 
-  if(folderlist->child && ret == NULL) {
-    ret = LIBMTP_Find_Folder(folderlist->child, id);
-  }
+  // Close file.
+#ifdef USE_WINDOWS_IO_H
+  _close(fd);
+#else
+  close(fd);
+#endif
 
   return ret;
 }
 
 /**
- * Function used to recursively get subfolders from params.
+ * This function sends a generic file from a file descriptor to an
+ * MTP device. A filename and a set of metadata must be
+ * given as input.
+ *
+ * This can potentially be used for sending in a stream of unknown
+ * length. Send music files with
+ * <code>LIBMTP_Send_Track_From_File_Descriptor()</code>
+ *
+ * @param device a pointer to the device to send the file to.
+ * @param fd the filedescriptor for a local file which will be sent.
+ * @param filedata a file metadata set to be written along with the file.
+ *        After this call the field <code>filedata-&gt;item_id</code>
+ *        will contain the new file ID. Other fields such
+ *        as the <code>filedata-&gt;filename</code>, <code>filedata-&gt;parent_id</code>
+ *        or <code>filedata-&gt;storage_id</code> may also change during this
+ *        operation due to device restrictions, so do not rely on the
+ *        contents of this struct to be preserved in any way.
+ *        <ul>
+ *        <li><code>filedata-&gt;parent_id</code> should be set to the parent
+ *        (e.g. folder) to store this file in. If this is 0,
+ *        the file will be stored in the root folder.
+ *        <li><code>filedata-&gt;storage_id</code> should be set to the
+ *        desired storage (e.g. memory card or whatever your device
+ *        presents) to store this file in. Setting this to 0 will store
+ *        the file on the primary storage.
+ *        </ul>
+ * @param callback a progress indicator function or NULL to ignore.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function in order to
+ *             pass along some user defined data to the progress
+ *             updates. If not used, set this to NULL.
+ * @return 0 if the transfer was successful, any other value means
+ *           failure.
+ * @see LIBMTP_Send_File_From_File()
+ * @see LIBMTP_Send_Track_From_File_Descriptor()
+ * @see LIBMTP_Delete_Object()
  */
-static LIBMTP_folder_t *get_subfolders_for_folder(LIBMTP_folder_t *list, uint32_t parent)
+int LIBMTP_Send_File_From_File_Descriptor(LIBMTP_mtpdevice_t *device,
+			 int const fd, LIBMTP_file_t * const filedata,
+                         LIBMTP_progressfunc_t const callback,
+			 void const * const data)
 {
-  LIBMTP_folder_t *retfolders = NULL;
-  LIBMTP_folder_t *children, *iter, *curr;
-
-  iter = list->sibling;
-  while(iter != list) {
-    if (iter->parent_id != parent) {
-      iter = iter->sibling;
-      continue;
-    }
-
-    /* We know that iter is a child of 'parent', therefore we can safely
-     * hold on to 'iter' locally since no one else will steal it
-     * from the 'list' as we recurse. */
-    children = get_subfolders_for_folder(list, iter->folder_id);
+  uint16_t ret;
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  LIBMTP_file_t *newfilemeta;
+  int oldtimeout;
+  int timeout;
 
-    curr = iter;
-    iter = iter->sibling;
+  /*
+   * SendObjectInfo and SendObject must follow each other directly, so
+   * hold the transaction lock for both. The cache is only needed while
+   * setting up the object info.
+   */
+  ptp_lock_cache(params, 1);
+  ptp_lock_transactions(params);
+  if (send_file_object_info(device, filedata, NULL))
+  {
+    ptp_unlock_transactions(params);
+    ptp_unlock_cache(params);
+    // no need to output an error since send_file_object_info will already have done so
+    return -1;
+  }
+  ptp_unlock_cache(params);
 
-    // Remove curr from the list.
-    curr->child->sibling = curr->sibling;
-    curr->sibling->child = curr->child;
+  // Callbacks
+  ptp_usb->callback_active = 1;
+  // The callback will deactivate itself after this amount of data has been sent
+  // One BULK header for the request, one for the data phase. No parameters to the request.
+  ptp_usb->current_transfer_total = filedata->filesize+PTP_USB_BULK_HDR_LEN*2;
+  ptp_usb->current_transfer_complete = 0;
+  ptp_usb->current_transfer_callback = callback;
+  ptp_usb->current_transfer_callback_data = data;
 
-    // Attach the children to curr.
-    curr->child = children;
+  /*
+   * We might need to increase the timeout here, files can be pretty
+   * large. Take the default timeout and add the calculated time for
+   * this transfer
+   */
+  get_usb_device_timeout(ptp_usb, &oldtimeout);
+  timeout = oldtimeout +
+    (ptp_usb->current_transfer_total / guess_usb_speed(ptp_usb)) * 1000;
+  set_usb_device_timeout(ptp_usb, timeout);
 
-    // Put this folder into the list of siblings.
-    curr->sibling = retfolders;
-    retfolders = curr;
+  ret = ptp_sendobject_fromfd(params, fd, filedata->filesize);
+
+  ptp_usb->callback_active = 0;
+  ptp_usb->current_transfer_callback = NULL;
+  ptp_usb->current_transfer_callback_data = NULL;
+  set_usb_device_timeout(ptp_usb, oldtimeout);
+  ptp_unlock_transactions(params);
+
+  if (ret == PTP_ERROR_CANCEL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED, "LIBMTP_Send_File_From_File_Descriptor(): Cancelled transfer.");
+    return -1;
+  }
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Send_File_From_File_Descriptor(): "
+				"Could not send object.");
+    return -1;
   }
 
-  return retfolders;
+  add_object_to_cache(device, filedata->item_id);
+
+  /*
+   * Get the device-assigned parent_id from the cache.
+   * The operation that adds it to the cache will
+   * look it up from the device, so we get the new
+   * parent_id from the cache.
+   */
+  newfilemeta = LIBMTP_Get_Filemetadata(device, filedata->item_id);
+  if (newfilemeta != NULL) {
+    filedata->parent_id = newfilemeta->parent_id;
+    filedata->storage_id = newfilemeta->storage_id;
+    LIBMTP_destroy_file_t(newfilemeta);
+  } else {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Send_File_From_File_Descriptor(): "
+			    "Could not retrieve updated metadata.");
+    return -1;
+  }
+
+  return 0;
 }
 
 /**
- * This returns a list of all folders available
- * on the current MTP device.
+ * This function sends a generic file from a handler function to an
+ * MTP device. A filename and a set of metadata must be
+ * given as input.
  *
- * @param device a pointer to the device to get the folder listing for.
- * @param storage a storage ID to get the folder list from
- * @return a list of folders
+ * This can potentially be used for sending in a stream of unknown
+ * length. Send music files with
+ * <code>LIBMTP_Send_Track_From_Handler()</code>
+ *
+ * @param device a pointer to the device to send the file to.
+ * @param get_func the function to call to get data to write
+ * @param priv a user-defined pointer that is passed along to
+ *        <code>get_func</code>. If not used, this is set to NULL.
+ * @param filedata a file metadata set to be written along with the file.
+ *        After this call the field <code>filedata-&gt;item_id</code>
+ *        will contain the new file ID. Other fields such
+ *        as the <code>filedata-&gt;filename</code>, <code>filedata-&gt;parent_id</code>
+ *        or <code>filedata-&gt;storage_id</code> may also change during this
+ *        operation due to device restrictions, so do not rely on the
+ *        contents of this struct to be preserved in any way.
+ *        <ul>
+ *        <li><code>filedata-&gt;parent_id</code> should be set to the parent
+ *        (e.g. folder) to store this file in. If this is 0,
+ *        the file will be stored in the root folder.
+ *        <li><code>filedata-&gt;storage_id</code> should be set to the
+ *        desired storage (e.g. memory card or whatever your device
+ *        presents) to store this file in. Setting this to 0 will store
+ *        the file on the primary storage.
+ *        </ul>
+ * @param callback a progress indicator function or NULL to ignore.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function in order to
+ *             pass along some user defined data to the progress
+ *             updates. If not used, set this to NULL.
+ * @return 0 if the transfer was successful, any other value means
+ *           failure.
+ * @see LIBMTP_Send_File_From_File()
+ * @see LIBMTP_Send_Track_From_File_Descriptor()
+ * @see LIBMTP_Delete_Object()
  */
- LIBMTP_folder_t *LIBMTP_Get_Folder_List_For_Storage(LIBMTP_mtpdevice_t *device,
-						    uint32_t const storage)
+int LIBMTP_Send_File_From_Handler(LIBMTP_mtpdevice_t *device,
+			 MTPDataGetFunc get_func, void * priv, LIBMTP_file_t * const filedata,
+       LIBMTP_progressfunc_t const callback, void const * const data)
 {
+  uint16_t ret;
   PTPParams *params = (PTPParams *) device->params;
-  LIBMTP_folder_t head, *rv;
-  int i;
-
-  // Get all the handles if we haven't already done that
-  if (params->nrofobjects == 0) {
-    flush_handles(device);
-  }
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  LIBMTP_file_t *newfilemeta;
 
   /*
-   * This creates a temporary list of the folders, this is in a
-   * reverse order and uses the Folder pointers that are already
-   * in the Folder structure. From this we can then build up the
-   * folder hierarchy with only looking at this temporary list,
-   * and removing the folders from this temporary list as we go.
-   * This significantly reduces the number of operations that we
-   * have to do in building the folder hierarchy. Also since the
-   * temp list is in reverse order, when we prepend to the sibling
-   * list things are in the same order as they were originally
-   * in the handle list.
+   * SendObjectInfo and SendObject must follow each other directly, so
+   * hold the transaction lock for both. The cache is only needed while
+   * setting up the object info.
    */
-  head.sibling = &head;
-  head.child = &head;
-  for (i = 0; i < params->nrofobjects; i++) {
-    LIBMTP_folder_t *folder;
-    PTPObject *ob;
-
-    ob = &params->objects[i];
-    if (ob->oi.ObjectFormat != PTP_OFC_Association) {
-      continue;
-    }
+  ptp_lock_cache(params, 1);
+  ptp_lock_transactions(params);
+  if (send_file_object_info(device, filedata, NULL))
+  {
+    ptp_unlock_transactions(params);
+    ptp_unlock_cache(params);
+    // no need to output an error since send_file_object_info will already have done so
+    return -1;
+  }
+  ptp_unlock_cache(params);
 
-    if (storage != PTP_GOH_ALL_STORAGE && storage != ob->oi.StorageID) {
-      continue;
-    }
+  // Callbacks
+  ptp_usb->callback_active = 1;
+  // The callback will deactivate itself after this amount of data has been sent
+  // One BULK header for the request, one for the data phase. No parameters to the request.
+  ptp_usb->current_transfer_total = filedata->filesize+PTP_USB_BULK_HDR_LEN*2;
+  ptp_usb->current_transfer_complete = 0;
+  ptp_usb->current_transfer_callback = callback;
+  ptp_usb->current_transfer_callback_data = data;
 
-    /*
-     * Do we know how to handle these? They are part
-     * of the MTP 1.0 specification paragraph 3.6.4.
-     * For AssociationDesc 0x00000001U ptp_mtp_getobjectreferences()
-     * should be called on these to get the contained objects, but
-     * we basically don't care. Hopefully parent_id is maintained for all
-     * children, because we rely on that instead.
-     */
-    if (ob->oi.AssociationDesc != 0x00000000U) {
-      LIBMTP_INFO("MTP extended association type 0x%08x encountered\n", ob->oi.AssociationDesc);
-    }
+  MTPDataHandler mtp_handler;
+  mtp_handler.getfunc = get_func;
+  mtp_handler.putfunc = NULL;
+  mtp_handler.priv = priv;
 
-    // Create a folder struct...
-    folder = LIBMTP_new_folder_t();
-    if (folder == NULL) {
-      // malloc failure or so.
-      return NULL;
-    }
-    folder->folder_id = ob->oid;
-    folder->parent_id = ob->oi.ParentObject;
-    folder->storage_id = ob->oi.StorageID;
-    folder->name = (ob->oi.Filename) ? (char *)strdup(ob->oi.Filename) : NULL;
+  PTPDataHandler handler;
+  handler.getfunc = get_func_wrapper;
+  handler.putfunc = NULL;
+  handler.priv = &mtp_handler;
 
-    // pretend sibling says next, and child says prev.
-    folder->sibling = head.sibling;
-    folder->child = &head;
-    head.sibling->child = folder;
-    head.sibling = folder;
-  }
+  ret = ptp_sendobject_from_handler(params, &handler, filedata->filesize);
 
-  // We begin at the given root folder and get them all recursively
-  rv = get_subfolders_for_folder(&head, 0x00000000U);
+  ptp_usb->callback_active = 0;
+  ptp_usb->current_transfer_callback = NULL;
+  ptp_usb->current_transfer_callback_data = NULL;
+  ptp_unlock_transactions(params);
 
-  // Some buggy devices may have some files in the "root folder"
-  // 0xffffffff so if 0x00000000 didn't return any folders,
-  // look for children of the root 0xffffffffU
-  if (rv == NULL) {
-    rv = get_subfolders_for_folder(&head, 0xffffffffU);
-    if (rv != NULL)
-      LIBMTP_ERROR("Device have files in \"root folder\" 0xffffffffU - "
-		   "this is a firmware bug (but continuing)\n");
+  if (ret == PTP_ERROR_CANCEL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED, "LIBMTP_Send_File_From_Handler(): Cancelled transfer.");
+    return -1;
+  }
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Send_File_From_Handler(): "
+				"Could not send object.");
+    return -1;
   }
 
-  // The temp list should be empty. Clean up any orphans just in case.
-  while(head.sibling != &head) {
-    LIBMTP_folder_t *curr = head.sibling;
+  add_object_to_cache(device, filedata->item_id);
 
-    LIBMTP_INFO("Orphan folder with ID: 0x%08x name: \"%s\" encountered.\n",
-	   curr->folder_id,
-	   curr->name);
-    curr->sibling->child = curr->child;
-    curr->child->sibling = curr->sibling;
-    curr->child = NULL;
-    curr->sibling = NULL;
-    LIBMTP_destroy_folder_t(curr);
+  /*
+   * Get the device-assined parent_id from the cache.
+   * The operation that adds it to the cache will
+   * look it up from the device, so we get the new
+   * parent_id from the cache.
+   */
+  newfilemeta = LIBMTP_Get_Filemetadata(device, filedata->item_id);
+  if (newfilemeta != NULL) {
+    filedata->parent_id = newfilemeta->parent_id;
+    filedata->storage_id = newfilemeta->storage_id;
+    LIBMTP_destroy_file_t(newfilemeta);
+  } else {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Send_File_From_Handler(): "
+			    "Could not retrieve updated metadata.");
+    return -1;
   }
 
-  return rv;
+  return 0;
 }
 
-/**
- * This returns a list of all folders available
- * on the current MTP device.
- *
- * @param device a pointer to the device to get the folder listing for.
- * @return a list of folders
+/*
+ * The properties that can be set when creating objects of one format,
+ * see get_settable_props().
  */
-LIBMTP_folder_t *LIBMTP_Get_Folder_List(LIBMTP_mtpdevice_t *device)
-{
-  return LIBMTP_Get_Folder_List_For_Storage(device, PTP_GOH_ALL_STORAGE);
-}
+typedef struct send_props_struct {
+  uint16_t ofc; /**< PTP object format */
+  uint16_t *props; /**< Settable properties */
+  uint32_t nrofprops; /**< Number of settable properties */
+} send_props_t;
+
+typedef struct send_props_cache_struct {
+  send_props_t *formats; /**< One entry per format looked up so far */
+  uint32_t nrofformats; /**< Number of entries in formats */
+} send_props_cache_t;
 
 /**
- * This create a folder on the current MTP device. The PTP name
- * for a folder is "association". The PTP/MTP devices does not
- * have an internal "folder" concept really, it contains a flat
- * list of all files and some file are "associations" that other
- * files and folders may refer to as its "parent".
- *
- * @param device a pointer to the device to create the folder on.
- * @param name the name of the new folder. Note this can be modified
- *        if the device does not support all the characters in the
- *        name.
- * @param parent_id id of parent folder to add the new folder to,
- *        or 0 to put it in the root directory.
- * @param storage_id id of the storage to add this new folder to.
- *        notice that you cannot mismatch storage id and parent id:
- *        they must both be on the same storage! Pass in 0 if you
- *        want to create this folder on the default storage.
- * @return id to new folder or 0 if an error occured
- */
-uint32_t LIBMTP_Create_Folder(LIBMTP_mtpdevice_t *device, char *name,
-			      uint32_t parent_id, uint32_t storage_id)
+ * Look up the properties that can be set when creating an object of
+ * a certain format. Only the properties <code>send_file_object_info()</code>
+ * knows how to fill in are asked for.
+ * @param device a pointer to the device.
+ * @param of the PTP object format.
+ * @param propcache a cache to keep the answers in across several
+ *        uploads, or NULL to ask the device every time.
+ * @param props the properties are returned here.
+ * @param nrofprops the number of properties is returned here.
+ * @return 0 if the returned array belongs to <code>propcache</code>,
+ *         1 if it must be freed by the caller.
+ */
+static int get_settable_props(LIBMTP_mtpdevice_t *device, uint16_t const of,
+			       send_props_cache_t *propcache,
+			       uint16_t **props, uint32_t *nrofprops)
 {
   PTPParams *params = (PTPParams *) device->params;
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  uint32_t parenthandle = 0;
-  uint32_t store;
-  PTPObjectInfo new_folder;
+  uint16_t *properties = NULL;
+  uint32_t propcnt = 0;
+  uint32_t nrofsettable = 0;
+  uint32_t i;
   uint16_t ret;
-  uint32_t new_id = 0;
 
-  if (storage_id == 0) {
-    // I'm just guessing that a folder may require 512 bytes
-    store = get_suggested_storage_id(device, 512, parent_id);
-  } else {
-    store = storage_id;
+  *props = NULL;
+  *nrofprops = 0;
+  if (propcache != NULL) {
+    for (i = 0; i < propcache->nrofformats; i++) {
+      if (propcache->formats[i].ofc == of) {
+	*props = propcache->formats[i].props;
+	*nrofprops = propcache->formats[i].nrofprops;
+	return 0;
+      }
+    }
   }
-  parenthandle = parent_id;
 
-  memset(&new_folder, 0, sizeof(new_folder));
-  new_folder.Filename = name;
-  if (FLAG_ONLY_7BIT_FILENAMES(ptp_usb)) {
-    strip_7bit_from_utf8(new_folder.Filename);
+  ptp_mtp_getobjectpropssupported(params, of, &propcnt, &properties);
+  for (i = 0; i < propcnt; i++) {
+    PTPObjectPropDesc opd;
+
+    switch (properties[i]) {
+    case PTP_OPC_ObjectFileName:
+    case PTP_OPC_ProtectionStatus:
+    case PTP_OPC_NonConsumable:
+    case PTP_OPC_Name:
+    case PTP_OPC_DateModified:
+      ret = ptp_mtp_getobjectpropdesc(params, properties[i], of, &opd);
+      if (ret != PTP_RC_OK) {
+	add_ptp_error_to_errorstack(device, ret, "send_file_object_info(): "
+				    "could not get property description.");
+	break;
+      }
+      // Settable properties are moved to the front of the array
+      if (opd.GetSet)
+	properties[nrofsettable++] = properties[i];
+      ptp_free_objectpropdesc(&opd);
+      break;
+    default:
+      break;
+    }
   }
-  new_folder.ObjectCompressedSize = 0;
-  new_folder.ObjectFormat = PTP_OFC_Association;
-  new_folder.ProtectionStatus = PTP_PS_NoProtection;
-  new_folder.AssociationType = PTP_AT_GenericFolder;
-  new_folder.ParentObject = parent_id;
-  new_folder.StorageID = store;
 
-  // Create the object
-  if (!(params->device_flags & DEVICE_FLAG_BROKEN_SEND_OBJECT_PROPLIST) &&
-	ptp_operation_issupported(params,PTP_OC_MTP_SendObjectPropList)) {
-	MTPProperties *props = (MTPProperties*)calloc(2,sizeof(MTPProperties));
+  *props = properties;
+  *nrofprops = nrofsettable;
+  if (propcache != NULL) {
+    send_props_t *formats;
 
-	props[0].property = PTP_OPC_ObjectFileName;
-	props[0].datatype = PTP_DTC_STR;
-	props[0].propval.str = name;
+    formats = realloc(propcache->formats,
+		      (propcache->nrofformats + 1) * sizeof(send_props_t));
+    // Without room in the cache the list is only used this once
+    if (formats != NULL) {
+      propcache->formats = formats;
+      formats[propcache->nrofformats].ofc = of;
+      formats[propcache->nrofformats].props = properties;
+      formats[propcache->nrofformats].nrofprops = nrofsettable;
+      propcache->nrofformats++;
+      return 0;
+    }
+  }
+  return 1;
+}
 
-	props[1].property = PTP_OPC_Name;
-	props[1].datatype = PTP_DTC_STR;
-	props[1].propval.str = name;
+/**
+ * Free the property lists kept by a cache filled in by
+ * <code>get_settable_props()</code>.
+ * @param propcache the cache to free the contents of.
+ */
+static void free_settable_props(send_props_cache_t *propcache)
+{
+  uint32_t i;
 
-	ret = ptp_mtp_sendobjectproplist(params, &store, &parenthandle, &new_id, PTP_OFC_Association,
-			0, props, 1);
-	free(props);
-  } else {
-	ret = ptp_sendobjectinfo(params, &store, &parenthandle, &new_id, &new_folder);
-  }
+  for (i = 0; i < propcache->nrofformats; i++)
+    free(propcache->formats[i].props);
+  free(propcache->formats);
+  propcache->formats = NULL;
+  propcache->nrofformats = 0;
+}
 
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Create_Folder: Could not send object info.");
-    if (ret == PTP_RC_AccessDenied) {
-      add_ptp_error_to_errorstack(device, ret, "ACCESS DENIED.");
-    }
-    return 0;
+/*
+ * A folder that receives at least this many files from
+ * LIBMTP_Send_Files() is reread as a whole afterwards.
+ */
+#define SEND_FILES_REFRESH_MIN 8
+
+/*
+ * Files sent by LIBMTP_Send_Files() bundled by destination, to pick
+ * storage, check free space and update the cache once per folder or
+ * storage instead of once per file.
+ */
+typedef struct send_folder_struct {
+  uint32_t storage; /**< Storage of the folder, 0 if not known yet */
+  uint32_t parent; /**< The folder */
+  uint32_t store; /**< Storage picked for the folder */
+  uint64_t bytes; /**< Bytes going to the folder */
+  uint32_t nroffiles; /**< Files going to the folder */
+} send_folder_t;
+
+/*
+ * Progress of a whole LIBMTP_Send_Files() batch, wrapped around the
+ * progress of each single transfer.
+ */
+typedef struct send_progress_struct {
+  LIBMTP_progressfunc_t callback; /**< Callback of the caller */
+  void const *data; /**< Data for the callback of the caller */
+  uint64_t sent; /**< Bytes in the files already sent */
+  uint64_t filesize; /**< Size of the file being sent */
+  uint64_t total; /**< Bytes in all files */
+} send_progress_t;
+
+/**
+ * Look up a destination in a table of destinations, adding it if
+ * it is not there yet. The table must have room for one more entry.
+ * @param folders the table.
+ * @param nroffolders the number of entries in the table.
+ * @param storage the storage of the destination.
+ * @param parent the folder of the destination.
+ * @return the entry for the destination.
+ */
+static send_folder_t *get_send_folder(send_folder_t *folders,
+				      uint32_t *nroffolders,
+				      uint32_t const storage,
+				      uint32_t const parent)
+{
+  uint32_t i;
+
+  for (i = 0; i < *nroffolders; i++) {
+    if (folders[i].storage == storage && folders[i].parent == parent)
+      return &folders[i];
   }
-  // NOTE: don't destroy the new_folder objectinfo, because it is statically referencing
-  // several strings.
+  memset(&folders[i], 0, sizeof(send_folder_t));
+  folders[i].storage = storage;
+  folders[i].parent = parent;
+  (*nroffolders)++;
+  return &folders[i];
+}
 
-  add_object_to_cache(device, new_id);
+/**
+ * Passes the progress of a single transfer on as the progress of a
+ * whole batch of transfers.
+ */
+static int send_files_progress(uint64_t const sent, uint64_t const total,
+			       void const * const data)
+{
+  send_progress_t const *progress = (send_progress_t const *) data;
 
-  return new_id;
+  // The transfer counts the bulk headers too
+  if (sent > progress->filesize)
+    return progress->callback(progress->sent + progress->filesize,
+			      progress->total, progress->data);
+  return progress->callback(progress->sent + sent,
+			    progress->total, progress->data);
 }
 
 /**
- * This creates a new playlist metadata structure and allocates memory
- * for it. Notice that if you add strings to this structure they
- * will be freed by the corresponding <code>LIBMTP_destroy_playlist_t</code>
- * operation later, so be careful of using strdup() when assigning
- * strings, e.g.:
- *
- * <pre>
- * LIBMTP_playlist_t *pl = LIBMTP_new_playlist_t();
- * pl->name = strdup(str);
- * ....
- * LIBMTP_destroy_playlist_t(pl);
- * </pre>
- *
- * @return a pointer to the newly allocated metadata structure.
- * @see LIBMTP_destroy_playlist_t()
+ * Opens a local file to be sent by <code>LIBMTP_Send_Files()</code>
+ * and asks the system to start reading it in, so that it is read
+ * while the file before it is being transferred.
+ * @param device a pointer to the device the file will be sent to.
+ * @param path the file to open.
+ * @return a file descriptor or -1 on failure.
  */
-LIBMTP_playlist_t *LIBMTP_new_playlist_t(void)
+static int open_send_source(LIBMTP_mtpdevice_t *device, char const * const path)
 {
-  LIBMTP_playlist_t *new = (LIBMTP_playlist_t *) malloc(sizeof(LIBMTP_playlist_t));
-  if (new == NULL) {
-    return NULL;
+  int fd;
+
+  if (path == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Send_Files(): Bad arguments, path was NULL.");
+    return -1;
   }
-  new->playlist_id = 0;
-  new->parent_id = 0;
-  new->storage_id = 0;
-  new->name = NULL;
-  new->tracks = NULL;
-  new->no_tracks = 0;
-  new->next = NULL;
-  return new;
+#ifdef __WIN32__
+#ifdef USE_WINDOWS_IO_H
+  if ( (fd = _open(path, O_RDONLY|O_BINARY)) == -1 ) {
+#else
+  if ( (fd = open(path, O_RDONLY|O_BINARY)) == -1 ) {
+#endif
+#else
+  if ( (fd = open(path, O_RDONLY)) == -1) {
+#endif
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Send_Files(): Could not open source file.");
+    return -1;
+  }
+#ifdef HAVE_POSIX_FADVISE
+  posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+  return fd;
 }
 
 /**
- * This destroys a playlist metadata structure and deallocates the memory
- * used by it, including any strings. Never use a track metadata
- * structure again after calling this function on it.
- * @param playlist the playlist metadata to destroy.
- * @see LIBMTP_new_playlist_t()
+ * Closes a file opened by <code>open_send_source()</code>.
+ * @param fd the file descriptor, -1 is ignored.
  */
-void LIBMTP_destroy_playlist_t(LIBMTP_playlist_t *playlist)
+static void close_send_source(int const fd)
 {
-  if (playlist == NULL) {
+  if (fd == -1)
     return;
-  }
-  if (playlist->name != NULL)
-    free(playlist->name);
-  if (playlist->tracks != NULL)
-    free(playlist->tracks);
-  free(playlist);
-  return;
+#ifdef USE_WINDOWS_IO_H
+  _close(fd);
+#else
+  close(fd);
+#endif
 }
 
 /**
- * This function returns a list of the playlists available on the
- * device. Typical usage:
+ * This function sends a batch of local files to an MTP device, e.g.
+ * when copying a whole directory of pictures. It does the same as
+ * calling <code>LIBMTP_Send_File_From_File()</code> for each file,
+ * but a lot of the work around each transfer is only done once for
+ * the whole batch:
+ * <ul>
+ * <li>Storage is picked once per destination folder, and the free
+ *     space of each storage is checked once against all files going
+ *     there. If they do not fit, nothing is sent.
+ * <li>The properties that can be set on new objects are only looked
+ *     up once per file type.
+ * <li>Each local file is opened, and read ahead where the system
+ *     supports it, while the file before it is being transferred.
+ * <li>The object cache is updated once at the end. Folders receiving
+ *     many files are reread with a single request where possible.
+ * </ul>
  *
- * <pre>
- * </pre>
+ * If a file cannot be sent, the rest of the batch is still sent and
+ * the failure is reported on the error stack.
  *
- * @param device a pointer to the device to get the playlist listing from.
- * @return a playlist list on success, else NULL. If there are no playlists
- *         on the device, NULL will be returned as well.
- * @see LIBMTP_Get_Playlist()
+ * @param device a pointer to the device to send the files to.
+ * @param paths an array of the local files to send.
+ * @param filedata an array with a file metadata set for each file,
+ *        filled in like for <code>LIBMTP_Send_File_From_File()</code>.
+ *        After this call the field <code>filedata[i]-&gt;item_id</code>
+ *        will contain the new file ID, or 0 if that file was not sent.
+ *        The fields <code>filedata[i]-&gt;parent_id</code> and
+ *        <code>filedata[i]-&gt;storage_id</code> will contain where
+ *        the file ended up.
+ * @param nroffiles the number of files in <code>paths</code> and
+ *        <code>filedata</code>.
+ * @param callback a progress indicator function or NULL to ignore.
+ *        It is called with the number of bytes sent so far and the
+ *        total for all files, returning anything but 0 cancels the
+ *        rest of the batch.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function in order to
+ *             pass along some user defined data to the progress
+ *             updates. If not used, set this to NULL.
+ * @return 0 if all files were sent, any other value means that at
+ *           least one file was not sent.
+ * @see LIBMTP_Send_File_From_File()
  */
-LIBMTP_playlist_t *LIBMTP_Get_Playlist_List(LIBMTP_mtpdevice_t *device)
+int LIBMTP_Send_Files(LIBMTP_mtpdevice_t *device,
+		      char const * const * const paths,
+		      LIBMTP_file_t * const * const filedata,
+		      uint32_t const nroffiles,
+		      LIBMTP_progressfunc_t const callback,
+		      void const * const data)
+{
+  return send_files(device, paths, filedata, nroffiles, callback, data, 1);
+}
+
+/**
+ * Sends a batch of files, see <code>LIBMTP_Send_Files()</code>.
+ * @param updatecache set to 0 if the caller updates the cache itself.
+ */
+static int send_files(LIBMTP_mtpdevice_t *device,
+		      char const * const * const paths,
+		      LIBMTP_file_t * const * const filedata,
+		      uint32_t const nroffiles,
+		      LIBMTP_progressfunc_t const callback,
+		      void const * const data,
+		      int const updatecache)
 {
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  const int REQ_SPL = FLAG_PLAYLIST_SPL(ptp_usb);
   PTPParams *params = (PTPParams *) device->params;
-  LIBMTP_playlist_t *retlists = NULL;
-  LIBMTP_playlist_t *curlist = NULL;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  send_folder_t *folders;
+  uint32_t nroffolders = 0;
+  send_props_cache_t propcache;
+  send_progress_t progress;
+  LIBMTP_devicestorage_t *storage;
+  int fd;
+  int nextfd;
+  int oldtimeout;
+  int timeout;
+  int retval = 0;
   uint32_t i;
+  uint16_t ret;
 
-  // Get all the handles if we haven't already done that
-  if (params->nrofobjects == 0) {
-    flush_handles(device);
+  if (nroffiles == 0)
+    return 0;
+  if (paths == NULL || filedata == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Send_Files(): Bad arguments.");
+    return -1;
+  }
+  folders = malloc(nroffiles * sizeof(send_folder_t));
+  if (folders == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			    "LIBMTP_Send_Files(): out of memory.");
+    return -1;
   }
 
-  for (i = 0; i < params->nrofobjects; i++) {
-    LIBMTP_playlist_t *pl;
-    PTPObject *ob;
-    uint16_t ret;
-
-    ob = &params->objects[i];
-
-    // Ignore stuff that isn't playlists
-
-    // For Samsung players we must look for the .spl extension explicitly since
-    // playlists are not stored as playlist objects.
-    if ( REQ_SPL && is_spl_playlist(&ob->oi) ) {
-      // Allocate a new playlist type
-      pl = LIBMTP_new_playlist_t();
-      spl_to_playlist_t(device, &ob->oi, ob->oid, pl);
+  // Pick storage once per destination folder, for all files going there
+  progress.total = 0;
+  for (i = 0; i < nroffiles; i++) {
+    filedata[i]->item_id = 0;
+    progress.total += filedata[i]->filesize;
+    if (filedata[i]->storage_id == 0)
+      get_send_folder(folders, &nroffolders, 0,
+		      filedata[i]->parent_id)->bytes += filedata[i]->filesize;
+  }
+  for (i = 0; i < nroffolders; i++)
+    folders[i].store = get_suggested_storage_id(device, folders[i].bytes,
+						folders[i].parent);
+  for (i = 0; i < nroffiles; i++) {
+    if (filedata[i]->storage_id == 0)
+      filedata[i]->storage_id = get_send_folder(folders, &nroffolders, 0,
+						filedata[i]->parent_id)->store;
+  }
+
+  // Then make sure everything fits, once per storage
+  nroffolders = 0;
+  for (i = 0; i < nroffiles; i++)
+    get_send_folder(folders, &nroffolders, filedata[i]->storage_id,
+		    0)->bytes += filedata[i]->filesize;
+  // This refreshes the free space in the storage list
+  ptp_lock_cache(params, 1);
+  for (i = 0; i < nroffolders; i++) {
+    for (storage = device->storage; storage != NULL; storage = storage->next) {
+      if (storage->id == folders[i].storage)
+	break;
     }
-    else if ( ob->oi.ObjectFormat != PTP_OFC_MTP_AbstractAudioVideoPlaylist ) {
+    if (storage != NULL &&
+	check_if_file_fits(device, storage, folders[i].bytes) != 0) {
+      ptp_unlock_cache(params);
+      add_error_to_errorstack(device, LIBMTP_ERROR_STORAGE_FULL,
+			      "LIBMTP_Send_Files(): "
+			      "the files do not fit on the storage.");
+      free(folders);
+      return -1;
+    }
+  }
+  ptp_unlock_cache(params);
+
+  propcache.formats = NULL;
+  propcache.nrofformats = 0;
+  progress.callback = callback;
+  progress.data = data;
+  progress.sent = 0;
+
+  nextfd = open_send_source(device, paths[0]);
+  for (i = 0; i < nroffiles; i++) {
+    fd = nextfd;
+    // Get the next file going while this one is transferred
+    nextfd = -1;
+    if (i + 1 < nroffiles)
+      nextfd = open_send_source(device, paths[i+1]);
+    if (fd == -1) {
+      retval = -1;
+      progress.sent += filedata[i]->filesize;
       continue;
     }
-    else {
-      // Allocate a new playlist type
-      pl = LIBMTP_new_playlist_t();
-
-      // Try to look up proper name, else use the oi->Filename field.
-      pl->name = get_string_from_object(device, ob->oid, PTP_OPC_Name);
-      if (pl->name == NULL) {
-	pl->name = strdup(ob->oi.Filename);
-      }
-      pl->playlist_id = ob->oid;
-      pl->parent_id = ob->oi.ParentObject;
-      pl->storage_id = ob->oi.StorageID;
 
-      // Then get the track listing for this playlist
-      ret = ptp_mtp_getobjectreferences(params, pl->playlist_id, &pl->tracks, &pl->no_tracks);
-      if (ret != PTP_RC_OK) {
-        add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Playlist_List(): "
-				    "could not get object references.");
-        pl->tracks = NULL;
-        pl->no_tracks = 0;
-      }
+    ptp_lock_cache(params, 1);
+    ptp_lock_transactions(params);
+    if (send_file_object_info(device, filedata[i], &propcache)) {
+      ptp_unlock_transactions(params);
+      ptp_unlock_cache(params);
+      close_send_source(fd);
+      filedata[i]->item_id = 0;
+      retval = -1;
+      progress.sent += filedata[i]->filesize;
+      continue;
     }
-
-    // Add playlist to a list that will be returned afterwards.
-    if (retlists == NULL) {
-      retlists = pl;
-      curlist = pl;
-    } else {
-      curlist->next = pl;
-      curlist = pl;
+    ptp_unlock_cache(params);
+
+    progress.filesize = filedata[i]->filesize;
+    ptp_usb->callback_active = 1;
+    ptp_usb->current_transfer_total = filedata[i]->filesize+PTP_USB_BULK_HDR_LEN*2;
+    ptp_usb->current_transfer_complete = 0;
+    ptp_usb->current_transfer_callback = callback != NULL ? send_files_progress : NULL;
+    ptp_usb->current_transfer_callback_data = &progress;
+
+    get_usb_device_timeout(ptp_usb, &oldtimeout);
+    timeout = oldtimeout +
+      (ptp_usb->current_transfer_total / guess_usb_speed(ptp_usb)) * 1000;
+    set_usb_device_timeout(ptp_usb, timeout);
+
+    ret = ptp_sendobject_fromfd(params, fd, filedata[i]->filesize);
+
+    ptp_usb->callback_active = 0;
+    ptp_usb->current_transfer_callback = NULL;
+    ptp_usb->current_transfer_callback_data = NULL;
+    set_usb_device_timeout(ptp_usb, oldtimeout);
+    ptp_unlock_transactions(params);
+    close_send_source(fd);
+    progress.sent += filedata[i]->filesize;
+
+    if (ret == PTP_ERROR_CANCEL) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED, "LIBMTP_Send_Files(): Cancelled transfer.");
+      filedata[i]->item_id = 0;
+      retval = -1;
+      break;
     }
-
-    // Call callback here if we decide to add that possibility...
-  }
-  return retlists;
-}
-
-
-/**
- * This function retrieves an individual playlist from the device.
- * @param device a pointer to the device to get the playlist from.
- * @param plid the unique ID of the playlist to retrieve.
- * @return a valid playlist metadata post or NULL on failure.
- * @see LIBMTP_Get_Playlist_List()
- */
-LIBMTP_playlist_t *LIBMTP_Get_Playlist(LIBMTP_mtpdevice_t *device, uint32_t const plid)
-{
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  const int REQ_SPL = FLAG_PLAYLIST_SPL(ptp_usb);
-  PTPParams *params = (PTPParams *) device->params;
-  PTPObject *ob;
-  LIBMTP_playlist_t *pl;
-  uint16_t ret;
-
-  // Get all the handles if we haven't already done that
-  if (params->nrofobjects == 0) {
-    flush_handles(device);
-  }
-
-  ret = ptp_object_want (params, plid, PTPOBJECT_OBJECTINFO_LOADED, &ob);
-  if (ret != PTP_RC_OK)
-    return NULL;
-
-  // For Samsung players we must look for the .spl extension explicitly since
-  // playlists are not stored as playlist objects.
-  if ( REQ_SPL && is_spl_playlist(&ob->oi) ) {
-    // Allocate a new playlist type
-    pl = LIBMTP_new_playlist_t();
-    spl_to_playlist_t(device, &ob->oi, ob->oid, pl);
-    return pl;
-  }
-
-  // Ignore stuff that isn't playlists
-  else if ( ob->oi.ObjectFormat != PTP_OFC_MTP_AbstractAudioVideoPlaylist ) {
-    return NULL;
-  }
-
-  // Allocate a new playlist type
-  pl = LIBMTP_new_playlist_t();
-
-  pl->name = get_string_from_object(device, ob->oid, PTP_OPC_Name);
-  if (pl->name == NULL) {
-    pl->name = strdup(ob->oi.Filename);
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, ret, "LIBMTP_Send_Files(): "
+				  "Could not send object.");
+      filedata[i]->item_id = 0;
+      retval = -1;
+    }
+    // The device reports the root folder as -1 when creating objects
+    if (filedata[i]->parent_id == 0xFFFFFFFFU)
+      filedata[i]->parent_id = 0;
   }
-  pl->playlist_id = ob->oid;
-  pl->parent_id = ob->oi.ParentObject;
-  pl->storage_id = ob->oi.StorageID;
-
-  // Then get the track listing for this playlist
-  ret = ptp_mtp_getobjectreferences(params, pl->playlist_id, &pl->tracks, &pl->no_tracks);
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Playlist(): Could not get object references.");
-    pl->tracks = NULL;
-    pl->no_tracks = 0;
+  close_send_source(nextfd);
+  free_settable_props(&propcache);
+  if (!updatecache) {
+    free(folders);
+    return retval;
   }
 
-  return pl;
+  /*
+   * Now update the cache. A folder receiving many files is cheaper to
+   * reread with one property list request than to add file by file.
+   */
+  nroffolders = 0;
+  for (i = 0; i < nroffiles; i++) {
+    if (filedata[i]->item_id != 0)
+      get_send_folder(folders, &nroffolders, filedata[i]->storage_id,
+		      filedata[i]->parent_id)->nroffiles++;
+  }
+  ptp_lock_cache(params, 1);
+  for (i = 0; i < nroffolders; i++) {
+    if (device->cached &&
+	folders[i].nroffiles >= SEND_FILES_REFRESH_MIN &&
+	ptp_operation_issupported(params,PTP_OC_MTP_GetObjPropList) &&
+	!FLAG_BROKEN_MTPGETOBJPROPLIST(ptp_usb) &&
+	refresh_folder(device, folders[i].storage, folders[i].parent, 1) == 0)
+      folders[i].nroffiles = 0;
+  }
+  for (i = 0; i < nroffiles; i++) {
+    if (filedata[i]->item_id != 0 &&
+	get_send_folder(folders, &nroffolders, filedata[i]->storage_id,
+			filedata[i]->parent_id)->nroffiles != 0)
+      add_object_to_cache(device, filedata[i]->item_id);
+  }
+  ptp_unlock_cache(params);
+
+  free(folders);
+  return retval;
 }
 
 /**
- * This function creates a new abstract list such as a playlist
- * or an album.
- *
- * @param device a pointer to the device to create the new abstract list
- *        on.
- * @param name the name of the new abstract list.
- * @param artist the artist of the new abstract list or NULL.
- * @param genre the genre of the new abstract list or NULL.
- * @param parenthandle the handle of the parent or 0 for no parent
- *        i.e. the root folder.
- * @param objectformat the abstract list type to create.
- * @param suffix the ".foo" (4 characters) suffix to use for the virtual
- *        "file" created by this operation.
- * @param newid a pointer to a variable that will hold the new object
- *        ID if this call is successful.
- * @param tracks an array of tracks to associate with this list.
- * @param no_tracks the number of tracks in the list.
- * @return 0 on success, any other value means failure.
+ * This function sends the file object info, ready for sendobject
+ * @param device a pointer to the device to send the file to.
+ * @param filedata a file metadata set to be written along with the file.
+ * @param propcache a cache for the settable properties of each format
+ *        when several files are sent in a row, or NULL.
+ * @return 0 if the transfer was successful, any other value means
+ *           failure.
  */
-static int create_new_abstract_list(LIBMTP_mtpdevice_t *device,
-				    char const * const name,
-				    char const * const artist,
-				    char const * const composer,
-				    char const * const genre,
-				    uint32_t const parenthandle,
-				    uint32_t const storageid,
-				    uint16_t const objectformat,
-				    char const * const suffix,
-				    uint32_t * const newid,
-				    uint32_t const * const tracks,
-				    uint32_t const no_tracks)
-
+static int send_file_object_info(LIBMTP_mtpdevice_t *device, LIBMTP_file_t *filedata,
+				 send_props_cache_t *propcache)
 {
-  int i;
-  int supported = 0;
-  uint16_t ret;
-  uint16_t *properties = NULL;
-  uint32_t propcnt = 0;
-  uint32_t store;
-  uint32_t localph = parenthandle;
-  uint8_t nonconsumable = 0x00U; /* By default it is consumable */
   PTPParams *params = (PTPParams *) device->params;
   PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  char fname[256];
-  //uint8_t data[2];
+  uint32_t store;
+  int use_primary_storage = 1;
+  uint16_t of = map_libmtp_type_to_ptp_type(filedata->filetype);
+  LIBMTP_devicestorage_t *storage;
+  uint32_t localph = filedata->parent_id;
+  uint16_t ret;
+  int i;
 
-  // NULL check
-  if (!name) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): list name was NULL, using default name \"Unknown\"");
+#if 0
+  // Sanity check: no zerolength files on some devices?
+  // If the zerolength files cause problems on some devices,
+  // then add a bug flag for this.
+  if (filedata->filesize == 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "send_file_object_info(): "
+			    "File of zero size.");
     return -1;
   }
-
-  if (storageid == 0) {
-    // I'm just guessing that an abstract list may require 512 bytes
-    store = get_suggested_storage_id(device, 512, localph);
+#endif
+  if (filedata->storage_id != 0) {
+    store = filedata->storage_id;
   } else {
-    store = storageid;
+    store = get_suggested_storage_id(device, filedata->filesize, localph);
   }
 
-  // Check if we can create an object of this type
-  for ( i=0; i < params->deviceinfo.ImageFormats_len; i++ ) {
-    if (params->deviceinfo.ImageFormats[i] == objectformat) {
-      supported = 1;
-      break;
-    }
-  }
-  if (!supported) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): player does not support this abstract type");
-    LIBMTP_ERROR("Unsupported abstract list type: %04x\n", objectformat);
-    return -1;
+  // Detect if something non-primary is in use.
+  ptp_lock_cache(params, 0);
+  storage = device->storage;
+  if (storage != NULL && store != storage->id) {
+    use_primary_storage = 0;
   }
+  ptp_unlock_cache(params);
 
-  // add the new suffix if it isn't there
-  fname[0] = '\0';
-  if (strlen(name) > strlen(suffix)) {
-    char const * const suff = &name[strlen(name)-strlen(suffix)];
-    if (!strcmp(suff, suffix)) {
-      // Home free.
-      strncpy(fname, name, sizeof(fname));
+  /*
+   * If no destination folder was given, look up a default
+   * folder if possible. Perhaps there is some way of retrieveing
+   * the default folder for different forms of content, what
+   * do I know, we use a fixed list in lack of any better method.
+   * Some devices obviously need to have their files in certain
+   * folders in order to find/display them at all (hello Creative),
+   * so we have to have a method for this. We only do this if the
+   * primary storage is in use.
+   */
+
+  if (localph == 0 && use_primary_storage) {
+    if (LIBMTP_FILETYPE_IS_AUDIO(filedata->filetype)) {
+      localph = device->default_music_folder;
+    } else if (LIBMTP_FILETYPE_IS_VIDEO(filedata->filetype)) {
+      localph = device->default_video_folder;
+    } else if (of == PTP_OFC_EXIF_JPEG ||
+	       of == PTP_OFC_JP2 ||
+	       of == PTP_OFC_JPX ||
+	       of == PTP_OFC_JFIF ||
+	       of == PTP_OFC_TIFF ||
+	       of == PTP_OFC_TIFF_IT ||
+	       of == PTP_OFC_BMP ||
+	       of == PTP_OFC_GIF ||
+	       of == PTP_OFC_PICT ||
+	       of == PTP_OFC_PNG ||
+	       of == PTP_OFC_MTP_WindowsImageFormat) {
+      localph = device->default_picture_folder;
+    } else if (of == PTP_OFC_MTP_vCalendar1 ||
+	       of == PTP_OFC_MTP_vCalendar2 ||
+	       of == PTP_OFC_MTP_UndefinedContact ||
+	       of == PTP_OFC_MTP_vCard2 ||
+	       of == PTP_OFC_MTP_vCard3 ||
+	       of == PTP_OFC_MTP_UndefinedCalendarItem) {
+      localph = device->default_organizer_folder;
+    } else if (of == PTP_OFC_Text) {
+      localph = device->default_text_folder;
     }
   }
-  // If it didn't end with "<suffix>" then add that here.
-  if (fname[0] == '\0') {
-    strncpy(fname, name, sizeof(fname)-strlen(suffix)-1);
-    strcat(fname, suffix);
-    fname[sizeof(fname)-1] = '\0';
+
+  // Here we wire the type to unknown on bugged, but
+  // Ogg or FLAC-supportive devices.
+  if (FLAG_OGG_IS_UNKNOWN(ptp_usb) && of == PTP_OFC_MTP_OGG) {
+    of = PTP_OFC_Undefined;
+  }
+  if (FLAG_FLAC_IS_UNKNOWN(ptp_usb) && of == PTP_OFC_MTP_FLAC) {
+    of = PTP_OFC_Undefined;
   }
 
   if (ptp_operation_issupported(params, PTP_OC_MTP_SendObjectPropList) &&
       !FLAG_BROKEN_SEND_OBJECT_PROPLIST(ptp_usb)) {
-    MTPProperties *props = NULL;
-    MTPProperties *prop = NULL;
-    int nrofprops = 0;
-
-    *newid = 0x00000000U;
-
-    ret = ptp_mtp_getobjectpropssupported(params, objectformat, &propcnt, &properties);
-
-    for (i=0;i<propcnt;i++) {
-      PTPObjectPropDesc opd;
-
-      ret = ptp_mtp_getobjectpropdesc(params, properties[i], objectformat, &opd);
-      if (ret != PTP_RC_OK) {
-	add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): "
-				"could not get property description.");
-      } else if (opd.GetSet) {
-	switch (properties[i]) {
-	case PTP_OPC_ObjectFileName:
-	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
-	  prop->ObjectHandle = *newid;
-	  prop->property = PTP_OPC_ObjectFileName;
-	  prop->datatype = PTP_DTC_STR;
-	  prop->propval.str = strdup(fname);
-	  if (FLAG_ONLY_7BIT_FILENAMES(ptp_usb)) {
-	    strip_7bit_from_utf8(prop->propval.str);
-	  }
-	  break;
-	case PTP_OPC_ProtectionStatus:
-	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
-	  prop->ObjectHandle = *newid;
-	  prop->property = PTP_OPC_ProtectionStatus;
-	  prop->datatype = PTP_DTC_UINT16;
-	  prop->propval.u16 = 0x0000U; /* Not protected */
-	  break;
-	case PTP_OPC_NonConsumable:
-	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
-	  prop->ObjectHandle = *newid;
-	  prop->property = PTP_OPC_NonConsumable;
-	  prop->datatype = PTP_DTC_UINT8;
-	  prop->propval.u8 = nonconsumable;
-	  break;
-	case PTP_OPC_Name:
-	  if (name != NULL) {
-	    prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
-	    prop->ObjectHandle = *newid;
-	    prop->property = PTP_OPC_Name;
-	    prop->datatype = PTP_DTC_STR;
-	    prop->propval.str = strdup(name);
-	  }
-	  break;
-	case PTP_OPC_AlbumArtist:
-	  if (artist != NULL) {
-	    prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
-	    prop->ObjectHandle = *newid;
-	    prop->property = PTP_OPC_AlbumArtist;
-	    prop->datatype = PTP_DTC_STR;
-	    prop->propval.str = strdup(artist);
-	  }
-	  break;
-	case PTP_OPC_Artist:
-	  if (artist != NULL) {
-	    prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
-	    prop->ObjectHandle = *newid;
-	    prop->property = PTP_OPC_Artist;
-	    prop->datatype = PTP_DTC_STR;
-	    prop->propval.str = strdup(artist);
-	  }
-	  break;
-	case PTP_OPC_Composer:
-	  if (composer != NULL) {
-	    prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
-	    prop->ObjectHandle = *newid;
-	    prop->property = PTP_OPC_Composer;
-	    prop->datatype = PTP_DTC_STR;
-	    prop->propval.str = strdup(composer);
-	  }
-	  break;
-	case PTP_OPC_Genre:
-	  if (genre != NULL) {
-	    prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
-	    prop->ObjectHandle = *newid;
-	    prop->property = PTP_OPC_Genre;
-	    prop->datatype = PTP_DTC_STR;
-	    prop->propval.str = strdup(genre);
-	  }
-	  break;
- 	case PTP_OPC_DateModified:
-	  // Tag with current time if that is supported
-	  if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
-	    prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
-	    prop->ObjectHandle = *newid;
-	    prop->property = PTP_OPC_DateModified;
-	    prop->datatype = PTP_DTC_STR;
-	    prop->propval.str = get_iso8601_stamp();
+    /*
+     * MTP enhanched does it this way (from a sniff):
+     * -> PTP_OC_MTP_SendObjectPropList (0x9808):
+     *    20 00 00 00 01 00 08 98 1B 00 00 00 01 00 01 00
+     *    FF FF FF FF 00 30 00 00 00 00 00 00 12 5E 00 00
+     *    Length: 0x00000020
+     *    Type:   0x0001 PTP_USB_CONTAINER_COMMAND
+     *    Code:   0x9808
+     *    Transaction ID: 0x0000001B
+     *    Param1: 0x00010001 <- store
+     *    Param2: 0xffffffff <- parent handle (-1 ?)
+     *    Param3: 0x00003000 <- file type PTP_OFC_Undefined - we don't know about PDF files
+     *    Param4: 0x00000000 <- file length MSB (-0x0c header len)
+     *    Param5: 0x00005e12 <- file length LSB (-0x0c header len)
+     *
+     * -> PTP_OC_MTP_SendObjectPropList (0x9808):
+     *    46 00 00 00 02 00 08 98 1B 00 00 00 03 00 00 00
+     *    00 00 00 00 07 DC FF FF 0D 4B 00 53 00 30 00 36 - dc07 = file name
+     *    00 30 00 33 00 30 00 36 00 2E 00 70 00 64 00 66
+     *    00 00 00 00 00 00 00 03 DC 04 00 00 00 00 00 00 - dc03 = protection status
+     *    00 4F DC 02 00 01                               - dc4f = non consumable
+     *    Length: 0x00000046
+     *    Type:   0x0002 PTP_USB_CONTAINER_DATA
+     *    Code:   0x9808
+     *    Transaction ID: 0x0000001B
+     *    Metadata....
+     *    0x00000003 <- Number of metadata items
+     *    0x00000000 <- Object handle, set to 0x00000000 since it is unknown!
+     *    0xdc07     <- metadata type: file name
+     *    0xffff     <- metadata type: string
+     *    0x0d       <- number of (uint16_t) characters
+     *    4b 53 30 36 30 33 30 36 2e 50 64 66 00 "KS060306.pdf", null terminated
+     *    0x00000000 <- Object handle, set to 0x00000000 since it is unknown!
+     *    0xdc03     <- metadata type: protection status
+     *    0x0004     <- metadata type: uint16_t
+     *    0x0000     <- not protected
+     *    0x00000000 <- Object handle, set to 0x00000000 since it is unknown!
+     *    0xdc4f     <- non consumable
+     *    0x0002     <- metadata type: uint8_t
+     *    0x01       <- non-consumable (this device cannot display PDF)
+     *
+     * <- Read 0x18 bytes back
+     *    18 00 00 00 03 00 01 20 1B 00 00 00 01 00 01 00
+     *    00 00 00 00 01 40 00 00
+     *    Length: 0x000000018
+     *    Type:   0x0003 PTP_USB_CONTAINER_RESPONSE
+     *    Code:   0x2001 PTP_OK
+     *    Transaction ID: 0x0000001B
+     *    Param1: 0x00010001 <- store
+     *    Param2: 0x00000000 <- parent handle
+     *    Param3: 0x00004001 <- new file/object ID
+     *
+     * -> PTP_OC_SendObject (0x100d)
+     *    0C 00 00 00 01 00 0D 10 1C 00 00 00
+     * -> ... all the bytes ...
+     * <- Read 0x0c bytes back
+     *    0C 00 00 00 03 00 01 20 1C 00 00 00
+     *    ... Then update metadata one-by one, actually (instead of sending it first!) ...
+     */
+    MTPProperties *props = NULL;
+    int nrofprops = 0;
+    MTPProperties *prop = NULL;
+    uint16_t *properties = NULL;
+    uint32_t propcnt = 0;
+    int freeprops;
+
+    // default parent handle
+    if (localph == 0)
+      localph = 0xFFFFFFFFU; // Set to -1
+
+    // Must be 0x00000000U for new objects
+    filedata->item_id = 0x00000000U;
+
+    freeprops = get_settable_props(device, of, propcache, &properties, &propcnt);
+
+    for (i=0;i<propcnt;i++) {
+      switch (properties[i]) {
+      case PTP_OPC_ObjectFileName:
+	prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	prop->ObjectHandle = filedata->item_id;
+	prop->property = PTP_OPC_ObjectFileName;
+	prop->datatype = PTP_DTC_STR;
+	if (filedata->filename != NULL) {
+	  prop->propval.str = strdup(filedata->filename);
+	  if (FLAG_ONLY_7BIT_FILENAMES(ptp_usb)) {
+	    strip_7bit_from_utf8(prop->propval.str);
 	  }
-	  break;
 	}
+	break;
+      case PTP_OPC_ProtectionStatus:
+	prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	prop->ObjectHandle = filedata->item_id;
+	prop->property = PTP_OPC_ProtectionStatus;
+	prop->datatype = PTP_DTC_UINT16;
+	prop->propval.u16 = 0x0000U; /* Not protected */
+	break;
+      case PTP_OPC_NonConsumable:
+	prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	prop->ObjectHandle = filedata->item_id;
+	prop->property = PTP_OPC_NonConsumable;
+	prop->datatype = PTP_DTC_UINT8;
+	prop->propval.u8 = 0x00; /* It is supported, then it is consumable */
+	break;
+      case PTP_OPC_Name:
+	prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	prop->ObjectHandle = filedata->item_id;
+	prop->property = PTP_OPC_Name;
+	prop->datatype = PTP_DTC_STR;
+	if (filedata->filename != NULL)
+	  prop->propval.str = strdup(filedata->filename);
+	break;
+      case PTP_OPC_DateModified:
+	// Tag with current time if that is supported
+	if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
+	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	  prop->ObjectHandle = filedata->item_id;
+	  prop->property = PTP_OPC_DateModified;
+	  prop->datatype = PTP_DTC_STR;
+	  prop->propval.str = get_iso8601_stamp();
+	  filedata->modificationdate = time(NULL);
+	}
+	break;
       }
-      ptp_free_objectpropdesc(&opd);
     }
-    free(properties);
+    if (freeprops)
+      free(properties);
 
-    ret = ptp_mtp_sendobjectproplist(params, &store, &localph, newid,
-				     objectformat, 0, props, nrofprops);
+    ret = ptp_mtp_sendobjectproplist(params, &store, &localph, &filedata->item_id,
+				     of, filedata->filesize, props, nrofprops);
 
     /* Free property list */
     ptp_destroy_object_prop_list(props, nrofprops);
 
     if (ret != PTP_RC_OK) {
-      add_ptp_error_to_errorstack(device, ret, "create_new_abstract_list(): Could not send object property list.");
+      add_ptp_error_to_errorstack(device, ret, "send_file_object_info():"
+				  "Could not send object property list.");
       if (ret == PTP_RC_AccessDenied) {
 	add_ptp_error_to_errorstack(device, ret, "ACCESS DENIED.");
       }
       return -1;
     }
-
-    // now send the blank object
-    ret = ptp_sendobject(params, NULL, 0);
-    if (ret != PTP_RC_OK) {
-      add_ptp_error_to_errorstack(device, ret, "create_new_abstract_list(): Could not send blank object data.");
-      return -1;
-    }
-
   } else if (ptp_operation_issupported(params,PTP_OC_SendObjectInfo)) {
-    PTPObjectInfo new_object;
+    PTPObjectInfo new_file;
 
-    new_object.Filename = fname;
+    memset(&new_file, 0, sizeof(PTPObjectInfo));
+
+    new_file.Filename = filedata->filename;
     if (FLAG_ONLY_7BIT_FILENAMES(ptp_usb)) {
-      strip_7bit_from_utf8(new_object.Filename);
+      strip_7bit_from_utf8(new_file.Filename);
     }
-    // At one point this had to be one
-    new_object.ObjectCompressedSize = 0;
-    new_object.ObjectFormat = objectformat;
+    if (filedata->filesize > 0xFFFFFFFFL) {
+      // This is a kludge in the MTP standard for large files.
+      new_file.ObjectCompressedSize = (uint32_t) 0xFFFFFFFF;
+    } else {
+      new_file.ObjectCompressedSize = (uint32_t) filedata->filesize;
+    }
+    new_file.ObjectFormat = of;
+    new_file.StorageID = store;
+    new_file.ParentObject = localph;
+    new_file.ModificationDate = time(NULL);
 
     // Create the object
-    ret = ptp_sendobjectinfo(params, &store, &localph, newid, &new_object);
+    ret = ptp_sendobjectinfo(params, &store, &localph, &filedata->item_id, &new_file);
+
     if (ret != PTP_RC_OK) {
-      add_ptp_error_to_errorstack(device, ret, "create_new_abstract_list(): Could not send object info (the playlist itself).");
+      add_ptp_error_to_errorstack(device, ret, "send_file_object_info(): "
+				  "Could not send object info.");
       if (ret == PTP_RC_AccessDenied) {
 	add_ptp_error_to_errorstack(device, ret, "ACCESS DENIED.");
       }
       return -1;
     }
-    // NOTE: don't destroy new_object objectinfo afterwards - the strings it contains are
-    // not copies.
+    // NOTE: the char* pointers inside new_file are not copies so don't
+    // try to destroy this objectinfo!
+  }
 
-#if 0
-    /*
-     * At one time we had to send this one blank data byte.
-     * If we didn't, the handle will not be created and thus there is
-     * no playlist. Possibly this was masking some bug, so removing it
-     * now.
-     */
-    data[0] = '\0';
-    data[1] = '\0';
-    ret = ptp_sendobject(params, data, 1);
-    if (ret != PTP_RC_OK) {
-      add_ptp_error_to_errorstack(device, ret, "create_new_abstract_list(): Could not send blank object data.");
-      return -1;
-    }
-#endif
+  // Now there IS an object with this parent handle.
+  filedata->parent_id = localph;
+  filedata->storage_id = store;
 
-    // set the properties one by one
-    ret = ptp_mtp_getobjectpropssupported(params, objectformat, &propcnt, &properties);
+  return 0;
+}
+
+/**
+ * This function updates the MTP track object metadata on a
+ * single file identified by an object ID.
+ * @param device a pointer to the device to update the track
+ *        metadata on.
+ * @param metadata a track metadata set to be written to the file.
+ *        notice that the <code>track_id</code> field of the
+ *        metadata structure must be correct so that the
+ *        function can update the right file. If some properties
+ *        of this metadata are set to NULL (strings) or 0
+ *        (numerical values) they will be discarded and the
+ *        track will not be tagged with these blank values.
+ * @return 0 on success, any other value means failure. If some
+ *        or all of the properties fail to update we will still
+ *        return success. On some devices (notably iRiver T30)
+ *        properties that exist cannot be updated.
+ */
+int LIBMTP_Update_Track_Metadata(LIBMTP_mtpdevice_t *device,
+				 LIBMTP_track_t const * const metadata)
+{
+  uint16_t ret;
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  uint32_t i;
+  uint16_t *properties = NULL;
+  uint32_t propcnt = 0;
+
+  // First see which properties can be set on this file format and apply accordingly
+  // i.e only try to update this metadata for object tags that exist on the current player.
+  ret = ptp_mtp_getobjectpropssupported(params, map_libmtp_type_to_ptp_type(metadata->filetype), &propcnt, &properties);
+  if (ret != PTP_RC_OK) {
+    // Just bail out for now, nothing is ever set.
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+			    "could not retrieve supported object properties.");
+    return -1;
+  }
+  if (ptp_operation_issupported(params, PTP_OC_MTP_SetObjPropList) &&
+      !FLAG_BROKEN_SET_OBJECT_PROPLIST(ptp_usb)) {
+    MTPProperties *props = NULL;
+    MTPProperties *prop = NULL;
+    int nrofprops = 0;
 
     for (i=0;i<propcnt;i++) {
       PTPObjectPropDesc opd;
 
-      ret = ptp_mtp_getobjectpropdesc(params, properties[i], objectformat, &opd);
+      ret = ptp_mtp_getobjectpropdesc(params, properties[i], map_libmtp_type_to_ptp_type(metadata->filetype), &opd);
       if (ret != PTP_RC_OK) {
-	add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): "
+	add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
 				"could not get property description.");
       } else if (opd.GetSet) {
 	switch (properties[i]) {
 	case PTP_OPC_Name:
-	  if (name != NULL) {
-	    ret = set_object_string(device, *newid, PTP_OPC_Name, name);
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): could not set entity name.");
-	      return -1;
-	    }
-	  }
+	  if (metadata->title == NULL)
+	    break;
+	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	  prop->ObjectHandle = metadata->item_id;
+	  prop->property = PTP_OPC_Name;
+	  prop->datatype = PTP_DTC_STR;
+	  prop->propval.str = strdup(metadata->title);
 	  break;
-	case PTP_OPC_AlbumArtist:
-	  if (artist != NULL) {
-	    ret = set_object_string(device, *newid, PTP_OPC_AlbumArtist, artist);
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): could not set entity album artist.");
-	      return -1;
-	    }
-	  }
+	case PTP_OPC_AlbumName:
+	  if (metadata->album == NULL)
+	    break;
+	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	  prop->ObjectHandle = metadata->item_id;
+	  prop->property = PTP_OPC_AlbumName;
+	  prop->datatype = PTP_DTC_STR;
+	  prop->propval.str = strdup(metadata->album);
 	  break;
 	case PTP_OPC_Artist:
-	  if (artist != NULL) {
-	    ret = set_object_string(device, *newid, PTP_OPC_Artist, artist);
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): could not set entity artist.");
-	      return -1;
-	    }
-	  }
+	  if (metadata->artist == NULL)
+	    break;
+	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	  prop->ObjectHandle = metadata->item_id;
+	  prop->property = PTP_OPC_Artist;
+	  prop->datatype = PTP_DTC_STR;
+	  prop->propval.str = strdup(metadata->artist);
 	  break;
 	case PTP_OPC_Composer:
-	  if (composer != NULL) {
-	    ret = set_object_string(device, *newid, PTP_OPC_Composer, composer);
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): could not set entity composer.");
-	      return -1;
-	    }
-	  }
+	  if (metadata->composer == NULL)
+	    break;
+	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	  prop->ObjectHandle = metadata->item_id;
+	  prop->property = PTP_OPC_Composer;
+	  prop->datatype = PTP_DTC_STR;
+	  prop->propval.str = strdup(metadata->composer);
 	  break;
 	case PTP_OPC_Genre:
-	  if (genre != NULL) {
-	    ret = set_object_string(device, *newid, PTP_OPC_Genre, genre);
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): could not set entity genre.");
-	      return -1;
-	    }
-	  }
+	  if (metadata->genre == NULL)
+	    break;
+	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	  prop->ObjectHandle = metadata->item_id;
+	  prop->property = PTP_OPC_Genre;
+	  prop->datatype = PTP_DTC_STR;
+	  prop->propval.str = strdup(metadata->genre);
 	  break;
- 	case PTP_OPC_DateModified:
+	case PTP_OPC_Duration:
+	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	  prop->ObjectHandle = metadata->item_id;
+	  prop->property = PTP_OPC_Duration;
+	  prop->datatype = PTP_DTC_UINT32;
+	  prop->propval.u32 = adjust_u32(metadata->duration, &opd);
+	  break;
+	case PTP_OPC_Track:
+	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	  prop->ObjectHandle = metadata->item_id;
+	  prop->property = PTP_OPC_Track;
+	  prop->datatype = PTP_DTC_UINT16;
+	  prop->propval.u16 = adjust_u16(metadata->tracknumber, &opd);
+	  break;
+	case PTP_OPC_OriginalReleaseDate:
+	  if (metadata->date == NULL)
+	    break;
+	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	  prop->ObjectHandle = metadata->item_id;
+	  prop->property = PTP_OPC_OriginalReleaseDate;
+	  prop->datatype = PTP_DTC_STR;
+	  prop->propval.str = strdup(metadata->date);
+	  break;
+	case PTP_OPC_SampleRate:
+	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	  prop->ObjectHandle = metadata->item_id;
+	  prop->property = PTP_OPC_SampleRate;
+	  prop->datatype = PTP_DTC_UINT32;
+	  prop->propval.u32 = adjust_u32(metadata->samplerate, &opd);
+	  break;
+	case PTP_OPC_NumberOfChannels:
+	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	  prop->ObjectHandle = metadata->item_id;
+	  prop->property = PTP_OPC_NumberOfChannels;
+	  prop->datatype = PTP_DTC_UINT16;
+	  prop->propval.u16 = adjust_u16(metadata->nochannels, &opd);
+	  break;
+	case PTP_OPC_AudioWAVECodec:
+	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	  prop->ObjectHandle = metadata->item_id;
+	  prop->property = PTP_OPC_AudioWAVECodec;
+	  prop->datatype = PTP_DTC_UINT32;
+	  prop->propval.u32 = adjust_u32(metadata->wavecodec, &opd);
+	  break;
+	case PTP_OPC_AudioBitRate:
+	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	  prop->ObjectHandle = metadata->item_id;
+	  prop->property = PTP_OPC_AudioBitRate;
+	  prop->datatype = PTP_DTC_UINT32;
+	  prop->propval.u32 = adjust_u32(metadata->bitrate, &opd);
+	  break;
+	case PTP_OPC_BitRateType:
+	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	  prop->ObjectHandle = metadata->item_id;
+	  prop->property = PTP_OPC_BitRateType;
+	  prop->datatype = PTP_DTC_UINT16;
+	  prop->propval.u16 = adjust_u16(metadata->bitratetype, &opd);
+	  break;
+	case PTP_OPC_Rating:
+	  // TODO: shall this be set for rating 0?
+	  if (metadata->rating == 0)
+	    break;
+	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	  prop->ObjectHandle = metadata->item_id;
+	  prop->property = PTP_OPC_Rating;
+	  prop->datatype = PTP_DTC_UINT16;
+	  prop->propval.u16 = adjust_u16(metadata->rating, &opd);
+	  break;
+	case PTP_OPC_UseCount:
+	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	  prop->ObjectHandle = metadata->item_id;
+	  prop->property = PTP_OPC_UseCount;
+	  prop->datatype = PTP_DTC_UINT32;
+	  prop->propval.u32 = adjust_u32(metadata->usecount, &opd);
+	  break;
+	case PTP_OPC_DateModified:
 	  if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
-	    ret = set_object_string(device, *newid, PTP_OPC_DateModified, get_iso8601_stamp());
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): could not set date modified.");
-	      return -1;
-	    }
+	    // Tag with current time if that is supported
+	    prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	    prop->ObjectHandle = metadata->item_id;
+	    prop->property = PTP_OPC_DateModified;
+	    prop->datatype = PTP_DTC_STR;
+	    prop->propval.str = get_iso8601_stamp();
 	  }
 	  break;
+	default:
+	  break;
 	}
       }
       ptp_free_objectpropdesc(&opd);
     }
-    free(properties);
-  }
-
-  if (no_tracks > 0) {
-    // Add tracks to the list as object references.
-    ret = ptp_mtp_setobjectreferences (params, *newid, (uint32_t *) tracks, no_tracks);
-    if (ret != PTP_RC_OK) {
-      add_ptp_error_to_errorstack(device, ret, "create_new_abstract_list(): could not add tracks as object references.");
-      return -1;
-    }
-  }
 
-  add_object_to_cache(device, *newid);
+    // NOTE: File size is not updated, this should not change anyway.
+    // neither will we change the filename.
 
-  return 0;
-}
+    ret = ptp_mtp_setobjectproplist(params, props, nrofprops);
 
-/**
- * This updates the metadata and track listing
- * for an abstract list.
- * @param device a pointer to the device that the abstract list
- *        resides on.
- * @param name the name of the abstract list.
- * @param artist the artist of the abstract list or NULL.
- * @param genre the genre of the abstract list or NULL.
- * @param objecthandle the object to be updated.
- * @param objectformat the abstract list type to update.
- * @param tracks an array of tracks to associate with this list.
- * @param no_tracks the number of tracks in the list.
- * @return 0 on success, any other value means failure.
- */
-static int update_abstract_list(LIBMTP_mtpdevice_t *device,
-				char const * const name,
-				char const * const artist,
-				char const * const composer,
-				char const * const genre,
-				uint32_t const objecthandle,
-				uint16_t const objectformat,
-				uint32_t const * const tracks,
-				uint32_t const no_tracks)
-{
-  uint16_t ret;
-  PTPParams *params = (PTPParams *) device->params;
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  uint16_t *properties = NULL;
-  uint32_t propcnt = 0;
-  int i;
+    ptp_destroy_object_prop_list(props, nrofprops);
 
-  // First see which properties can be set
-  // i.e only try to update this metadata for object tags that exist on the current player.
-  ret = ptp_mtp_getobjectpropssupported(params, objectformat, &propcnt, &properties);
-  if (ret != PTP_RC_OK) {
-    // Just bail out for now, nothing is ever set.
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
-			    "could not retrieve supported object properties.");
-    return -1;
-  }
-  if (ptp_operation_issupported(params,PTP_OC_MTP_SetObjPropList) &&
-      !FLAG_BROKEN_SET_OBJECT_PROPLIST(ptp_usb)) {
-    MTPProperties *props = NULL;
-    MTPProperties *prop = NULL;
-    int nrofprops = 0;
+    if (ret != PTP_RC_OK) {
+      // TODO: return error of which property we couldn't set
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+			      "could not set object property list.");
+      free(properties);
+      return -1;
+    }
 
+  } else if (ptp_operation_issupported(params,PTP_OC_MTP_SetObjectPropValue)) {
     for (i=0;i<propcnt;i++) {
       PTPObjectPropDesc opd;
 
-      ret = ptp_mtp_getobjectpropdesc(params, properties[i], objectformat, &opd);
+      ret = ptp_mtp_getobjectpropdesc(params, properties[i], map_libmtp_type_to_ptp_type(metadata->filetype), &opd);
       if (ret != PTP_RC_OK) {
-	add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
+	add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
 				"could not get property description.");
       } else if (opd.GetSet) {
 	switch (properties[i]) {
 	case PTP_OPC_Name:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = objecthandle;
-	  prop->property = PTP_OPC_Name;
-	  prop->datatype = PTP_DTC_STR;
-	  if (name != NULL)
-	    prop->propval.str = strdup(name);
-	  break;
-	case PTP_OPC_AlbumArtist:
-	  if (artist != NULL) {
-	    prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	    prop->ObjectHandle = objecthandle;
-	    prop->property = PTP_OPC_AlbumArtist;
-	    prop->datatype = PTP_DTC_STR;
-	    prop->propval.str = strdup(artist);
+	  // Update title
+	  ret = set_object_string(device, metadata->item_id, PTP_OPC_Name, metadata->title);
+	  if (ret != 0) {
+	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				    "could not set track title.");
+	  }
+	  break;
+	case PTP_OPC_AlbumName:
+	  // Update album
+	  ret = set_object_string(device, metadata->item_id, PTP_OPC_AlbumName, metadata->album);
+	  if (ret != 0) {
+	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				    "could not set track album name.");
 	  }
 	  break;
 	case PTP_OPC_Artist:
-	  if (artist != NULL) {
-	    prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	    prop->ObjectHandle = objecthandle;
-	    prop->property = PTP_OPC_Artist;
-	    prop->datatype = PTP_DTC_STR;
-	    prop->propval.str = strdup(artist);
+	  // Update artist
+	  ret = set_object_string(device, metadata->item_id, PTP_OPC_Artist, metadata->artist);
+	  if (ret != 0) {
+	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				    "could not set track artist name.");
 	  }
 	  break;
 	case PTP_OPC_Composer:
-	  if (composer != NULL) {
-	    prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	    prop->ObjectHandle = objecthandle;
-	    prop->property = PTP_OPC_Composer;
-	    prop->datatype = PTP_DTC_STR;
-	    prop->propval.str = strdup(composer);
+	  // Update composer
+	  ret = set_object_string(device, metadata->item_id, PTP_OPC_Composer, metadata->composer);
+	  if (ret != 0) {
+	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				    "could not set track composer name.");
 	  }
 	  break;
 	case PTP_OPC_Genre:
-	  if (genre != NULL) {
-	    prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	    prop->ObjectHandle = objecthandle;
-	    prop->property = PTP_OPC_Genre;
-	    prop->datatype = PTP_DTC_STR;
-	    prop->propval.str = strdup(genre);
+	  // Update genre (but only if valid)
+	  if (metadata->genre) {
+	    ret = set_object_string(device, metadata->item_id, PTP_OPC_Genre, metadata->genre);
+	    if (ret != 0) {
+	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
+				      "could not set genre.");
+	    }
 	  }
 	  break;
- 	case PTP_OPC_DateModified:
-	  if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
-	    // Tag with current time if that is supported
-	    prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	    prop->ObjectHandle = objecthandle;
-	    prop->property = PTP_OPC_DateModified;
-	    prop->datatype = PTP_DTC_STR;
-	    prop->propval.str = get_iso8601_stamp();
+	case PTP_OPC_Duration:
+	  // Update duration
+	  if (metadata->duration != 0) {
+	    ret = set_object_u32(device, metadata->item_id, PTP_OPC_Duration, adjust_u32(metadata->duration, &opd));
+	    if (ret != 0) {
+	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				      "could not set track duration.");
+	    }
 	  }
 	  break;
-	default:
+	case PTP_OPC_Track:
+	  // Update track number.
+	  if (metadata->tracknumber != 0) {
+	    ret = set_object_u16(device, metadata->item_id, PTP_OPC_Track, adjust_u16(metadata->tracknumber, &opd));
+	    if (ret != 0) {
+	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				      "could not set track tracknumber.");
+	    }
+	  }
 	  break;
-	}
-      }
-      ptp_free_objectpropdesc(&opd);
-    }
-
-    // proplist could be NULL if we can't write any properties
-    if (props != NULL) {
-      ret = ptp_mtp_setobjectproplist(params, props, nrofprops);
-
-      ptp_destroy_object_prop_list(props, nrofprops);
-
-      if (ret != PTP_RC_OK) {
-        // TODO: return error of which property we couldn't set
-        add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
-                                "could not set object property list.");
-        free(properties);
-        return -1;
-      }
-    }
-
-  } else if (ptp_operation_issupported(params,PTP_OC_MTP_SetObjectPropValue)) {
-    for (i=0;i<propcnt;i++) {
-      switch (properties[i]) {
-      case PTP_OPC_Name:
-	// Update title
-	ret = set_object_string(device, objecthandle, PTP_OPC_Name, name);
-	if (ret != 0) {
-	  add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
-				  "could not set title.");
-	}
-	break;
-      case PTP_OPC_AlbumArtist:
-	// Update album artist
-	ret = set_object_string(device, objecthandle, PTP_OPC_AlbumArtist, artist);
-	if (ret != 0) {
-	  add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
-				  "could not set album artist name.");
-	}
-	break;
-      case PTP_OPC_Artist:
-	// Update artist
-	ret = set_object_string(device, objecthandle, PTP_OPC_Artist, artist);
-	if (ret != 0) {
-	  add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
-				  "could not set artist name.");
-	}
-	break;
-      case PTP_OPC_Composer:
-	// Update composer
-	ret = set_object_string(device, objecthandle, PTP_OPC_Composer, composer);
-	if (ret != 0) {
-	  add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
-				  "could not set composer name.");
-	}
-	break;
-      case PTP_OPC_Genre:
-	// Update genre (but only if valid)
-	if(genre) {
-	  ret = set_object_string(device, objecthandle, PTP_OPC_Genre, genre);
+	case PTP_OPC_OriginalReleaseDate:
+	  // Update creation datetime
+	  // The date can be zero, but some devices do not support setting zero
+	  // dates (and it seems that a zero date should never be set anyway)
+	  if (metadata->date) {
+	    ret = set_object_string(device, metadata->item_id, PTP_OPC_OriginalReleaseDate, metadata->date);
+	    if (ret != 0) {
+	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				      "could not set track release date.");
+	    }
+	  }
+	  break;
+	  // These are, well not so important.
+	case PTP_OPC_SampleRate:
+	  // Update sample rate
+	  if (metadata->samplerate != 0) {
+	    ret = set_object_u32(device, metadata->item_id, PTP_OPC_SampleRate, adjust_u32(metadata->samplerate, &opd));
+	    if (ret != 0) {
+	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				      "could not set samplerate.");
+	    }
+	  }
+	  break;
+	case PTP_OPC_NumberOfChannels:
+	  // Update number of channels
+	  if (metadata->nochannels != 0) {
+	    ret = set_object_u16(device, metadata->item_id, PTP_OPC_NumberOfChannels, adjust_u16(metadata->nochannels, &opd));
 	  if (ret != 0) {
-	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
-				    "could not set genre.");
+	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				    "could not set number of channels.");
 	  }
-        }
-	break;
-      case PTP_OPC_DateModified:
-	// Update date modified
-	if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
-	  char *tmpdate = get_iso8601_stamp();
-	  ret = set_object_string(device, objecthandle, PTP_OPC_DateModified, tmpdate);
+	}
+	  break;
+	case PTP_OPC_AudioWAVECodec:
+	  // Update WAVE codec
+	  if (metadata->wavecodec != 0) {
+	    ret = set_object_u32(device, metadata->item_id, PTP_OPC_AudioWAVECodec, adjust_u32(metadata->wavecodec, &opd));
+	    if (ret != 0) {
+	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				      "could not set WAVE codec.");
+	    }
+	  }
+	  break;
+	case PTP_OPC_AudioBitRate:
+	  // Update bitrate
+	  if (metadata->bitrate != 0) {
+	    ret = set_object_u32(device, metadata->item_id, PTP_OPC_AudioBitRate, adjust_u32(metadata->bitrate, &opd));
+	    if (ret != 0) {
+	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				      "could not set bitrate.");
+	  }
+	  }
+	  break;
+	case PTP_OPC_BitRateType:
+	  // Update bitrate type
+	  if (metadata->bitratetype != 0) {
+	    ret = set_object_u16(device, metadata->item_id, PTP_OPC_BitRateType, adjust_u16(metadata->bitratetype, &opd));
+	    if (ret != 0) {
+	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				      "could not set bitratetype.");
+	    }
+	  }
+	  break;
+	case PTP_OPC_Rating:
+	  // Update user rating
+	  // TODO: shall this be set for rating 0?
+	  if (metadata->rating != 0) {
+	    ret = set_object_u16(device, metadata->item_id, PTP_OPC_Rating, adjust_u16(metadata->rating, &opd));
+	    if (ret != 0) {
+	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				      "could not set user rating.");
+	    }
+	  }
+	  break;
+	case PTP_OPC_UseCount:
+	  // Update use count, set even to zero if desired.
+	  ret = set_object_u32(device, metadata->item_id, PTP_OPC_UseCount, adjust_u32(metadata->usecount, &opd));
 	  if (ret != 0) {
-	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
-				    "could not set modification date.");
+	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				  "could not set use count.");
 	  }
-	  free(tmpdate);
+	  break;
+	case PTP_OPC_DateModified:
+	  if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
+	    // Update modification time if supported
+	    char *tmpstamp = get_iso8601_stamp();
+	    ret = set_object_string(device, metadata->item_id, PTP_OPC_DateModified, tmpstamp);
+	    if (ret != 0) {
+	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				      "could not set modification date.");
+	    }
+	    free(tmpstamp);
+	  }
+	  break;
+
+	  // NOTE: File size is not updated, this should not change anyway.
+	  // neither will we change the filename.
+	default:
+	  break;
 	}
-	break;
-      default:
-	break;
       }
+      ptp_free_objectpropdesc(&opd);
     }
   } else {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
                             "Your device doesn't seem to support any known way of setting metadata.");
     free(properties);
     return -1;
   }
 
-  // Then the object references...
-  ret = ptp_mtp_setobjectreferences (params, objecthandle, (uint32_t *) tracks, no_tracks);
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "update_abstract_list(): could not add tracks as object references.");
-    free(properties);
-    return -1;
-  }
+  // update cached object properties if metadata cache exists
+  update_metadata_cache(device, metadata->item_id);
 
   free(properties);
 
-  update_metadata_cache(device, objecthandle);
-
   return 0;
 }
 
-
 /**
- * This routine creates a new playlist based on the metadata
- * supplied. If the <code>tracks</code> field of the metadata
- * contains a track listing, these tracks will be added to the
- * playlist.
- * @param device a pointer to the device to create the new playlist on.
- * @param metadata the metadata for the new playlist. If the function
- *        exits with success, the <code>playlist_id</code> field of this
- *        struct will contain the new playlist ID of the playlist.
- *        <ul>
- *        <li><code>metadata-&gt;parent_id</code> should be set to the parent 
- *        (e.g. folder) to store this track in. Since some 
- *        devices are a bit picky about where files
- *        are placed, a default folder will be chosen if libmtp
- *        has detected one for the current filetype and this
- *        parameter is set to 0. If this is 0 and no default folder
- *        can be found, the file will be stored in the root folder.
- *        <li><code>metadata-&gt;storage_id</code> should be set to the
- *        desired storage (e.g. memory card or whatever your device
- *        presents) to store this track in. Setting this to 0 will store
- *        the track on the primary storage.
- *        </ul>
+ * This function deletes a single file, track, playlist, folder or
+ * any other object off the MTP device, identified by the object ID.
+ *
+ * If you delete a folder, there is no guarantee that the device will
+ * really delete all the files that were in that folder, rather it is
+ * expected that they will not be deleted, and will turn up in object
+ * listings with parent set to a non-existant object ID. The safe way
+ * to do this is to recursively delete all files (and folders) contained
+ * in the folder, then the folder itself.
+ *
+ * @param device a pointer to the device to delete the object from.
+ * @param object_id the object to delete.
  * @return 0 on success, any other value means failure.
- * @see LIBMTP_Update_Playlist()
- * @see LIBMTP_Delete_Object()
  */
-int LIBMTP_Create_New_Playlist(LIBMTP_mtpdevice_t *device,
-			       LIBMTP_playlist_t * const metadata)
+int LIBMTP_Delete_Object(LIBMTP_mtpdevice_t *device,
+			 uint32_t object_id)
 {
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  uint32_t localph = metadata->parent_id;
-
-  // Use a default folder if none given
-  if (localph == 0) {
-    if (device->default_playlist_folder != 0)
-      localph = device->default_playlist_folder;
-    else
-      localph = device->default_music_folder;
-  }
-  metadata->parent_id = localph;
+  uint16_t ret;
+  PTPParams *params = (PTPParams *) device->params;
 
-  // Samsung needs its own special type of playlists
-  if(FLAG_PLAYLIST_SPL(ptp_usb)) {
-    return playlist_t_to_spl(device, metadata);
+  ptp_lock_cache(params, 1);
+  ret = ptp_deleteobject(params, object_id, 0);
+  ptp_unlock_cache(params);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Delete_Object(): could not delete object.");
+    return -1;
   }
 
-  // Just create a new abstract audio/video playlist...
-  return create_new_abstract_list(device,
-				  metadata->name,
-				  NULL,
-				  NULL,
-				  NULL,
-				  localph,
-				  metadata->storage_id,
-				  PTP_OFC_MTP_AbstractAudioVideoPlaylist,
-				  get_playlist_extension(ptp_usb),
-				  &metadata->playlist_id,
-				  metadata->tracks,
-				  metadata->no_tracks);
+  return 0;
 }
 
 /**
- * This routine updates a playlist based on the metadata
- * supplied. If the <code>tracks</code> field of the metadata
- * contains a track listing, these tracks will be added to the
- * playlist in place of those already present, i.e. the
- * previous track listing will be deleted. For Samsung devices the
- * playlist id (metadata->playlist_id) is likely to change.
- * @param device a pointer to the device to create the new playlist on.
- * @param metadata the metadata for the playlist to be updated.
- *                 notice that the field <code>playlist_id</code>
- *                 must contain the apropriate playlist ID. Playlist ID
- *                 be modified to a new playlist ID by the time the
- *                 function returns since edit-in-place is not always possible.
- * @return 0 on success, any other value means failure.
- * @see LIBMTP_Create_New_Playlist()
- * @see LIBMTP_Delete_Object()
+ * An object to delete in LIBMTP_Delete_Objects().
  */
-int LIBMTP_Update_Playlist(LIBMTP_mtpdevice_t *device,
-			   LIBMTP_playlist_t * const metadata)
-{
+typedef struct delete_entry_struct {
+  uint32_t id; /**< The object to delete */
+  uint32_t depth; /**< Number of cached ancestors of the object */
+} delete_entry_t;
 
-  // Samsung needs its own special type of playlists
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  if(FLAG_PLAYLIST_SPL(ptp_usb)) {
-    return update_spl_playlist(device, metadata);
-  }
+/**
+ * Sorts objects to delete so that the deepest come first, i.e.
+ * contents before the folders holding them.
+ */
+static int compare_delete_entries(const void *a, const void *b)
+{
+  delete_entry_t const *x = (delete_entry_t const *) a;
+  delete_entry_t const *y = (delete_entry_t const *) b;
 
-  return update_abstract_list(device,
-			      metadata->name,
-			      NULL,
-			      NULL,
-			      NULL,
-			      metadata->playlist_id,
-			      PTP_OFC_MTP_AbstractAudioVideoPlaylist,
-			      metadata->tracks,
-			      metadata->no_tracks);
+  if (x->depth != y->depth)
+    return x->depth > y->depth ? -1 : 1;
+  return x->id < y->id ? -1 : x->id > y->id;
 }
 
 /**
- * This creates a new album metadata structure and allocates memory
- * for it. Notice that if you add strings to this structure they
- * will be freed by the corresponding <code>LIBMTP_destroy_album_t</code>
- * operation later, so be careful of using strdup() when assigning
- * strings.
- *
- * @return a pointer to the newly allocated metadata structure.
- * @see LIBMTP_destroy_album_t()
+ * Count how many folders a cached object sits below.
+ * @param params the PTP parameters holding the cache.
+ * @param object_id the object.
+ * @return the number of ancestors in the cache.
  */
-LIBMTP_album_t *LIBMTP_new_album_t(void)
+static uint32_t get_object_depth(PTPParams *params, uint32_t object_id)
 {
-  LIBMTP_album_t *new = (LIBMTP_album_t *) malloc(sizeof(LIBMTP_album_t));
-  if (new == NULL) {
-    return NULL;
+  uint32_t depth = 0;
+  PTPObject *ob;
+
+  // The bound protects against parent loops on broken devices
+  while (depth < params->nrofobjects &&
+	 ptp_object_find(params, object_id, &ob) == PTP_RC_OK &&
+	 (ob->flags & PTPOBJECT_PARENTOBJECT_LOADED) &&
+	 ob->oi.ParentObject != 0 && ob->oi.ParentObject != 0xffffffffU) {
+    object_id = ob->oi.ParentObject;
+    depth++;
   }
-  new->album_id = 0;
-  new->parent_id = 0;
-  new->storage_id = 0;
-  new->name = NULL;
-  new->artist = NULL;
-  new->composer = NULL;
-  new->genre = NULL;
-  new->tracks = NULL;
-  new->no_tracks = 0;
-  new->next = NULL;
-  return new;
+  return depth;
 }
 
 /**
- * This recursively deletes the memory for an album structure
+ * This function deletes many objects off the MTP device at once, e.g.
+ * when clearing out a folder full of pictures.
  *
- * @param album structure to destroy
- * @see LIBMTP_new_album_t()
+ * The objects are deleted deepest first, so if a folder is passed
+ * along with its contents, the contents are gone before the folder
+ * is deleted, which is the safe way to delete a folder as explained
+ * for <code>LIBMTP_Delete_Object()</code>. The object cache is
+ * updated once when all deletes are done rather than after every
+ * single one.
+ *
+ * If some object cannot be deleted, the others are still deleted
+ * and the failure is reported on the error stack.
+ *
+ * @param device a pointer to the device to delete the objects from.
+ * @param object_ids an array of the objects to delete.
+ * @param nrofobjects the number of objects in <code>object_ids</code>.
+ * @param callback a progress indicator function or NULL to ignore.
+ *        It is called with the number of objects handled so far and
+ *        the total, returning anything but 0 cancels the operation.
+ * @param data a user-defined pointer that is passed along to
+ *        the <code>progress</code> function in order to
+ *        pass along some user defined data to the progress
+ *        updates. If not used, set this to NULL.
+ * @return 0 if all objects were deleted, any other value means
+ *        that at least one object was not deleted.
+ * @see LIBMTP_Delete_Object()
  */
-void LIBMTP_destroy_album_t(LIBMTP_album_t *album)
+int LIBMTP_Delete_Objects(LIBMTP_mtpdevice_t *device,
+			  uint32_t const * const object_ids,
+			  uint32_t const nrofobjects,
+			  LIBMTP_progressfunc_t const callback,
+			  void const * const data)
 {
-  if (album == NULL) {
-    return;
+  PTPParams *params = (PTPParams *) device->params;
+  delete_entry_t *entries;
+  uint8_t *deleted = NULL;
+  int retval = 0;
+  uint32_t i;
+  uint16_t ret;
+
+  if (nrofobjects == 0)
+    return 0;
+
+  entries = malloc(nrofobjects * sizeof(delete_entry_t));
+  if (entries == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			    "LIBMTP_Delete_Objects(): out of memory.");
+    return -1;
   }
-  if (album->name != NULL)
-    free(album->name);
-  if (album->artist != NULL)
-    free(album->artist);
-  if (album->composer != NULL)
-    free(album->composer);
-  if (album->genre != NULL)
-    free(album->genre);
-  if (album->tracks != NULL)
-    free(album->tracks);
-  free(album);
-  return;
+  ptp_lock_cache(params, 1);
+  for (i = 0; i < nrofobjects; i++) {
+    entries[i].id = object_ids[i];
+    entries[i].depth = get_object_depth(params, object_ids[i]);
+  }
+  qsort(entries, nrofobjects, sizeof(delete_entry_t), compare_delete_entries);
+
+  // Deleted objects are marked here and removed from the cache in the end
+  if (params->nrofobjects > 0)
+    deleted = calloc(params->nrofobjects, sizeof(uint8_t));
+
+  for (i = 0; i < nrofobjects; i++) {
+    // Duplicates end up next to each other
+    if (i == 0 || entries[i].id != entries[i-1].id) {
+      ret = ptp_deleteobject_nocache(params, entries[i].id, 0);
+      if (ret != PTP_RC_OK) {
+	add_ptp_error_to_errorstack(device, ret, "LIBMTP_Delete_Objects(): "
+				    "could not delete object.");
+	retval = -1;
+      } else if (deleted != NULL) {
+	PTPObject *ob;
+
+	if (ptp_object_find(params, entries[i].id, &ob) == PTP_RC_OK)
+	  deleted[ob - params->objects] = 1;
+      } else {
+	ptp_remove_object_from_cache(params, entries[i].id);
+      }
+    }
+    if (callback != NULL && callback(i + 1, nrofobjects, data) != 0) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED,
+			      "LIBMTP_Delete_Objects(): "
+			      "cancelled by user.");
+      retval = -1;
+      break;
+    }
+  }
+
+  if (deleted != NULL) {
+    purge_objects_from_cache(params, deleted);
+    free(deleted);
+  }
+  ptp_unlock_cache(params);
+  free(entries);
+  return retval;
 }
 
 /**
- * This function maps and copies a property onto the album metadata if applicable.
+ * Internal function to update an object filename property.
  */
-static void pick_property_to_album_metadata(LIBMTP_mtpdevice_t *device,
-					    MTPProperties *prop, LIBMTP_album_t *alb)
+static int set_object_filename(LIBMTP_mtpdevice_t *device,
+			       uint32_t object_id, uint16_t ptp_type,
+			       const char **newname_ptr)
 {
-  switch (prop->property) {
-  case PTP_OPC_Name:
-    if (prop->propval.str != NULL)
-      alb->name = strdup(prop->propval.str);
-    else
-      alb->name = NULL;
-    break;
-  case PTP_OPC_AlbumArtist:
-    if (prop->propval.str != NULL) {
-      // This should take precedence over plain "Artist"
-      if (alb->artist != NULL)
-	free(alb->artist);
-      alb->artist = strdup(prop->propval.str);
-    } else
-      alb->artist = NULL;
-    break;
-  case PTP_OPC_Artist:
-    if (prop->propval.str != NULL) {
-      // Only use of AlbumArtist is not set
-      if (alb->artist == NULL)
-	alb->artist = strdup(prop->propval.str);
-    } else
-      alb->artist = NULL;
-    break;
-  case PTP_OPC_Composer:
-    if (prop->propval.str != NULL)
-      alb->composer = strdup(prop->propval.str);
-    else
-      alb->composer = NULL;
+  PTPParams             *params = (PTPParams *) device->params;
+  PTP_USB               *ptp_usb = (PTP_USB*) device->usbinfo;
+  PTPObjectPropDesc     opd;
+  uint16_t              ret;
+  char                  *newname;
+
+  // See if we can modify the filename on this kind of files.
+  ret = ptp_mtp_getobjectpropdesc(params, PTP_OPC_ObjectFileName, ptp_type, &opd);
+  if (ret != PTP_RC_OK) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "set_object_filename(): "
+			    "could not get property description.");
+    return -1;
+  }
+
+  if (!opd.GetSet) {
+    ptp_free_objectpropdesc(&opd);
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "set_object_filename(): "
+            " property is not settable.");
+    // TODO: we COULD actually upload/download the object here, if we feel
+    //       like wasting time for the user.
+    return -1;
+  }
+
+  newname = strdup(*newname_ptr);
+
+  if (FLAG_ONLY_7BIT_FILENAMES(ptp_usb)) {
+    strip_7bit_from_utf8(newname);
+  }
+
+  if (ptp_operation_issupported(params, PTP_OC_MTP_SetObjPropList) &&
+      !FLAG_BROKEN_SET_OBJECT_PROPLIST(ptp_usb)) {
+    MTPProperties *props = NULL;
+    MTPProperties *prop = NULL;
+    int nrofprops = 0;
+
+    prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+    prop->ObjectHandle = object_id;
+    prop->property = PTP_OPC_ObjectFileName;
+    prop->datatype = PTP_DTC_STR;
+    prop->propval.str = newname;
+
+    ret = ptp_mtp_setobjectproplist(params, props, nrofprops);
+
+    ptp_destroy_object_prop_list(props, nrofprops);
+
+    if (ret != PTP_RC_OK) {
+        add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "set_object_filename(): "
+              " could not set object property list.");
+        ptp_free_objectpropdesc(&opd);
+        return -1;
+    }
+  } else if (ptp_operation_issupported(params, PTP_OC_MTP_SetObjectPropValue)) {
+    ret = set_object_string(device, object_id, PTP_OPC_ObjectFileName, newname);
+    if (ret != 0) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "set_object_filename(): "
+              " could not set object filename.");
+      ptp_free_objectpropdesc(&opd);
+      return -1;
+    }
+  } else {
+    free(newname);
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "set_object_filename(): "
+              " your device doesn't seem to support any known way of setting metadata.");
+    ptp_free_objectpropdesc(&opd);
+    return -1;
+  }
+
+  ptp_free_objectpropdesc(&opd);
+
+  // update cached object properties if metadata cache exists
+  update_metadata_cache(device, object_id);
+
+  return 0;
+}
+
+/**
+ * This function renames a single file.
+ * This simply means that the PTP_OPC_ObjectFileName property
+ * is updated, if this is supported by the device.
+ *
+ * @param device a pointer to the device that contains the file.
+ * @param file the file metadata of the file to rename.
+ *        On success, the filename member is updated. Be aware, that
+ *        this name can be different than newname depending of device restrictions.
+ * @param newname the new filename for this object.
+ * @return 0 on success, any other value means failure.
+ */
+int LIBMTP_Set_File_Name(LIBMTP_mtpdevice_t *device,
+                   LIBMTP_file_t *file, const char *newname)
+{
+  int         ret;
+
+  ret = set_object_filename(device, file->item_id,
+			    map_libmtp_type_to_ptp_type(file->filetype),
+			    &newname);
+
+  if (ret != 0) {
+    return ret;
+  }
+
+  free(file->filename);
+  file->filename = strdup(newname);
+  return ret;
+}
+
+/**
+ * This function renames a single folder.
+ * This simply means that the PTP_OPC_ObjectFileName property
+ * is updated, if this is supported by the device.
+ *
+ * @param device a pointer to the device that contains the file.
+ * @param folder the folder metadata of the folder to rename.
+ *        On success, the name member is updated. Be aware, that
+ *        this name can be different than newname depending of device restrictions.
+ * @param newname the new name for this object.
+ * @return 0 on success, any other value means failure.
+ */
+int LIBMTP_Set_Folder_Name(LIBMTP_mtpdevice_t *device,
+                   LIBMTP_folder_t *folder, const char* newname)
+{
+  int ret;
+
+  ret = set_object_filename(device, folder->folder_id,
+			    PTP_OFC_Association,
+			    &newname);
+
+  if (ret != 0) {
+    return ret;
+    }
+
+  free(folder->name);
+  folder->name = strdup(newname);
+  return ret;
+}
+
+/**
+ * This function renames a single track.
+ * This simply means that the PTP_OPC_ObjectFileName property
+ * is updated, if this is supported by the device.
+ *
+ * @param device a pointer to the device that contains the file.
+ * @param track the track metadata of the track to rename.
+ *        On success, the filename member is updated. Be aware, that
+ *        this name can be different than newname depending of device restrictions.
+ * @param newname the new filename for this object.
+ * @return 0 on success, any other value means failure.
+ */
+int LIBMTP_Set_Track_Name(LIBMTP_mtpdevice_t *device,
+                   LIBMTP_track_t *track, const char* newname)
+{
+  int         ret;
+
+  ret = set_object_filename(device, track->item_id,
+			    map_libmtp_type_to_ptp_type(track->filetype),
+			    &newname);
+
+  if (ret != 0) {
+    return ret;
+  }
+
+  free(track->filename);
+  track->filename = strdup(newname);
+  return ret;
+}
+
+/**
+ * This function renames a single playlist object file holder.
+ * This simply means that the <code>PTP_OPC_ObjectFileName</code>
+ * property is updated, if this is supported by the device.
+ * The playlist filename should nominally end with an extension
+ * like ".pla".
+ *
+ * NOTE: if you want to change the metadata the device display
+ * about a playlist you must <i>not</i> use this function,
+ * use <code>LIBMTP_Update_Playlist()</code> instead!
+ *
+ * @param device a pointer to the device that contains the file.
+ * @param playlist the playlist metadata of the playlist to rename.
+ *        On success, the name member is updated. Be aware, that
+ *        this name can be different than newname depending of device restrictions.
+ * @param newname the new name for this object.
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Update_Playlist()
+ */
+int LIBMTP_Set_Playlist_Name(LIBMTP_mtpdevice_t *device,
+                   LIBMTP_playlist_t *playlist, const char* newname)
+{
+  int ret;
+
+  ret = set_object_filename(device, playlist->playlist_id,
+			    PTP_OFC_MTP_AbstractAudioVideoPlaylist,
+			    &newname);
+
+  if (ret != 0) {
+    return ret;
+  }
+
+  free(playlist->name);
+  playlist->name = strdup(newname);
+  return ret;
+}
+
+/**
+ * This function renames a single album.
+ * This simply means that the <code>PTP_OPC_ObjectFileName</code>
+ * property is updated, if this is supported by the device.
+ * The album filename should nominally end with an extension
+ * like ".alb".
+ *
+ * NOTE: if you want to change the metadata the device display
+ * about a playlist you must <i>not</i> use this function,
+ * use <code>LIBMTP_Update_Album()</code> instead!
+ *
+ * @param device a pointer to the device that contains the file.
+ * @param album the album metadata of the album to rename.
+ *        On success, the name member is updated. Be aware, that
+ *        this name can be different than newname depending of device restrictions.
+ * @param newname the new name for this object.
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Update_Album()
+ */
+int LIBMTP_Set_Album_Name(LIBMTP_mtpdevice_t *device,
+                   LIBMTP_album_t *album, const char* newname)
+{
+  int ret;
+
+  ret = set_object_filename(device, album->album_id,
+			    PTP_OFC_MTP_AbstractAudioAlbum,
+			    &newname);
+
+  if (ret != 0) {
+    return ret;
+  }
+
+  free(album->name);
+  album->name = strdup(newname);
+  return ret;
+}
+
+/**
+ * THIS FUNCTION IS DEPRECATED. PLEASE UPDATE YOUR CODE IN ORDER
+ * NOT TO USE IT.
+ *
+ * @see LIBMTP_Set_File_Name()
+ * @see LIBMTP_Set_Track_Name()
+ * @see LIBMTP_Set_Folder_Name()
+ * @see LIBMTP_Set_Playlist_Name()
+ * @see LIBMTP_Set_Album_Name()
+ */
+int LIBMTP_Set_Object_Filename(LIBMTP_mtpdevice_t *device,
+                   uint32_t object_id, char* newname)
+{
+  int             ret;
+  LIBMTP_file_t   *file;
+
+  file = LIBMTP_Get_Filemetadata(device, object_id);
+
+  if (file == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Set_Object_Filename(): "
+			    "could not get file metadata for target object.");
+    return -1;
+  }
+
+  ret = set_object_filename(device, object_id, map_libmtp_type_to_ptp_type(file->filetype), (const char **) &newname);
+
+  free(file);
+
+  return ret;
+}
+
+/**
+ * Helper function. This indicates if a track exists on the device
+ * @param device a pointer to the device to get the track from.
+ * @param id the track ID of the track to retrieve.
+ * @return TRUE (!=0) if the track exists, FALSE (0) if not
+ */
+int LIBMTP_Track_Exists(LIBMTP_mtpdevice_t *device,
+           uint32_t const id)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint16_t ret;
+  PTPObject *ob;
+
+  ptp_lock_cache(params, 1);
+  ret = ptp_object_want (params, id, 0, &ob);
+  ptp_unlock_cache(params);
+  if (ret == PTP_RC_OK)
+      return -1;
+  return 0;
+}
+
+/**
+ * This creates a new folder structure and allocates memory
+ * for it. Notice that if you add strings to this structure they
+ * will be freed by the corresponding <code>LIBMTP_folder_track_t</code>
+ * operation later, so be careful of using strdup() when assigning
+ * strings, e.g.:
+ *
+ * @return a pointer to the newly allocated folder structure.
+ * @see LIBMTP_destroy_folder_t()
+ */
+LIBMTP_folder_t *LIBMTP_new_folder_t(void)
+{
+  LIBMTP_folder_t *new = (LIBMTP_folder_t *) malloc(sizeof(LIBMTP_folder_t));
+  if (new == NULL) {
+    return NULL;
+  }
+  new->folder_id = 0;
+  new->parent_id = 0;
+  new->storage_id = 0;
+  new->name = NULL;
+  new->sibling = NULL;
+  new->child = NULL;
+  return new;
+}
+
+/**
+ * This recursively deletes the memory for a folder structure.
+ * This shall typically be called on a top-level folder list to
+ * detsroy the entire folder tree.
+ *
+ * @param folder folder structure to destroy
+ * @see LIBMTP_new_folder_t()
+ */
+void LIBMTP_destroy_folder_t(LIBMTP_folder_t *folder)
+{
+
+  if(folder == NULL) {
+     return;
+  }
+
+  //Destroy from the bottom up
+  if(folder->child != NULL) {
+     LIBMTP_destroy_folder_t(folder->child);
+  }
+
+  if(folder->sibling != NULL) {
+    LIBMTP_destroy_folder_t(folder->sibling);
+  }
+
+  if(folder->name != NULL) {
+    free(folder->name);
+  }
+
+  free(folder);
+}
+
+/**
+ * Helper function. Returns a folder structure for a
+ * specified id.
+ *
+ * @param folderlist list of folders to search
+ * @id id of folder to look for
+ * @return a folder or NULL if not found
+ */
+LIBMTP_folder_t *LIBMTP_Find_Folder(LIBMTP_folder_t *folderlist, uint32_t id)
+{
+  LIBMTP_folder_t *ret = NULL;
+
+  if(folderlist == NULL) {
+    return NULL;
+  }
+
+  if(folderlist->folder_id == id) {
+    return folderlist;
+  }
+
+  if(folderlist->sibling) {
+    ret = LIBMTP_Find_Folder(folderlist->sibling, id);
+  }
+
+  if(folderlist->child && ret == NULL) {
+    ret = LIBMTP_Find_Folder(folderlist->child, id);
+  }
+
+  return ret;
+}
+
+/**
+ * Function used to recursively get subfolders from params.
+ */
+static LIBMTP_folder_t *get_subfolders_for_folder(LIBMTP_folder_t *list, uint32_t parent)
+{
+  LIBMTP_folder_t *retfolders = NULL;
+  LIBMTP_folder_t *children, *iter, *curr;
+
+  iter = list->sibling;
+  while(iter != list) {
+    if (iter->parent_id != parent) {
+      iter = iter->sibling;
+      continue;
+    }
+
+    /* We know that iter is a child of 'parent', therefore we can safely
+     * hold on to 'iter' locally since no one else will steal it
+     * from the 'list' as we recurse. */
+    children = get_subfolders_for_folder(list, iter->folder_id);
+
+    curr = iter;
+    iter = iter->sibling;
+
+    // Remove curr from the list.
+    curr->child->sibling = curr->sibling;
+    curr->sibling->child = curr->child;
+
+    // Attach the children to curr.
+    curr->child = children;
+
+    // Put this folder into the list of siblings.
+    curr->sibling = retfolders;
+    retfolders = curr;
+  }
+
+  return retfolders;
+}
+
+/**
+ * This returns a list of all folders available
+ * on the current MTP device.
+ *
+ * @param device a pointer to the device to get the folder listing for.
+ * @param storage a storage ID to get the folder list from
+ * @return a list of folders
+ */
+ LIBMTP_folder_t *LIBMTP_Get_Folder_List_For_Storage(LIBMTP_mtpdevice_t *device,
+						    uint32_t const storage)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  LIBMTP_folder_t head, *rv;
+  int i;
+
+  lock_cache_for_listing(device, NULL, NULL);
+
+  /*
+   * This creates a temporary list of the folders, this is in a
+   * reverse order and uses the Folder pointers that are already
+   * in the Folder structure. From this we can then build up the
+   * folder hierarchy with only looking at this temporary list,
+   * and removing the folders from this temporary list as we go.
+   * This significantly reduces the number of operations that we
+   * have to do in building the folder hierarchy. Also since the
+   * temp list is in reverse order, when we prepend to the sibling
+   * list things are in the same order as they were originally
+   * in the handle list.
+   */
+  head.sibling = &head;
+  head.child = &head;
+  for (i = 0; i < params->nrofobjects; i++) {
+    LIBMTP_folder_t *folder;
+    PTPObject *ob;
+
+    ob = &params->objects[i];
+    if (ob->oi.ObjectFormat != PTP_OFC_Association) {
+      continue;
+    }
+
+    if (storage != PTP_GOH_ALL_STORAGE && storage != ob->oi.StorageID) {
+      continue;
+    }
+
+    /*
+     * Do we know how to handle these? They are part
+     * of the MTP 1.0 specification paragraph 3.6.4.
+     * For AssociationDesc 0x00000001U ptp_mtp_getobjectreferences()
+     * should be called on these to get the contained objects, but
+     * we basically don't care. Hopefully parent_id is maintained for all
+     * children, because we rely on that instead.
+     */
+    if (ob->oi.AssociationDesc != 0x00000000U) {
+      LIBMTP_INFO("MTP extended association type 0x%08x encountered\n", ob->oi.AssociationDesc);
+    }
+
+    // Create a folder struct...
+    folder = LIBMTP_new_folder_t();
+    if (folder == NULL) {
+      // malloc failure or so.
+      ptp_unlock_cache(params);
+      return NULL;
+    }
+    folder->folder_id = ob->oid;
+    folder->parent_id = ob->oi.ParentObject;
+    folder->storage_id = ob->oi.StorageID;
+    folder->name = (ob->oi.Filename) ? (char *)strdup(ob->oi.Filename) : NULL;
+
+    // pretend sibling says next, and child says prev.
+    folder->sibling = head.sibling;
+    folder->child = &head;
+    head.sibling->child = folder;
+    head.sibling = folder;
+  }
+  ptp_unlock_cache(params);
+
+  // We begin at the given root folder and get them all recursively
+  rv = get_subfolders_for_folder(&head, 0x00000000U);
+
+  // Some buggy devices may have some files in the "root folder"
+  // 0xffffffff so if 0x00000000 didn't return any folders,
+  // look for children of the root 0xffffffffU
+  if (rv == NULL) {
+    rv = get_subfolders_for_folder(&head, 0xffffffffU);
+    if (rv != NULL)
+      LIBMTP_ERROR("Device have files in \"root folder\" 0xffffffffU - "
+		   "this is a firmware bug (but continuing)\n");
+  }
+
+  // The temp list should be empty. Clean up any orphans just in case.
+  while(head.sibling != &head) {
+    LIBMTP_folder_t *curr = head.sibling;
+
+    LIBMTP_INFO("Orphan folder with ID: 0x%08x name: \"%s\" encountered.\n",
+	   curr->folder_id,
+	   curr->name);
+    curr->sibling->child = curr->child;
+    curr->child->sibling = curr->sibling;
+    curr->child = NULL;
+    curr->sibling = NULL;
+    LIBMTP_destroy_folder_t(curr);
+  }
+
+  return rv;
+}
+
+/**
+ * This returns a list of all folders available
+ * on the current MTP device.
+ *
+ * @param device a pointer to the device to get the folder listing for.
+ * @return a list of folders
+ */
+LIBMTP_folder_t *LIBMTP_Get_Folder_List(LIBMTP_mtpdevice_t *device)
+{
+  return LIBMTP_Get_Folder_List_For_Storage(device, PTP_GOH_ALL_STORAGE);
+}
+
+/**
+ * This create a folder on the current MTP device. The PTP name
+ * for a folder is "association". The PTP/MTP devices does not
+ * have an internal "folder" concept really, it contains a flat
+ * list of all files and some file are "associations" that other
+ * files and folders may refer to as its "parent".
+ *
+ * @param device a pointer to the device to create the folder on.
+ * @param name the name of the new folder. Note this can be modified
+ *        if the device does not support all the characters in the
+ *        name.
+ * @param parent_id id of parent folder to add the new folder to,
+ *        or 0 to put it in the root directory.
+ * @param storage_id id of the storage to add this new folder to.
+ *        notice that you cannot mismatch storage id and parent id:
+ *        they must both be on the same storage! Pass in 0 if you
+ *        want to create this folder on the default storage.
+ * @return id to new folder or 0 if an error occured
+ */
+uint32_t LIBMTP_Create_Folder(LIBMTP_mtpdevice_t *device, char *name,
+			      uint32_t parent_id, uint32_t storage_id)
+{
+  uint32_t new_id;
+
+  new_id = create_folder(device, name, parent_id, storage_id);
+  if (new_id != 0)
+    add_object_to_cache(device, new_id);
+  return new_id;
+}
+
+/**
+ * Creates a folder like <code>LIBMTP_Create_Folder()</code>, but
+ * leaves adding it to the cache to the caller.
+ */
+static uint32_t create_folder(LIBMTP_mtpdevice_t *device, char *name,
+			      uint32_t parent_id, uint32_t storage_id)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  uint32_t parenthandle = 0;
+  uint32_t store;
+  PTPObjectInfo new_folder;
+  uint16_t ret;
+  uint32_t new_id = 0;
+
+  if (storage_id == 0) {
+    // I'm just guessing that a folder may require 512 bytes
+    store = get_suggested_storage_id(device, 512, parent_id);
+  } else {
+    store = storage_id;
+  }
+  parenthandle = parent_id;
+
+  memset(&new_folder, 0, sizeof(new_folder));
+  new_folder.Filename = name;
+  if (FLAG_ONLY_7BIT_FILENAMES(ptp_usb)) {
+    strip_7bit_from_utf8(new_folder.Filename);
+  }
+  new_folder.ObjectCompressedSize = 0;
+  new_folder.ObjectFormat = PTP_OFC_Association;
+  new_folder.ProtectionStatus = PTP_PS_NoProtection;
+  new_folder.AssociationType = PTP_AT_GenericFolder;
+  new_folder.ParentObject = parent_id;
+  new_folder.StorageID = store;
+
+  // Create the object
+  if (!(params->device_flags & DEVICE_FLAG_BROKEN_SEND_OBJECT_PROPLIST) &&
+	ptp_operation_issupported(params,PTP_OC_MTP_SendObjectPropList)) {
+	MTPProperties *props = (MTPProperties*)calloc(2,sizeof(MTPProperties));
+
+	props[0].property = PTP_OPC_ObjectFileName;
+	props[0].datatype = PTP_DTC_STR;
+	props[0].propval.str = name;
+
+	props[1].property = PTP_OPC_Name;
+	props[1].datatype = PTP_DTC_STR;
+	props[1].propval.str = name;
+
+	ret = ptp_mtp_sendobjectproplist(params, &store, &parenthandle, &new_id, PTP_OFC_Association,
+			0, props, 1);
+	free(props);
+  } else {
+	ret = ptp_sendobjectinfo(params, &store, &parenthandle, &new_id, &new_folder);
+  }
+
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Create_Folder: Could not send object info.");
+    if (ret == PTP_RC_AccessDenied) {
+      add_ptp_error_to_errorstack(device, ret, "ACCESS DENIED.");
+    }
+    return 0;
+  }
+  // NOTE: don't destroy the new_folder objectinfo, because it is statically referencing
+  // several strings.
+
+  return new_id;
+}
+
+/*
+ * States of a local directory mirrored by LIBMTP_Upload_Tree().
+ */
+#define TREE_DIR_EXISTS 0 /* The folder was on the device already */
+#define TREE_DIR_NEW    1 /* The folder was created, so it is empty */
+#define TREE_DIR_FAILED 2 /* No folder, skipped along with all below it */
+
+/*
+ * Name prefix a replacement file is sent under by LIBMTP_Upload_Tree()
+ * until the file it replaces is deleted.
+ */
+#define TREE_NEW_PREFIX ".libmtp-new-"
+
+/*
+ * A local directory mirrored by LIBMTP_Upload_Tree().
+ */
+typedef struct tree_dir_struct {
+  char *path; /**< Local path of the directory */
+  char const *name; /**< Last component of the path */
+  uint32_t parent; /**< Index of the parent directory in the table */
+  uint32_t folder_id; /**< The folder on the device */
+  int state; /**< One of TREE_DIR_* */
+  uint32_t nrofnew; /**< Objects created in the folder */
+  LIBMTP_file_t *listing; /**< Objects in the folder, once listed */
+  int listed; /**< 1 once the folder is listed, -1 if that failed */
+} tree_dir_t;
+
+/*
+ * A local file mirrored by LIBMTP_Upload_Tree().
+ */
+typedef struct tree_file_struct {
+  char *path; /**< Local path of the file */
+  LIBMTP_file_t *file; /**< Metadata to send the file with */
+  uint32_t dir; /**< Index of the directory in the table */
+  uint32_t replaces; /**< The object replaced by the file, or 0 */
+} tree_file_t;
+
+/*
+ * A file fetched by LIBMTP_Download_Tree().
+ */
+typedef struct tree_get_struct {
+  uint32_t id; /**< The object */
+  char *path; /**< Local path of the file */
+  uint64_t filesize; /**< Size on the device */
+  time_t modificationdate; /**< Modification date on the device */
+} tree_get_t;
+
+/*
+ * All files fetched by LIBMTP_Download_Tree(), sorted by object.
+ */
+typedef struct tree_gets_struct {
+  tree_get_t *gets; /**< The files */
+  uint32_t nrofgets; /**< Number of files */
+} tree_gets_t;
+
+/**
+ * Makes room for one more entry in a growing array.
+ * @param array the array.
+ * @param alloced the number of entries allocated.
+ * @param used the number of entries in use.
+ * @param size the size of an entry.
+ * @return 0 on success, -1 if out of memory.
+ */
+static int tree_grow(void **array, uint32_t *alloced, uint32_t const used,
+		     size_t const size)
+{
+  void *grown;
+  uint32_t n;
+
+  if (used < *alloced)
+    return 0;
+  n = *alloced ? *alloced * 2 : 64;
+  grown = realloc(*array, n * size);
+  if (grown == NULL)
+    return -1;
+  *array = grown;
+  *alloced = n;
+  return 0;
+}
+
+/**
+ * Joins a directory and a name into a newly allocated path.
+ */
+static char *tree_join(char const * const dir, char const * const name)
+{
+  char *path = malloc(strlen(dir) + strlen(name) + 2);
+
+  if (path != NULL)
+    sprintf(path, "%s/%s", dir, name);
+  return path;
+}
+
+/**
+ * Creates a local directory unless it is already there.
+ * @return 0 if the directory is there, -1 otherwise.
+ */
+static int tree_mkdir(char const * const path)
+{
+  struct stat st;
+
+#if defined(__WIN32__) || defined(_MSC_VER)
+  if (mkdir(path) == 0)
+#else
+  if (mkdir(path, S_IRWXU|S_IRWXG|S_IRWXO) == 0)
+#endif
+    return 0;
+  if (stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+    return 0;
+  return -1;
+}
+
+/**
+ * Lists the names in a local directory, leaving out "." and "..".
+ * @param path the directory.
+ * @param names the names are returned here, the array and the names
+ *        must be freed by the caller.
+ * @param nrofnames the number of names is returned here.
+ * @return 0 on success, -1 if the directory could not be read and
+ *         -2 if out of memory.
+ */
+static int tree_read_dir(char const * const path, char ***names,
+			 uint32_t *nrofnames)
+{
+  uint32_t alloced = 0;
+  int retval = 0;
+#ifdef _MSC_VER
+  struct _finddata_t found;
+  intptr_t dir;
+  char *pattern = tree_join(path, "*");
+
+  *names = NULL;
+  *nrofnames = 0;
+  if (pattern == NULL)
+    return -2;
+  dir = _findfirst(pattern, &found);
+  free(pattern);
+  if (dir == -1)
+    return -1;
+  do {
+    char const *name = found.name;
+#else
+  DIR *dir;
+  struct dirent *dent;
+
+  *names = NULL;
+  *nrofnames = 0;
+  dir = opendir(path);
+  if (dir == NULL)
+    return -1;
+  while ((dent = readdir(dir)) != NULL) {
+    char const *name = dent->d_name;
+#endif
+
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+      continue;
+    if (tree_grow((void **) names, &alloced, *nrofnames, sizeof(char *)) != 0 ||
+	((*names)[*nrofnames] = strdup(name)) == NULL) {
+      retval = -2;
+      break;
+    }
+    (*nrofnames)++;
+#ifdef _MSC_VER
+  } while (_findnext(dir, &found) == 0);
+  _findclose(dir);
+#else
+  }
+  closedir(dir);
+#endif
+  return retval;
+}
+
+/**
+ * Lists the objects in a folder on the device. On a cached device this
+ * goes through the indexes kept over the object cache, otherwise the
+ * device is asked.
+ * @param device a pointer to the device.
+ * @param storage the storage of the folder, 0 for any storage.
+ * @param parent the folder, 0 for the root folder.
+ * @param files the objects are returned here as a list to be destroyed
+ *        by the caller.
+ * @return 0 on success, -1 if the folder could not be listed.
+ */
+static int tree_list_folder(LIBMTP_mtpdevice_t *device,
+			    uint32_t const storage,
+			    uint32_t const parent,
+			    LIBMTP_file_t **files)
+{
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  LIBMTP_query_t query;
+  LIBMTP_file_t *last = NULL;
+  uint32_t *handles = NULL;
+  uint32_t count = 0;
+  uint32_t i;
+
+  *files = NULL;
+  if (!device->cached) {
+    // An empty list would make every object look missing
+    if (FLAG_BROKEN_GET_OBJECT_PROPVAL(ptp_usb)) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "tree_list_folder(): "
+			      "folders cannot be listed on this device when it is opened uncached.");
+      return -1;
+    }
+    *files = LIBMTP_Get_Files_And_Folders(device, storage,
+					  parent == 0 ? PTP_GOH_ROOT_PARENT : parent);
+    return 0;
+  }
+
+  memset(&query, 0, sizeof(query));
+  query.match = LIBMTP_QUERY_MATCH_PARENT;
+  if (storage != 0) {
+    query.match |= LIBMTP_QUERY_MATCH_STORAGE;
+    query.storage_id = storage;
+  }
+  query.parent_id = parent;
+  if (LIBMTP_Query_Objects(device, &query, &handles, &count) != 0)
+    return -1;
+  for (i = 0; i < count; i++) {
+    LIBMTP_file_t *file = LIBMTP_Get_Filemetadata(device, handles[i]);
+
+    if (file == NULL)
+      continue;
+    if (last == NULL)
+      *files = file;
+    else
+      last->next = file;
+    last = file;
+  }
+  free(handles);
+  return 0;
+}
+
+/**
+ * Looks up an object by name in the folder of a local directory,
+ * listing the folder the first time.
+ * @param device a pointer to the device.
+ * @param storage the storage of the folder.
+ * @param dir the directory.
+ * @param name the exact name of the object.
+ * @param found the object is returned here, or NULL if there is no
+ *        such object. It belongs to the listing of the directory.
+ * @return 0 on success, -1 if the folder could not be listed.
+ */
+static int tree_find(LIBMTP_mtpdevice_t *device,
+		     uint32_t const storage,
+		     tree_dir_t *dir,
+		     char const * const name,
+		     LIBMTP_file_t **found)
+{
+  LIBMTP_file_t *file;
+
+  *found = NULL;
+  if (dir->listed == 0)
+    dir->listed = tree_list_folder(device, storage, dir->folder_id,
+				   &dir->listing) == 0 ? 1 : -1;
+  if (dir->listed < 0)
+    return -1;
+  for (file = dir->listing; file != NULL; file = file->next) {
+    if (file->filename != NULL && strcmp(file->filename, name) == 0) {
+      *found = file;
+      break;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Destroys a list of file metadata.
+ */
+static void tree_destroy_files(LIBMTP_file_t *files)
+{
+  while (files != NULL) {
+    LIBMTP_file_t *next = files->next;
+
+    LIBMTP_destroy_file_t(files);
+    files = next;
+  }
+}
+
+/**
+ * This copies a local directory tree to a folder on the device, e.g.
+ * to put a whole music collection on a player. The contents of the
+ * local directory end up in the folder, folders that already exist on
+ * the device are reused and missing ones are created.
+ *
+ * A file that is already on the device with the same size, and that
+ * was put there after the local file was last modified, is skipped.
+ * Other files with the same name are replaced: the new file is sent
+ * under a temporary name first, and the old one is only deleted once
+ * the new one is on the device, which then gets the real name. The
+ * names are looked up in the indexes kept over the object cache, so
+ * the whole device is listed first if that has not been done yet. On
+ * an uncached device each folder is listed as it is needed instead.
+ *
+ * All files are sent in one batch with
+ * <code>LIBMTP_Send_Files()</code>, and the object cache is updated
+ * once at the end. Symbolic links and special files are skipped.
+ *
+ * @param device a pointer to the device to copy the tree to.
+ * @param path the local directory to copy.
+ * @param parent_id the folder to copy the tree into, or 0 for the
+ *        root folder.
+ * @param storage_id the storage of that folder, or 0 for the
+ *        primary storage.
+ * @param callback a progress indicator function or NULL to ignore.
+ *        It is called with the number of bytes sent so far and the
+ *        total for all files that are sent.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function in order to
+ *             pass along some user defined data to the progress
+ *             updates. If not used, set this to NULL.
+ * @return 0 if the whole tree was copied, any other value means that
+ *           at least one file or folder was not.
+ * @see LIBMTP_Download_Tree()
+ */
+int LIBMTP_Upload_Tree(LIBMTP_mtpdevice_t *device,
+		       char const * const path,
+		       uint32_t const parent_id,
+		       uint32_t const storage_id,
+		       LIBMTP_progressfunc_t const callback,
+		       void const * const data)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  tree_dir_t *dirs = NULL;
+  uint32_t nrofdirs = 0;
+  uint32_t dirsalloced = 0;
+  tree_file_t *files = NULL;
+  uint32_t nroffiles = 0;
+  uint32_t filesalloced = 0;
+  char const **sendpaths = NULL;
+  LIBMTP_file_t **sendfiles = NULL;
+  uint32_t nrofsends = 0;
+  uint32_t store;
+  int retval = 0;
+  uint32_t d;
+  uint32_t i;
+
+  if (path == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Upload_Tree(): Bad arguments, path was NULL.");
+    return -1;
+  }
+  if (storage_id != 0)
+    store = storage_id;
+  else
+    store = get_suggested_storage_id(device, 0, parent_id);
+
+  if (tree_grow((void **) &dirs, &dirsalloced, nrofdirs, sizeof(tree_dir_t)) != 0 ||
+      (dirs[0].path = strdup(path)) == NULL)
+    goto oom;
+  dirs[0].name = dirs[0].path;
+  dirs[0].parent = 0;
+  dirs[0].folder_id = parent_id;
+  dirs[0].state = TREE_DIR_EXISTS;
+  dirs[0].nrofnew = 0;
+  dirs[0].listing = NULL;
+  dirs[0].listed = 0;
+  nrofdirs = 1;
+
+  // Walk the local tree, the table of directories grows as we go
+  for (d = 0; d < nrofdirs; d++) {
+    char **names;
+    uint32_t nrofnames;
+    uint32_t n;
+    int ret;
+
+    ret = tree_read_dir(dirs[d].path, &names, &nrofnames);
+    if (ret == -1) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Upload_Tree(): Could not read directory.");
+      retval = -1;
+    }
+    for (n = 0; n < nrofnames && ret != -2; n++) {
+      struct stat st;
+      char *full = tree_join(dirs[d].path, names[n]);
+
+      if (full == NULL) {
+	ret = -2;
+	break;
+      }
+#if defined(__WIN32__) || defined(_MSC_VER)
+      if (stat(full, &st) != 0) {
+#else
+      if (lstat(full, &st) != 0) {
+#endif
+	free(full);
+	continue;
+      }
+      if (S_ISDIR(st.st_mode)) {
+	if (tree_grow((void **) &dirs, &dirsalloced, nrofdirs, sizeof(tree_dir_t)) != 0) {
+	  free(full);
+	  ret = -2;
+	  break;
+	}
+	dirs[nrofdirs].path = full;
+	dirs[nrofdirs].name = full + strlen(dirs[d].path) + 1;
+	dirs[nrofdirs].parent = d;
+	dirs[nrofdirs].folder_id = 0;
+	dirs[nrofdirs].state = TREE_DIR_EXISTS;
+	dirs[nrofdirs].nrofnew = 0;
+	dirs[nrofdirs].listing = NULL;
+	dirs[nrofdirs].listed = 0;
+	nrofdirs++;
+      } else if (S_ISREG(st.st_mode)) {
+	LIBMTP_file_t *file;
+
+	if (tree_grow((void **) &files, &filesalloced, nroffiles, sizeof(tree_file_t)) != 0 ||
+	    (file = LIBMTP_new_file_t()) == NULL) {
+	  free(full);
+	  ret = -2;
+	  break;
+	}
+	file->filesize = st.st_size;
+	file->modificationdate = st.st_mtime;
+	file->filetype = LIBMTP_FILETYPE_UNKNOWN;
+	files[nroffiles].path = full;
+	files[nroffiles].file = file;
+	files[nroffiles].dir = d;
+	files[nroffiles].replaces = 0;
+	nroffiles++;
+      } else {
+	// Links and special files
+	free(full);
+      }
+    }
+    for (n = 0; n < nrofnames; n++)
+      free(names[n]);
+    free(names);
+    if (ret == -2)
+      goto oom;
+  }
+
+  // Then the folders, parents come before their children in the table
+  for (d = 1; d < nrofdirs; d++) {
+    tree_dir_t *parent = &dirs[dirs[d].parent];
+    LIBMTP_file_t *existing = NULL;
+    char *name;
+
+    if (parent->state == TREE_DIR_FAILED) {
+      dirs[d].state = TREE_DIR_FAILED;
+      continue;
+    }
+    // Without a listing an existing folder could be created twice
+    if (parent->state == TREE_DIR_EXISTS &&
+	tree_find(device, store, parent, dirs[d].name, &existing) != 0) {
+      dirs[d].state = TREE_DIR_FAILED;
+      retval = -1;
+      continue;
+    }
+    if (existing != NULL) {
+      if (existing->filetype == LIBMTP_FILETYPE_FOLDER) {
+	dirs[d].folder_id = existing->item_id;
+      } else {
+	add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Upload_Tree(): A file is in the way of a folder.");
+	dirs[d].state = TREE_DIR_FAILED;
+	retval = -1;
+      }
+      continue;
+    }
+    // The name may be changed to suit the device
+    name = strdup(dirs[d].name);
+    if (name == NULL)
+      goto oom;
+    dirs[d].folder_id = create_folder(device, name, parent->folder_id, store);
+    free(name);
+    if (dirs[d].folder_id == 0) {
+      dirs[d].state = TREE_DIR_FAILED;
+      retval = -1;
+    } else {
+      dirs[d].state = TREE_DIR_NEW;
+      parent->nrofnew++;
+    }
+  }
+
+  // And last the files that are missing or changed
+  sendpaths = malloc((nroffiles + 1) * sizeof(char const *));
+  sendfiles = malloc((nroffiles + 1) * sizeof(LIBMTP_file_t *));
+  if (sendpaths == NULL || sendfiles == NULL)
+    goto oom;
+  for (i = 0; i < nroffiles; i++) {
+    tree_dir_t *dir = &dirs[files[i].dir];
+    LIBMTP_file_t *file = files[i].file;
+    LIBMTP_file_t *existing = NULL;
+    char const *name = files[i].path + strlen(dir->path) + 1;
+
+    if (dir->state == TREE_DIR_FAILED) {
+      retval = -1;
+      continue;
+    }
+    file->parent_id = dir->folder_id;
+    file->storage_id = store;
+    if (dir->state == TREE_DIR_EXISTS &&
+	tree_find(device, store, dir, name, &existing) != 0) {
+      retval = -1;
+      continue;
+    }
+    if (existing != NULL) {
+      if (existing->filetype == LIBMTP_FILETYPE_FOLDER) {
+	add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Upload_Tree(): A folder is in the way of a file.");
+	retval = -1;
+	continue;
+      }
+      /*
+       * A device without modification dates reports 0, so its files
+       * always look older and are replaced rather than wrongly kept.
+       */
+      if (existing->filesize == file->filesize &&
+	  existing->modificationdate >= file->modificationdate)
+	continue;
+      files[i].replaces = existing->item_id;
+    }
+    // Replacements go beside the old file until they are complete
+    if (files[i].replaces != 0)
+      file->filename = malloc(strlen(TREE_NEW_PREFIX) + strlen(name) + 1);
+    else
+      file->filename = malloc(strlen(name) + 1);
+    if (file->filename == NULL)
+      goto oom;
+    sprintf(file->filename, "%s%s",
+	    files[i].replaces != 0 ? TREE_NEW_PREFIX : "", name);
+    sendpaths[nrofsends] = files[i].path;
+    sendfiles[nrofsends] = file;
+    nrofsends++;
+    dir->nrofnew++;
+  }
+
+  if (nrofsends > 0 &&
+      send_files(device, sendpaths, sendfiles, nrofsends, callback, data, 0) != 0)
+    retval = -1;
+
+  // Only a replacement that made it onto the device retires the old file
+  for (i = 0; i < nroffiles; i++) {
+    char const *name = files[i].path + strlen(dirs[files[i].dir].path) + 1;
+
+    if (files[i].replaces == 0 || files[i].file->item_id == 0)
+      continue;
+    if (LIBMTP_Delete_Object(device, files[i].replaces) != 0 ||
+	LIBMTP_Set_File_Name(device, files[i].file, name) != 0)
+      retval = -1;
+  }
+
+  /*
+   * Update the cache once. A new folder is not in the cache, so
+   * rereading the folder it was created in brings in all below it.
+   */
+  ptp_lock_cache(params, 1);
+  if (device->cached &&
+      ptp_operation_issupported(params,PTP_OC_MTP_GetObjPropList) &&
+      !FLAG_BROKEN_MTPGETOBJPROPLIST(ptp_usb)) {
+    for (d = 0; d < nrofdirs; d++) {
+      if (dirs[d].state == TREE_DIR_EXISTS && dirs[d].nrofnew > 0 &&
+	  refresh_folder(device, store, dirs[d].folder_id, 1) != 0)
+	retval = -1;
+    }
+  } else {
+    for (d = 0; d < nrofdirs; d++) {
+      if (dirs[d].state == TREE_DIR_NEW)
+	add_object_to_cache(device, dirs[d].folder_id);
+    }
+    for (i = 0; i < nrofsends; i++) {
+      if (sendfiles[i]->item_id != 0)
+	add_object_to_cache(device, sendfiles[i]->item_id);
+    }
+  }
+  ptp_unlock_cache(params);
+
+ out:
+  for (d = 0; d < nrofdirs; d++) {
+    free(dirs[d].path);
+    tree_destroy_files(dirs[d].listing);
+  }
+  free(dirs);
+  for (i = 0; i < nroffiles; i++) {
+    free(files[i].path);
+    LIBMTP_destroy_file_t(files[i].file);
+  }
+  free(files);
+  free(sendpaths);
+  free(sendfiles);
+  return retval;
+
+ oom:
+  add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			  "LIBMTP_Upload_Tree(): out of memory.");
+  retval = -1;
+  goto out;
+}
+
+static int compare_tree_gets(const void *a, const void *b)
+{
+  uint32_t x = ((tree_get_t const *) a)->id;
+  uint32_t y = ((tree_get_t const *) b)->id;
+
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Opens the local file an object is fetched to by
+ * <code>LIBMTP_Download_Tree()</code>.
+ */
+static int open_tree_destination(LIBMTP_file_t const * const file,
+				 void const * const data)
+{
+  tree_gets_t const *table = (tree_gets_t const *) data;
+  tree_get_t key;
+  tree_get_t *get;
+
+  key.id = file->item_id;
+  get = bsearch(&key, table->gets, table->nrofgets, sizeof(tree_get_t),
+		compare_tree_gets);
+  if (get == NULL)
+    return -1;
+#ifdef __WIN32__
+#ifdef USE_WINDOWS_IO_H
+  return _open(get->path, O_RDWR|O_CREAT|O_TRUNC|O_BINARY,_S_IREAD);
+#else
+  return open(get->path, O_RDWR|O_CREAT|O_TRUNC|O_BINARY,S_IRWXU);
+#endif
+#else
+  return open(get->path, O_RDWR|O_CREAT|O_TRUNC,S_IRWXU|S_IRGRP);
+#endif
+}
+
+/**
+ * This copies a folder on the device with everything below it to a
+ * local directory, e.g. to back up all pictures and music on a phone.
+ * The contents of the folder end up in the local directory, which is
+ * created if it is not there.
+ *
+ * A local file that has the same size and modification date as the
+ * file on the device is skipped, so copying the same folder again only
+ * fetches what is new or changed. Files fetched in full get the
+ * modification date of the file on the device for this. Files that
+ * have no modification date on the device are always fetched.
+ *
+ * The folders are walked through the indexes kept over the object
+ * cache, so the whole device is listed first if that has not been done
+ * yet. On an uncached device each folder is listed as it is walked
+ * instead. All files are fetched in one batch with
+ * <code>LIBMTP_Get_Files()</code>.
+ *
+ * @param device a pointer to the device to copy the tree from.
+ * @param storage_id the storage of the folder, or 0 for any storage.
+ * @param folder_id the folder to copy, or 0 for the root folder.
+ * @param path the local directory to copy the folder to.
+ * @param callback a progress indicator function or NULL to ignore.
+ *        It is called with the number of bytes retrieved so far and
+ *        the total for all files that are retrieved.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function in order to
+ *             pass along some user defined data to the progress
+ *             updates. If not used, set this to NULL.
+ * @return 0 if the whole tree was copied, any other value means that
+ *           at least one file or folder was not.
+ * @see LIBMTP_Upload_Tree()
+ */
+int LIBMTP_Download_Tree(LIBMTP_mtpdevice_t *device,
+			 uint32_t const storage_id,
+			 uint32_t const folder_id,
+			 char const * const path,
+			 LIBMTP_progressfunc_t const callback,
+			 void const * const data)
+{
+  tree_dir_t *dirs = NULL;
+  uint32_t nrofdirs = 0;
+  uint32_t dirsalloced = 0;
+  tree_gets_t table;
+  uint32_t getsalloced = 0;
+  uint32_t *ids = NULL;
+  uint8_t *fetched = NULL;
+  handle_set_t walked;
+  int retval = 0;
+  uint32_t d;
+  uint32_t i;
+
+  table.gets = NULL;
+  table.nrofgets = 0;
+  memset(&walked, 0, sizeof(walked));
+  if (path == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Download_Tree(): Bad arguments, path was NULL.");
+    return -1;
+  }
+  if (tree_mkdir(path) != 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Download_Tree(): Could not create directory.");
+    return -1;
+  }
+  if (tree_grow((void **) &dirs, &dirsalloced, nrofdirs, sizeof(tree_dir_t)) != 0 ||
+      (dirs[0].path = strdup(path)) == NULL)
+    goto oom;
+  dirs[0].folder_id = folder_id;
+  nrofdirs = 1;
+  if (folder_id != 0 && handle_set_add(&walked, folder_id) != 0)
+    goto oom;
+
+  // Walk the folders on the device, the table grows as we go
+  for (d = 0; d < nrofdirs; d++) {
+    LIBMTP_file_t *listing;
+    LIBMTP_file_t *file;
+
+    if (tree_list_folder(device, storage_id, dirs[d].folder_id, &listing) != 0) {
+      retval = -1;
+      continue;
+    }
+    for (file = listing; file != NULL; file = file->next) {
+      struct stat st;
+      char *full;
+
+      if (!is_local_filename(file->filename)) {
+	add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Download_Tree(): Bad file name on device.");
+	retval = -1;
+	continue;
+      }
+      full = tree_join(dirs[d].path, file->filename);
+      if (full == NULL) {
+	tree_destroy_files(listing);
+	goto oom;
+      }
+      if (file->filetype == LIBMTP_FILETYPE_FOLDER) {
+	// A broken device may list a folder below itself
+	if (file->item_id == 0 || handle_set_contains(&walked, file->item_id)) {
+	  add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Download_Tree(): Folder loop on device.");
+	  free(full);
+	  retval = -1;
+	} else if (tree_mkdir(full) != 0) {
+	  add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Download_Tree(): Could not create directory.");
+	  free(full);
+	  retval = -1;
+	} else if (tree_grow((void **) &dirs, &dirsalloced, nrofdirs, sizeof(tree_dir_t)) != 0 ||
+		   handle_set_add(&walked, file->item_id) != 0) {
+	  free(full);
+	  tree_destroy_files(listing);
+	  goto oom;
+	} else {
+	  dirs[nrofdirs].path = full;
+	  dirs[nrofdirs].folder_id = file->item_id;
+	  nrofdirs++;
+	}
+      } else if (file->modificationdate != 0 &&
+		 stat(full, &st) == 0 &&
+		 (uint64_t) st.st_size == file->filesize &&
+		 st.st_mtime == file->modificationdate) {
+	// Fetched before and unchanged since
+	free(full);
+      } else if (tree_grow((void **) &table.gets, &getsalloced, table.nrofgets,
+			   sizeof(tree_get_t)) != 0) {
+	free(full);
+	tree_destroy_files(listing);
+	goto oom;
+      } else {
+	table.gets[table.nrofgets].id = file->item_id;
+	table.gets[table.nrofgets].path = full;
+	table.gets[table.nrofgets].filesize = file->filesize;
+	table.gets[table.nrofgets].modificationdate = file->modificationdate;
+	table.nrofgets++;
+      }
+    }
+    tree_destroy_files(listing);
+  }
+
+  if (table.nrofgets > 0) {
+    qsort(table.gets, table.nrofgets, sizeof(tree_get_t), compare_tree_gets);
+    ids = malloc(table.nrofgets * sizeof(uint32_t));
+    fetched = calloc(table.nrofgets, sizeof(uint8_t));
+    if (ids == NULL || fetched == NULL)
+      goto oom;
+    for (i = 0; i < table.nrofgets; i++)
+      ids[i] = table.gets[i].id;
+    if (get_files(device, ids, table.nrofgets, NULL, open_tree_destination,
+		  &table, callback, NULL, data, fetched) != 0)
+      retval = -1;
+
+    /*
+     * Stamp the files that arrived in full so that they are skipped
+     * next time, a file cut short keeps its local date and is fetched
+     * again.
+     */
+    for (i = 0; i < table.nrofgets; i++) {
+      struct utimbuf times;
+
+      if (!fetched[i] || table.gets[i].modificationdate == 0)
+	continue;
+      times.actime = table.gets[i].modificationdate;
+      times.modtime = table.gets[i].modificationdate;
+      utime(table.gets[i].path, &times);
+    }
+  }
+
+ out:
+  for (d = 0; d < nrofdirs; d++)
+    free(dirs[d].path);
+  free(dirs);
+  for (i = 0; i < table.nrofgets; i++)
+    free(table.gets[i].path);
+  free(table.gets);
+  free(ids);
+  free(fetched);
+  handle_set_clear(&walked);
+  return retval;
+
+ oom:
+  add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			  "LIBMTP_Download_Tree(): out of memory.");
+  retval = -1;
+  goto out;
+}
+
+/**
+ * This creates a new playlist metadata structure and allocates memory
+ * for it. Notice that if you add strings to this structure they
+ * will be freed by the corresponding <code>LIBMTP_destroy_playlist_t</code>
+ * operation later, so be careful of using strdup() when assigning
+ * strings, e.g.:
+ *
+ * <pre>
+ * LIBMTP_playlist_t *pl = LIBMTP_new_playlist_t();
+ * pl->name = strdup(str);
+ * ....
+ * LIBMTP_destroy_playlist_t(pl);
+ * </pre>
+ *
+ * @return a pointer to the newly allocated metadata structure.
+ * @see LIBMTP_destroy_playlist_t()
+ */
+LIBMTP_playlist_t *LIBMTP_new_playlist_t(void)
+{
+  LIBMTP_playlist_t *new = (LIBMTP_playlist_t *) malloc(sizeof(LIBMTP_playlist_t));
+  if (new == NULL) {
+    return NULL;
+  }
+  new->playlist_id = 0;
+  new->parent_id = 0;
+  new->storage_id = 0;
+  new->name = NULL;
+  new->tracks = NULL;
+  new->no_tracks = 0;
+  new->next = NULL;
+  return new;
+}
+
+/**
+ * This destroys a playlist metadata structure and deallocates the memory
+ * used by it, including any strings. Never use a track metadata
+ * structure again after calling this function on it.
+ * @param playlist the playlist metadata to destroy.
+ * @see LIBMTP_new_playlist_t()
+ */
+void LIBMTP_destroy_playlist_t(LIBMTP_playlist_t *playlist)
+{
+  if (playlist == NULL) {
+    return;
+  }
+  if (playlist->name != NULL)
+    free(playlist->name);
+  if (playlist->tracks != NULL)
+    free(playlist->tracks);
+  free(playlist);
+  return;
+}
+
+/**
+ * This function returns a list of the playlists available on the
+ * device. Typical usage:
+ *
+ * <pre>
+ * </pre>
+ *
+ * @param device a pointer to the device to get the playlist listing from.
+ * @return a playlist list on success, else NULL. If there are no playlists
+ *         on the device, NULL will be returned as well.
+ * @see LIBMTP_Get_Playlist()
+ */
+LIBMTP_playlist_t *LIBMTP_Get_Playlist_List(LIBMTP_mtpdevice_t *device)
+{
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  const int REQ_SPL = FLAG_PLAYLIST_SPL(ptp_usb);
+  PTPParams *params = (PTPParams *) device->params;
+  LIBMTP_playlist_t *retlists = NULL;
+  LIBMTP_playlist_t *curlist = NULL;
+  uint32_t i;
+
+  ptp_lock_cache(params, 1);
+  // Get all the handles if we haven't already done that
+  if (params->nrofobjects == 0) {
+    flush_handles(device);
+  }
+
+  for (i = 0; i < params->nrofobjects; i++) {
+    LIBMTP_playlist_t *pl;
+    PTPObject *ob;
+    uint16_t ret;
+
+    ob = &params->objects[i];
+
+    // Ignore stuff that isn't playlists
+
+    // For Samsung players we must look for the .spl extension explicitly since
+    // playlists are not stored as playlist objects.
+    if ( REQ_SPL && is_spl_playlist(&ob->oi) ) {
+      // Allocate a new playlist type
+      pl = LIBMTP_new_playlist_t();
+      spl_to_playlist_t(device, &ob->oi, ob->oid, pl);
+    }
+    else if ( ob->oi.ObjectFormat != PTP_OFC_MTP_AbstractAudioVideoPlaylist ) {
+      continue;
+    }
+    else {
+      // Allocate a new playlist type
+      pl = LIBMTP_new_playlist_t();
+
+      // Try to look up proper name, else use the oi->Filename field.
+      pl->name = get_string_from_object(device, ob->oid, PTP_OPC_Name);
+      if (pl->name == NULL) {
+	pl->name = strdup(ob->oi.Filename);
+      }
+      pl->playlist_id = ob->oid;
+      pl->parent_id = ob->oi.ParentObject;
+      pl->storage_id = ob->oi.StorageID;
+
+      // Then get the track listing for this playlist
+      ret = ptp_mtp_getobjectreferences(params, pl->playlist_id, &pl->tracks, &pl->no_tracks);
+      if (ret != PTP_RC_OK) {
+        add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Playlist_List(): "
+				    "could not get object references.");
+        pl->tracks = NULL;
+        pl->no_tracks = 0;
+      }
+    }
+
+    // Add playlist to a list that will be returned afterwards.
+    if (retlists == NULL) {
+      retlists = pl;
+      curlist = pl;
+    } else {
+      curlist->next = pl;
+      curlist = pl;
+    }
+
+    // Call callback here if we decide to add that possibility...
+  }
+  ptp_unlock_cache(params);
+  return retlists;
+}
+
+
+/**
+ * This function retrieves an individual playlist from the device.
+ * @param device a pointer to the device to get the playlist from.
+ * @param plid the unique ID of the playlist to retrieve.
+ * @return a valid playlist metadata post or NULL on failure.
+ * @see LIBMTP_Get_Playlist_List()
+ */
+LIBMTP_playlist_t *LIBMTP_Get_Playlist(LIBMTP_mtpdevice_t *device, uint32_t const plid)
+{
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  const int REQ_SPL = FLAG_PLAYLIST_SPL(ptp_usb);
+  PTPParams *params = (PTPParams *) device->params;
+  PTPObject *ob;
+  LIBMTP_playlist_t *pl;
+  uint16_t ret;
+
+  ptp_lock_cache(params, 1);
+  // Get all the handles if we haven't already done that
+  if (params->nrofobjects == 0) {
+    flush_handles(device);
+  }
+
+  ret = ptp_object_want (params, plid, PTPOBJECT_OBJECTINFO_LOADED, &ob);
+  if (ret != PTP_RC_OK) {
+    ptp_unlock_cache(params);
+    return NULL;
+  }
+
+  // For Samsung players we must look for the .spl extension explicitly since
+  // playlists are not stored as playlist objects.
+  if ( REQ_SPL && is_spl_playlist(&ob->oi) ) {
+    // Allocate a new playlist type
+    pl = LIBMTP_new_playlist_t();
+    spl_to_playlist_t(device, &ob->oi, ob->oid, pl);
+    ptp_unlock_cache(params);
+    return pl;
+  }
+
+  // Ignore stuff that isn't playlists
+  else if ( ob->oi.ObjectFormat != PTP_OFC_MTP_AbstractAudioVideoPlaylist ) {
+    ptp_unlock_cache(params);
+    return NULL;
+  }
+
+  // Allocate a new playlist type
+  pl = LIBMTP_new_playlist_t();
+
+  pl->name = get_string_from_object(device, ob->oid, PTP_OPC_Name);
+  if (pl->name == NULL) {
+    pl->name = strdup(ob->oi.Filename);
+  }
+  pl->playlist_id = ob->oid;
+  pl->parent_id = ob->oi.ParentObject;
+  pl->storage_id = ob->oi.StorageID;
+
+  // Then get the track listing for this playlist
+  ret = ptp_mtp_getobjectreferences(params, pl->playlist_id, &pl->tracks, &pl->no_tracks);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Playlist(): Could not get object references.");
+    pl->tracks = NULL;
+    pl->no_tracks = 0;
+  }
+
+  ptp_unlock_cache(params);
+  return pl;
+}
+
+/**
+ * This function creates a new abstract list such as a playlist
+ * or an album.
+ *
+ * @param device a pointer to the device to create the new abstract list
+ *        on.
+ * @param name the name of the new abstract list.
+ * @param artist the artist of the new abstract list or NULL.
+ * @param genre the genre of the new abstract list or NULL.
+ * @param parenthandle the handle of the parent or 0 for no parent
+ *        i.e. the root folder.
+ * @param objectformat the abstract list type to create.
+ * @param suffix the ".foo" (4 characters) suffix to use for the virtual
+ *        "file" created by this operation.
+ * @param newid a pointer to a variable that will hold the new object
+ *        ID if this call is successful.
+ * @param tracks an array of tracks to associate with this list.
+ * @param no_tracks the number of tracks in the list.
+ * @return 0 on success, any other value means failure.
+ */
+static int create_new_abstract_list(LIBMTP_mtpdevice_t *device,
+				    char const * const name,
+				    char const * const artist,
+				    char const * const composer,
+				    char const * const genre,
+				    uint32_t const parenthandle,
+				    uint32_t const storageid,
+				    uint16_t const objectformat,
+				    char const * const suffix,
+				    uint32_t * const newid,
+				    uint32_t const * const tracks,
+				    uint32_t const no_tracks)
+
+{
+  int i;
+  int supported = 0;
+  uint16_t ret;
+  uint16_t *properties = NULL;
+  uint32_t propcnt = 0;
+  uint32_t store;
+  uint32_t localph = parenthandle;
+  uint8_t nonconsumable = 0x00U; /* By default it is consumable */
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  char fname[256];
+  //uint8_t data[2];
+
+  // NULL check
+  if (!name) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): list name was NULL, using default name \"Unknown\"");
+    return -1;
+  }
+
+  if (storageid == 0) {
+    // I'm just guessing that an abstract list may require 512 bytes
+    store = get_suggested_storage_id(device, 512, localph);
+  } else {
+    store = storageid;
+  }
+
+  // Check if we can create an object of this type
+  ptp_lock_info(params);
+  for ( i=0; i < params->deviceinfo.ImageFormats_len; i++ ) {
+    if (params->deviceinfo.ImageFormats[i] == objectformat) {
+      supported = 1;
+      break;
+    }
+  }
+  ptp_unlock_info(params);
+  if (!supported) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): player does not support this abstract type");
+    LIBMTP_ERROR("Unsupported abstract list type: %04x\n", objectformat);
+    return -1;
+  }
+
+  // add the new suffix if it isn't there
+  fname[0] = '\0';
+  if (strlen(name) > strlen(suffix)) {
+    char const * const suff = &name[strlen(name)-strlen(suffix)];
+    if (!strcmp(suff, suffix)) {
+      // Home free.
+      strncpy(fname, name, sizeof(fname));
+    }
+  }
+  // If it didn't end with "<suffix>" then add that here.
+  if (fname[0] == '\0') {
+    strncpy(fname, name, sizeof(fname)-strlen(suffix)-1);
+    strcat(fname, suffix);
+    fname[sizeof(fname)-1] = '\0';
+  }
+
+  if (ptp_operation_issupported(params, PTP_OC_MTP_SendObjectPropList) &&
+      !FLAG_BROKEN_SEND_OBJECT_PROPLIST(ptp_usb)) {
+    MTPProperties *props = NULL;
+    MTPProperties *prop = NULL;
+    int nrofprops = 0;
+
+    *newid = 0x00000000U;
+
+    ret = ptp_mtp_getobjectpropssupported(params, objectformat, &propcnt, &properties);
+
+    for (i=0;i<propcnt;i++) {
+      PTPObjectPropDesc opd;
+
+      ret = ptp_mtp_getobjectpropdesc(params, properties[i], objectformat, &opd);
+      if (ret != PTP_RC_OK) {
+	add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): "
+				"could not get property description.");
+      } else if (opd.GetSet) {
+	switch (properties[i]) {
+	case PTP_OPC_ObjectFileName:
+	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	  prop->ObjectHandle = *newid;
+	  prop->property = PTP_OPC_ObjectFileName;
+	  prop->datatype = PTP_DTC_STR;
+	  prop->propval.str = strdup(fname);
+	  if (FLAG_ONLY_7BIT_FILENAMES(ptp_usb)) {
+	    strip_7bit_from_utf8(prop->propval.str);
+	  }
+	  break;
+	case PTP_OPC_ProtectionStatus:
+	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	  prop->ObjectHandle = *newid;
+	  prop->property = PTP_OPC_ProtectionStatus;
+	  prop->datatype = PTP_DTC_UINT16;
+	  prop->propval.u16 = 0x0000U; /* Not protected */
+	  break;
+	case PTP_OPC_NonConsumable:
+	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	  prop->ObjectHandle = *newid;
+	  prop->property = PTP_OPC_NonConsumable;
+	  prop->datatype = PTP_DTC_UINT8;
+	  prop->propval.u8 = nonconsumable;
+	  break;
+	case PTP_OPC_Name:
+	  if (name != NULL) {
+	    prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	    prop->ObjectHandle = *newid;
+	    prop->property = PTP_OPC_Name;
+	    prop->datatype = PTP_DTC_STR;
+	    prop->propval.str = strdup(name);
+	  }
+	  break;
+	case PTP_OPC_AlbumArtist:
+	  if (artist != NULL) {
+	    prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	    prop->ObjectHandle = *newid;
+	    prop->property = PTP_OPC_AlbumArtist;
+	    prop->datatype = PTP_DTC_STR;
+	    prop->propval.str = strdup(artist);
+	  }
+	  break;
+	case PTP_OPC_Artist:
+	  if (artist != NULL) {
+	    prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	    prop->ObjectHandle = *newid;
+	    prop->property = PTP_OPC_Artist;
+	    prop->datatype = PTP_DTC_STR;
+	    prop->propval.str = strdup(artist);
+	  }
+	  break;
+	case PTP_OPC_Composer:
+	  if (composer != NULL) {
+	    prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	    prop->ObjectHandle = *newid;
+	    prop->property = PTP_OPC_Composer;
+	    prop->datatype = PTP_DTC_STR;
+	    prop->propval.str = strdup(composer);
+	  }
+	  break;
+	case PTP_OPC_Genre:
+	  if (genre != NULL) {
+	    prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	    prop->ObjectHandle = *newid;
+	    prop->property = PTP_OPC_Genre;
+	    prop->datatype = PTP_DTC_STR;
+	    prop->propval.str = strdup(genre);
+	  }
+	  break;
+ 	case PTP_OPC_DateModified:
+	  // Tag with current time if that is supported
+	  if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
+	    prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	    prop->ObjectHandle = *newid;
+	    prop->property = PTP_OPC_DateModified;
+	    prop->datatype = PTP_DTC_STR;
+	    prop->propval.str = get_iso8601_stamp();
+	  }
+	  break;
+	}
+      }
+      ptp_free_objectpropdesc(&opd);
+    }
+    free(properties);
+
+    // The blank object must directly follow the property list
+    ptp_lock_transactions(params);
+    ret = ptp_mtp_sendobjectproplist(params, &store, &localph, newid,
+				     objectformat, 0, props, nrofprops);
+
+    /* Free property list */
+    ptp_destroy_object_prop_list(props, nrofprops);
+
+    if (ret != PTP_RC_OK) {
+      ptp_unlock_transactions(params);
+      add_ptp_error_to_errorstack(device, ret, "create_new_abstract_list(): Could not send object property list.");
+      if (ret == PTP_RC_AccessDenied) {
+	add_ptp_error_to_errorstack(device, ret, "ACCESS DENIED.");
+      }
+      return -1;
+    }
+
+    // now send the blank object
+    ret = ptp_sendobject(params, NULL, 0);
+    ptp_unlock_transactions(params);
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, ret, "create_new_abstract_list(): Could not send blank object data.");
+      return -1;
+    }
+
+  } else if (ptp_operation_issupported(params,PTP_OC_SendObjectInfo)) {
+    PTPObjectInfo new_object;
+
+    new_object.Filename = fname;
+    if (FLAG_ONLY_7BIT_FILENAMES(ptp_usb)) {
+      strip_7bit_from_utf8(new_object.Filename);
+    }
+    // At one point this had to be one
+    new_object.ObjectCompressedSize = 0;
+    new_object.ObjectFormat = objectformat;
+
+    // Create the object
+    ret = ptp_sendobjectinfo(params, &store, &localph, newid, &new_object);
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, ret, "create_new_abstract_list(): Could not send object info (the playlist itself).");
+      if (ret == PTP_RC_AccessDenied) {
+	add_ptp_error_to_errorstack(device, ret, "ACCESS DENIED.");
+      }
+      return -1;
+    }
+    // NOTE: don't destroy new_object objectinfo afterwards - the strings it contains are
+    // not copies.
+
+#if 0
+    /*
+     * At one time we had to send this one blank data byte.
+     * If we didn't, the handle will not be created and thus there is
+     * no playlist. Possibly this was masking some bug, so removing it
+     * now.
+     */
+    data[0] = '\0';
+    data[1] = '\0';
+    ret = ptp_sendobject(params, data, 1);
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, ret, "create_new_abstract_list(): Could not send blank object data.");
+      return -1;
+    }
+#endif
+
+    // set the properties one by one
+    ret = ptp_mtp_getobjectpropssupported(params, objectformat, &propcnt, &properties);
+
+    for (i=0;i<propcnt;i++) {
+      PTPObjectPropDesc opd;
+
+      ret = ptp_mtp_getobjectpropdesc(params, properties[i], objectformat, &opd);
+      if (ret != PTP_RC_OK) {
+	add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): "
+				"could not get property description.");
+      } else if (opd.GetSet) {
+	switch (properties[i]) {
+	case PTP_OPC_Name:
+	  if (name != NULL) {
+	    ret = set_object_string(device, *newid, PTP_OPC_Name, name);
+	    if (ret != 0) {
+	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): could not set entity name.");
+	      return -1;
+	    }
+	  }
+	  break;
+	case PTP_OPC_AlbumArtist:
+	  if (artist != NULL) {
+	    ret = set_object_string(device, *newid, PTP_OPC_AlbumArtist, artist);
+	    if (ret != 0) {
+	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): could not set entity album artist.");
+	      return -1;
+	    }
+	  }
+	  break;
+	case PTP_OPC_Artist:
+	  if (artist != NULL) {
+	    ret = set_object_string(device, *newid, PTP_OPC_Artist, artist);
+	    if (ret != 0) {
+	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): could not set entity artist.");
+	      return -1;
+	    }
+	  }
+	  break;
+	case PTP_OPC_Composer:
+	  if (composer != NULL) {
+	    ret = set_object_string(device, *newid, PTP_OPC_Composer, composer);
+	    if (ret != 0) {
+	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): could not set entity composer.");
+	      return -1;
+	    }
+	  }
+	  break;
+	case PTP_OPC_Genre:
+	  if (genre != NULL) {
+	    ret = set_object_string(device, *newid, PTP_OPC_Genre, genre);
+	    if (ret != 0) {
+	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): could not set entity genre.");
+	      return -1;
+	    }
+	  }
+	  break;
+ 	case PTP_OPC_DateModified:
+	  if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
+	    ret = set_object_string(device, *newid, PTP_OPC_DateModified, get_iso8601_stamp());
+	    if (ret != 0) {
+	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): could not set date modified.");
+	      return -1;
+	    }
+	  }
+	  break;
+	}
+      }
+      ptp_free_objectpropdesc(&opd);
+    }
+    free(properties);
+  }
+
+  if (no_tracks > 0) {
+    // Add tracks to the list as object references.
+    ret = ptp_mtp_setobjectreferences (params, *newid, (uint32_t *) tracks, no_tracks);
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, ret, "create_new_abstract_list(): could not add tracks as object references.");
+      return -1;
+    }
+  }
+
+  add_object_to_cache(device, *newid);
+
+  return 0;
+}
+
+/**
+ * This updates the metadata and track listing
+ * for an abstract list.
+ * @param device a pointer to the device that the abstract list
+ *        resides on.
+ * @param name the name of the abstract list.
+ * @param artist the artist of the abstract list or NULL.
+ * @param genre the genre of the abstract list or NULL.
+ * @param objecthandle the object to be updated.
+ * @param objectformat the abstract list type to update.
+ * @param tracks an array of tracks to associate with this list.
+ * @param no_tracks the number of tracks in the list.
+ * @return 0 on success, any other value means failure.
+ */
+static int update_abstract_list(LIBMTP_mtpdevice_t *device,
+				char const * const name,
+				char const * const artist,
+				char const * const composer,
+				char const * const genre,
+				uint32_t const objecthandle,
+				uint16_t const objectformat,
+				uint32_t const * const tracks,
+				uint32_t const no_tracks)
+{
+  uint16_t ret;
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  uint16_t *properties = NULL;
+  uint32_t propcnt = 0;
+  int i;
+
+  // First see which properties can be set
+  // i.e only try to update this metadata for object tags that exist on the current player.
+  ret = ptp_mtp_getobjectpropssupported(params, objectformat, &propcnt, &properties);
+  if (ret != PTP_RC_OK) {
+    // Just bail out for now, nothing is ever set.
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
+			    "could not retrieve supported object properties.");
+    return -1;
+  }
+  if (ptp_operation_issupported(params,PTP_OC_MTP_SetObjPropList) &&
+      !FLAG_BROKEN_SET_OBJECT_PROPLIST(ptp_usb)) {
+    MTPProperties *props = NULL;
+    MTPProperties *prop = NULL;
+    int nrofprops = 0;
+
+    for (i=0;i<propcnt;i++) {
+      PTPObjectPropDesc opd;
+
+      ret = ptp_mtp_getobjectpropdesc(params, properties[i], objectformat, &opd);
+      if (ret != PTP_RC_OK) {
+	add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
+				"could not get property description.");
+      } else if (opd.GetSet) {
+	switch (properties[i]) {
+	case PTP_OPC_Name:
+	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	  prop->ObjectHandle = objecthandle;
+	  prop->property = PTP_OPC_Name;
+	  prop->datatype = PTP_DTC_STR;
+	  if (name != NULL)
+	    prop->propval.str = strdup(name);
+	  break;
+	case PTP_OPC_AlbumArtist:
+	  if (artist != NULL) {
+	    prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	    prop->ObjectHandle = objecthandle;
+	    prop->property = PTP_OPC_AlbumArtist;
+	    prop->datatype = PTP_DTC_STR;
+	    prop->propval.str = strdup(artist);
+	  }
+	  break;
+	case PTP_OPC_Artist:
+	  if (artist != NULL) {
+	    prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	    prop->ObjectHandle = objecthandle;
+	    prop->property = PTP_OPC_Artist;
+	    prop->datatype = PTP_DTC_STR;
+	    prop->propval.str = strdup(artist);
+	  }
+	  break;
+	case PTP_OPC_Composer:
+	  if (composer != NULL) {
+	    prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	    prop->ObjectHandle = objecthandle;
+	    prop->property = PTP_OPC_Composer;
+	    prop->datatype = PTP_DTC_STR;
+	    prop->propval.str = strdup(composer);
+	  }
+	  break;
+	case PTP_OPC_Genre:
+	  if (genre != NULL) {
+	    prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	    prop->ObjectHandle = objecthandle;
+	    prop->property = PTP_OPC_Genre;
+	    prop->datatype = PTP_DTC_STR;
+	    prop->propval.str = strdup(genre);
+	  }
+	  break;
+ 	case PTP_OPC_DateModified:
+	  if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
+	    // Tag with current time if that is supported
+	    prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	    prop->ObjectHandle = objecthandle;
+	    prop->property = PTP_OPC_DateModified;
+	    prop->datatype = PTP_DTC_STR;
+	    prop->propval.str = get_iso8601_stamp();
+	  }
+	  break;
+	default:
+	  break;
+	}
+      }
+      ptp_free_objectpropdesc(&opd);
+    }
+
+    // proplist could be NULL if we can't write any properties
+    if (props != NULL) {
+      ret = ptp_mtp_setobjectproplist(params, props, nrofprops);
+
+      ptp_destroy_object_prop_list(props, nrofprops);
+
+      if (ret != PTP_RC_OK) {
+        // TODO: return error of which property we couldn't set
+        add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
+                                "could not set object property list.");
+        free(properties);
+        return -1;
+      }
+    }
+
+  } else if (ptp_operation_issupported(params,PTP_OC_MTP_SetObjectPropValue)) {
+    for (i=0;i<propcnt;i++) {
+      switch (properties[i]) {
+      case PTP_OPC_Name:
+	// Update title
+	ret = set_object_string(device, objecthandle, PTP_OPC_Name, name);
+	if (ret != 0) {
+	  add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
+				  "could not set title.");
+	}
+	break;
+      case PTP_OPC_AlbumArtist:
+	// Update album artist
+	ret = set_object_string(device, objecthandle, PTP_OPC_AlbumArtist, artist);
+	if (ret != 0) {
+	  add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
+				  "could not set album artist name.");
+	}
+	break;
+      case PTP_OPC_Artist:
+	// Update artist
+	ret = set_object_string(device, objecthandle, PTP_OPC_Artist, artist);
+	if (ret != 0) {
+	  add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
+				  "could not set artist name.");
+	}
+	break;
+      case PTP_OPC_Composer:
+	// Update composer
+	ret = set_object_string(device, objecthandle, PTP_OPC_Composer, composer);
+	if (ret != 0) {
+	  add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
+				  "could not set composer name.");
+	}
+	break;
+      case PTP_OPC_Genre:
+	// Update genre (but only if valid)
+	if(genre) {
+	  ret = set_object_string(device, objecthandle, PTP_OPC_Genre, genre);
+	  if (ret != 0) {
+	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
+				    "could not set genre.");
+	  }
+        }
+	break;
+      case PTP_OPC_DateModified:
+	// Update date modified
+	if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
+	  char *tmpdate = get_iso8601_stamp();
+	  ret = set_object_string(device, objecthandle, PTP_OPC_DateModified, tmpdate);
+	  if (ret != 0) {
+	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
+				    "could not set modification date.");
+	  }
+	  free(tmpdate);
+	}
+	break;
+      default:
+	break;
+      }
+    }
+  } else {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
+                            "Your device doesn't seem to support any known way of setting metadata.");
+    free(properties);
+    return -1;
+  }
+
+  // Then the object references...
+  ret = ptp_mtp_setobjectreferences (params, objecthandle, (uint32_t *) tracks, no_tracks);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "update_abstract_list(): could not add tracks as object references.");
+    free(properties);
+    return -1;
+  }
+
+  free(properties);
+
+  update_metadata_cache(device, objecthandle);
+
+  return 0;
+}
+
+
+/**
+ * This routine creates a new playlist based on the metadata
+ * supplied. If the <code>tracks</code> field of the metadata
+ * contains a track listing, these tracks will be added to the
+ * playlist.
+ * @param device a pointer to the device to create the new playlist on.
+ * @param metadata the metadata for the new playlist. If the function
+ *        exits with success, the <code>playlist_id</code> field of this
+ *        struct will contain the new playlist ID of the playlist.
+ *        <ul>
+ *        <li><code>metadata-&gt;parent_id</code> should be set to the parent 
+ *        (e.g. folder) to store this track in. Since some 
+ *        devices are a bit picky about where files
+ *        are placed, a default folder will be chosen if libmtp
+ *        has detected one for the current filetype and this
+ *        parameter is set to 0. If this is 0 and no default folder
+ *        can be found, the file will be stored in the root folder.
+ *        <li><code>metadata-&gt;storage_id</code> should be set to the
+ *        desired storage (e.g. memory card or whatever your device
+ *        presents) to store this track in. Setting this to 0 will store
+ *        the track on the primary storage.
+ *        </ul>
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Update_Playlist()
+ * @see LIBMTP_Delete_Object()
+ */
+int LIBMTP_Create_New_Playlist(LIBMTP_mtpdevice_t *device,
+			       LIBMTP_playlist_t * const metadata)
+{
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  uint32_t localph = metadata->parent_id;
+
+  // Use a default folder if none given
+  if (localph == 0) {
+    if (device->default_playlist_folder != 0)
+      localph = device->default_playlist_folder;
+    else
+      localph = device->default_music_folder;
+  }
+  metadata->parent_id = localph;
+
+  // Samsung needs its own special type of playlists
+  if(FLAG_PLAYLIST_SPL(ptp_usb)) {
+    return playlist_t_to_spl(device, metadata);
+  }
+
+  // Just create a new abstract audio/video playlist...
+  return create_new_abstract_list(device,
+				  metadata->name,
+				  NULL,
+				  NULL,
+				  NULL,
+				  localph,
+				  metadata->storage_id,
+				  PTP_OFC_MTP_AbstractAudioVideoPlaylist,
+				  get_playlist_extension(ptp_usb),
+				  &metadata->playlist_id,
+				  metadata->tracks,
+				  metadata->no_tracks);
+}
+
+/**
+ * This routine updates a playlist based on the metadata
+ * supplied. If the <code>tracks</code> field of the metadata
+ * contains a track listing, these tracks will be added to the
+ * playlist in place of those already present, i.e. the
+ * previous track listing will be deleted. For Samsung devices the
+ * playlist id (metadata->playlist_id) is likely to change.
+ * @param device a pointer to the device to create the new playlist on.
+ * @param metadata the metadata for the playlist to be updated.
+ *                 notice that the field <code>playlist_id</code>
+ *                 must contain the apropriate playlist ID. Playlist ID
+ *                 be modified to a new playlist ID by the time the
+ *                 function returns since edit-in-place is not always possible.
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Create_New_Playlist()
+ * @see LIBMTP_Delete_Object()
+ */
+int LIBMTP_Update_Playlist(LIBMTP_mtpdevice_t *device,
+			   LIBMTP_playlist_t * const metadata)
+{
+
+  // Samsung needs its own special type of playlists
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  if(FLAG_PLAYLIST_SPL(ptp_usb)) {
+    return update_spl_playlist(device, metadata);
+  }
+
+  return update_abstract_list(device,
+			      metadata->name,
+			      NULL,
+			      NULL,
+			      NULL,
+			      metadata->playlist_id,
+			      PTP_OFC_MTP_AbstractAudioVideoPlaylist,
+			      metadata->tracks,
+			      metadata->no_tracks);
+}
+
+/**
+ * This creates a new album metadata structure and allocates memory
+ * for it. Notice that if you add strings to this structure they
+ * will be freed by the corresponding <code>LIBMTP_destroy_album_t</code>
+ * operation later, so be careful of using strdup() when assigning
+ * strings.
+ *
+ * @return a pointer to the newly allocated metadata structure.
+ * @see LIBMTP_destroy_album_t()
+ */
+LIBMTP_album_t *LIBMTP_new_album_t(void)
+{
+  LIBMTP_album_t *new = (LIBMTP_album_t *) malloc(sizeof(LIBMTP_album_t));
+  if (new == NULL) {
+    return NULL;
+  }
+  new->album_id = 0;
+  new->parent_id = 0;
+  new->storage_id = 0;
+  new->name = NULL;
+  new->artist = NULL;
+  new->composer = NULL;
+  new->genre = NULL;
+  new->tracks = NULL;
+  new->no_tracks = 0;
+  new->next = NULL;
+  return new;
+}
+
+/**
+ * This recursively deletes the memory for an album structure
+ *
+ * @param album structure to destroy
+ * @see LIBMTP_new_album_t()
+ */
+void LIBMTP_destroy_album_t(LIBMTP_album_t *album)
+{
+  if (album == NULL) {
+    return;
+  }
+  if (album->name != NULL)
+    free(album->name);
+  if (album->artist != NULL)
+    free(album->artist);
+  if (album->composer != NULL)
+    free(album->composer);
+  if (album->genre != NULL)
+    free(album->genre);
+  if (album->tracks != NULL)
+    free(album->tracks);
+  free(album);
+  return;
+}
+
+/**
+ * This function maps and copies a property onto the album metadata if applicable.
+ */
+static void pick_property_to_album_metadata(LIBMTP_mtpdevice_t *device,
+					    MTPProperties *prop, LIBMTP_album_t *alb)
+{
+  switch (prop->property) {
+  case PTP_OPC_Name:
+    if (prop->propval.str != NULL)
+      alb->name = strdup(prop->propval.str);
+    else
+      alb->name = NULL;
+    break;
+  case PTP_OPC_AlbumArtist:
+    if (prop->propval.str != NULL) {
+      // This should take precedence over plain "Artist"
+      if (alb->artist != NULL)
+	free(alb->artist);
+      alb->artist = strdup(prop->propval.str);
+    } else
+      alb->artist = NULL;
+    break;
+  case PTP_OPC_Artist:
+    if (prop->propval.str != NULL) {
+      // Only use of AlbumArtist is not set
+      if (alb->artist == NULL)
+	alb->artist = strdup(prop->propval.str);
+    } else
+      alb->artist = NULL;
+    break;
+  case PTP_OPC_Composer:
+    if (prop->propval.str != NULL)
+      alb->composer = strdup(prop->propval.str);
+    else
+      alb->composer = NULL;
+    break;
+  case PTP_OPC_Genre:
+    if (prop->propval.str != NULL)
+      alb->genre = strdup(prop->propval.str);
+    else
+      alb->genre = NULL;
+    break;
+  }
+}
+
+/**
+ * This function retrieves the album metadata for an album
+ * given by a unique ID.
+ * @param device a pointer to the device to get the track metadata off.
+ * @param alb an album metadata metadata set to fill in.
+ */
+static void get_album_metadata(LIBMTP_mtpdevice_t *device,
+			       LIBMTP_album_t *alb)
+{
+  uint16_t ret;
+  PTPParams *params = (PTPParams *) device->params;
+  uint32_t i;
+  MTPProperties *prop;
+  PTPObject *ob;
+
+  /*
+   * If we have a cached, large set of metadata, then use it!
+   */
+  ret = ptp_object_want(params, alb->album_id, PTPOBJECT_MTPPROPLIST_LOADED, &ob);
+  if (ob->mtpprops) {
+    prop = ob->mtpprops;
+    for (i=0;i<ob->nrofmtpprops;i++,prop++)
+      pick_property_to_album_metadata(device, prop, alb);
+  } else {
+    uint16_t *props = NULL;
+    uint32_t propcnt = 0;
+
+    // First see which properties can be retrieved for albums
+    ret = ptp_mtp_getobjectpropssupported(params, PTP_OFC_MTP_AbstractAudioAlbum, &propcnt, &props);
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, ret, "get_album_metadata(): call to ptp_mtp_getobjectpropssupported() failed.");
+      // Just bail out for now, nothing is ever set.
+      return;
+    } else {
+      for (i=0;i<propcnt;i++) {
+	switch (props[i]) {
+	case PTP_OPC_Name:
+	  alb->name = get_string_from_object(device, ob->oid, PTP_OPC_Name);
+	  break;
+	case PTP_OPC_AlbumArtist:
+	  if (alb->artist != NULL)
+	    free(alb->artist);
+	  alb->artist = get_string_from_object(device, ob->oid, PTP_OPC_AlbumArtist);
+	  break;
+	case PTP_OPC_Artist:
+	  if (alb->artist == NULL)
+	    alb->artist = get_string_from_object(device, ob->oid, PTP_OPC_Artist);
+	  break;
+	case PTP_OPC_Composer:
+	  alb->composer = get_string_from_object(device, ob->oid, PTP_OPC_Composer);
+	  break;
+	case PTP_OPC_Genre:
+	  alb->genre = get_string_from_object(device, ob->oid, PTP_OPC_Genre);
+	  break;
+	default:
+	  break;
+	}
+      }
+      free(props);
+    }
+  }
+}
+
+
+/**
+ * This function returns a list of the albums available on the
+ * device.
+ *
+ * @param device a pointer to the device to get the album listing from.
+ * @return an album list on success, else NULL. If there are no albums
+ *         on the device, NULL will be returned as well.
+ * @see LIBMTP_Get_Album()
+ */
+LIBMTP_album_t *LIBMTP_Get_Album_List(LIBMTP_mtpdevice_t *device)
+{
+	// Read all storage devices
+	return LIBMTP_Get_Album_List_For_Storage(device, 0);
+}
+
+
+/**
+ * This function returns a list of the albums available on the
+ * device. You can filter on the storage ID.
+ *
+ * @param device a pointer to the device to get the album listing from.
+ * @param storage_id ID of device storage (if null, all storages)
+ *
+ * @return an album list on success, else NULL. If there are no albums
+ *         on the device, NULL will be returned as well.
+ * @see LIBMTP_Get_Album()
+ */
+LIBMTP_album_t *LIBMTP_Get_Album_List_For_Storage(LIBMTP_mtpdevice_t *device, uint32_t const storage_id)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  LIBMTP_album_t *retalbums = NULL;
+  LIBMTP_album_t *curalbum = NULL;
+  uint32_t i;
+
+  ptp_lock_cache(params, 1);
+  // Get all the handles if we haven't already done that
+  if (params->nrofobjects == 0)
+    flush_handles(device);
+
+  for (i = 0; i < params->nrofobjects; i++) {
+    LIBMTP_album_t *alb;
+    PTPObject *ob;
+    uint16_t ret;
+
+    ob = &params->objects[i];
+
+    // Ignore stuff that isn't an album
+    if ( ob->oi.ObjectFormat != PTP_OFC_MTP_AbstractAudioAlbum )
+      continue;
+
+	// Ignore stuff that isn't into the storage device
+	if ((storage_id != 0) && (ob->oi.StorageID != storage_id ))
+		continue;
+
+    // Allocate a new album type
+    alb = LIBMTP_new_album_t();
+    alb->album_id = ob->oid;
+    alb->parent_id = ob->oi.ParentObject;
+    alb->storage_id = ob->oi.StorageID;
+
+    // Fetch supported metadata
+    get_album_metadata(device, alb);
+
+    // Then get the track listing for this album
+    ret = ptp_mtp_getobjectreferences(params, alb->album_id, &alb->tracks, &alb->no_tracks);
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Album_List(): Could not get object references.");
+      alb->tracks = NULL;
+      alb->no_tracks = 0;
+    }
+
+    // Add album to a list that will be returned afterwards.
+    if (retalbums == NULL) {
+      retalbums = alb;
+      curalbum = alb;
+    } else {
+      curalbum->next = alb;
+      curalbum = alb;
+    }
+
+  }
+  ptp_unlock_cache(params);
+  return retalbums;
+}
+
+/**
+ * This function retrieves an individual album from the device.
+ * @param device a pointer to the device to get the album from.
+ * @param albid the unique ID of the album to retrieve.
+ * @return a valid album metadata or NULL on failure.
+ * @see LIBMTP_Get_Album_List()
+ */
+LIBMTP_album_t *LIBMTP_Get_Album(LIBMTP_mtpdevice_t *device, uint32_t const albid)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint16_t ret;
+  PTPObject *ob;
+  LIBMTP_album_t *alb;
+
+  ptp_lock_cache(params, 1);
+  // Get all the handles if we haven't already done that
+  if (params->nrofobjects == 0)
+    flush_handles(device);
+
+  ret = ptp_object_want(params, albid, PTPOBJECT_OBJECTINFO_LOADED, &ob);
+  if (ret != PTP_RC_OK) {
+    ptp_unlock_cache(params);
+    return NULL;
+  }
+
+  // Ignore stuff that isn't an album
+  if (ob->oi.ObjectFormat != PTP_OFC_MTP_AbstractAudioAlbum) {
+    ptp_unlock_cache(params);
+    return NULL;
+  }
+
+  // Allocate a new album type
+  alb = LIBMTP_new_album_t();
+  alb->album_id = ob->oid;
+  alb->parent_id = ob->oi.ParentObject;
+  alb->storage_id = ob->oi.StorageID;
+
+  // Fetch supported metadata
+  get_album_metadata(device, alb);
+
+  // Then get the track listing for this album
+  ret = ptp_mtp_getobjectreferences(params, alb->album_id, &alb->tracks, &alb->no_tracks);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Album: Could not get object references.");
+    alb->tracks = NULL;
+    alb->no_tracks = 0;
+  }
+
+  ptp_unlock_cache(params);
+  return alb;
+}
+
+/**
+ * This routine creates a new album based on the metadata
+ * supplied. If the <code>tracks</code> field of the metadata
+ * contains a track listing, these tracks will be added to the
+ * album.
+ * @param device a pointer to the device to create the new album on.
+ * @param metadata the metadata for the new album. If the function
+ *        exits with success, the <code>album_id</code> field of this
+ *        struct will contain the new ID of the album.
+ *        <ul>
+ *        <li><code>metadata-&gt;parent_id</code> should be set to the parent
+ *        (e.g. folder) to store this track in. Since some
+ *        devices are a bit picky about where files
+ *        are placed, a default folder will be chosen if libmtp
+ *        has detected one for the current filetype and this
+ *        parameter is set to 0. If this is 0 and no default folder
+ *        can be found, the file will be stored in the root folder.
+ *        <li><code>metadata-&gt;storage_id</code> should be set to the
+ *        desired storage (e.g. memory card or whatever your device
+ *        presents) to store this track in. Setting this to 0 will store
+ *        the track on the primary storage.
+ *        </ul>
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Update_Album()
+ * @see LIBMTP_Delete_Object()
+ */
+int LIBMTP_Create_New_Album(LIBMTP_mtpdevice_t *device,
+			    LIBMTP_album_t * const metadata)
+{
+  uint32_t localph = metadata->parent_id;
+
+  // Use a default folder if none given
+  if (localph == 0) {
+    if (device->default_album_folder != 0)
+      localph = device->default_album_folder;
+    else
+      localph = device->default_music_folder;
+  }
+  metadata->parent_id = localph;
+
+  // Just create a new abstract album...
+  return create_new_abstract_list(device,
+				  metadata->name,
+				  metadata->artist,
+				  metadata->composer,
+				  metadata->genre,
+				  localph,
+				  metadata->storage_id,
+				  PTP_OFC_MTP_AbstractAudioAlbum,
+				  ".alb",
+				  &metadata->album_id,
+				  metadata->tracks,
+				  metadata->no_tracks);
+}
+
+/**
+ * This creates a new sample data metadata structure and allocates memory
+ * for it. Notice that if you add strings to this structure they
+ * will be freed by the corresponding <code>LIBMTP_destroy_sampledata_t</code>
+ * operation later, so be careful of using strdup() when assigning
+ * strings.
+ *
+ * @return a pointer to the newly allocated metadata structure.
+ * @see LIBMTP_destroy_sampledata_t()
+ */
+LIBMTP_filesampledata_t *LIBMTP_new_filesampledata_t(void)
+{
+  LIBMTP_filesampledata_t *new = (LIBMTP_filesampledata_t *) malloc(sizeof(LIBMTP_filesampledata_t));
+  if (new == NULL) {
+    return NULL;
+  }
+  new->height=0;
+  new->width = 0;
+  new->data = NULL;
+  new->duration = 0;
+  new->size = 0;
+  return new;
+}
+
+/**
+ * This destroys a file sample metadata type.
+ * @param sample the file sample metadata to be destroyed.
+ */
+void LIBMTP_destroy_filesampledata_t(LIBMTP_filesampledata_t * sample)
+{
+  if (sample == NULL) {
+    return;
+  }
+  if (sample->data != NULL) {
+    free(sample->data);
+  }
+  free(sample);
+}
+
+/**
+ * This routine figures out whether a certain filetype supports
+ * representative samples (small thumbnail images) or not. This
+ * typically applies to JPEG files, MP3 files and Album abstract
+ * playlists, but in theory any filetype could support representative
+ * samples.
+ * @param device a pointer to the device which is to be examined.
+ * @param filetype the fileype to examine, and return the representative sample
+ *        properties for.
+ * @param sample this will contain a new sample type with the fields
+ *        filled in with suitable default values. For example, the
+ *        supported sample type will be set, the supported height and
+ *        width will be set to max values if it is an image sample,
+ *        and duration will also be given some suitable default value
+ *        which should not be exceeded on audio samples. If the
+ *        device does not support samples for this filetype, this
+ *        pointer will be NULL. If it is not NULL, the user must
+ *        destroy this struct with <code>LIBMTP_destroy_filesampledata_t()</code>
+ *        after use.
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Send_Representative_Sample()
+ * @see LIBMTP_Create_New_Album()
+ */
+int LIBMTP_Get_Representative_Sample_Format(LIBMTP_mtpdevice_t *device,
+					    LIBMTP_filetype_t const filetype,
+					    LIBMTP_filesampledata_t ** sample)
+{
+  uint16_t ret;
+  PTPParams *params = (PTPParams *) device->params;
+  uint16_t *props = NULL;
+  uint32_t propcnt = 0;
+  int i;
+  // TODO: Get rid of these when we can properly query the device.
+  int support_data = 0;
+  int support_format = 0;
+  int support_height = 0;
+  int support_width = 0;
+  int support_duration = 0;
+  int support_size = 0;
+
+  PTPObjectPropDesc opd_height;
+  PTPObjectPropDesc opd_width;
+  PTPObjectPropDesc opd_format;
+  PTPObjectPropDesc opd_duration;
+  PTPObjectPropDesc opd_size;
+
+  // Default to no type supported.
+  *sample = NULL;
+
+  ret = ptp_mtp_getobjectpropssupported(params, map_libmtp_type_to_ptp_type(filetype), &propcnt, &props);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Representative_Sample_Format(): could not get object properties.");
+    return -1;
+  }
+  /*
+   * TODO: when walking through these object properties, make calls to
+   * a new function in ptp.h/ptp.c that can send the command
+   * PTP_OC_MTP_GetObjectPropDesc to get max/min values of the properties
+   * supported.
+   */
+  for (i = 0; i < propcnt; i++) {
+    switch(props[i]) {
+    case PTP_OPC_RepresentativeSampleData:
+      support_data = 1;
+      break;
+    case PTP_OPC_RepresentativeSampleFormat:
+      support_format = 1;
+      break;
+    case PTP_OPC_RepresentativeSampleSize:
+      support_size = 1;
+      break;
+    case PTP_OPC_RepresentativeSampleHeight:
+      support_height = 1;
+      break;
+    case PTP_OPC_RepresentativeSampleWidth:
+      support_width = 1;
+      break;
+    case PTP_OPC_RepresentativeSampleDuration:
+      support_duration = 1;
+      break;
+    default:
+      break;
+    }
+  }
+  free(props);
+
+  if (support_data && support_format && support_height && support_width && !support_duration) {
+    // Something that supports height and width and not duration is likely to be JPEG
+    LIBMTP_filesampledata_t *retsam = LIBMTP_new_filesampledata_t();
+    /*
+     * Populate the sample format with the first supported format
+     *
+     * TODO: figure out how to pass back more than one format if more are
+     * supported by the device.
+     */
+    ptp_mtp_getobjectpropdesc (params, PTP_OPC_RepresentativeSampleFormat, map_libmtp_type_to_ptp_type(filetype), &opd_format);
+    retsam->filetype = map_ptp_type_to_libmtp_type(opd_format.FORM.Enum.SupportedValue[0].u16);
+    ptp_free_objectpropdesc(&opd_format);
+    /* Populate the maximum image height */
+    ptp_mtp_getobjectpropdesc (params, PTP_OPC_RepresentativeSampleWidth, map_libmtp_type_to_ptp_type(filetype), &opd_width);
+    retsam->width = opd_width.FORM.Range.MaximumValue.u32;
+    ptp_free_objectpropdesc(&opd_width);
+    /* Populate the maximum image width */
+    ptp_mtp_getobjectpropdesc (params, PTP_OPC_RepresentativeSampleHeight, map_libmtp_type_to_ptp_type(filetype), &opd_height);
+    retsam->height = opd_height.FORM.Range.MaximumValue.u32;
+    ptp_free_objectpropdesc(&opd_height);
+    /* Populate the maximum size */
+    if (support_size) {
+      ptp_mtp_getobjectpropdesc (params, PTP_OPC_RepresentativeSampleSize, map_libmtp_type_to_ptp_type(filetype), &opd_size);
+      retsam->size = opd_size.FORM.Range.MaximumValue.u32;
+      ptp_free_objectpropdesc(&opd_size);
+    }
+    *sample = retsam;
+  } else if (support_data && support_format && !support_height && !support_width && support_duration) {
+    // Another qualified guess
+    LIBMTP_filesampledata_t *retsam = LIBMTP_new_filesampledata_t();
+    /*
+     * Populate the sample format with the first supported format
+     *
+     * TODO: figure out how to pass back more than one format if more are
+     * supported by the device.
+     */
+    ptp_mtp_getobjectpropdesc (params, PTP_OPC_RepresentativeSampleFormat, map_libmtp_type_to_ptp_type(filetype), &opd_format);
+    retsam->filetype = map_ptp_type_to_libmtp_type(opd_format.FORM.Enum.SupportedValue[0].u16);
+    ptp_free_objectpropdesc(&opd_format);
+    /* Populate the maximum duration */
+    ptp_mtp_getobjectpropdesc (params, PTP_OPC_RepresentativeSampleDuration, map_libmtp_type_to_ptp_type(filetype), &opd_duration);
+    retsam->duration = opd_duration.FORM.Range.MaximumValue.u32;
+    ptp_free_objectpropdesc(&opd_duration);
+    /* Populate the maximum size */
+    if (support_size) {
+      ptp_mtp_getobjectpropdesc (params, PTP_OPC_RepresentativeSampleSize, map_libmtp_type_to_ptp_type(filetype), &opd_size);
+      retsam->size = opd_size.FORM.Range.MaximumValue.u32;
+      ptp_free_objectpropdesc(&opd_size);
+    }
+    *sample = retsam;
+  }
+  return 0;
+}
+
+/**
+ * This routine sends representative sample data for an object.
+ * This uses the RepresentativeSampleData property of the album,
+ * if the device supports it. The data should be of a format acceptable
+ * to the player (for iRiver and Creative, this seems to be JPEG) and
+ * must not be too large. (for a Creative, max seems to be about 20KB.)
+ * Check by calling LIBMTP_Get_Representative_Sample_Format() to get
+ * maximum size, dimensions, etc..
+ * @param device a pointer to the device which the object is on.
+ * @param id unique id of the object to set artwork for.
+ * @param pointer to LIBMTP_filesampledata_t struct containing data
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Get_Representative_Sample()
+ * @see LIBMTP_Get_Representative_Sample_Format()
+ * @see LIBMTP_Create_New_Album()
+ */
+int LIBMTP_Send_Representative_Sample(LIBMTP_mtpdevice_t *device,
+                          uint32_t const id,
+                          LIBMTP_filesampledata_t *sampledata)
+{
+  uint16_t ret;
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  PTPPropertyValue propval;
+  PTPObject *ob;
+  uint16_t format;
+  uint32_t i;
+  uint16_t *props = NULL;
+  uint32_t propcnt = 0;
+  int supported = 0;
+
+  // get the file format for the object we're going to send representative data for
+  ptp_lock_cache(params, 1);
+  ret = ptp_object_want (params, id, PTPOBJECT_OBJECTINFO_LOADED, &ob);
+  if (ret != PTP_RC_OK) {
+    ptp_unlock_cache(params);
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Send_Representative_Sample(): could not get object info.");
+    return -1;
+  }
+  format = ob->oi.ObjectFormat;
+  ptp_unlock_cache(params);
+
+  // check that we can send representative sample data for this object format
+  ret = ptp_mtp_getobjectpropssupported(params, format, &propcnt, &props);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Send_Representative_Sample(): could not get object properties.");
+    return -1;
+  }
+
+  for (i = 0; i < propcnt; i++) {
+    if (props[i] == PTP_OPC_RepresentativeSampleData) {
+      supported = 1;
+      break;
+    }
+  }
+  if (!supported) {
+    free(props);
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Send_Representative_Sample(): object type doesn't support RepresentativeSampleData.");
+    return -1;
+  }
+  free(props);
+
+  // Go ahead and send the data
+  propval.a.count = sampledata->size;
+  propval.a.v = malloc(sizeof(PTPPropertyValue) * sampledata->size);
+  for (i = 0; i < sampledata->size; i++) {
+    propval.a.v[i].u8 = sampledata->data[i];
+  }
+
+  ret = ptp_mtp_setobjectpropvalue(params,id,PTP_OPC_RepresentativeSampleData,
+				   &propval,PTP_DTC_AUINT8);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Send_Representative_Sample(): could not send sample data.");
+    free(propval.a.v);
+    return -1;
+  }
+  free(propval.a.v);
+
+  /* Set the height and width if the sample is an image, otherwise just
+   * set the duration and size */
+  switch(sampledata->filetype) {
+  case LIBMTP_FILETYPE_JPEG:
+  case LIBMTP_FILETYPE_JFIF:
+  case LIBMTP_FILETYPE_TIFF:
+  case LIBMTP_FILETYPE_BMP:
+  case LIBMTP_FILETYPE_GIF:
+  case LIBMTP_FILETYPE_PICT:
+  case LIBMTP_FILETYPE_PNG:
+    if (!FLAG_BROKEN_SET_SAMPLE_DIMENSIONS(ptp_usb)) {
+      // For images, set the height and width
+      set_object_u32(device, id, PTP_OPC_RepresentativeSampleHeight, sampledata->height);
+      set_object_u32(device, id, PTP_OPC_RepresentativeSampleWidth, sampledata->width);
+    }
     break;
-  case PTP_OPC_Genre:
-    if (prop->propval.str != NULL)
-      alb->genre = strdup(prop->propval.str);
-    else
-      alb->genre = NULL;
+  default:
+    // For anything not an image, set the duration and size
+    set_object_u32(device, id, PTP_OPC_RepresentativeSampleDuration, sampledata->duration);
+    set_object_u32(device, id, PTP_OPC_RepresentativeSampleSize, sampledata->size);
     break;
   }
+
+  return 0;
 }
 
 /**
- * This function retrieves the album metadata for an album
- * given by a unique ID.
- * @param device a pointer to the device to get the track metadata off.
- * @param alb an album metadata metadata set to fill in.
+ * This routine gets representative sample data for an object.
+ * This uses the RepresentativeSampleData property of the album,
+ * if the device supports it.
+ * @param device a pointer to the device which the object is on.
+ * @param id unique id of the object to get data for.
+ * @param pointer to LIBMTP_filesampledata_t struct to receive data
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Send_Representative_Sample()
+ * @see LIBMTP_Get_Representative_Sample_Format()
+ * @see LIBMTP_Create_New_Album()
  */
-static void get_album_metadata(LIBMTP_mtpdevice_t *device,
-			       LIBMTP_album_t *alb)
+int LIBMTP_Get_Representative_Sample(LIBMTP_mtpdevice_t *device,
+                          uint32_t const id,
+                          LIBMTP_filesampledata_t *sampledata)
 {
   uint16_t ret;
   PTPParams *params = (PTPParams *) device->params;
-  uint32_t i;
-  MTPProperties *prop;
+  PTPPropertyValue propval;
   PTPObject *ob;
+  uint16_t format;
+  uint32_t i;
+  uint16_t *props = NULL;
+  uint32_t propcnt = 0;
+  int supported = 0;
 
-  /*
-   * If we have a cached, large set of metadata, then use it!
-   */
-  ret = ptp_object_want(params, alb->album_id, PTPOBJECT_MTPPROPLIST_LOADED, &ob);
-  if (ob->mtpprops) {
-    prop = ob->mtpprops;
-    for (i=0;i<ob->nrofmtpprops;i++,prop++)
-      pick_property_to_album_metadata(device, prop, alb);
-  } else {
-    uint16_t *props = NULL;
-    uint32_t propcnt = 0;
+  // get the file format for the object we're going to send representative data for
+  ptp_lock_cache(params, 1);
+  ret = ptp_object_want (params, id, PTPOBJECT_OBJECTINFO_LOADED, &ob);
+  if (ret != PTP_RC_OK) {
+    ptp_unlock_cache(params);
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_Representative_Sample(): could not get object info.");
+    return -1;
+  }
+  format = ob->oi.ObjectFormat;
+  ptp_unlock_cache(params);
 
-    // First see which properties can be retrieved for albums
-    ret = ptp_mtp_getobjectpropssupported(params, PTP_OFC_MTP_AbstractAudioAlbum, &propcnt, &props);
-    if (ret != PTP_RC_OK) {
-      add_ptp_error_to_errorstack(device, ret, "get_album_metadata(): call to ptp_mtp_getobjectpropssupported() failed.");
-      // Just bail out for now, nothing is ever set.
-      return;
-    } else {
-      for (i=0;i<propcnt;i++) {
-	switch (props[i]) {
-	case PTP_OPC_Name:
-	  alb->name = get_string_from_object(device, ob->oid, PTP_OPC_Name);
-	  break;
-	case PTP_OPC_AlbumArtist:
-	  if (alb->artist != NULL)
-	    free(alb->artist);
-	  alb->artist = get_string_from_object(device, ob->oid, PTP_OPC_AlbumArtist);
-	  break;
-	case PTP_OPC_Artist:
-	  if (alb->artist == NULL)
-	    alb->artist = get_string_from_object(device, ob->oid, PTP_OPC_Artist);
-	  break;
-	case PTP_OPC_Composer:
-	  alb->composer = get_string_from_object(device, ob->oid, PTP_OPC_Composer);
-	  break;
-	case PTP_OPC_Genre:
-	  alb->genre = get_string_from_object(device, ob->oid, PTP_OPC_Genre);
-	  break;
-	default:
-	  break;
-	}
-      }
-      free(props);
+  // check that we can store representative sample data for this object format
+  ret = ptp_mtp_getobjectpropssupported(params, format, &propcnt, &props);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Representative_Sample(): could not get object properties.");
+    return -1;
+  }
+
+  for (i = 0; i < propcnt; i++) {
+    if (props[i] == PTP_OPC_RepresentativeSampleData) {
+      supported = 1;
+      break;
     }
   }
-}
+  if (!supported) {
+    free(props);
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_Representative_Sample(): object type doesn't support RepresentativeSampleData.");
+    return -1;
+  }
+  free(props);
 
+  // Get the data
+  ret = ptp_mtp_getobjectpropvalue(params,id,PTP_OPC_RepresentativeSampleData,
+				   &propval,PTP_DTC_AUINT8);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Representative_Sample(): could not get sample data.");
+    return -1;
+  }
 
-/**
- * This function returns a list of the albums available on the
- * device.
- *
- * @param device a pointer to the device to get the album listing from.
- * @return an album list on success, else NULL. If there are no albums
- *         on the device, NULL will be returned as well.
- * @see LIBMTP_Get_Album()
- */
-LIBMTP_album_t *LIBMTP_Get_Album_List(LIBMTP_mtpdevice_t *device)
-{
-	// Read all storage devices
-	return LIBMTP_Get_Album_List_For_Storage(device, 0);
-}
+  // Store it
+  sampledata->size = propval.a.count;
+  sampledata->data = malloc(sizeof(PTPPropertyValue) * propval.a.count);
+  for (i = 0; i < propval.a.count; i++) {
+    sampledata->data[i] = propval.a.v[i].u8;
+  }
+  free(propval.a.v);
+
+  // Get the other properties
+  sampledata->width = get_u32_from_object(device, id, PTP_OPC_RepresentativeSampleWidth, 0);
+  sampledata->height = get_u32_from_object(device, id, PTP_OPC_RepresentativeSampleHeight, 0);
+  sampledata->duration = get_u32_from_object(device, id, PTP_OPC_RepresentativeSampleDuration, 0);
+  sampledata->filetype = map_ptp_type_to_libmtp_type(
+        get_u16_from_object(device, id, PTP_OPC_RepresentativeSampleFormat, LIBMTP_FILETYPE_UNKNOWN));
 
+  return 0;
+}
 
 /**
- * This function returns a list of the albums available on the
- * device. You can filter on the storage ID.
- *
- * @param device a pointer to the device to get the album listing from.
- * @param storage_id ID of device storage (if null, all storages)
- *
- * @return an album list on success, else NULL. If there are no albums
- *         on the device, NULL will be returned as well.
- * @see LIBMTP_Get_Album()
+ * Retrieve the thumbnail for a file.
+ * @param device a pointer to the device to get the thumbnail from.
+ * @param id the object ID of the file to retrieve the thumbnail for.
+ * @return 0 on success, any other value means failure.
  */
-LIBMTP_album_t *LIBMTP_Get_Album_List_For_Storage(LIBMTP_mtpdevice_t *device, uint32_t const storage_id)
+int LIBMTP_Get_Thumbnail(LIBMTP_mtpdevice_t *device, uint32_t const id,
+                         unsigned char **data, unsigned int *size)
 {
   PTPParams *params = (PTPParams *) device->params;
-  LIBMTP_album_t *retalbums = NULL;
-  LIBMTP_album_t *curalbum = NULL;
-  uint32_t i;
-
-  // Get all the handles if we haven't already done that
-  if (params->nrofobjects == 0)
-    flush_handles(device);
-
-  for (i = 0; i < params->nrofobjects; i++) {
-    LIBMTP_album_t *alb;
-    PTPObject *ob;
-    uint16_t ret;
-
-    ob = &params->objects[i];
-
-    // Ignore stuff that isn't an album
-    if ( ob->oi.ObjectFormat != PTP_OFC_MTP_AbstractAudioAlbum )
-      continue;
+  uint16_t ret;
 
-	// Ignore stuff that isn't into the storage device
-	if ((storage_id != 0) && (ob->oi.StorageID != storage_id ))
-		continue;
+  ret = ptp_getthumb(params, id, data, size);
+  if (ret == PTP_RC_OK)
+      return 0;
+  return -1;
+}
 
-    // Allocate a new album type
-    alb = LIBMTP_new_album_t();
-    alb->album_id = ob->oid;
-    alb->parent_id = ob->oi.ParentObject;
-    alb->storage_id = ob->oi.StorageID;
 
-    // Fetch supported metadata
-    get_album_metadata(device, alb);
+int LIBMTP_GetPartialObject(LIBMTP_mtpdevice_t *device, uint32_t const id,
+                            uint64_t offset, uint32_t maxbytes,
+                            unsigned char **data, unsigned int *size)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint16_t ret;
 
-    // Then get the track listing for this album
-    ret = ptp_mtp_getobjectreferences(params, alb->album_id, &alb->tracks, &alb->no_tracks);
-    if (ret != PTP_RC_OK) {
-      add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Album_List(): Could not get object references.");
-      alb->tracks = NULL;
-      alb->no_tracks = 0;
+  if (!ptp_operation_issupported(params, PTP_OC_ANDROID_GetPartialObject64)) {
+    if  (!ptp_operation_issupported(params, PTP_OC_GetPartialObject)) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+        "LIBMTP_GetPartialObject: PTP_OC_GetPartialObject not supported");
+      return -1;
     }
 
-    // Add album to a list that will be returned afterwards.
-    if (retalbums == NULL) {
-      retalbums = alb;
-      curalbum = alb;
-    } else {
-      curalbum->next = alb;
-      curalbum = alb;
+    if (offset >> 32 != 0) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+        "LIBMTP_GetPartialObject: PTP_OC_GetPartialObject only supports 32bit offsets");
+      return -1;
     }
 
+    ret = ptp_getpartialobject(params, id, (uint32_t)offset, maxbytes, data, size);
+  } else {
+    ret = ptp_android_getpartialobject64(params, id, offset, maxbytes, data, size);
   }
-  return retalbums;
+  if (ret == PTP_RC_OK)
+      return 0;
+  return -1;
 }
 
-/**
- * This function retrieves an individual album from the device.
- * @param device a pointer to the device to get the album from.
- * @param albid the unique ID of the album to retrieve.
- * @return a valid album metadata or NULL on failure.
- * @see LIBMTP_Get_Album_List()
- */
-LIBMTP_album_t *LIBMTP_Get_Album(LIBMTP_mtpdevice_t *device, uint32_t const albid)
+
+int LIBMTP_SendPartialObject(LIBMTP_mtpdevice_t *device, uint32_t const id,
+                             uint64_t offset, unsigned char *data, unsigned int size)
 {
   PTPParams *params = (PTPParams *) device->params;
   uint16_t ret;
-  PTPObject *ob;
-  LIBMTP_album_t *alb;
 
-  // Get all the handles if we haven't already done that
-  if (params->nrofobjects == 0)
-    flush_handles(device);
-
-  ret = ptp_object_want(params, albid, PTPOBJECT_OBJECTINFO_LOADED, &ob);
-  if (ret != PTP_RC_OK)
-    return NULL;
+  if (!ptp_operation_issupported(params, PTP_OC_ANDROID_SendPartialObject)) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+      "LIBMTP_SendPartialObject: PTP_OC_ANDROID_SendPartialObject not supported");
+    return -1;
+  }
 
-  // Ignore stuff that isn't an album
-  if (ob->oi.ObjectFormat != PTP_OFC_MTP_AbstractAudioAlbum)
-    return NULL;
+  ret = ptp_android_sendpartialobject(params, id, offset, data, size);
+  if (ret == PTP_RC_OK)
+      return 0;
+  return -1;
+}
 
-  // Allocate a new album type
-  alb = LIBMTP_new_album_t();
-  alb->album_id = ob->oid;
-  alb->parent_id = ob->oi.ParentObject;
-  alb->storage_id = ob->oi.StorageID;
 
-  // Fetch supported metadata
-  get_album_metadata(device, alb);
+int LIBMTP_BeginEditObject(LIBMTP_mtpdevice_t *device, uint32_t const id)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint16_t ret;
 
-  // Then get the track listing for this album
-  ret = ptp_mtp_getobjectreferences(params, alb->album_id, &alb->tracks, &alb->no_tracks);
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Album: Could not get object references.");
-    alb->tracks = NULL;
-    alb->no_tracks = 0;
+  if (!ptp_operation_issupported(params, PTP_OC_ANDROID_BeginEditObject)) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+      "LIBMTP_BeginEditObject: PTP_OC_ANDROID_BeginEditObject not supported");
+    return -1;
   }
 
-  return alb;
+  ret = ptp_android_begineditobject(params, id);
+  if (ret == PTP_RC_OK)
+      return 0;
+  return -1;
 }
 
-/**
- * This routine creates a new album based on the metadata
- * supplied. If the <code>tracks</code> field of the metadata
- * contains a track listing, these tracks will be added to the
- * album.
- * @param device a pointer to the device to create the new album on.
- * @param metadata the metadata for the new album. If the function
- *        exits with success, the <code>album_id</code> field of this
- *        struct will contain the new ID of the album.
- *        <ul>
- *        <li><code>metadata-&gt;parent_id</code> should be set to the parent
- *        (e.g. folder) to store this track in. Since some
- *        devices are a bit picky about where files
- *        are placed, a default folder will be chosen if libmtp
- *        has detected one for the current filetype and this
- *        parameter is set to 0. If this is 0 and no default folder
- *        can be found, the file will be stored in the root folder.
- *        <li><code>metadata-&gt;storage_id</code> should be set to the
- *        desired storage (e.g. memory card or whatever your device
- *        presents) to store this track in. Setting this to 0 will store
- *        the track on the primary storage.
- *        </ul>
- * @return 0 on success, any other value means failure.
- * @see LIBMTP_Update_Album()
- * @see LIBMTP_Delete_Object()
- */
-int LIBMTP_Create_New_Album(LIBMTP_mtpdevice_t *device,
-			    LIBMTP_album_t * const metadata)
+
+int LIBMTP_EndEditObject(LIBMTP_mtpdevice_t *device, uint32_t const id)
 {
-  uint32_t localph = metadata->parent_id;
+  PTPParams *params = (PTPParams *) device->params;
+  uint16_t ret;
 
-  // Use a default folder if none given
-  if (localph == 0) {
-    if (device->default_album_folder != 0)
-      localph = device->default_album_folder;
-    else
-      localph = device->default_music_folder;
+  if (!ptp_operation_issupported(params, PTP_OC_ANDROID_EndEditObject)) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+      "LIBMTP_EndEditObject: PTP_OC_ANDROID_EndEditObject not supported");
+    return -1;
   }
-  metadata->parent_id = localph;
 
-  // Just create a new abstract album...
-  return create_new_abstract_list(device,
-				  metadata->name,
-				  metadata->artist,
-				  metadata->composer,
-				  metadata->genre,
-				  localph,
-				  metadata->storage_id,
-				  PTP_OFC_MTP_AbstractAudioAlbum,
-				  ".alb",
-				  &metadata->album_id,
-				  metadata->tracks,
-				  metadata->no_tracks);
+  ret = ptp_android_endeditobject(params, id);
+  if (ret == PTP_RC_OK) {
+      // update cached object properties if metadata cache exists
+      update_metadata_cache(device, id);
+      return 0;
+  }
+  return -1;
 }
 
-/**
- * This creates a new sample data metadata structure and allocates memory
- * for it. Notice that if you add strings to this structure they
- * will be freed by the corresponding <code>LIBMTP_destroy_sampledata_t</code>
- * operation later, so be careful of using strdup() when assigning
- * strings.
- *
- * @return a pointer to the newly allocated metadata structure.
- * @see LIBMTP_destroy_sampledata_t()
- */
-LIBMTP_filesampledata_t *LIBMTP_new_filesampledata_t(void)
+
+int LIBMTP_TruncateObject(LIBMTP_mtpdevice_t *device, uint32_t const id,
+                          uint64_t offset)
 {
-  LIBMTP_filesampledata_t *new = (LIBMTP_filesampledata_t *) malloc(sizeof(LIBMTP_filesampledata_t));
-  if (new == NULL) {
-    return NULL;
+  PTPParams *params = (PTPParams *) device->params;
+  uint16_t ret;
+
+  if (!ptp_operation_issupported(params, PTP_OC_ANDROID_TruncateObject)) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+      "LIBMTP_TruncateObject: PTP_OC_ANDROID_TruncateObject not supported");
+    return -1;
   }
-  new->height=0;
-  new->width = 0;
-  new->data = NULL;
-  new->duration = 0;
-  new->size = 0;
-  return new;
+
+  ret = ptp_android_truncate(params, id, offset);
+  if (ret == PTP_RC_OK)
+      return 0;
+  return -1;
 }
 
+/*
+ * Delta updates compare the local file with the object in blocks of
+ * this size, and send runs of changed blocks of up to DELTA_MAX_RUN
+ * bytes at a time.
+ */
+#define DELTA_BLOCK_SIZE       (64*1024)
+#define DELTA_MAX_RUN          (16*DELTA_BLOCK_SIZE)
+
+/*
+ * A manifest starts with the magic, the block size, the number of
+ * blocks, the object size and modification date, followed by the
+ * 64-bit hash of each block. Everything is little endian.
+ */
+#define DELTA_MANIFEST_MAGIC   "LIBMTPD1"
+#define DELTA_MANIFEST_HDR_LEN 32
+
 /**
- * This destroys a file sample metadata type.
- * @param sample the file sample metadata to be destroyed.
+ * FNV-1a hash of a block. This is not a cryptographic hash, it only
+ * has to tell blocks apart that were changed by accident, not on
+ * purpose.
  */
-void LIBMTP_destroy_filesampledata_t(LIBMTP_filesampledata_t * sample)
+static uint64_t delta_hash(unsigned char const *data, uint32_t const len)
 {
-  if (sample == NULL) {
-    return;
-  }
-  if (sample->data != NULL) {
-    free(sample->data);
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  uint32_t i;
+
+  for (i = 0; i < len; i++) {
+    hash ^= data[i];
+    hash *= 0x100000001b3ULL;
   }
-  free(sample);
+  return hash;
 }
 
-/**
- * This routine figures out whether a certain filetype supports
- * representative samples (small thumbnail images) or not. This
- * typically applies to JPEG files, MP3 files and Album abstract
- * playlists, but in theory any filetype could support representative
- * samples.
- * @param device a pointer to the device which is to be examined.
- * @param filetype the fileype to examine, and return the representative sample
- *        properties for.
- * @param sample this will contain a new sample type with the fields
- *        filled in with suitable default values. For example, the
- *        supported sample type will be set, the supported height and
- *        width will be set to max values if it is an image sample,
- *        and duration will also be given some suitable default value
- *        which should not be exceeded on audio samples. If the
- *        device does not support samples for this filetype, this
- *        pointer will be NULL. If it is not NULL, the user must
- *        destroy this struct with <code>LIBMTP_destroy_filesampledata_t()</code>
- *        after use.
- * @return 0 on success, any other value means failure.
- * @see LIBMTP_Send_Representative_Sample()
- * @see LIBMTP_Create_New_Album()
- */
-int LIBMTP_Get_Representative_Sample_Format(LIBMTP_mtpdevice_t *device,
-					    LIBMTP_filetype_t const filetype,
-					    LIBMTP_filesampledata_t ** sample)
+static void delta_put_le(unsigned char *dest, uint64_t val, int const len)
 {
-  uint16_t ret;
-  PTPParams *params = (PTPParams *) device->params;
-  uint16_t *props = NULL;
-  uint32_t propcnt = 0;
   int i;
-  // TODO: Get rid of these when we can properly query the device.
-  int support_data = 0;
-  int support_format = 0;
-  int support_height = 0;
-  int support_width = 0;
-  int support_duration = 0;
-  int support_size = 0;
-
-  PTPObjectPropDesc opd_height;
-  PTPObjectPropDesc opd_width;
-  PTPObjectPropDesc opd_format;
-  PTPObjectPropDesc opd_duration;
-  PTPObjectPropDesc opd_size;
 
-  // Default to no type supported.
-  *sample = NULL;
-
-  ret = ptp_mtp_getobjectpropssupported(params, map_libmtp_type_to_ptp_type(filetype), &propcnt, &props);
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Representative_Sample_Format(): could not get object properties.");
-    return -1;
-  }
-  /*
-   * TODO: when walking through these object properties, make calls to
-   * a new function in ptp.h/ptp.c that can send the command
-   * PTP_OC_MTP_GetObjectPropDesc to get max/min values of the properties
-   * supported.
-   */
-  for (i = 0; i < propcnt; i++) {
-    switch(props[i]) {
-    case PTP_OPC_RepresentativeSampleData:
-      support_data = 1;
-      break;
-    case PTP_OPC_RepresentativeSampleFormat:
-      support_format = 1;
-      break;
-    case PTP_OPC_RepresentativeSampleSize:
-      support_size = 1;
-      break;
-    case PTP_OPC_RepresentativeSampleHeight:
-      support_height = 1;
-      break;
-    case PTP_OPC_RepresentativeSampleWidth:
-      support_width = 1;
-      break;
-    case PTP_OPC_RepresentativeSampleDuration:
-      support_duration = 1;
-      break;
-    default:
+  for (i = 0; i < len; i++, val >>= 8)
+    dest[i] = val & 0xff;
+}
+
+static uint64_t delta_get_le(unsigned char const *src, int const len)
+{
+  uint64_t val = 0;
+  int i;
+
+  for (i = len - 1; i >= 0; i--)
+    val = (val << 8) | src[i];
+  return val;
+}
+
+/**
+ * Read as much as possible of a block from a local file.
+ * @return the number of bytes read, -1 on failure.
+ */
+static int64_t delta_read(int const fd, unsigned char *buf, uint32_t const len)
+{
+  uint32_t got = 0;
+
+  while (got < len) {
+    ssize_t n = read(fd, buf + got, len - got);
+
+    if (n < 0)
+      return -1;
+    if (n == 0)
       break;
-    }
+    got += n;
   }
-  free(props);
+  return got;
+}
 
-  if (support_data && support_format && support_height && support_width && !support_duration) {
-    // Something that supports height and width and not duration is likely to be JPEG
-    LIBMTP_filesampledata_t *retsam = LIBMTP_new_filesampledata_t();
-    /*
-     * Populate the sample format with the first supported format
-     *
-     * TODO: figure out how to pass back more than one format if more are
-     * supported by the device.
-     */
-    ptp_mtp_getobjectpropdesc (params, PTP_OPC_RepresentativeSampleFormat, map_libmtp_type_to_ptp_type(filetype), &opd_format);
-    retsam->filetype = map_ptp_type_to_libmtp_type(opd_format.FORM.Enum.SupportedValue[0].u16);
-    ptp_free_objectpropdesc(&opd_format);
-    /* Populate the maximum image height */
-    ptp_mtp_getobjectpropdesc (params, PTP_OPC_RepresentativeSampleWidth, map_libmtp_type_to_ptp_type(filetype), &opd_width);
-    retsam->width = opd_width.FORM.Range.MaximumValue.u32;
-    ptp_free_objectpropdesc(&opd_width);
-    /* Populate the maximum image width */
-    ptp_mtp_getobjectpropdesc (params, PTP_OPC_RepresentativeSampleHeight, map_libmtp_type_to_ptp_type(filetype), &opd_height);
-    retsam->height = opd_height.FORM.Range.MaximumValue.u32;
-    ptp_free_objectpropdesc(&opd_height);
-    /* Populate the maximum size */
-    if (support_size) {
-      ptp_mtp_getobjectpropdesc (params, PTP_OPC_RepresentativeSampleSize, map_libmtp_type_to_ptp_type(filetype), &opd_size);
-      retsam->size = opd_size.FORM.Range.MaximumValue.u32;
-      ptp_free_objectpropdesc(&opd_size);
-    }
-    *sample = retsam;
-  } else if (support_data && support_format && !support_height && !support_width && support_duration) {
-    // Another qualified guess
-    LIBMTP_filesampledata_t *retsam = LIBMTP_new_filesampledata_t();
-    /*
-     * Populate the sample format with the first supported format
-     *
-     * TODO: figure out how to pass back more than one format if more are
-     * supported by the device.
-     */
-    ptp_mtp_getobjectpropdesc (params, PTP_OPC_RepresentativeSampleFormat, map_libmtp_type_to_ptp_type(filetype), &opd_format);
-    retsam->filetype = map_ptp_type_to_libmtp_type(opd_format.FORM.Enum.SupportedValue[0].u16);
-    ptp_free_objectpropdesc(&opd_format);
-    /* Populate the maximum duration */
-    ptp_mtp_getobjectpropdesc (params, PTP_OPC_RepresentativeSampleDuration, map_libmtp_type_to_ptp_type(filetype), &opd_duration);
-    retsam->duration = opd_duration.FORM.Range.MaximumValue.u32;
-    ptp_free_objectpropdesc(&opd_duration);
-    /* Populate the maximum size */
-    if (support_size) {
-      ptp_mtp_getobjectpropdesc (params, PTP_OPC_RepresentativeSampleSize, map_libmtp_type_to_ptp_type(filetype), &opd_size);
-      retsam->size = opd_size.FORM.Range.MaximumValue.u32;
-      ptp_free_objectpropdesc(&opd_size);
-    }
-    *sample = retsam;
+/**
+ * Loads the manifest of an object, if it still describes the object.
+ * @param path the manifest file.
+ * @param filesize the current size of the object.
+ * @param modificationdate the current modification date of the object.
+ * @param hashes the block hashes are returned here, to be freed by
+ *        the caller.
+ * @param nrofhashes the number of hashes is returned here.
+ * @return 0 if a matching manifest was loaded, -1 otherwise.
+ */
+static int load_delta_manifest(char const * const path,
+			       uint64_t const filesize,
+			       time_t const modificationdate,
+			       uint64_t **hashes, uint32_t *nrofhashes)
+{
+  unsigned char hdr[DELTA_MANIFEST_HDR_LEN];
+  unsigned char *raw;
+  uint32_t n;
+  uint32_t i;
+  int fd;
+
+  *hashes = NULL;
+  *nrofhashes = 0;
+#ifdef __WIN32__
+#ifdef USE_WINDOWS_IO_H
+  if ( (fd = _open(path, O_RDONLY|O_BINARY)) == -1 )
+#else
+  if ( (fd = open(path, O_RDONLY|O_BINARY)) == -1 )
+#endif
+#else
+  if ( (fd = open(path, O_RDONLY)) == -1)
+#endif
+    return -1;
+  if (delta_read(fd, hdr, sizeof(hdr)) != sizeof(hdr) ||
+      memcmp(hdr, DELTA_MANIFEST_MAGIC, 8) != 0 ||
+      delta_get_le(hdr + 8, 4) != DELTA_BLOCK_SIZE ||
+      delta_get_le(hdr + 16, 8) != filesize ||
+      (time_t) delta_get_le(hdr + 24, 8) != modificationdate) {
+    close(fd);
+    return -1;
   }
+  n = delta_get_le(hdr + 12, 4);
+  if (n != (filesize + DELTA_BLOCK_SIZE - 1) / DELTA_BLOCK_SIZE) {
+    close(fd);
+    return -1;
+  }
+  raw = malloc(n * 8 + 1);
+  *hashes = malloc(n * sizeof(uint64_t) + 1);
+  if (raw == NULL || *hashes == NULL ||
+      delta_read(fd, raw, n * 8) != (int64_t) n * 8) {
+    free(raw);
+    free(*hashes);
+    *hashes = NULL;
+    close(fd);
+    return -1;
+  }
+  close(fd);
+  for (i = 0; i < n; i++)
+    (*hashes)[i] = delta_get_le(raw + i * 8, 8);
+  free(raw);
+  *nrofhashes = n;
   return 0;
 }
 
 /**
- * This routine sends representative sample data for an object.
- * This uses the RepresentativeSampleData property of the album,
- * if the device supports it. The data should be of a format acceptable
- * to the player (for iRiver and Creative, this seems to be JPEG) and
- * must not be too large. (for a Creative, max seems to be about 20KB.)
- * Check by calling LIBMTP_Get_Representative_Sample_Format() to get
- * maximum size, dimensions, etc..
- * @param device a pointer to the device which the object is on.
- * @param id unique id of the object to set artwork for.
- * @param pointer to LIBMTP_filesampledata_t struct containing data
- * @return 0 on success, any other value means failure.
- * @see LIBMTP_Get_Representative_Sample()
- * @see LIBMTP_Get_Representative_Sample_Format()
- * @see LIBMTP_Create_New_Album()
+ * Gets the modification date that a manifest is keyed on straight
+ * from the device. The date in the object info and the one in the
+ * property list may differ, and the cache may hold either, so the
+ * property is asked for every time.
+ * @param device a pointer to the device the object is on.
+ * @param id the object.
+ * @param fallback the date to use if the device has no such property.
+ * @return the modification date, 0 if unknown.
  */
-int LIBMTP_Send_Representative_Sample(LIBMTP_mtpdevice_t *device,
-                          uint32_t const id,
-                          LIBMTP_filesampledata_t *sampledata)
+static time_t get_delta_date(LIBMTP_mtpdevice_t *device, uint32_t const id,
+			     time_t const fallback)
 {
-  uint16_t ret;
   PTPParams *params = (PTPParams *) device->params;
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
   PTPPropertyValue propval;
-  PTPObject *ob;
-  uint32_t i;
-  uint16_t *props = NULL;
-  uint32_t propcnt = 0;
-  int supported = 0;
+  time_t date;
+
+  if (!ptp_operation_issupported(params, PTP_OC_MTP_GetObjectPropValue))
+    return fallback;
+  if (ptp_mtp_getobjectpropvalue(params, id, PTP_OPC_DateModified,
+				 &propval, PTP_DTC_STR) != PTP_RC_OK)
+    return fallback;
+  if (propval.str == NULL)
+    return 0;
+  date = ptp_parse_date(params, propval.str);
+  free(propval.str);
+  return date;
+}
 
-  // get the file format for the object we're going to send representative data for
-  ret = ptp_object_want (params, id, PTPOBJECT_OBJECTINFO_LOADED, &ob);
-  if (ret != PTP_RC_OK) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Send_Representative_Sample(): could not get object info.");
-    return -1;
+/**
+ * Checks the first and the last block of an object on the device
+ * against the hashes in its manifest. This catches most changes made
+ * on the device that kept the size and the modification date.
+ * @return 1 if they match, 0 otherwise.
+ */
+static int check_delta_manifest(LIBMTP_mtpdevice_t *device, uint32_t const id,
+				uint64_t const filesize,
+				uint64_t const * const hashes,
+				uint32_t const nrofhashes)
+{
+  uint32_t blocks[2];
+  int i;
+
+  if (nrofhashes == 0)
+    return 1;
+  blocks[0] = 0;
+  blocks[1] = nrofhashes - 1;
+  for (i = 0; i < 2; i++) {
+    uint64_t offset = (uint64_t) blocks[i] * DELTA_BLOCK_SIZE;
+    uint32_t len = DELTA_BLOCK_SIZE;
+    unsigned char *remote = NULL;
+    unsigned int got = 0;
+    int match;
+
+    if (filesize - offset < len)
+      len = filesize - offset;
+    match = LIBMTP_GetPartialObject(device, id, offset, len, &remote, &got) == 0 &&
+      got == len && delta_hash(remote, len) == hashes[blocks[i]];
+    free(remote);
+    if (!match)
+      return 0;
   }
+  return 1;
+}
 
-  // check that we can send representative sample data for this object format
-  ret = ptp_mtp_getobjectpropssupported(params, ob->oi.ObjectFormat, &propcnt, &props);
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Send_Representative_Sample(): could not get object properties.");
+/**
+ * Saves the manifest of an object.
+ * @return 0 on success, -1 on failure.
+ */
+static int save_delta_manifest(char const * const path,
+			       uint64_t const filesize,
+			       time_t const modificationdate,
+			       uint64_t const * const hashes,
+			       uint32_t const nrofhashes)
+{
+  unsigned char *raw;
+  uint32_t len = DELTA_MANIFEST_HDR_LEN + nrofhashes * 8;
+  uint32_t done = 0;
+  uint32_t i;
+  int fd;
+
+  raw = malloc(len);
+  if (raw == NULL)
     return -1;
-  }
+  memcpy(raw, DELTA_MANIFEST_MAGIC, 8);
+  delta_put_le(raw + 8, DELTA_BLOCK_SIZE, 4);
+  delta_put_le(raw + 12, nrofhashes, 4);
+  delta_put_le(raw + 16, filesize, 8);
+  delta_put_le(raw + 24, (uint64_t) modificationdate, 8);
+  for (i = 0; i < nrofhashes; i++)
+    delta_put_le(raw + DELTA_MANIFEST_HDR_LEN + i * 8, hashes[i], 8);
 
-  for (i = 0; i < propcnt; i++) {
-    if (props[i] == PTP_OPC_RepresentativeSampleData) {
-      supported = 1;
-      break;
-    }
-  }
-  if (!supported) {
-    free(props);
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Send_Representative_Sample(): object type doesn't support RepresentativeSampleData.");
+#ifdef __WIN32__
+#ifdef USE_WINDOWS_IO_H
+  if ( (fd = _open(path, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY,_S_IREAD|_S_IWRITE)) == -1 ) {
+#else
+  if ( (fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY,S_IRWXU)) == -1 ) {
+#endif
+#else
+  if ( (fd = open(path, O_WRONLY|O_CREAT|O_TRUNC,S_IRUSR|S_IWUSR)) == -1) {
+#endif
+    free(raw);
     return -1;
   }
-  free(props);
+  while (done < len) {
+    ssize_t n = write(fd, raw + done, len - done);
 
-  // Go ahead and send the data
-  propval.a.count = sampledata->size;
-  propval.a.v = malloc(sizeof(PTPPropertyValue) * sampledata->size);
-  for (i = 0; i < sampledata->size; i++) {
-    propval.a.v[i].u8 = sampledata->data[i];
+    if (n <= 0)
+      break;
+    done += n;
   }
-
-  ret = ptp_mtp_setobjectpropvalue(params,id,PTP_OPC_RepresentativeSampleData,
-				   &propval,PTP_DTC_AUINT8);
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Send_Representative_Sample(): could not send sample data.");
-    free(propval.a.v);
+  free(raw);
+  if (close(fd) != 0 || done < len) {
+    unlink(path);
     return -1;
   }
-  free(propval.a.v);
-
-  /* Set the height and width if the sample is an image, otherwise just
-   * set the duration and size */
-  switch(sampledata->filetype) {
-  case LIBMTP_FILETYPE_JPEG:
-  case LIBMTP_FILETYPE_JFIF:
-  case LIBMTP_FILETYPE_TIFF:
-  case LIBMTP_FILETYPE_BMP:
-  case LIBMTP_FILETYPE_GIF:
-  case LIBMTP_FILETYPE_PICT:
-  case LIBMTP_FILETYPE_PNG:
-    if (!FLAG_BROKEN_SET_SAMPLE_DIMENSIONS(ptp_usb)) {
-      // For images, set the height and width
-      set_object_u32(device, id, PTP_OPC_RepresentativeSampleHeight, sampledata->height);
-      set_object_u32(device, id, PTP_OPC_RepresentativeSampleWidth, sampledata->width);
-    }
-    break;
-  default:
-    // For anything not an image, set the duration and size
-    set_object_u32(device, id, PTP_OPC_RepresentativeSampleDuration, sampledata->duration);
-    set_object_u32(device, id, PTP_OPC_RepresentativeSampleSize, sampledata->size);
-    break;
-  }
-
   return 0;
 }
 
 /**
- * This routine gets representative sample data for an object.
- * This uses the RepresentativeSampleData property of the album,
- * if the device supports it.
- * @param device a pointer to the device which the object is on.
- * @param id unique id of the object to get data for.
- * @param pointer to LIBMTP_filesampledata_t struct to receive data
- * @return 0 on success, any other value means failure.
- * @see LIBMTP_Send_Representative_Sample()
- * @see LIBMTP_Get_Representative_Sample_Format()
- * @see LIBMTP_Create_New_Album()
+ * This updates a file that is already on the device with a changed
+ * local copy, sending only the parts that changed. This is much less
+ * work than deleting the file and sending it again for large files
+ * with small changes, like an edited database or an e-book with new
+ * notes, and wears the flash of the device less.
+ *
+ * The local file is compared with the file on the device in blocks.
+ * If a manifest from an earlier update of this file is given and the
+ * file has not changed on the device since, the blocks are compared
+ * with the block hashes in the manifest. The file counts as unchanged
+ * if its size and modification date are the same as when the manifest
+ * was written and, if the device can send parts of files, its first
+ * and last blocks still match. A device that reports no modification
+ * date never gets a manifest. Otherwise the blocks are compared
+ * with the blocks read back from the device, or, if the device cannot
+ * send parts of files, all of the file is sent. Afterwards the
+ * manifest is written for the next update.
+ *
+ * This needs a device that can edit objects in place, which are
+ * mostly Android devices. On other devices the file has to be deleted
+ * and sent again. If the update fails halfway the file on the device
+ * may be partially updated, and the manifest is removed.
+ *
+ * @param device a pointer to the device the file is on.
+ * @param id the file ID of the file to update.
+ * @param path the local file with the new contents.
+ * @param manifest a file to keep the block hashes of the file on the
+ *        device in between updates, or NULL to always compare with
+ *        the device.
+ * @param callback a progress indicator function or NULL to ignore.
+ *        It is called with the number of changed bytes sent so far
+ *        and the total number of changed bytes.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function in order to
+ *             pass along some user defined data to the progress
+ *             updates. If not used, set this to NULL.
+ * @return 0 if the file was updated, any other value means failure.
+ * @see LIBMTP_Send_File_From_File()
  */
-int LIBMTP_Get_Representative_Sample(LIBMTP_mtpdevice_t *device,
-                          uint32_t const id,
-                          LIBMTP_filesampledata_t *sampledata)
+int LIBMTP_Update_File_From_File(LIBMTP_mtpdevice_t *device,
+				 uint32_t const id,
+				 char const * const path,
+				 char const * const manifest,
+				 LIBMTP_progressfunc_t const callback,
+				 void const * const data)
 {
-  uint16_t ret;
   PTPParams *params = (PTPParams *) device->params;
-  PTPPropertyValue propval;
-  PTPObject *ob;
+  LIBMTP_file_t *file;
+  struct stat st;
+  uint64_t oldsize;
+  uint64_t newsize;
+  time_t olddate;
+  uint64_t *oldhashes = NULL;
+  uint32_t nrofoldhashes = 0;
+  uint64_t *hashes = NULL;
+  uint8_t *changed = NULL;
+  uint32_t nrofblocks;
+  unsigned char *buf = NULL;
+  uint64_t tosend = 0;
+  uint64_t sent = 0;
+  int can_read;
+  int editing = 0;
+  int retval = -1;
   uint32_t i;
-  uint16_t *props = NULL;
-  uint32_t propcnt = 0;
-  int supported = 0;
+  int fd;
 
-  // get the file format for the object we're going to send representative data for
-  ret = ptp_object_want (params, id, PTPOBJECT_OBJECTINFO_LOADED, &ob);
-  if (ret != PTP_RC_OK) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_Representative_Sample(): could not get object info.");
+  if (path == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_File_From_File(): Bad arguments, path was NULL.");
+    return -1;
+  }
+  if (!ptp_operation_issupported(params, PTP_OC_ANDROID_BeginEditObject) ||
+      !ptp_operation_issupported(params, PTP_OC_ANDROID_SendPartialObject) ||
+      !ptp_operation_issupported(params, PTP_OC_ANDROID_EndEditObject)) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_File_From_File(): "
+			    "the device cannot edit objects in place.");
     return -1;
   }
 
-  // check that we can store representative sample data for this object format
-  ret = ptp_mtp_getobjectpropssupported(params, ob->oi.ObjectFormat, &propcnt, &props);
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Representative_Sample(): could not get object properties.");
+  file = LIBMTP_Get_Filemetadata(device, id);
+  if (file == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_File_From_File(): Could not get object info.");
     return -1;
   }
+  oldsize = file->filesize;
+  olddate = file->modificationdate;
+  LIBMTP_destroy_file_t(file);
+  can_read = ptp_operation_issupported(params, PTP_OC_ANDROID_GetPartialObject64) ||
+    (ptp_operation_issupported(params, PTP_OC_GetPartialObject) &&
+     oldsize <= 0xFFFFFFFFU);
 
-  for (i = 0; i < propcnt; i++) {
-    if (props[i] == PTP_OPC_RepresentativeSampleData) {
-      supported = 1;
-      break;
+#ifdef __WIN32__
+#ifdef USE_WINDOWS_IO_H
+  if ( (fd = _open(path, O_RDONLY|O_BINARY)) == -1 ) {
+#else
+  if ( (fd = open(path, O_RDONLY|O_BINARY)) == -1 ) {
+#endif
+#else
+  if ( (fd = open(path, O_RDONLY)) == -1) {
+#endif
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_File_From_File(): Could not open source file.");
+    return -1;
+  }
+  if (fstat(fd, &st) != 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_File_From_File(): Could not stat source file.");
+    close(fd);
+    return -1;
+  }
+  newsize = st.st_size;
+  if (newsize > 0xFFFFFFFFULL * DELTA_BLOCK_SIZE) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_File_From_File(): Source file too large.");
+    close(fd);
+    return -1;
+  }
+  nrofblocks = (newsize + DELTA_BLOCK_SIZE - 1) / DELTA_BLOCK_SIZE;
+
+  if (manifest != NULL) {
+    olddate = get_delta_date(device, id, olddate);
+    // Without a date a change on the device could go unnoticed
+    if (olddate != 0 &&
+	load_delta_manifest(manifest, oldsize, olddate,
+			    &oldhashes, &nrofoldhashes) == 0 &&
+	can_read &&
+	!check_delta_manifest(device, id, oldsize, oldhashes, nrofoldhashes)) {
+      free(oldhashes);
+      oldhashes = NULL;
+      nrofoldhashes = 0;
+    }
+  }
+
+  buf = malloc(DELTA_MAX_RUN);
+  hashes = malloc(nrofblocks * sizeof(uint64_t) + 1);
+  changed = malloc(nrofblocks + 1);
+  if (buf == NULL || hashes == NULL || changed == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION, "LIBMTP_Update_File_From_File(): out of memory.");
+    goto out;
+  }
+
+  // First find out which blocks changed
+  for (i = 0; i < nrofblocks; i++) {
+    uint64_t offset = (uint64_t) i * DELTA_BLOCK_SIZE;
+    uint32_t len = DELTA_BLOCK_SIZE;
+    uint32_t oldlen = 0;
+
+    if (newsize - offset < len)
+      len = newsize - offset;
+    if (delta_read(fd, buf, len) != len) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_File_From_File(): Could not read source file.");
+      goto out;
+    }
+    hashes[i] = delta_hash(buf, len);
+    if (offset < oldsize)
+      oldlen = oldsize - offset < DELTA_BLOCK_SIZE ? oldsize - offset : DELTA_BLOCK_SIZE;
+
+    // Blocks at the end that grew, shrank or are new always changed
+    changed[i] = 1;
+    if (oldlen == len && oldhashes != NULL) {
+      changed[i] = hashes[i] != oldhashes[i];
+    } else if (oldlen == len && can_read) {
+      unsigned char *remote = NULL;
+      unsigned int got = 0;
+
+      if (LIBMTP_GetPartialObject(device, id, offset, len, &remote, &got) == 0 &&
+	  got == len && memcmp(remote, buf, len) == 0)
+	changed[i] = 0;
+      free(remote);
     }
+    if (changed[i])
+      tosend += len;
   }
-  if (!supported) {
-    free(props);
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_Representative_Sample(): object type doesn't support RepresentativeSampleData.");
-    return -1;
-  }
-  free(props);
 
-  // Get the data
-  ret = ptp_mtp_getobjectpropvalue(params,id,PTP_OPC_RepresentativeSampleData,
-				   &propval,PTP_DTC_AUINT8);
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Representative_Sample(): could not get sample data.");
-    return -1;
+  if (tosend == 0 && newsize == oldsize) {
+    retval = 0;
+    goto manifest;
   }
 
-  // Store it
-  sampledata->size = propval.a.count;
-  sampledata->data = malloc(sizeof(PTPPropertyValue) * propval.a.count);
-  for (i = 0; i < propval.a.count; i++) {
-    sampledata->data[i] = propval.a.v[i].u8;
+  if (LIBMTP_BeginEditObject(device, id) != 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_File_From_File(): Could not begin editing the object.");
+    goto out;
   }
-  free(propval.a.v);
+  editing = 1;
 
-  // Get the other properties
-  sampledata->width = get_u32_from_object(device, id, PTP_OPC_RepresentativeSampleWidth, 0);
-  sampledata->height = get_u32_from_object(device, id, PTP_OPC_RepresentativeSampleHeight, 0);
-  sampledata->duration = get_u32_from_object(device, id, PTP_OPC_RepresentativeSampleDuration, 0);
-  sampledata->filetype = map_ptp_type_to_libmtp_type(
-        get_u16_from_object(device, id, PTP_OPC_RepresentativeSampleFormat, LIBMTP_FILETYPE_UNKNOWN));
+  // Send each run of changed blocks
+  i = 0;
+  while (i < nrofblocks) {
+    uint64_t offset;
+    uint32_t first;
+    int64_t len;
 
-  return 0;
+    if (!changed[i]) {
+      i++;
+      continue;
+    }
+    first = i;
+    while (i < nrofblocks && changed[i] && i - first < DELTA_MAX_RUN / DELTA_BLOCK_SIZE)
+      i++;
+    offset = (uint64_t) first * DELTA_BLOCK_SIZE;
+    if (lseek(fd, offset, SEEK_SET) == (off_t) -1 ||
+	(len = delta_read(fd, buf, (i - first) * DELTA_BLOCK_SIZE)) <= 0) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_File_From_File(): Could not read source file.");
+      goto out;
+    }
+    if (LIBMTP_SendPartialObject(device, id, offset, buf, len) != 0) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_File_From_File(): Could not send changed blocks.");
+      goto out;
+    }
+    sent += len;
+    if (callback != NULL && callback(sent, tosend, data) != 0) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED, "LIBMTP_Update_File_From_File(): Cancelled transfer.");
+      goto out;
+    }
+  }
+
+  if (newsize < oldsize &&
+      LIBMTP_TruncateObject(device, id, newsize) != 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_File_From_File(): Could not truncate object.");
+    goto out;
+  }
+
+  editing = 0;
+  if (LIBMTP_EndEditObject(device, id) != 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_File_From_File(): Could not end editing the object.");
+    goto out;
+  }
+  retval = 0;
+
+ manifest:
+  if (manifest != NULL) {
+    time_t newdate = 0;
+
+    // The device has a new modification date for the object now
+    file = LIBMTP_Get_Filemetadata(device, id);
+    if (file != NULL)
+      newdate = get_delta_date(device, id, file->modificationdate);
+    if (file == NULL || file->filesize != newsize) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_File_From_File(): Could not save manifest.");
+      retval = -1;
+    } else if (newdate == 0) {
+      // Such a manifest would never be used, see above
+      unlink(manifest);
+    } else if (save_delta_manifest(manifest, file->filesize, newdate,
+				   hashes, nrofblocks) != 0) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_File_From_File(): Could not save manifest.");
+      retval = -1;
+    }
+    if (file != NULL)
+      LIBMTP_destroy_file_t(file);
+  }
+
+ out:
+  if (editing)
+    LIBMTP_EndEditObject(device, id);
+  if (retval != 0 && manifest != NULL)
+    unlink(manifest);
+  close(fd);
+  free(buf);
+  free(hashes);
+  free(changed);
+  free(oldhashes);
+  return retval;
 }
 
-/**
- * Retrieve the thumbnail for a file.
- * @param device a pointer to the device to get the thumbnail from.
- * @param id the object ID of the file to retrieve the thumbnail for.
- * @return 0 on success, any other value means failure.
+/*
+ * Object readers keep a few blocks of the object. Random reads fetch
+ * aligned blocks of the smallest size; sequential reads double the
+ * size of each fetch up to the largest.
+ */
+#define READER_NROFBLOCKS   4
+#define READER_MIN_FETCH    (64*1024)
+#define READER_MAX_FETCH    (4*1024*1024)
+
+typedef struct {
+  uint64_t offset; /**< Where in the object the block starts */
+  unsigned char *data; /**< The block, NULL if unused */
+  uint32_t len; /**< Length of the block */
+  unsigned int used; /**< Reader clock of the last use */
+} reader_block_t;
+
+struct LIBMTP_object_reader_struct {
+  LIBMTP_mtpdevice_t *device; /**< Device the object is on */
+  uint32_t id; /**< The object being read */
+  uint64_t size; /**< Size of the object */
+  uint64_t pos; /**< Position for reads that do not give one */
+  uint64_t seqend; /**< Where the last fetch ended */
+  uint32_t fetch; /**< Size of the next sequential fetch */
+  unsigned int clock; /**< Bumped on every block use */
+  reader_block_t blocks[READER_NROFBLOCKS];
+};
+
+/**
+ * This opens an object on the device for reading parts of it, for
+ * instance to look at the headers of a media file without getting the
+ * whole file. The reader fetches ahead while the object is read from
+ * start to end, and keeps a few blocks around for reads that jump
+ * back and forth. It needs a device that can send parts of an object.
+ *
+ * A reader must only be used by one thread at a time.
+ *
+ * @param device a pointer to the device the object is on.
+ * @param id the object ID of the object to read.
+ * @return a reader to use with <code>LIBMTP_Read_Object_Reader()</code>
+ *         and friends, or NULL on failure. Close it with
+ *         <code>LIBMTP_Close_Object_Reader()</code>.
+ * @see LIBMTP_GetPartialObject()
  */
-int LIBMTP_Get_Thumbnail(LIBMTP_mtpdevice_t *device, uint32_t const id,
-                         unsigned char **data, unsigned int *size)
+LIBMTP_object_reader_t *LIBMTP_Open_Object_Reader(LIBMTP_mtpdevice_t *device,
+						  uint32_t const id)
 {
   PTPParams *params = (PTPParams *) device->params;
-  uint16_t ret;
+  LIBMTP_object_reader_t *reader;
+  LIBMTP_file_t *file;
 
-  ret = ptp_getthumb(params, id, data, size);
-  if (ret == PTP_RC_OK)
-      return 0;
-  return -1;
+  if (!ptp_operation_issupported(params, PTP_OC_ANDROID_GetPartialObject64) &&
+      !ptp_operation_issupported(params, PTP_OC_GetPartialObject)) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+      "LIBMTP_Open_Object_Reader(): the device cannot send parts of objects.");
+    return NULL;
+  }
+  file = LIBMTP_Get_Filemetadata(device, id);
+  if (file == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+      "LIBMTP_Open_Object_Reader(): could not get object info.");
+    return NULL;
+  }
+  reader = calloc(1, sizeof(LIBMTP_object_reader_t));
+  if (reader == NULL) {
+    LIBMTP_destroy_file_t(file);
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+      "LIBMTP_Open_Object_Reader(): out of memory.");
+    return NULL;
+  }
+  reader->device = device;
+  reader->id = id;
+  reader->size = file->filesize;
+  reader->fetch = READER_MIN_FETCH;
+  LIBMTP_destroy_file_t(file);
+  return reader;
 }
 
-
-int LIBMTP_GetPartialObject(LIBMTP_mtpdevice_t *device, uint32_t const id,
-                            uint64_t offset, uint32_t maxbytes,
-                            unsigned char **data, unsigned int *size)
+/**
+ * Gets the block holding an offset of the object, fetching it from
+ * the device if it is not kept already.
+ * @return the block, or NULL on failure.
+ */
+static reader_block_t *get_reader_block(LIBMTP_object_reader_t *reader,
+					uint64_t const offset)
 {
-  PTPParams *params = (PTPParams *) device->params;
-  uint16_t ret;
+  reader_block_t *block = &reader->blocks[0];
+  uint64_t start;
+  uint32_t want;
+  unsigned char *data = NULL;
+  unsigned int got = 0;
+  int i;
 
-  if (!ptp_operation_issupported(params, PTP_OC_ANDROID_GetPartialObject64)) {
-    if  (!ptp_operation_issupported(params, PTP_OC_GetPartialObject)) {
-      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-        "LIBMTP_GetPartialObject: PTP_OC_GetPartialObject not supported");
-      return -1;
-    }
+  reader->clock++;
+  for (i = 0; i < READER_NROFBLOCKS; i++) {
+    reader_block_t *b = &reader->blocks[i];
 
-    if (offset >> 32 != 0) {
-      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-        "LIBMTP_GetPartialObject: PTP_OC_GetPartialObject only supports 32bit offsets");
-      return -1;
+    if (b->data != NULL && offset >= b->offset && offset < b->offset + b->len) {
+      b->used = reader->clock;
+      return b;
     }
+    // Reuse an empty block, or else the one unused the longest
+    if (block->data != NULL &&
+	(b->data == NULL || reader->clock - b->used > reader->clock - block->used))
+      block = b;
+  }
 
-    ret = ptp_getpartialobject(params, id, (uint32_t)offset, maxbytes, data, size);
+  if (offset == reader->seqend) {
+    // Going on where the last fetch ended, so fetch more next time
+    start = offset;
+    want = reader->fetch;
+    if (reader->fetch < READER_MAX_FETCH)
+      reader->fetch *= 2;
   } else {
-    ret = ptp_android_getpartialobject64(params, id, offset, maxbytes, data, size);
+    start = offset - offset % READER_MIN_FETCH;
+    want = READER_MIN_FETCH;
+    reader->fetch = READER_MIN_FETCH;
+  }
+  if (reader->size - start < want)
+    want = reader->size - start;
+  if (LIBMTP_GetPartialObject(reader->device, reader->id, start, want,
+			      &data, &got) != 0 || got == 0 ||
+      start + got <= offset) {
+    free(data);
+    add_error_to_errorstack(reader->device, LIBMTP_ERROR_GENERAL,
+      "get_reader_block(): could not get a part of the object.");
+    return NULL;
   }
-  if (ret == PTP_RC_OK)
-      return 0;
-  return -1;
+  free(block->data);
+  block->offset = start;
+  block->data = data;
+  block->len = got > want ? want : got;
+  block->used = reader->clock;
+  reader->seqend = start + block->len;
+  return block;
 }
 
-
-int LIBMTP_SendPartialObject(LIBMTP_mtpdevice_t *device, uint32_t const id,
-                             uint64_t offset, unsigned char *data, unsigned int size)
+/**
+ * This reads from a given offset of an object without moving the
+ * position of the reader.
+ * @param reader the reader to read with.
+ * @param buf where to put the data.
+ * @param count the number of bytes to read.
+ * @param offset where in the object to start reading.
+ * @return the number of bytes read, which is less than
+ *         <code>count</code> only at the end of the object, or -1 on
+ *         failure.
+ */
+int LIBMTP_Pread_Object_Reader(LIBMTP_object_reader_t *reader,
+			       void * const buf, uint32_t const count,
+			       uint64_t const offset)
 {
-  PTPParams *params = (PTPParams *) device->params;
-  uint16_t ret;
+  uint64_t pos = offset;
+  uint32_t left = count;
 
-  if (!ptp_operation_issupported(params, PTP_OC_ANDROID_SendPartialObject)) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-      "LIBMTP_SendPartialObject: PTP_OC_ANDROID_SendPartialObject not supported");
-    return -1;
-  }
+  if (left > INT_MAX)
+    left = INT_MAX;
+  if (pos >= reader->size)
+    return 0;
+  if (reader->size - pos < left)
+    left = reader->size - pos;
+  while (left > 0) {
+    reader_block_t *block = get_reader_block(reader, pos);
+    uint32_t skip, len;
 
-  ret = ptp_android_sendpartialobject(params, id, offset, data, size);
-  if (ret == PTP_RC_OK)
-      return 0;
-  return -1;
+    if (block == NULL)
+      return -1;
+    skip = pos - block->offset;
+    len = block->len - skip;
+    if (len > left)
+      len = left;
+    memcpy((unsigned char *) buf + (pos - offset), block->data + skip, len);
+    pos += len;
+    left -= len;
+  }
+  return pos - offset;
 }
 
-
-int LIBMTP_BeginEditObject(LIBMTP_mtpdevice_t *device, uint32_t const id)
+/**
+ * This reads from the position of the reader and moves it past the
+ * data read.
+ * @param reader the reader to read with.
+ * @param buf where to put the data.
+ * @param count the number of bytes to read.
+ * @return the number of bytes read, 0 at the end of the object, or -1
+ *         on failure.
+ */
+int LIBMTP_Read_Object_Reader(LIBMTP_object_reader_t *reader,
+			      void * const buf, uint32_t const count)
 {
-  PTPParams *params = (PTPParams *) device->params;
-  uint16_t ret;
-
-  if (!ptp_operation_issupported(params, PTP_OC_ANDROID_BeginEditObject)) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-      "LIBMTP_BeginEditObject: PTP_OC_ANDROID_BeginEditObject not supported");
-    return -1;
-  }
+  int ret = LIBMTP_Pread_Object_Reader(reader, buf, count, reader->pos);
 
-  ret = ptp_android_begineditobject(params, id);
-  if (ret == PTP_RC_OK)
-      return 0;
-  return -1;
+  if (ret > 0)
+    reader->pos += ret;
+  return ret;
 }
 
-
-int LIBMTP_EndEditObject(LIBMTP_mtpdevice_t *device, uint32_t const id)
+/**
+ * This moves the position of a reader, like lseek(2).
+ * @param reader the reader to move.
+ * @param offset the new position, relative to <code>whence</code>.
+ * @param whence <code>SEEK_SET</code>, <code>SEEK_CUR</code> or
+ *        <code>SEEK_END</code>.
+ * @return the new position from the start of the object, or -1 if it
+ *         would be before the start.
+ */
+int64_t LIBMTP_Seek_Object_Reader(LIBMTP_object_reader_t *reader,
+				  int64_t const offset, int const whence)
 {
-  PTPParams *params = (PTPParams *) device->params;
-  uint16_t ret;
+  int64_t base;
 
-  if (!ptp_operation_issupported(params, PTP_OC_ANDROID_EndEditObject)) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-      "LIBMTP_EndEditObject: PTP_OC_ANDROID_EndEditObject not supported");
+  switch (whence) {
+  case SEEK_SET:
+    base = 0;
+    break;
+  case SEEK_CUR:
+    base = reader->pos;
+    break;
+  case SEEK_END:
+    base = reader->size;
+    break;
+  default:
     return -1;
   }
-
-  ret = ptp_android_endeditobject(params, id);
-  if (ret == PTP_RC_OK) {
-      // update cached object properties if metadata cache exists
-      update_metadata_cache(device, id);
-      return 0;
-  }
-  return -1;
+  if (offset < -base)
+    return -1;
+  reader->pos = base + offset;
+  return reader->pos;
 }
 
-
-int LIBMTP_TruncateObject(LIBMTP_mtpdevice_t *device, uint32_t const id,
-                          uint64_t offset)
+/**
+ * This closes a reader and frees what it kept.
+ * @param reader the reader to close.
+ */
+void LIBMTP_Close_Object_Reader(LIBMTP_object_reader_t *reader)
 {
-  PTPParams *params = (PTPParams *) device->params;
-  uint16_t ret;
-
-  if (!ptp_operation_issupported(params, PTP_OC_ANDROID_TruncateObject)) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-      "LIBMTP_TruncateObject: PTP_OC_ANDROID_TruncateObject not supported");
-    return -1;
-  }
+  int i;
 
-  ret = ptp_android_truncate(params, id, offset);
-  if (ret == PTP_RC_OK)
-      return 0;
-  return -1;
+  if (reader == NULL)
+    return;
+  for (i = 0; i < READER_NROFBLOCKS; i++)
+    free(reader->blocks[i].data);
+  free(reader);
 }
 
 
@@ -9070,7 +14267,9 @@ static void add_object_to_cache(LIBMTP_mtpdevice_t *device, uint32_t object_id)
   PTPParams *params = (PTPParams *)device->params;
   uint16_t ret;
 
+  ptp_lock_cache(params, 1);
   ret = ptp_add_object_to_cache(params, object_id);
+  ptp_unlock_cache(params);
   if (ret != PTP_RC_OK) {
     add_ptp_error_to_errorstack(device, ret, "add_object_to_cache(): couldn't add object to cache");
   }
@@ -9086,6 +14285,228 @@ static void update_metadata_cache(LIBMTP_mtpdevice_t *device, uint32_t object_id
 {
   PTPParams *params = (PTPParams *)device->params;
 
+  ptp_lock_cache(params, 1);
   ptp_remove_object_from_cache(params, object_id);
   add_object_to_cache(device, object_id);
+  ptp_unlock_cache(params);
+}
+
+/**
+ * Remove a set of objects from the cache in a single pass.
+ * @param params the PTP parameters holding the cache.
+ * @param doomed an array with one entry per cached object, objects
+ *        with a non-zero entry are freed and removed.
+ */
+static void purge_objects_from_cache(PTPParams *params, uint8_t const * const doomed)
+{
+  uint32_t i;
+  uint32_t kept = 0;
+
+  for (i = 0; i < params->nrofobjects; i++) {
+    if (doomed[i]) {
+      ptp_object_uncharge_mtpprops(params, &params->objects[i]);
+      ptp_free_object(&params->objects[i]);
+      continue;
+    }
+    if (kept != i)
+      params->objects[kept] = params->objects[i];
+    kept++;
+  }
+  if (kept == params->nrofobjects)
+    return;
+  params->nrofobjects = kept;
+  if (kept == 0) {
+    free(params->objects);
+    params->objects = NULL;
+  } else {
+    /* We use less memory than before so this shouldn't fail */
+    PTPObject *tmp = realloc(params->objects, sizeof(PTPObject) * kept);
+    if (tmp != NULL)
+      params->objects = tmp;
+  }
+}
+
+/**
+ * Remove a set of objects and all their descendants from the cache.
+ * @param params the PTP parameters holding the cache.
+ * @param doomed an array with one entry per cached object, objects
+ *        with a non-zero entry are removed along with everything
+ *        below them. The array is modified.
+ */
+static void purge_object_trees_from_cache(PTPParams *params, uint8_t * const doomed)
+{
+  uint32_t i;
+  int changed;
+
+  /*
+   * Children may well have lower handles than their parents, so
+   * keep sweeping until no more objects get marked.
+   */
+  do {
+    changed = 0;
+    for (i = 0; i < params->nrofobjects; i++) {
+      PTPObject *ob = &params->objects[i];
+      PTPObject *parent;
+
+      if (doomed[i] || !(ob->flags & PTPOBJECT_PARENTOBJECT_LOADED))
+	continue;
+      if (ptp_object_find(params, ob->oi.ParentObject, &parent) != PTP_RC_OK)
+	continue;
+      if (doomed[parent - params->objects]) {
+	doomed[i] = 1;
+	changed = 1;
+      }
+    }
+  } while (changed);
+
+  purge_objects_from_cache(params, doomed);
+}
+
+/**
+ * Remove an object and all its descendants from the cache. This is
+ * what the device does when a folder is deleted.
+ * @param device the device which may have a cache from which the objects
+ *        should be removed.
+ * @param object_id the topmost object to remove.
+ */
+static void remove_object_tree_from_cache(LIBMTP_mtpdevice_t *device, uint32_t object_id)
+{
+  PTPParams *params = (PTPParams *)device->params;
+  PTPObject *ob;
+  uint8_t *doomed;
+
+  if (ptp_object_find(params, object_id, &ob) != PTP_RC_OK)
+    return;
+
+  doomed = calloc(params->nrofobjects, sizeof(uint8_t));
+  if (doomed == NULL) {
+    ptp_remove_object_from_cache(params, object_id);
+    return;
+  }
+  doomed[ob - params->objects] = 1;
+  purge_object_trees_from_cache(params, doomed);
+  free(doomed);
+}
+
+/**
+ * Remove all objects on a certain storage from the cache.
+ * @param device the device which may have a cache from which the objects
+ *        should be removed.
+ * @param storage_id the storage to remove objects for.
+ */
+static void remove_storage_from_cache(LIBMTP_mtpdevice_t *device, uint32_t storage_id)
+{
+  PTPParams *params = (PTPParams *)device->params;
+  uint8_t *doomed;
+  uint32_t i;
+
+  if (params->nrofobjects == 0)
+    return;
+  doomed = calloc(params->nrofobjects, sizeof(uint8_t));
+  if (doomed == NULL)
+    return;
+  for (i = 0; i < params->nrofobjects; i++) {
+    PTPObject *ob = &params->objects[i];
+
+    if ((ob->flags & PTPOBJECT_STORAGEID_LOADED) &&
+	ob->oi.StorageID == storage_id)
+      doomed[i] = 1;
+  }
+  purge_objects_from_cache(params, doomed);
+  free(doomed);
+}
+
+/**
+ * Refresh the capacity and labels of a single storage in the storage
+ * list without rebuilding the list.
+ * @param device the device to update the storage for.
+ * @param storage_id the storage to update.
+ */
+static void update_storage_info(LIBMTP_mtpdevice_t *device, uint32_t storage_id)
+{
+  PTPParams *params = (PTPParams *)device->params;
+  LIBMTP_devicestorage_t *storage = device->storage;
+  PTPStorageInfo storageInfo;
+  uint16_t ret;
+
+  while (storage != NULL && storage->id != storage_id)
+    storage = storage->next;
+  if (storage == NULL) {
+    // We do not know this storage, rescan them all.
+    LIBMTP_Get_Storage(device, LIBMTP_STORAGE_SORTBY_NOTSORTED);
+    return;
+  }
+  if (!ptp_operation_issupported(params,PTP_OC_GetStorageInfo))
+    return;
+
+  ret = ptp_getstorageinfo(params, storage_id, &storageInfo);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "update_storage_info(): "
+				"Could not get storage info.");
+    return;
+  }
+  free(storage->StorageDescription);
+  free(storage->VolumeIdentifier);
+  storage->StorageType = storageInfo.StorageType;
+  storage->FilesystemType = storageInfo.FilesystemType;
+  storage->AccessCapability = storageInfo.AccessCapability;
+  storage->MaxCapacity = storageInfo.MaxCapability;
+  storage->FreeSpaceInBytes = storageInfo.FreeSpaceInBytes;
+  storage->FreeSpaceInObjects = storageInfo.FreeSpaceInImages;
+  storage->StorageDescription = storageInfo.StorageDescription;
+  storage->VolumeIdentifier = storageInfo.VolumeLabel;
+}
+
+/**
+ * Retrieve the device info anew, e.g. after the device announced
+ * that the set of supported operations or properties changed.
+ * @param device the device to update the device info for.
+ */
+static void update_device_info(LIBMTP_mtpdevice_t *device)
+{
+  PTPParams *params = (PTPParams *)device->params;
+  PTPDeviceInfo deviceinfo;
+  uint16_t ret;
+
+  memset(&deviceinfo, 0, sizeof(deviceinfo));
+  ret = ptp_getdeviceinfo(params, &deviceinfo);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "update_device_info(): "
+				"Could not get device info.");
+    ptp_free_deviceinfo(&deviceinfo);
+    return;
+  }
+  ptp_lock_cache(params, 1);
+  // What the device supports per format may have changed along with it
+  ptp_free_objectpropssupported(params);
+  ptp_lock_info(params);
+  ptp_free_deviceinfo(&params->deviceinfo);
+  params->deviceinfo = deviceinfo;
+  ptp_unlock_info(params);
+  ptp_unlock_cache(params);
+}
+
+/**
+ * Drop a cached device property description so that it is retrieved
+ * from the device the next time it is needed.
+ * @param device the device the property belongs to.
+ * @param propcode the device property that changed.
+ */
+static void invalidate_device_property(LIBMTP_mtpdevice_t *device, uint16_t propcode)
+{
+  PTPParams *params = (PTPParams *)device->params;
+  unsigned int i;
+
+  ptp_lock_cache(params, 1);
+  for (i = 0; i < params->nrofdeviceproperties; i++)
+    if (params->deviceproperties[i].desc.DevicePropertyCode == propcode)
+      break;
+  if (i < params->nrofdeviceproperties) {
+    ptp_free_devicepropdesc(&params->deviceproperties[i].desc);
+    if (i < params->nrofdeviceproperties - 1)
+      memmove(&params->deviceproperties[i], &params->deviceproperties[i+1],
+	      (params->nrofdeviceproperties - 1 - i) * sizeof(params->deviceproperties[0]));
+    params->nrofdeviceproperties--;
+  }
+  ptp_unlock_cache(params);
 }
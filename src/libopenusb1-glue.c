@@ -779,6 +779,17 @@ libusb_glue_error(PTPParams *params, const char *format, ...) {
 #define CONTEXT_BLOCK_SIZE_2  0x200
 #define CONTEXT_BLOCK_SIZE    CONTEXT_BLOCK_SIZE_1+CONTEXT_BLOCK_SIZE_2
 
+/*
+ * Transfers are serialized by the transaction lock, so one buffer per
+ * device is enough. It is kept until the device is closed.
+ */
+static unsigned char *get_transfer_buffer(PTP_USB *ptp_usb)
+{
+    if (ptp_usb->transfer_buffer == NULL)
+        ptp_usb->transfer_buffer = malloc(CONTEXT_BLOCK_SIZE);
+    return ptp_usb->transfer_buffer;
+}
+
 static short
 ptp_read_func(
         unsigned long size, PTPDataHandler *handler, void *data,
@@ -794,8 +805,8 @@ ptp_read_func(
     unsigned char *bytes;
     int expect_terminator_byte = 0;
     unsigned long usb_inep_maxpacket_size;
-    unsigned long context_block_size_1;
-    unsigned long context_block_size_2;
+    unsigned long context_block_size_1 = CONTEXT_BLOCK_SIZE_1;
+    unsigned long context_block_size_2 = CONTEXT_BLOCK_SIZE_2;
     uint16_t ptp_dev_vendor_id = ptp_usb->rawdevice.device_entry.vendor_id;
 
     //"iRiver" device special handling
@@ -812,7 +823,10 @@ ptp_read_func(
     }
     struct openusb_bulk_request bulk;
     // This is the largest block we'll need to read in.
-    bytes = malloc(CONTEXT_BLOCK_SIZE);
+    bytes = get_transfer_buffer(ptp_usb);
+    if (!bytes) {
+        return PTP_ERROR_IO;
+    }
     while (curread < size) {
 
         LIBMTP_USB_DEBUG("Remaining size to read: 0x%04lx bytes\n", size - curread);
@@ -907,7 +921,6 @@ ptp_read_func(
             break;
     }
     if (readbytes) *readbytes = curread;
-    free(bytes);
     LIBMTP_USB_DEBUG("Pointer Updated\n");
     // there might be a zero packet waiting for us...
     if (readzero &&
@@ -956,7 +969,7 @@ ptp_write_func(
     struct openusb_bulk_request bulk;
 
     // This is the largest block we'll need to read in.
-    bytes = malloc(CONTEXT_BLOCK_SIZE);
+    bytes = get_transfer_buffer(ptp_usb);
     if (!bytes) {
         return PTP_ERROR_IO;
     }
@@ -1025,7 +1038,6 @@ ptp_write_func(
         if (xwritten < towrite) /* short writes happen */
             break;
     }
-    free(bytes);
     if (written) {
         *written = curwrite;
     }
@@ -1351,6 +1363,15 @@ ptp_usb_getdata(PTPParams* params, PTPContainer* ptp, PTPDataHandler *handler) {
                 break;
             }
         }
+        /* A callback waiting for a transfer of unknown size starts
+         * once the data header tells the size */
+        if (ptp_usb->current_transfer_callback != NULL &&
+                ptp_usb->current_transfer_total == 0 &&
+                dtoh32(usbdata.length) != 0xffffffffU) {
+            ptp_usb->current_transfer_total = dtoh32(usbdata.length);
+            ptp_usb->current_transfer_complete = rlen;
+            ptp_usb->callback_active = 1;
+        }
         if (rlen == PTP_USB_BULK_HS_MAX_PACKET_LEN_READ) {
             /* Copy first part of data to 'data' */
             putfunc_ret =
@@ -1959,6 +1980,8 @@ static void close_usb(PTP_USB* ptp_usb) {
         openusb_reset(*ptp_usb->handle);
     }
     openusb_close_device(*ptp_usb->handle);
+    free(ptp_usb->transfer_buffer);
+    ptp_usb->transfer_buffer = NULL;
 }
 
 /**
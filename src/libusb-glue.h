@@ -107,6 +107,8 @@ struct _PTP_USB {
   uint64_t current_transfer_complete;
   LIBMTP_progressfunc_t current_transfer_callback;
   void const * current_transfer_callback_data;
+  /** Bulk transfer buffer, only used internally */
+  unsigned char *transfer_buffer;
   /** Any special device flags, only used internally */
   LIBMTP_raw_device_t rawdevice;
 };
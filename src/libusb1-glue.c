@@ -824,6 +824,18 @@ libusb_glue_error (PTPParams *params, const char *format, ...)
 #define CONTEXT_BLOCK_SIZE_1	0x3e00
 #define CONTEXT_BLOCK_SIZE_2  0x200
 #define CONTEXT_BLOCK_SIZE    CONTEXT_BLOCK_SIZE_1+CONTEXT_BLOCK_SIZE_2
+
+/*
+ * Transfers are serialized by the transaction lock, so one buffer per
+ * device is enough. It is kept until the device is closed.
+ */
+static unsigned char *get_transfer_buffer(PTP_USB *ptp_usb)
+{
+  if (ptp_usb->transfer_buffer == NULL)
+    ptp_usb->transfer_buffer = malloc(CONTEXT_BLOCK_SIZE);
+  return ptp_usb->transfer_buffer;
+}
+
 static short
 ptp_read_func (
 	unsigned long size, PTPDataHandler *handler,void *data,
@@ -839,8 +851,8 @@ ptp_read_func (
   unsigned char *bytes;
   int expect_terminator_byte = 0;
   unsigned long usb_inep_maxpacket_size;
-  unsigned long context_block_size_1;
-  unsigned long context_block_size_2;
+  unsigned long context_block_size_1 = CONTEXT_BLOCK_SIZE_1;
+  unsigned long context_block_size_2 = CONTEXT_BLOCK_SIZE_2;
   uint16_t ptp_dev_vendor_id = ptp_usb->rawdevice.device_entry.vendor_id;
 
   //"iRiver" device special handling
@@ -856,7 +868,10 @@ ptp_read_func (
 	  }
   }
   // This is the largest block we'll need to read in.
-  bytes = malloc(CONTEXT_BLOCK_SIZE);
+  bytes = get_transfer_buffer(ptp_usb);
+  if (!bytes) {
+    return PTP_ERROR_IO;
+  }
   while (curread < size) {
 
     LIBMTP_USB_DEBUG("Remaining size to read: 0x%04lx bytes\n", size - curread);
@@ -945,7 +960,6 @@ ptp_read_func (
       break;
   }
   if (readbytes) *readbytes = curread;
-  free (bytes);
 
   // there might be a zero packet waiting for us...
   if (readzero &&
@@ -984,7 +998,7 @@ ptp_write_func (
   unsigned char *bytes;
 
   // This is the largest block we'll need to read in.
-  bytes = malloc(CONTEXT_BLOCK_SIZE);
+  bytes = get_transfer_buffer(ptp_usb);
   if (!bytes) {
     return PTP_ERROR_IO;
   }
@@ -1003,7 +1017,6 @@ ptp_write_func (
     }
     int getfunc_ret = handler->getfunc(NULL, handler->priv,towrite,bytes,&towrite);
     if (getfunc_ret != PTP_RC_OK) {
-      free(bytes);
       return getfunc_ret;
     }
     while (usbwritten < towrite) {
@@ -1017,7 +1030,6 @@ ptp_write_func (
 	    LIBMTP_USB_DEBUG("USB OUT==>\n");
 
 	    if (ret != LIBUSB_SUCCESS) {
-              free(bytes);
 	      return PTP_ERROR_IO;
 	    }
 	    LIBMTP_USB_DATA(bytes+usbwritten, xwritten, 16);
@@ -1040,7 +1052,6 @@ ptp_write_func (
 						 ptp_usb->current_transfer_total,
 						 ptp_usb->current_transfer_callback_data);
 	if (ret != 0) {
-          free(bytes);
 	  return PTP_ERROR_CANCEL;
 	}
       }
@@ -1048,7 +1059,6 @@ ptp_write_func (
     if (xwritten < towrite) /* short writes happen */
       break;
   }
-  free (bytes);
   if (written) {
     *written = curwrite;
   }
@@ -1362,6 +1372,15 @@ ptp_usb_getdata (PTPParams* params, PTPContainer* ptp, PTPDataHandler *handler)
 				break;
 			}
 		}
+		/* A callback waiting for a transfer of unknown size starts
+		 * once the data header tells the size */
+		if (ptp_usb->current_transfer_callback != NULL &&
+		    ptp_usb->current_transfer_total == 0 &&
+		    dtoh32(usbdata.length) != 0xffffffffU) {
+			ptp_usb->current_transfer_total = dtoh32(usbdata.length);
+			ptp_usb->current_transfer_complete = rlen;
+			ptp_usb->callback_active = 1;
+		}
 		if (rlen == PTP_USB_BULK_HS_MAX_PACKET_LEN_READ) {
 		  /* Copy first part of data to 'data' */
 		  putfunc_ret =
@@ -1883,6 +1902,8 @@ static void close_usb(PTP_USB* ptp_usb)
     libusb_reset_device (ptp_usb->handle);
   }
   libusb_close(ptp_usb->handle);
+  free(ptp_usb->transfer_buffer);
+  ptp_usb->transfer_buffer = NULL;
 }
 
 /**
@@ -2092,6 +2113,7 @@ LIBMTP_error_number_t configure_usb_device(LIBMTP_raw_device_t *device,
     if ((ret = ptp_opensession(params, 1)) == PTP_ERROR_IO) {
       LIBMTP_ERROR("LIBMTP PANIC: failed to open session on second attempt\n");
       libusb_free_device_list (devs, 0);
+      free (ptp_usb->transfer_buffer);
       free (ptp_usb);
       return LIBMTP_ERROR_CONNECTING;
     }
@@ -2110,6 +2132,7 @@ LIBMTP_error_number_t configure_usb_device(LIBMTP_raw_device_t *device,
 	    ret);
     libusb_release_interface(ptp_usb->handle, ptp_usb->interface);
     libusb_free_device_list (devs, 0);
+    free (ptp_usb->transfer_buffer);
     free (ptp_usb);
     return LIBMTP_ERROR_CONNECTING;
   }
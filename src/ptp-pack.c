@@ -24,15 +24,14 @@
 
 /* currently this file is included into ptp.c */
 
+#include "unicode.h"
+
 #ifdef HAVE_LIMITS_H
 #include <limits.h>
 #endif
 #ifndef UINT_MAX
 # define UINT_MAX 0xFFFFFFFF
 #endif
-#ifdef HAVE_ICONV
-#include <iconv.h>
-#endif
 
 static inline uint16_t
 htod16p (PTPParams *params, uint16_t var)
@@ -130,102 +129,71 @@ static inline char*
 ptp_unpack_string(PTPParams *params, unsigned char* data, uint16_t offset, uint8_t *len)
 {
 	uint8_t length;
-	uint16_t string[PTP_MAXSTRLEN+1];
-	/* allow for UTF-8: max of 3 bytes per UCS-2 char, plus final null */
-	char loclstr[PTP_MAXSTRLEN*3+1];
-	size_t nconv, srclen, destlen;
-	char *src, *dest;
+	uint16_t string[PTP_MAXSTRLEN];
+	uint16_t seen = 0;
+	char *loclstr;
+	size_t size;
+	int i, n;
 
 	length = dtoh8a(&data[offset]);	/* PTP_MAXSTRLEN == 255, 8 bit len */
 	*len = length;
 	if (length == 0)		/* nothing to do? */
 		return(NULL);
 
-	/* copy to string[] to ensure correct alignment for iconv(3) */
-	memcpy(string, &data[offset+1], length * sizeof(string[0]));
-	string[length] = 0x0000U;   /* be paranoid!  add a terminator. */
-	loclstr[0] = '\0';
-
-	/* convert from camera UCS-2 to our locale */
-	src = (char *)string;
-	srclen = length * sizeof(string[0]);
-	dest = loclstr;
-	destlen = sizeof(loclstr)-1;
-	nconv = (size_t)-1;
-#ifdef HAVE_ICONV
-	if (params->cd_ucs2_to_locale != (iconv_t)-1)
-		nconv = iconv(params->cd_ucs2_to_locale, &src, &srclen, &dest, &destlen);
-#endif
-	if (nconv == (size_t) -1) { /* do it the hard way */
-		int i;
-		/* try the old way, in case iconv is broken */
-		for (i=0;i<length;i++) {
-			if (dtoh16a(&data[offset+1+2*i])>127)
-				loclstr[i] = '?';
-			else
-				loclstr[i] = dtoh16a(&data[offset+1+2*i]);
-		}
-		dest = loclstr+length;
+	/*
+	 * Our locale is always UTF-8, so convert straight to it instead
+	 * of going through iconv(3), which would mean taking a lock and
+	 * copying the result once more for every string. The length
+	 * includes the terminator, but do not trust the device on that.
+	 */
+	for (n = 0; n < length; n++) {
+		string[n] = dtoh16a(&data[offset+1+2*n]);
+		if (string[n] == 0x0000U)
+			break;
+		seen |= string[n];
 	}
-	*dest = '\0';
-	loclstr[sizeof(loclstr)-1] = '\0';   /* be safe? */
-	return(strdup(loclstr));
-}
-
-static inline int
-ucs2strlen(uint16_t const * const unicstr)
-{
-	int length = 0;
-	
-	/* Unicode strings are terminated with 2 * 0x00 */
-	for(length = 0; unicstr[length] != 0x0000U; length ++);
-	return length;
+	if (seen < 0x80) {
+		/* Plain ASCII, which most strings are */
+		loclstr = malloc(n+1);
+		if (loclstr == NULL)
+			return NULL;
+		for (i = 0; i < n; i++)
+			loclstr[i] = (char) string[i];
+		loclstr[n] = '\0';
+		return loclstr;
+	}
+	size = utf16_units_to_utf8(string, n, NULL);
+	loclstr = malloc(size+1);
+	if (loclstr == NULL)
+		return NULL;
+	utf16_units_to_utf8(string, n, loclstr);
+	loclstr[size] = '\0';
+	return loclstr;
 }
 
-
 static inline void
 ptp_pack_string(PTPParams *params, char *string, unsigned char* data, uint16_t offset, uint8_t *len)
 {
-	int packedlen = 0;
-	uint16_t ucs2str[PTP_MAXSTRLEN+1];
-	char *ucs2strp = (char *) ucs2str;
-	size_t convlen = strlen(string);
-
-	/* Cannot exceed 255 (PTP_MAXSTRLEN) since it is a single byte, duh ... */
-	memset(ucs2strp, 0, sizeof(ucs2str));  /* XXX: necessary? */
-#ifdef HAVE_ICONV
-	if (params->cd_locale_to_ucs2 != (iconv_t)-1) {
-		size_t nconv;
-		size_t convmax = PTP_MAXSTRLEN * 2; /* Includes the terminator */
-		char *stringp = string;
-
-		nconv = iconv(params->cd_locale_to_ucs2, &stringp, &convlen,
-			&ucs2strp, &convmax);
-		if (nconv == (size_t) -1)
-			ucs2str[0] = 0x0000U;
-	} else
-#endif
-	{
-		unsigned int i;
+	uint16_t ucs2str[PTP_MAXSTRLEN];
+	size_t packedlen;
+	size_t i;
 
-		for (i=0;i<convlen;i++) {
-			ucs2str[i] = string[i];
-		}
-		ucs2str[convlen] = 0;
-	}
 	/*
-	 * XXX: isn't packedlen just ( (uint16_t *)ucs2strp - ucs2str )?
-	 *      why do we need ucs2strlen()?
+	 * Our locale is always UTF-8, so encode the UTF-16 ourselves.
+	 * Cannot exceed 255 (PTP_MAXSTRLEN) since it is a single byte,
+	 * duh ...
 	 */
-	packedlen = ucs2strlen(ucs2str);
+	packedlen = utf8_to_utf16_units(string, NULL);
 	if (packedlen > PTP_MAXSTRLEN-1) {
 		*len=0;
 		return;
 	}
-	
+	utf8_to_utf16_units(string, ucs2str);
+
 	/* number of characters including terminating 0 (PTP standard confirmed) */
 	htod8a(&data[offset],packedlen+1);
-	memcpy(&data[offset+1], &ucs2str[0], packedlen * sizeof(ucs2str[0]));
+	for (i = 0; i < packedlen; i++)
+		htod16a(&data[offset+1+i*2], ucs2str[i]);
 	htod16a(&data[offset+packedlen*2+1], 0x0000);  /* terminate 0 */
 
 	/* The returned length is in number of characters */
@@ -257,10 +225,52 @@ ptp_get_packed_stringcopy(PTPParams *params, char *string, uint32_t *packed_size
 	return (retcopy);
 }
 
+/*
+ * Bulk conversion of arrays from device byte order. The byte order is
+ * looked at once per array: when it is that of the host the array is
+ * copied as it is, otherwise a loop with a fixed byte order does the
+ * swapping, which compilers turn into vector code.
+ */
+#ifdef WORDS_BIGENDIAN
+#define PTP_DL_HOST	PTP_DL_BE
+#else
+#define PTP_DL_HOST	PTP_DL_LE
+#endif
+
+static inline void
+dtoh32_array (PTPParams *params, uint32_t *dst, const unsigned char *src, uint32_t n)
+{
+	uint32_t i;
+
+	if (params->byteorder == PTP_DL_HOST)
+		memcpy (dst, src, n*sizeof(uint32_t));
+	else if (params->byteorder == PTP_DL_LE)
+		for (i=0;i<n;i++)
+			dst[i] = le32atoh(&src[i*sizeof(uint32_t)]);
+	else
+		for (i=0;i<n;i++)
+			dst[i] = be32atoh(&src[i*sizeof(uint32_t)]);
+}
+
+static inline void
+dtoh16_array (PTPParams *params, uint16_t *dst, const unsigned char *src, uint32_t n)
+{
+	uint32_t i;
+
+	if (params->byteorder == PTP_DL_HOST)
+		memcpy (dst, src, n*sizeof(uint16_t));
+	else if (params->byteorder == PTP_DL_LE)
+		for (i=0;i<n;i++)
+			dst[i] = le16atoh(&src[i*sizeof(uint16_t)]);
+	else
+		for (i=0;i<n;i++)
+			dst[i] = be16atoh(&src[i*sizeof(uint16_t)]);
+}
+
 static inline uint32_t
 ptp_unpack_uint32_t_array(PTPParams *params, unsigned char* data, uint16_t offset, uint32_t **array)
 {
-	uint32_t n, i=0;
+	uint32_t n;
 
 	*array = NULL;
 	n=dtoh32a(&data[offset]);
@@ -269,8 +279,9 @@ ptp_unpack_uint32_t_array(PTPParams *params, unsigned char* data, uint16_t offse
 	if (!n)
 		return 0;
 	*array = malloc (n*sizeof(uint32_t));
-	for (i=0;i<n;i++)
-		(*array)[i]=dtoh32a(&data[offset+(sizeof(uint32_t)*(i+1))]);
+	if (!*array)
+		return 0;
+	dtoh32_array (params, *array, &data[offset+sizeof(uint32_t)], n);
 	return n;
 }
 
@@ -289,7 +300,7 @@ ptp_pack_uint32_t_array(PTPParams *params, uint32_t *array, uint32_t arraylen, u
 static inline uint32_t
 ptp_unpack_uint16_t_array(PTPParams *params, unsigned char* data, uint16_t offset, uint16_t **array)
 {
-	uint32_t n, i=0;
+	uint32_t n;
 
 	*array = NULL;
 	n=dtoh32a(&data[offset]);
@@ -298,8 +309,9 @@ ptp_unpack_uint16_t_array(PTPParams *params, unsigned char* data, uint16_t offse
 	if (!n)
 		return 0;
 	*array = malloc (n*sizeof(uint16_t));
-	for (i=0;i<n;i++)
-		(*array)[i]=dtoh16a(&data[offset+(sizeof(uint16_t)*(i+2))]);
+	if (!*array)
+		return 0;
+	dtoh16_array (params, *array, &data[offset+sizeof(uint32_t)], n);
 	return n;
 }
 
@@ -566,48 +578,149 @@ ptp_pack_OI (PTPParams *params, PTPObjectInfo *oi, unsigned char** oidataptr)
 	return (PTP_oi_Filename+filenamelen*2+(capturedatelen+1)*3)+params->ocs64*4;
 }
 
-static time_t
-ptp_unpack_PTPTIME (const char *str) {
-	char ptpdate[40];
-	char tmp[5];
-	size_t  ptpdatelen;
+/* Days from 1970-01-01 to a date of the proleptic Gregorian calendar */
+static inline int32_t
+ptp_days_from_civil (int32_t y, int32_t m, int32_t d)
+{
+	int32_t era, yoe, doy, doe;
+
+	y -= m <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = y - era * 400;
+	doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + doe - 719468;
+}
+
+/* Reads n decimal digits, -1 if they are not all digits */
+static inline int
+ptp_unpack_digits (const char *str, int n)
+{
+	int value = 0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		unsigned int digit = (unsigned char) str[i] - '0';
+
+		if (digit > 9)
+			return -1;
+		value = value * 10 + digit;
+	}
+	return value;
+}
+
+/* How far local time is ahead of UTC at a local time, per mktime(3) */
+static int
+ptp_localtime_offset (int year, int month, int day, int hour, int min, int sec,
+		      int32_t *offset)
+{
 	struct tm tm;
+	time_t t;
+
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year = year - 1900;
+	tm.tm_mon = month - 1;
+	tm.tm_mday = day;
+	tm.tm_hour = hour;
+	tm.tm_min = min;
+	tm.tm_sec = sec;
+	tm.tm_isdst = -1;
+	t = mktime (&tm);
+	if (t == (time_t) -1)
+		return -1;
+	*offset = (int32_t) ((int64_t) ptp_days_from_civil(year, month, day) * 86400 +
+			     hour * 3600 + min * 60 + sec - t);
+	return 0;
+}
 
-	if (!str)
-		return 0;
-	ptpdatelen = strlen(str);
-	if (ptpdatelen >= sizeof (ptpdate)) {
-		/*ptp_debug (params ,"datelen is larger then size of buffer", ptpdatelen, (int)sizeof(ptpdate));*/
+/*
+ * Converts a PTP date, a subset of ISO 8601: YYYYMMDDThhmmss with
+ * optional tenths of seconds and time zone, "Z" or +/-hh[mm]. A date
+ * without a time zone is in local time. Malformed dates give 0.
+ *
+ * mktime(3) takes a lock and may look at the time zone files on each
+ * call, so it is only used to learn the offset of local time, once per
+ * month unless the clocks change that month. The offsets are kept for
+ * as long as the device is open: a process that changes its time zone
+ * meanwhile, through TZ or the system setting, gets dates in the old
+ * zone until it opens the device again.
+ */
+static time_t
+ptp_unpack_PTPTIME (PTPParams *params, const char *str) {
+	int year, month, day, hour, min, sec, days, hit, d;
+	int32_t key, offset, next;
+	int64_t wall;
+	PTPLocalTimeMonth *cached;
+	const char *zone;
+
+	/* Stops at the first bad character, so never reads past the end */
+	if (!str ||
+	    (year = ptp_unpack_digits(str, 4)) < 0 ||
+	    (month = ptp_unpack_digits(str + 4, 2)) < 1 || month > 12 ||
+	    (day = ptp_unpack_digits(str + 6, 2)) < 1 || day > 31 ||
+	    str[8] != 'T' ||
+	    (hour = ptp_unpack_digits(str + 9, 2)) < 0 || hour > 23 ||
+	    (min = ptp_unpack_digits(str + 11, 2)) < 0 || min > 59 ||
+	    (sec = ptp_unpack_digits(str + 13, 2)) < 0 || sec > 60)
 		return 0;
+	wall = (int64_t) ptp_days_from_civil(year, month, day) * 86400 +
+		hour * 3600 + min * 60 + sec;
+
+	zone = str + 15;
+	if (*zone == '.')
+		for (zone++; *zone >= '0' && *zone <= '9'; zone++);
+	if (*zone == 'Z')
+		return (time_t) wall;
+	if (*zone == '+' || *zone == '-') {
+		int zhour = ptp_unpack_digits(zone + 1, 2);
+		int zmin = zhour < 0 ? -1 : ptp_unpack_digits(zone + 3, 2);
+
+		if (zhour < 0)
+			return 0;
+		offset = zhour * 3600 + (zmin < 0 ? 0 : zmin * 60);
+		return (time_t) (*zone == '+' ? wall - offset : wall + offset);
 	}
-	if (ptpdatelen<15) {
-		/*ptp_debug (params ,"datelen is less than 15 (%d)", ptpdatelen);*/
-		return 0;
+
+	/* Local time, look for the offset of this month */
+	key = year * 12 + month;
+	cached = &params->localtime_months[key % PTP_LOCALTIME_MONTHS];
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock (&params->time_lock);
+#endif
+	hit = cached->month == key;
+	offset = cached->offset;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock (&params->time_lock);
+#endif
+	if (hit)
+		return (time_t) (wall - offset);
+
+	/* The same offset at the start of every day and at the end of the
+	 * month means the clocks did not change in between, comparing the
+	 * ends alone would miss two changes that cancel out */
+	days = month == 12 ? 31 : ptp_days_from_civil(year, month + 1, 1) -
+		ptp_days_from_civil(year, month, 1);
+	hit = ptp_localtime_offset(year, month, 1, 0, 0, 0, &offset) == 0;
+	for (d = 2; hit && d <= days; d++)
+		hit = ptp_localtime_offset(year, month, d, 0, 0, 0, &next) == 0 &&
+			next == offset;
+	if (hit)
+		hit = ptp_localtime_offset(year, month, days, 23, 59, 59, &next) == 0 &&
+			next == offset;
+	if (hit) {
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_lock (&params->time_lock);
+#endif
+		cached->month = key;
+		cached->offset = offset;
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_unlock (&params->time_lock);
+#endif
+		return (time_t) (wall - offset);
 	}
-	strncpy (ptpdate, str, sizeof(ptpdate));
-	ptpdate[sizeof(ptpdate) - 1] = '\0';
-
-	memset(&tm,0,sizeof(tm));
-	strncpy (tmp, ptpdate, 4);
-	tmp[4] = 0;
-	tm.tm_year=atoi (tmp) - 1900;
-	strncpy (tmp, ptpdate + 4, 2);
-	tmp[2] = 0;
-	tm.tm_mon = atoi (tmp) - 1;
-	strncpy (tmp, ptpdate + 6, 2);
-	tmp[2] = 0;
-	tm.tm_mday = atoi (tmp);
-	strncpy (tmp, ptpdate + 9, 2);
-	tmp[2] = 0;
-	tm.tm_hour = atoi (tmp);
-	strncpy (tmp, ptpdate + 11, 2);
-	tmp[2] = 0;
-	tm.tm_min = atoi (tmp);
-	strncpy (tmp, ptpdate + 13, 2);
-	tmp[2] = 0;
-	tm.tm_sec = atoi (tmp);
-	tm.tm_isdst = -1;
-	return mktime (&tm);
+	if (ptp_localtime_offset(year, month, day, hour, min, sec, &offset) != 0)
+		return 0;
+	return (time_t) (wall - offset);
 }
 
 static inline void
@@ -646,14 +759,14 @@ ptp_unpack_OI (PTPParams *params, unsigned char* data, PTPObjectInfo *oi, unsign
 	/* subset of ISO 8601, without '.s' tenths of second and 
 	 * time zone
 	 */
-	oi->CaptureDate = ptp_unpack_PTPTIME(capture_date);
+	oi->CaptureDate = ptp_unpack_PTPTIME(params, capture_date);
 	free(capture_date);
 
 	/* now the modification date ... */
 	capture_date = ptp_unpack_string(params, data,
 		PTP_oi_filenamelen+filenamelen*2
 		+capturedatelen*2+2,&capturedatelen);
-	oi->ModificationDate = ptp_unpack_PTPTIME(capture_date);
+	oi->ModificationDate = ptp_unpack_PTPTIME(params, capture_date);
 	free(capture_date);
 }
 
@@ -1236,12 +1349,97 @@ ptp_pack_OPL (PTPParams *params, MTPProperties *props, int nrofprops, unsigned c
 	return totalsize;
 }
 
+/*
+ * Size of the Object Property List record (handle, property code,
+ * datatype, value) starting at data. Returns 1 and the record size in
+ * *size if len bytes are enough to tell, 0 and the number of bytes
+ * needed to tell in *size if not, and -1 for unsupported datatypes.
+ */
+#define PTP_opl_ObjectHandle	0
+#define PTP_opl_PropertyCode	4
+#define PTP_opl_Datatype	6
+#define PTP_opl_Value		8
+
+static inline int
+ptp_unpack_OPL_recsize (PTPParams *params, unsigned char* data, unsigned long len, unsigned long *size)
+{
+	uint16_t	datatype;
+	unsigned int	elemsize, n;
+
+	*size = PTP_opl_Value;
+	if (len < PTP_opl_Value)
+		return 0;
+	datatype = dtoh16a(&data[PTP_opl_Datatype]);
+	if (datatype == PTP_DTC_STR) {
+		*size = PTP_opl_Value + 1;
+		if (len < *size)
+			return 0;
+		*size += dtoh8a(&data[PTP_opl_Value])*2;
+		return 1;
+	}
+	switch (datatype & ~PTP_DTC_ARRAY_MASK) {
+	case PTP_DTC_INT8:
+	case PTP_DTC_UINT8:	elemsize = 1; break;
+	case PTP_DTC_INT16:
+	case PTP_DTC_UINT16:	elemsize = 2; break;
+	case PTP_DTC_INT32:
+	case PTP_DTC_UINT32:	elemsize = 4; break;
+	case PTP_DTC_INT64:
+	case PTP_DTC_UINT64:	elemsize = 8; break;
+	case PTP_DTC_INT128:
+	case PTP_DTC_UINT128:	elemsize = 16; break;
+	default:
+		return -1;
+	}
+	if (!(datatype & PTP_DTC_ARRAY_MASK)) {
+		*size = PTP_opl_Value + elemsize;
+		return 1;
+	}
+	*size = PTP_opl_Value + sizeof(uint32_t);
+	if (len < *size)
+		return 0;
+	n = dtoh32a(&data[PTP_opl_Value]);
+	if (n >= (UINT_MAX - *size)/elemsize)
+		return -1;
+	*size += n*elemsize;
+	return 1;
+}
+
+/* The fixed part of a property list record, in one byte order test */
+static inline void
+ptp_unpack_OPL_header (PTPParams *params, unsigned char* data, MTPProperties *prop)
+{
+	if (params->byteorder == PTP_DL_LE) {
+		prop->ObjectHandle = le32atoh(&data[PTP_opl_ObjectHandle]);
+		prop->property = le16atoh(&data[PTP_opl_PropertyCode]);
+		prop->datatype = le16atoh(&data[PTP_opl_Datatype]);
+	} else {
+		prop->ObjectHandle = be32atoh(&data[PTP_opl_ObjectHandle]);
+		prop->property = be16atoh(&data[PTP_opl_PropertyCode]);
+		prop->datatype = be16atoh(&data[PTP_opl_Datatype]);
+	}
+}
+
 static int
 _compare_func(const void* x, const void *y) {
 	const MTPProperties *px = x;
 	const MTPProperties *py = y;
 
-	return px->ObjectHandle - py->ObjectHandle;
+	if (px->ObjectHandle < py->ObjectHandle) return -1;
+	return px->ObjectHandle > py->ObjectHandle;
+}
+
+/* Sort a property list by object handle, unless it already is */
+static void
+_sort_OPL (MTPProperties *props, unsigned int nrofprops)
+{
+	unsigned int i;
+
+	for (i = 1; i < nrofprops; i++)
+		if (props[i].ObjectHandle < props[i-1].ObjectHandle)
+			break;
+	if (i < nrofprops)
+		qsort (props, nrofprops, sizeof(MTPProperties),_compare_func);
 }
 
 static inline int
@@ -1265,28 +1463,20 @@ ptp_unpack_OPL (PTPParams *params, unsigned char* data, MTPProperties **pprops,
 			ptp_debug (params ,"short MTP Object Property List at property %d (of %d)", i, prop_count);
 			ptp_debug (params ,"device probably needs DEVICE_FLAG_BROKEN_MTPGETOBJPROPLIST_ALL", i);
 			ptp_debug (params ,"or even DEVICE_FLAG_BROKEN_MTPGETOBJPROPLIST", i);
-			qsort (props, i, sizeof(MTPProperties),_compare_func);
+			_sort_OPL (props, i);
 			*pprops = props;
 			return i;
 		}
-		props[i].ObjectHandle = dtoh32a(data);
-		data += sizeof(uint32_t);
-		len -= sizeof(uint32_t);
-
-		props[i].property = dtoh16a(data);
-		data += sizeof(uint16_t);
-		len -= sizeof(uint16_t);
-
-		props[i].datatype = dtoh16a(data);
-		data += sizeof(uint16_t);
-		len -= sizeof(uint16_t);
+		ptp_unpack_OPL_header(params, data, &props[i]);
+		data += PTP_opl_Value;
+		len -= PTP_opl_Value;
 
 		offset = 0;
 		ptp_unpack_DPV(params, data, &offset, len, &props[i].propval, props[i].datatype);
 		data += offset;
 		len -= offset;
 	}
-	qsort (props, prop_count, sizeof(MTPProperties),_compare_func);
+	_sort_OPL (props, prop_count);
 	*pprops = props;
 	return prop_count;
 }
@@ -102,6 +102,243 @@ ptp_error (PTPParams *params, const char *format, ...)
 
 #include "ptp-pack.c"
 
+/* locking */
+
+/**
+ * ptp_init_locks:
+ * params:	PTPParams*
+ *
+ * Sets up the locks that make a device usable from several threads.
+ * Lock order is cache lock, then transaction lock; the error lock is
+ * never held while taking another lock.
+ *
+ * The transaction lock is recursive so that a caller can hold it across
+ * several transactions that must not be interleaved with those of other
+ * threads (e.g. SendObjectInfo followed by SendObject). The cache lock is
+ * a reader/writer lock around params->objects and the storage list,
+ * where a thread holding it exclusively may take it again in either
+ * mode. The index lock guards data derived from the cache that readers
+ * build lazily, the time lock guards the local time offsets of
+ * ptp_unpack_PTPTIME() and the info lock guards params->deviceinfo
+ * while it is replaced; nothing else is locked while holding any of
+ * these. Code that keeps using the arrays or strings of the device
+ * info across other calls holds the cache lock instead, which is also
+ * held exclusively while the device info is replaced.
+ *
+ * Without pthreads all of these are no-ops, except that exclusive use
+ * of the cache still bumps params->cache_generation.
+ **/
+void
+ptp_init_locks (PTPParams *params)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init (&attr);
+	pthread_mutexattr_settype (&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init (&params->transaction_lock, &attr);
+	pthread_mutexattr_destroy (&attr);
+	pthread_mutex_init (&params->error_lock, NULL);
+	pthread_mutex_init (&params->index_lock, NULL);
+	pthread_mutex_init (&params->time_lock, NULL);
+	pthread_mutex_init (&params->info_lock, NULL);
+	pthread_rwlock_init (&params->cache_lock, NULL);
+	pthread_mutex_init (&params->cache_owner_lock, NULL);
+#endif
+	params->cache_write_depth = 0;
+}
+
+void
+ptp_free_locks (PTPParams *params)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy (&params->transaction_lock);
+	pthread_mutex_destroy (&params->error_lock);
+	pthread_mutex_destroy (&params->index_lock);
+	pthread_mutex_destroy (&params->time_lock);
+	pthread_mutex_destroy (&params->info_lock);
+	pthread_rwlock_destroy (&params->cache_lock);
+	pthread_mutex_destroy (&params->cache_owner_lock);
+#endif
+}
+
+void
+ptp_lock_transactions (PTPParams *params)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock (&params->transaction_lock);
+#endif
+}
+
+void
+ptp_unlock_transactions (PTPParams *params)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock (&params->transaction_lock);
+#endif
+}
+
+/*
+ * Adds delta to the nesting depth of the exclusive cache lock if the
+ * calling thread holds it. The owner lock makes the depth and writer
+ * safe to look at from threads that do not hold the cache lock.
+ * Returns -1 if the thread is not the writer, the new depth otherwise.
+ */
+static int
+ptp_cache_nest (PTPParams *params, int delta)
+{
+	int depth = -1;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock (&params->cache_owner_lock);
+	if (params->cache_write_depth &&
+	    pthread_equal (params->cache_writer, pthread_self ()))
+		depth = params->cache_write_depth += delta;
+	pthread_mutex_unlock (&params->cache_owner_lock);
+#else
+	if (params->cache_write_depth)
+		depth = params->cache_write_depth += delta;
+#endif
+	return depth;
+}
+
+/**
+ * ptp_lock_cache:
+ * params:	PTPParams*
+ * 		int exclusive		- 0 to only read the cache
+ *
+ * Locks the object cache. Readers may not upgrade to exclusive; a
+ * reader that finds it needs to modify the cache must unlock first.
+ **/
+void
+ptp_lock_cache (PTPParams *params, int exclusive)
+{
+	if (ptp_cache_nest (params, 1) >= 0)
+		return;
+	if (!exclusive) {
+#ifdef HAVE_PTHREAD_H
+		pthread_rwlock_rdlock (&params->cache_lock);
+#endif
+		return;
+	}
+#ifdef HAVE_PTHREAD_H
+	pthread_rwlock_wrlock (&params->cache_lock);
+	pthread_mutex_lock (&params->cache_owner_lock);
+	params->cache_writer = pthread_self ();
+	params->cache_write_depth = 1;
+	pthread_mutex_unlock (&params->cache_owner_lock);
+#else
+	params->cache_write_depth = 1;
+#endif
+	params->cache_generation++;
+}
+
+void
+ptp_unlock_cache (PTPParams *params)
+{
+	int depth = ptp_cache_nest (params, -1);
+
+	if (depth > 0)
+		return;
+	/* Whatever was derived meanwhile may be stale already */
+	if (depth == 0)
+		params->cache_generation++;
+#ifdef HAVE_PTHREAD_H
+	pthread_rwlock_unlock (&params->cache_lock);
+#endif
+}
+
+void
+ptp_lock_errors (PTPParams *params)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock (&params->error_lock);
+#endif
+}
+
+void
+ptp_unlock_errors (PTPParams *params)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock (&params->error_lock);
+#endif
+}
+
+void
+ptp_lock_index (PTPParams *params)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock (&params->index_lock);
+#endif
+}
+
+void
+ptp_unlock_index (PTPParams *params)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock (&params->index_lock);
+#endif
+}
+
+void
+ptp_lock_info (PTPParams *params)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock (&params->info_lock);
+#endif
+}
+
+void
+ptp_unlock_info (PTPParams *params)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock (&params->info_lock);
+#endif
+}
+
+/* ptp_object_want() runs under the shared cache lock too, so its
+ * statistics are counted atomically, or under the cache owner lock
+ * where 64 bit atomics are missing. */
+static void
+ptp_count (PTPParams *params, uint64_t *counter)
+{
+#if defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_8)
+	__atomic_fetch_add (counter, 1, __ATOMIC_RELAXED);
+#elif defined(HAVE_PTHREAD_H)
+	pthread_mutex_lock (&params->cache_owner_lock);
+	(*counter)++;
+	pthread_mutex_unlock (&params->cache_owner_lock);
+#else
+	(*counter)++;
+#endif
+}
+
+static uint64_t
+ptp_read_count (PTPParams *params, uint64_t *counter)
+{
+	uint64_t	value;
+
+#if defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_8)
+	value = __atomic_load_n (counter, __ATOMIC_RELAXED);
+#elif defined(HAVE_PTHREAD_H)
+	pthread_mutex_lock (&params->cache_owner_lock);
+	value = *counter;
+	pthread_mutex_unlock (&params->cache_owner_lock);
+#else
+	value = *counter;
+#endif
+	return value;
+}
+
+void
+ptp_get_want_stats (PTPParams *params, uint64_t *hits, uint64_t *misses,
+		    uint64_t *requests)
+{
+	*hits = ptp_read_count (params, &params->want_hits);
+	*misses = ptp_read_count (params, &params->want_misses);
+	*requests = ptp_read_count (params, &params->want_requests);
+}
+
 /* major PTP functions */
 
 /* Transaction data phase description */
@@ -138,16 +375,14 @@ ptp_error (PTPParams *params, const char *format, ...)
  * Upon success PTPContainer* ptp contains PTP Response Phase container with
  * all fields filled in.
  **/
-uint16_t
-ptp_transaction_new (PTPParams* params, PTPContainer* ptp, 
-		     uint16_t flags, uint64_t sendlen,
-		     PTPDataHandler *handler
+static uint16_t
+ptp_transaction_unlocked (PTPParams* params, PTPContainer* ptp,
+			  uint16_t flags, uint64_t sendlen,
+			  PTPDataHandler *handler
 ) {
 	int 		tries;
 	uint16_t	cmd;
 
-	if ((params==NULL) || (ptp==NULL)) 
-		return PTP_ERROR_BADPARAM;
 
 	cmd = ptp->Code;
 	ptp->Transaction_ID=params->transaction_id++;
@@ -226,6 +461,22 @@ ptp_transaction_new (PTPParams* params, PTPContainer* ptp,
 	return ptp->Code;
 }
 
+uint16_t
+ptp_transaction_new (PTPParams* params, PTPContainer* ptp, 
+		     uint16_t flags, uint64_t sendlen,
+		     PTPDataHandler *handler
+) {
+	uint16_t	ret;
+
+	if ((params==NULL) || (ptp==NULL)) 
+		return PTP_ERROR_BADPARAM;
+
+	ptp_lock_transactions (params);
+	ret = ptp_transaction_unlocked (params, ptp, flags, sendlen, handler);
+	ptp_unlock_transactions (params);
+	return ret;
+}
+
 /* memory data get/put handler */
 typedef struct {
 	unsigned char	*data;
@@ -1146,6 +1397,8 @@ ptp_free_params (PTPParams *params) {
 		ptp_free_devicepropdesc (&params->deviceproperties[i].desc);
 	free (params->deviceproperties);
 
+	ptp_free_objectpropssupported (params);
+
 	ptp_free_DI (&params->deviceinfo);
 }
 
@@ -1549,27 +1802,45 @@ ptp_getthumb (PTPParams* params, uint32_t handle, unsigned char** object, unsign
 }
 
 /**
- * ptp_deleteobject:
+ * ptp_deleteobject_nocache:
  * params:	PTPParams*
  *		handle			- object handle
  *		ofc			- object format code (optional)
  * 
- * Deletes desired objects.
+ * Deletes desired objects, but leaves the object cache alone. For
+ * callers that update the cache themselves, e.g. once for many deletes.
  *
  * Return values: Some PTP_RC_* code.
  **/
 uint16_t
-ptp_deleteobject (PTPParams* params, uint32_t handle, uint32_t ofc)
+ptp_deleteobject_nocache (PTPParams* params, uint32_t handle, uint32_t ofc)
 {
 	PTPContainer ptp;
-	uint16_t ret;
 
 	PTP_CNT_INIT(ptp);
 	ptp.Code=PTP_OC_DeleteObject;
 	ptp.Param1=handle;
 	ptp.Param2=ofc;
 	ptp.Nparam=2;
-	ret = ptp_transaction(params, &ptp, PTP_DP_NODATA, 0, NULL, NULL);
+	return ptp_transaction(params, &ptp, PTP_DP_NODATA, 0, NULL, NULL);
+}
+
+/**
+ * ptp_deleteobject:
+ * params:	PTPParams*
+ *		handle			- object handle
+ *		ofc			- object format code (optional)
+ * 
+ * Deletes desired objects.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_deleteobject (PTPParams* params, uint32_t handle, uint32_t ofc)
+{
+	uint16_t ret;
+
+	ret = ptp_deleteobject_nocache (params, handle, ofc);
 	if (ret != PTP_RC_OK) {
 		return ret;
 	}
@@ -3591,11 +3862,14 @@ ptp_nikon_writewifiprofile (PTPParams* params, PTPNIKONWifiProfile* profile)
  * ptp_mtp_getobjectpropssupported:
  *
  * This command gets the object properties possible from the device.
+ * The answer is only asked for once per object format and cached in
+ * params, until ptp_free_objectpropssupported() drops it when the
+ * device info changes.
  *  
  * params:	PTPParams*
  *	uint ofc		- object format code
  *	unsigned int *propnum	- number of elements in returned array
- *	uint16_t *props		- array of supported properties
+ *	uint16_t *props		- array of supported properties, to be freed
  *
  * Return values: Some PTP_RC_* code.
  *
@@ -3608,6 +3882,29 @@ ptp_mtp_getobjectpropssupported (PTPParams* params, uint16_t ofc,
 	uint16_t ret;
 	unsigned char *data = NULL;
 	unsigned int size = 0;
+	unsigned int i;
+	PTPObjectPropsSupported *ops;
+
+	/* the cache is shared by all threads using the device */
+	ptp_lock_transactions (params);
+	for (i=0;i<params->nrofobjectpropssupported;i++) {
+		ops = &params->objectpropssupported[i];
+		if (ops->ofc != ofc)
+			continue;
+		*props = NULL;
+		*propnum = 0;
+		if (ops->nrofprops) {
+			*props = malloc (ops->nrofprops*sizeof(uint16_t));
+			if (!*props) {
+				ptp_unlock_transactions (params);
+				return PTP_RC_GeneralError;
+			}
+			memcpy (*props, ops->props, ops->nrofprops*sizeof(uint16_t));
+			*propnum = ops->nrofprops;
+		}
+		ptp_unlock_transactions (params);
+		return PTP_RC_OK;
+	}
         
         PTP_CNT_INIT(ptp);
         ptp.Code=PTP_OC_MTP_GetObjectPropsSupported;
@@ -3617,9 +3914,54 @@ ptp_mtp_getobjectpropssupported (PTPParams* params, uint16_t ofc,
 	if (ret == PTP_RC_OK)
         	*propnum=ptp_unpack_uint16_t_array(params,data,0,props);
 	free(data);
+	if (ret == PTP_RC_OK && (*props || !*propnum)) {
+		ops = realloc (params->objectpropssupported,
+			(params->nrofobjectpropssupported+1)*sizeof(PTPObjectPropsSupported));
+		if (ops) {
+			params->objectpropssupported = ops;
+			ops = &ops[params->nrofobjectpropssupported];
+			ops->ofc = ofc;
+			ops->nrofprops = 0;
+			ops->props = NULL;
+			if (*propnum)
+				ops->props = malloc (*propnum*sizeof(uint16_t));
+			if (ops->props) {
+				memcpy (ops->props, *props, *propnum*sizeof(uint16_t));
+				ops->nrofprops = *propnum;
+			}
+			/* an entry that failed to copy is not kept */
+			if (ops->props || !*propnum)
+				params->nrofobjectpropssupported++;
+		}
+	}
+	ptp_unlock_transactions (params);
 	return ret;
 }
 
+/**
+ * ptp_free_objectpropssupported:
+ *
+ * Drops the supported object properties cached by
+ * ptp_mtp_getobjectpropssupported(), e.g. when the device info is
+ * replaced, so that they are asked for again.
+ *
+ * params:	PTPParams*
+ *
+ **/
+void
+ptp_free_objectpropssupported (PTPParams* params)
+{
+	unsigned int i;
+
+	ptp_lock_transactions (params);
+	for (i=0;i<params->nrofobjectpropssupported;i++)
+		free (params->objectpropssupported[i].props);
+	free (params->objectpropssupported);
+	params->objectpropssupported = NULL;
+	params->nrofobjectpropssupported = 0;
+	ptp_unlock_transactions (params);
+}
+
 /**
  * ptp_mtp_getobjectpropdesc:
  *
@@ -3794,6 +4136,188 @@ ptp_mtp_getobjectproplist (PTPParams* params, uint32_t handle, MTPProperties **p
 	return ret;
 }
 
+/* streaming object property list handler */
+typedef struct {
+	PTPParams	*params;
+	PTPOPLFunc	func;
+	void		*priv;
+	unsigned char	*buf;		/* record split across two chunks */
+	unsigned long	buflen, bufsize;
+	int		gotcount;	/* the leading record count is parsed */
+	uint32_t	left;		/* records still to come */
+	int		done;		/* ignore anything that follows */
+} PTPOPLStreamPrivate;
+
+/* size of the next unit (record count or record), see ptp_unpack_OPL_recsize */
+static int
+opl_stream_unitsize (PTPOPLStreamPrivate *priv, unsigned char *data,
+		     unsigned long len, unsigned long *size)
+{
+	int ret;
+
+	if (!priv->gotcount) {
+		*size = sizeof(uint32_t);
+		return len >= *size;
+	}
+	ret = ptp_unpack_OPL_recsize (priv->params, data, len, size);
+	if (ret < 0) {
+		ptp_debug (priv->params, "unsupported datatype in MTP Object Property List, %d records unread", priv->left);
+		priv->done = 1;
+	}
+	return ret;
+}
+
+/* decode one complete unit and hand records over to the consumer */
+static uint16_t
+opl_stream_unit (PTPOPLStreamPrivate *priv, unsigned char *data, unsigned long size)
+{
+	PTPParams	*params = priv->params;
+	MTPProperties	prop;
+	unsigned int	offset = 0;
+
+	if (!priv->gotcount) {
+		priv->gotcount = 1;
+		priv->left = dtoh32a(data);
+		ptp_debug (params, "Streaming MTP OPL (prop_count %d)", priv->left);
+		if (!priv->left)
+			priv->done = 1;
+		return PTP_RC_OK;
+	}
+	memset (&prop, 0, sizeof(prop));
+	ptp_unpack_OPL_header (params, data, &prop);
+	ptp_unpack_DPV (params, data + PTP_opl_Value, &offset,
+			size - PTP_opl_Value, &prop.propval, prop.datatype);
+	if (!--priv->left)
+		priv->done = 1;
+	/* the consumer owns the property value from here on */
+	return priv->func (params, priv->priv, &prop);
+}
+
+static uint16_t
+opl_stream_reserve (PTPOPLStreamPrivate *priv, unsigned long size)
+{
+	unsigned char	*newbuf;
+	unsigned long	newsize;
+
+	if (size <= priv->bufsize)
+		return PTP_RC_OK;
+	newsize = priv->bufsize ? priv->bufsize*2 : 256;
+	if (newsize < size)
+		newsize = size;
+	newbuf = realloc (priv->buf, newsize);
+	if (!newbuf)
+		return PTP_RC_GeneralError;
+	priv->buf = newbuf;
+	priv->bufsize = newsize;
+	return PTP_RC_OK;
+}
+
+static uint16_t
+opl_stream_putfunc (PTPParams* params, void* private,
+		    unsigned long sendlen, unsigned char *data,
+		    unsigned long *putlen
+) {
+	PTPOPLStreamPrivate* priv = (PTPOPLStreamPrivate*)private;
+	unsigned long	off = 0, size, tocopy;
+	uint16_t	ret;
+	int		known;
+
+	*putlen = sendlen;
+	/* complete a unit split across the previous chunk and this one */
+	while (priv->buflen && !priv->done) {
+		known = opl_stream_unitsize (priv, priv->buf, priv->buflen, &size);
+		if (known < 0)
+			break;
+		tocopy = size - priv->buflen;
+		if (tocopy > sendlen - off)
+			tocopy = sendlen - off;
+		if (opl_stream_reserve (priv, size) != PTP_RC_OK)
+			return PTP_RC_GeneralError;
+		memcpy (priv->buf + priv->buflen, data + off, tocopy);
+		priv->buflen += tocopy;
+		off += tocopy;
+		if (priv->buflen < size)
+			return PTP_RC_OK;
+		if (known) {
+			priv->buflen = 0;
+			ret = opl_stream_unit (priv, priv->buf, size);
+			if (ret != PTP_RC_OK)
+				return ret;
+		}
+	}
+	/* then decode straight out of the chunk */
+	while (off < sendlen && !priv->done) {
+		known = opl_stream_unitsize (priv, data + off, sendlen - off, &size);
+		if (known < 0)
+			break;
+		if (!known || size > sendlen - off) {
+			/* carry the partial unit over to the next chunk */
+			if (opl_stream_reserve (priv, sendlen - off) != PTP_RC_OK)
+				return PTP_RC_GeneralError;
+			memcpy (priv->buf, data + off, sendlen - off);
+			priv->buflen = sendlen - off;
+			break;
+		}
+		ret = opl_stream_unit (priv, data + off, size);
+		if (ret != PTP_RC_OK)
+			return ret;
+		off += size;
+	}
+	return PTP_RC_OK;
+}
+
+/**
+ * ptp_mtp_getobjectproplist_stream:
+ * params:	PTPParams*
+ *		handle - object to get the properties for, 0xffffffff for all
+ *		property - property code to get, 0xffffffff for all
+ *		depth - levels below handle to include, 0xffffffff for all
+ *		func - called for every property as soon as it is decoded
+ *		priv - passed on to func
+ *
+ * Retrieves the full property list of an object and the objects below
+ * it, like ptp_mtp_getobjectproplist(), but decodes the records while
+ * the data phase is still running instead of buffering the whole
+ * response. The records are delivered in the order the device sends
+ * them and func takes over the property values. Returning anything but
+ * PTP_RC_OK from func aborts the transfer.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_mtp_getobjectproplist_stream (PTPParams* params, uint32_t handle, uint32_t property,
+				  uint32_t depth, PTPOPLFunc func, void *priv)
+{
+	uint16_t		ret;
+	PTPContainer		ptp;
+	PTPDataHandler		handler;
+	PTPOPLStreamPrivate	stream;
+
+	PTP_CNT_INIT(ptp);
+	ptp.Code = PTP_OC_MTP_GetObjPropList;
+	ptp.Param1 = handle;
+	ptp.Param2 = 0x00000000U;  /* 0x00000000U should be "all formats" */
+	ptp.Param3 = property;  /* 0xFFFFFFFFU should be "all properties" */
+	ptp.Param4 = 0x00000000U;
+	ptp.Param5 = depth;  /* 0xFFFFFFFFU means - return full tree below the Param1 handle */
+	ptp.Nparam = 5;
+
+	memset (&stream, 0, sizeof(stream));
+	stream.params = params;
+	stream.func = func;
+	stream.priv = priv;
+	handler.getfunc = NULL;
+	handler.putfunc = opl_stream_putfunc;
+	handler.priv = &stream;
+	ret = ptp_transaction_new(params, &ptp, PTP_DP_GETDATA, 0, &handler);
+	if (ret == PTP_RC_OK && (stream.buflen || stream.left)) {
+		ptp_debug (params ,"short MTP Object Property List, %d properties missing", stream.left);
+		ptp_debug (params ,"device probably needs DEVICE_FLAG_BROKEN_MTPGETOBJPROPLIST_ALL");
+	}
+	free (stream.buf);
+	return ret;
+}
+
 uint16_t
 ptp_mtp_getobjectproplist_single (PTPParams* params, uint32_t handle, MTPProperties **props, int *nrofprops)
 {
@@ -4323,18 +4847,40 @@ ptp_android_sendpartialobject (PTPParams* params, uint32_t handle, uint64_t offs
 
 
 /* Non PTP protocol functions */
-/* devinfo testing functions */
+/* devinfo testing functions, see ptp_lock_info() */
+
+int
+ptp_operation_issupported(PTPParams* params, uint16_t operation)
+{
+	unsigned int i;
+	int found = 0;
+
+	ptp_lock_info (params);
+	for (i=0;i<params->deviceinfo.OperationsSupported_len;i++) {
+		if (params->deviceinfo.OperationsSupported[i]==operation) {
+			found = 1;
+			break;
+		}
+	}
+	ptp_unlock_info (params);
+	return found;
+}
 
 int
 ptp_event_issupported(PTPParams* params, uint16_t event)
 {
-	unsigned int i=0;
+	unsigned int i;
+	int found = 0;
 
-	for (;i<params->deviceinfo.EventsSupported_len;i++) {
-		if (params->deviceinfo.EventsSupported[i]==event)
-			return 1;
+	ptp_lock_info (params);
+	for (i=0;i<params->deviceinfo.EventsSupported_len;i++) {
+		if (params->deviceinfo.EventsSupported[i]==event) {
+			found = 1;
+			break;
+		}
 	}
-	return 0;
+	ptp_unlock_info (params);
+	return found;
 }
 
 
@@ -4342,11 +4888,25 @@ int
 ptp_property_issupported(PTPParams* params, uint16_t property)
 {
 	unsigned int i;
+	int found = 0;
 
-	for (i=0;i<params->deviceinfo.DevicePropertiesSupported_len;i++)
-		if (params->deviceinfo.DevicePropertiesSupported[i]==property)
-			return 1;
-	return 0;
+	ptp_lock_info (params);
+	for (i=0;i<params->deviceinfo.DevicePropertiesSupported_len;i++) {
+		if (params->deviceinfo.DevicePropertiesSupported[i]==property) {
+			found = 1;
+			break;
+		}
+	}
+	ptp_unlock_info (params);
+	return found;
+}
+
+void
+ptp_free_deviceinfo (PTPDeviceInfo *di)
+{
+	if (!di) return;
+	ptp_free_DI (di);
+	memset (di, 0, sizeof(*di));
 }
 
 void
@@ -4366,6 +4926,9 @@ ptp_free_object (PTPObject *ob)
 	ptp_free_objectinfo (&ob->oi);
 	for (i=0;i<ob->nrofmtpprops;i++)
 		ptp_destroy_object_prop(&ob->mtpprops[i]);
+	free (ob->mtpprops);
+	ob->mtpprops = NULL;
+	ob->nrofmtpprops = 0;
 	ob->flags = 0;
 }
 
@@ -6345,6 +6908,16 @@ ptp_destroy_object_prop_list(MTPProperties *props, int nrofprops)
   free(props);
 }
 
+/*
+ * Parse a PTP date string such as the one in an object's
+ * PTP_OPC_DateModified property.
+ */
+time_t
+ptp_parse_date(PTPParams *params, const char *str)
+{
+  return ptp_unpack_PTPTIME(params, str);
+}
+
 /*
  * Find a certain object property in the cache, i.e. a certain metadata
  * item for a certain object handle.
@@ -6381,6 +6954,7 @@ ptp_remove_object_from_cache(PTPParams *params, uint32_t handle)
 		return;
 	i = ob-params->objects;
 	/* remove object from object info cache */
+	ptp_object_uncharge_mtpprops (params, ob);
 	ptp_free_object (ob);
 
 	if (i < params->nrofobjects-1)
@@ -6476,6 +7050,107 @@ ptp_object_find_or_insert (PTPParams *params, uint32_t handle, PTPObject **retob
 	return PTP_RC_OK;
 }
 
+/* Approximate heap memory held by the MTP property list of an object */
+uint64_t
+ptp_object_mtpprops_size (PTPObject *ob) {
+	MTPProperties	*props = ob->mtpprops;
+	uint64_t	size = (uint64_t)ob->nrofmtpprops * sizeof(MTPProperties);
+	unsigned int	i;
+
+	for (i=0;i<ob->nrofmtpprops;i++) {
+		if (props[i].datatype == PTP_DTC_STR) {
+			if (props[i].propval.str)
+				size += strlen(props[i].propval.str) + 1;
+		} else if (props[i].datatype & PTP_DTC_ARRAY_MASK) {
+			size += (uint64_t)props[i].propval.a.count * sizeof(PTPPropertyValue);
+		}
+	}
+	return size;
+}
+
+struct _mtpprops_lru {
+	unsigned int	age;
+	uint32_t	pos;
+};
+
+static int _cmp_lru (const void *a, const void *b) {
+	const struct _mtpprops_lru *la = a;
+	const struct _mtpprops_lru *lb = b;
+
+	/* oldest first */
+	if (la->age > lb->age) return -1;
+	return la->age < lb->age;
+}
+
+/* Account for a property list that just became part of the cache, or
+ * changed, and evict others when that goes past params->mtpprops_limit.
+ * Charging an object again only adds what its list grew by. */
+void
+ptp_object_charge_mtpprops (PTPParams *params, PTPObject *ob) {
+	uint64_t	size = ob->mtpprops ? ptp_object_mtpprops_size (ob) : 0;
+
+	ob->mtpprops_used = ++params->mtpprops_clock;
+	params->mtpprops_size -= ob->mtpprops_charged;
+	params->mtpprops_size += size;
+	ob->mtpprops_charged = size;
+	if (params->mtpprops_limit && params->mtpprops_size > params->mtpprops_limit)
+		ptp_objects_trim_mtpprops (params, ob);
+}
+
+/* Take the property list of an object that is about to be freed or
+ * dropped off params->mtpprops_size. */
+void
+ptp_object_uncharge_mtpprops (PTPParams *params, PTPObject *ob) {
+	params->mtpprops_size -= ob->mtpprops_charged;
+	ob->mtpprops_charged = 0;
+}
+
+/* If the cached property lists are over the limit, drop the least
+ * recently used ones until a quarter of the limit is free again, so
+ * that the cache is sorted once per batch rather than once per list.
+ * Only the lists that ptp_object_want() can read back are dropped, the
+ * core object info always stays. "keep" is spared. */
+void
+ptp_objects_trim_mtpprops (PTPParams *params, PTPObject *keep) {
+	struct _mtpprops_lru	*lru;
+	uint64_t		target;
+	unsigned int		i, nroflru = 0;
+
+	if (!params->mtpprops_limit || params->mtpprops_size <= params->mtpprops_limit)
+		return;
+	if ((params->device_flags & DEVICE_FLAG_BROKEN_MTPGETOBJPROPLIST) ||
+	    !ptp_operation_issupported(params,PTP_OC_MTP_GetObjPropList))
+		return;
+
+	lru = malloc (params->nrofobjects * sizeof(struct _mtpprops_lru));
+	if (!lru)
+		return;
+	for (i=0;i<params->nrofobjects;i++) {
+		PTPObject *ob = &params->objects[i];
+
+		if (!ob->mtpprops || ob == keep)
+			continue;
+		/* relative to the clock, so that it may wrap */
+		lru[nroflru].age = params->mtpprops_clock - ob->mtpprops_used;
+		lru[nroflru].pos = i;
+		nroflru++;
+	}
+	qsort (lru, nroflru, sizeof(struct _mtpprops_lru), _cmp_lru);
+
+	target = params->mtpprops_limit - params->mtpprops_limit / 4;
+	for (i=0;i<nroflru && params->mtpprops_size > target;i++) {
+		PTPObject	*ob = &params->objects[lru[i].pos];
+
+		ptp_object_uncharge_mtpprops (params, ob);
+		ptp_destroy_object_prop_list (ob->mtpprops, ob->nrofmtpprops);
+		ob->mtpprops = NULL;
+		ob->nrofmtpprops = 0;
+		ob->flags &= ~PTPOBJECT_MTPPROPLIST_LOADED;
+	}
+	ptp_debug (params, "ptp_objects_trim_mtpprops: evicted %d property lists", i);
+	free (lru);
+}
+
 uint16_t
 ptp_object_want (PTPParams *params, uint32_t handle, unsigned int want, PTPObject **retob) {
 	uint16_t	ret;
@@ -6495,9 +7170,14 @@ ptp_object_want (PTPParams *params, uint32_t handle, unsigned int want, PTPObjec
 	if (ret != PTP_RC_OK)
 		return PTP_RC_GeneralError;
 	*retob = ob;
+	if (want & PTPOBJECT_MTPPROPLIST_LOADED)
+		ob->mtpprops_used = ++params->mtpprops_clock;
 	/* Do we have all of it already? */
-	if ((ob->flags & want) == want)
+	if ((ob->flags & want) == want) {
+		ptp_count (params, &params->want_hits);
 		return PTP_RC_OK;
+	}
+	ptp_count (params, &params->want_misses);
 
 #define X (PTPOBJECT_OBJECTINFO_LOADED|PTPOBJECT_STORAGEID_LOADED|PTPOBJECT_PARENTOBJECT_LOADED)
 	if ((want & X) && ((ob->flags & X) != X)) {
@@ -6507,6 +7187,7 @@ ptp_object_want (PTPParams *params, uint32_t handle, unsigned int want, PTPObjec
 		if (ob->flags & PTPOBJECT_PARENTOBJECT_LOADED)
 			saveparent = ob->oi.ParentObject;
 
+		ptp_count (params, &params->want_requests);
 		ret = ptp_getobjectinfo (params, handle, &ob->oi);
 		if (ret != PTP_RC_OK) {
 			/* kill it from the internal list ... */
@@ -6527,6 +7208,7 @@ ptp_object_want (PTPParams *params, uint32_t handle, unsigned int want, PTPObjec
 			PTPCANONFolderEntry *ents = NULL;
 			uint32_t            numents = 0;
 
+			ptp_count (params, &params->want_requests);
 			ret = ptp_canon_getobjectinfo(params,
 				ob->oi.StorageID,0,
 				ob->oi.ParentObject,handle,
@@ -6558,11 +7240,16 @@ ptp_object_want (PTPParams *params, uint32_t handle, unsigned int want, PTPObjec
 
 		ptp_debug (params, "ptp2/mtpfast: reading mtp proplist of %08x", handle);
 		/* We just want this one object, not all at once. */
+		ptp_count (params, &params->want_requests);
 		ret = ptp_mtp_getobjectproplist_single (params, handle, &props, &nrofprops);
 		if (ret != PTP_RC_OK)
 			goto fallback;
+		/* a partial list may have come with a listing */
+		ptp_object_uncharge_mtpprops (params, ob);
+		ptp_destroy_object_prop_list (ob->mtpprops, ob->nrofmtpprops);
 		ob->mtpprops = props;
 		ob->nrofmtpprops = nrofprops;
+		ptp_object_charge_mtpprops (params, ob);
 
 		/* Override the ObjectInfo data with data from properties */
 		if (params->device_flags & DEVICE_FLAG_PROPLIST_OVERRIDES_OI) {
@@ -6606,10 +7293,10 @@ ptp_object_want (PTPParams *params, uint32_t handle, unsigned int want, PTPObjec
 					}
 					break;
 				case PTP_OPC_DateCreated:
-					ob->oi.CaptureDate = ptp_unpack_PTPTIME(prop->propval.str);
+					ob->oi.CaptureDate = ptp_unpack_PTPTIME(params, prop->propval.str);
 					break;
 				case PTP_OPC_DateModified:
-					ob->oi.ModificationDate = ptp_unpack_PTPTIME(prop->propval.str);
+					ob->oi.ModificationDate = ptp_unpack_PTPTIME(params, prop->propval.str);
 					break;
 				case PTP_OPC_Keywords:
 					if (prop->propval.str) {
@@ -6698,7 +7385,7 @@ ptp_object_want (PTPParams *params, uint32_t handle, unsigned int want, PTPObjec
 					break;
 				}
 				ptp_debug (params, "ptp2/mtpfast: capturedate %s", xpl->propval.str);
-				oinfo.CaptureDate = ptp_unpack_PTPTIME (xpl->propval.str);
+				oinfo.CaptureDate = ptp_unpack_PTPTIME (params, xpl->propval.str);
 				break;
 			case PTP_OPC_DateModified:
 				if (xpl->datatype != PTP_DTC_STR) {
@@ -6706,7 +7393,7 @@ ptp_object_want (PTPParams *params, uint32_t handle, unsigned int want, PTPObjec
 					break;
 				}
 				ptp_debug (params, "ptp2/mtpfast: moddate %s", xpl->propval.str);
-				oinfo.ModificationDate = ptp_unpack_PTPTIME (xpl->propval.str);
+				oinfo.ModificationDate = ptp_unpack_PTPTIME (params, xpl->propval.str);
 				break;
 			default:
 				if ((xpl->property & 0xfff0) == 0xdc00)
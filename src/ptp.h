@@ -25,8 +25,8 @@
 
 #include <stdarg.h>
 #include <time.h>
-#ifdef HAVE_ICONV
-#include <iconv.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
 #endif
 #include "gphoto2-endian.h"
 #include "device-flags.h"
@@ -2308,6 +2308,10 @@ struct _PTPObject {
 	uint32_t	canon_flags;
 	MTPProperties	*mtpprops;
 	unsigned int	nrofmtpprops;
+	/* Last use of mtpprops, for evicting the least recently used */
+	unsigned int	mtpprops_used;
+	/* What mtpprops adds to params->mtpprops_size */
+	uint64_t	mtpprops_charged;
 };
 typedef struct _PTPObject PTPObject;
 
@@ -2319,6 +2323,22 @@ struct _PTPDeviceProperty {
 };
 typedef struct _PTPDeviceProperty PTPDeviceProperty;
 
+/* The Object Properties Supported Cache */
+struct _PTPObjectPropsSupported {
+	uint16_t		ofc;
+	uint32_t		nrofprops;
+	uint16_t		*props;
+};
+typedef struct _PTPObjectPropsSupported PTPObjectPropsSupported;
+
+/* The offset of local time from UTC throughout one month, only kept
+ * for months in which it does not change */
+#define PTP_LOCALTIME_MONTHS 128
+typedef struct _PTPLocalTimeMonth {
+	int32_t		month;	/* year * 12 + month (1-12), 0 if unused */
+	int32_t		offset;	/* seconds local time is ahead of UTC */
+} PTPLocalTimeMonth;
+
 struct _PTPParams {
 	/* device flags */
 	uint32_t	device_flags;
@@ -2369,6 +2389,10 @@ struct _PTPParams {
 	PTPDeviceProperty	*deviceproperties;
 	unsigned int		nrofdeviceproperties;
 
+	/* MTP: Object Properties Supported Caching, per format */
+	PTPObjectPropsSupported	*objectpropssupported;
+	unsigned int		nrofobjectpropssupported;
+
 	/* PTP: Canon specific flags list */
 	PTPCanon_Property	*canon_props;
 	unsigned int		nrofcanon_props;
@@ -2401,17 +2425,40 @@ struct _PTPParams {
 	char		*olympus_reply;
 	struct _PTPParams *outer_params;
 
-#ifdef HAVE_ICONV
-	/* PTP: iconv converters */
-	iconv_t	cd_locale_to_ucs2;
-	iconv_t cd_ucs2_to_locale;
-#endif
-
 	/* IO: Sometimes the response packet get send in the dataphase
 	 * too. This only happens for a Samsung player now.
 	 */
 	uint8_t		*response_packet;
 	uint16_t	response_packet_size;
+
+	/* Threading: see ptp_init_locks() */
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	transaction_lock;
+	pthread_mutex_t	error_lock;
+	pthread_mutex_t	index_lock;
+	pthread_mutex_t	time_lock;
+	pthread_mutex_t	info_lock;
+	pthread_rwlock_t cache_lock;
+	pthread_mutex_t	cache_owner_lock;
+	pthread_t	cache_writer;
+#endif
+	int		cache_write_depth;
+	/* Bumped whenever the object cache may have changed */
+	unsigned int	cache_generation;
+
+	/* Memory ceiling of the cached MTP property lists, 0 for none */
+	uint64_t	mtpprops_limit;
+	/* Memory held by them, the sum of the objects' mtpprops_charged */
+	uint64_t	mtpprops_size;
+	unsigned int	mtpprops_clock;
+
+	/* ptp_object_want() statistics, see ptp_get_want_stats() */
+	uint64_t	want_hits;
+	uint64_t	want_misses;
+	uint64_t	want_requests;
+
+	/* Local time offsets by month, see ptp_unpack_PTPTIME() */
+	PTPLocalTimeMonth localtime_months[PTP_LOCALTIME_MONTHS];
 };
 
 /* last, but not least - ptp functions */
@@ -2515,6 +2562,8 @@ uint16_t ptp_getthumb		(PTPParams *params, uint32_t handle,
 
 uint16_t ptp_deleteobject	(PTPParams* params, uint32_t handle,
 				uint32_t ofc);
+uint16_t ptp_deleteobject_nocache (PTPParams* params, uint32_t handle,
+				uint32_t ofc);
 
 uint16_t ptp_sendobjectinfo	(PTPParams* params, uint32_t* store,
 				uint32_t* parenthandle, uint32_t* handle,
@@ -2584,6 +2633,9 @@ uint16_t ptp_mtp_getobjectreferences (PTPParams* params, uint32_t handle, uint32
 uint16_t ptp_mtp_setobjectreferences (PTPParams* params, uint32_t handle, uint32_t* ohArray, uint32_t arraylen);
 uint16_t ptp_mtp_getobjectproplist (PTPParams* params, uint32_t handle, MTPProperties **props, int *nrofprops);
 uint16_t ptp_mtp_getobjectproplist_single (PTPParams* params, uint32_t handle, MTPProperties **props, int *nrofprops);
+/* Called for every record of a streamed object property list, takes over prop->propval */
+typedef uint16_t (* PTPOPLFunc)	(PTPParams* params, void* priv, MTPProperties *prop);
+uint16_t ptp_mtp_getobjectproplist_stream (PTPParams* params, uint32_t handle, uint32_t property, uint32_t depth, PTPOPLFunc func, void *priv);
 uint16_t ptp_mtp_sendobjectproplist (PTPParams* params, uint32_t* store, uint32_t* parenthandle, uint32_t* handle,
 				     uint16_t objecttype, uint64_t objectsize, MTPProperties *props, int nrofprops);
 uint16_t ptp_mtp_setobjectproplist (PTPParams* params, MTPProperties *props, int nrofprops);
@@ -3122,6 +3174,7 @@ uint16_t ptp_nikon_getfileinfoinblock (PTPParams* params, uint32_t p1, uint32_t
  **/
 #define ptp_nikon_device_ready(params) ptp_generic_no_data (params, PTP_OC_NIKON_DeviceReady, 0)
 uint16_t ptp_mtp_getobjectpropssupported (PTPParams* params, uint16_t ofc, uint32_t *propnum, uint16_t **props);
+void ptp_free_objectpropssupported (PTPParams* params);
 
 
 /* Android MTP Extensions */
@@ -3141,25 +3194,30 @@ uint16_t ptp_olympus_opensession (PTPParams*, unsigned char**, unsigned long *);
 uint16_t ptp_olympus_getcameraid (PTPParams*, unsigned char**, unsigned long *);
 
 /* Non PTP protocol functions */
-static inline int
-ptp_operation_issupported(PTPParams* params, uint16_t operation)
-{
-	unsigned int i=0;
-
-	for (;i<params->deviceinfo.OperationsSupported_len;i++) {
-		if (params->deviceinfo.OperationsSupported[i]==operation)
-			return 1;
-	}
-	return 0;
-}
-
+int ptp_operation_issupported	(PTPParams* params, uint16_t operation);
 int ptp_event_issupported	(PTPParams* params, uint16_t event);
 int ptp_property_issupported	(PTPParams* params, uint16_t property);
 
 void ptp_free_params		(PTPParams *params);
+
+void ptp_init_locks		(PTPParams *params);
+void ptp_free_locks		(PTPParams *params);
+void ptp_lock_transactions	(PTPParams *params);
+void ptp_unlock_transactions	(PTPParams *params);
+void ptp_lock_cache		(PTPParams *params, int exclusive);
+void ptp_unlock_cache		(PTPParams *params);
+void ptp_lock_errors		(PTPParams *params);
+void ptp_unlock_errors		(PTPParams *params);
+void ptp_lock_index		(PTPParams *params);
+void ptp_unlock_index		(PTPParams *params);
+void ptp_lock_info		(PTPParams *params);
+void ptp_unlock_info		(PTPParams *params);
+void ptp_get_want_stats		(PTPParams *params, uint64_t *hits,
+				 uint64_t *misses, uint64_t *requests);
 void ptp_free_objectpropdesc	(PTPObjectPropDesc*);
 void ptp_free_devicepropdesc	(PTPDevicePropDesc*);
 void ptp_free_devicepropvalue	(uint16_t, PTPPropertyValue*);
+void ptp_free_deviceinfo	(PTPDeviceInfo *di);
 void ptp_free_objectinfo	(PTPObjectInfo *oi);
 void ptp_free_object		(PTPObject *oi);
 
@@ -3181,6 +3239,7 @@ int ptp_render_mtp_propname(uint16_t propid, int spaceleft, char *txt);
 MTPProperties *ptp_get_new_object_prop_entry(MTPProperties **props, int *nrofprops);
 void ptp_destroy_object_prop(MTPProperties *prop);
 void ptp_destroy_object_prop_list(MTPProperties *props, int nrofprops);
+time_t ptp_parse_date(PTPParams *params, const char *str);
 MTPProperties *ptp_find_object_prop_in_cache(PTPParams *params, uint32_t const handle, uint32_t const attribute_id);
 void ptp_remove_object_from_cache(PTPParams *params, uint32_t handle);
 uint16_t ptp_add_object_to_cache(PTPParams *params, uint32_t handle);
@@ -3188,6 +3247,10 @@ uint16_t ptp_object_want (PTPParams *, uint32_t handle, unsigned int want, PTPOb
 void ptp_objects_sort (PTPParams *);
 uint16_t ptp_object_find (PTPParams *params, uint32_t handle, PTPObject **retob);
 uint16_t ptp_object_find_or_insert (PTPParams *params, uint32_t handle, PTPObject **retob);
+uint64_t ptp_object_mtpprops_size (PTPObject *ob);
+void ptp_object_charge_mtpprops (PTPParams *params, PTPObject *ob);
+void ptp_object_uncharge_mtpprops (PTPParams *params, PTPObject *ob);
+void ptp_objects_trim_mtpprops (PTPParams *params, PTPObject *keep);
 /* ptpip.c */
 void ptp_nikon_getptpipguid (unsigned char* guid);
 
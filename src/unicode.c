@@ -33,20 +33,15 @@
 
 #include <stdlib.h>
 #include <string.h>
-#ifdef HAVE_ICONV
-#include "iconv.h"
-#else
-#error "libmtp unicode.c needs fixing to work without iconv()!"
-#endif
 #include "libmtp.h"
 #include "unicode.h"
 #include "util.h"
 #include "ptp.h"
 
 /**
- * The size of the buffer (in characters) used for creating string copies.
+ * The character put in place of anything that cannot be converted.
  */
-#define STRING_BUFFER_LENGTH 1024
+#define REPLACEMENT_CHARACTER 0xFFFDU
 
 /**
  * Gets the length (in characters, not bytes) of a unicode
@@ -68,77 +63,281 @@ int ucs2_strlen(uint16_t const * const unicstr)
 }
 
 /**
- * Converts a big-endian UTF-16 2-byte string
- * to a UTF-8 string. Actually just a UCS-2 internal conversion
- * routine that strips off the BOM if there is one.
+ * Gets a code unit of a UTF-16 string, either in host byte order or
+ * little-endian whatever the byte order of the host.
+ */
+static uint16_t get_utf16_unit(uint16_t const *str, size_t i, int le)
+{
+  uint8_t const *p = (uint8_t const *) &str[i];
+
+  if (!le)
+    return str[i];
+  return p[0] | (p[1] << 8);
+}
+
+/**
+ * Stores a code unit of a UTF-16 string, see get_utf16_unit().
+ */
+static void put_utf16_unit(uint16_t *str, size_t i, uint16_t unit, int le)
+{
+  uint8_t *p = (uint8_t *) &str[i];
+
+  if (!le) {
+    str[i] = unit;
+    return;
+  }
+  p[0] = unit & 0xFFU;
+  p[1] = unit >> 8;
+}
+
+/**
+ * Decodes the character at position <code>*i</code> of the
+ * <code>n</code> code units of a UTF-16 string and moves
+ * <code>*i</code> past it. A surrogate that is not part of a pair
+ * decodes to the replacement character.
+ */
+static uint32_t next_utf16_char(uint16_t const *str, size_t n, size_t *i,
+				int le)
+{
+  uint32_t c = get_utf16_unit(str, (*i)++, le);
+  uint32_t low;
+
+  if (c < 0xD800U || c >= 0xE000U)
+    return c;
+  if (c >= 0xDC00U || *i >= n)
+    return REPLACEMENT_CHARACTER;
+  low = get_utf16_unit(str, *i, le);
+  if (low < 0xDC00U || low >= 0xE000U)
+    return REPLACEMENT_CHARACTER;
+  (*i)++;
+  return 0x10000U + ((c - 0xD800U) << 10) + (low - 0xDC00U);
+}
+
+/**
+ * Decodes the character at position <code>*i</code> of a terminated
+ * UTF-8 string and moves <code>*i</code> past it. Malformed or
+ * overlong sequences, encoded surrogates and code points above
+ * U+10FFFF decode to the replacement character one byte at a time.
+ */
+static uint32_t next_utf8_char(unsigned char const *str, size_t *i)
+{
+  unsigned char const *p = &str[*i];
+  uint32_t c, min;
+  int need, j;
+
+  if (p[0] < 0x80U) {
+    (*i)++;
+    return p[0];
+  }
+  if (p[0] >= 0xC2U && p[0] < 0xE0U) {
+    c = p[0] & 0x1FU;
+    need = 1;
+    min = 0x80U;
+  } else if (p[0] >= 0xE0U && p[0] < 0xF0U) {
+    c = p[0] & 0x0FU;
+    need = 2;
+    min = 0x800U;
+  } else if (p[0] >= 0xF0U && p[0] < 0xF5U) {
+    c = p[0] & 0x07U;
+    need = 3;
+    min = 0x10000U;
+  } else {
+    (*i)++;
+    return REPLACEMENT_CHARACTER;
+  }
+  // The terminator is no continuation byte, so this stops at it
+  for (j = 1; j <= need; j++) {
+    if ((p[j] & 0xC0U) != 0x80U) {
+      (*i)++;
+      return REPLACEMENT_CHARACTER;
+    }
+    c = (c << 6) | (p[j] & 0x3FU);
+  }
+  if (c < min || c > 0x10FFFFU || (c >= 0xD800U && c < 0xE000U)) {
+    (*i)++;
+    return REPLACEMENT_CHARACTER;
+  }
+  *i += need + 1;
+  return c;
+}
+
+/**
+ * Writes a character as UTF-8, or just counts the bytes if
+ * <code>dest</code> is NULL.
+ * @return the number of bytes of the character.
+ */
+static size_t put_utf8_char(char *dest, uint32_t c)
+{
+  if (c < 0x80U) {
+    if (dest != NULL)
+      dest[0] = c;
+    return 1;
+  }
+  if (c < 0x800U) {
+    if (dest != NULL) {
+      dest[0] = 0xC0U | (c >> 6);
+      dest[1] = 0x80U | (c & 0x3FU);
+    }
+    return 2;
+  }
+  if (c < 0x10000U) {
+    if (dest != NULL) {
+      dest[0] = 0xE0U | (c >> 12);
+      dest[1] = 0x80U | ((c >> 6) & 0x3FU);
+      dest[2] = 0x80U | (c & 0x3FU);
+    }
+    return 3;
+  }
+  if (dest != NULL) {
+    dest[0] = 0xF0U | (c >> 18);
+    dest[1] = 0x80U | ((c >> 12) & 0x3FU);
+    dest[2] = 0x80U | ((c >> 6) & 0x3FU);
+    dest[3] = 0x80U | (c & 0x3FU);
+  }
+  return 4;
+}
+
+/**
+ * Converts <code>n</code> UTF-16 code units to UTF-8, or just
+ * measures the result if <code>dest</code> is NULL.
+ */
+static size_t convert_utf16_to_utf8(uint16_t const *src, size_t n, int le,
+				    char *dest)
+{
+  size_t size = 0;
+  size_t i;
+
+  for (i = 0; i < n; ) {
+    uint16_t unit = get_utf16_unit(src, i, le);
+
+    if (unit < 0x80U) {
+      if (dest != NULL)
+	dest[size] = unit;
+      size++;
+      i++;
+    } else {
+      size += put_utf8_char(dest != NULL ? dest + size : NULL,
+			    next_utf16_char(src, n, &i, le));
+    }
+  }
+  return size;
+}
+
+/**
+ * Converts a terminated UTF-8 string to UTF-16 code units, without a
+ * terminator, or just counts them if <code>dest</code> is NULL.
+ */
+static size_t convert_utf8_to_utf16(unsigned char const *src, int le,
+				    uint16_t *dest)
+{
+  size_t units = 0;
+  size_t i;
+
+  for (i = 0; src[i] != '\0'; ) {
+    uint32_t c;
+
+    if (src[i] < 0x80U) {
+      c = src[i++];
+    } else {
+      c = next_utf8_char(src, &i);
+    }
+    if (c >= 0x10000U) {
+      if (dest != NULL) {
+	c -= 0x10000U;
+	put_utf16_unit(dest, units, 0xD800U | (c >> 10), le);
+	put_utf16_unit(dest, units + 1, 0xDC00U | (c & 0x3FFU), le);
+      }
+      units += 2;
+    } else {
+      if (dest != NULL)
+	put_utf16_unit(dest, units, c, le);
+      units++;
+    }
+  }
+  return units;
+}
+
+/**
+ * Converts <code>n</code> UTF-16 code units in host byte order to
+ * UTF-8. Surrogates that are not part of a pair become the replacement
+ * character U+FFFD.
+ *
+ * @param src the UTF-16 code units to convert.
+ * @param n the number of code units.
+ * @param dest where to write the UTF-8, without a terminator, or NULL
+ *        to only measure it.
+ * @return the number of bytes of UTF-8.
+ */
+size_t utf16_units_to_utf8(uint16_t const *src, size_t n, char *dest)
+{
+  return convert_utf16_to_utf8(src, n, 0, dest);
+}
+
+/**
+ * Converts a UTF-8 string to UTF-16 code units in host byte order.
+ * Invalid UTF-8 becomes the replacement character U+FFFD.
+ *
+ * @param src the UTF-8 string to convert.
+ * @param dest where to write the code units, without a terminator, or
+ *        NULL to only count them.
+ * @return the number of code units.
+ */
+size_t utf8_to_utf16_units(char const *src, uint16_t *dest)
+{
+  return convert_utf8_to_utf16((unsigned char const *) src, 0, dest);
+}
+
+/**
+ * Converts a little-endian UTF-16 string to a UTF-8 string, stripping
+ * off the BOM if there is one. Surrogates that are not part of a pair
+ * become the replacement character U+FFFD.
  *
  * @param device a pointer to the current device.
  * @param unicstr the UTF-16 unicode string to convert
- * @return a UTF-8 string.
+ * @return a UTF-8 string, or NULL if out of memory.
  */
 char *utf16_to_utf8(LIBMTP_mtpdevice_t *device, const uint16_t *unicstr)
 {
-  PTPParams *params = (PTPParams *) device->params;
-  char *stringp = (char *) unicstr;
-  char loclstr[STRING_BUFFER_LENGTH*3+1]; // UTF-8 encoding is max 3 bytes per UCS2 char.
-  char *locp = loclstr;
-  size_t nconv;
-  size_t convlen = (ucs2_strlen(unicstr)+1) * sizeof(uint16_t); // UCS-2 is 16 bit wide, include terminator
-  size_t convmax = STRING_BUFFER_LENGTH*3;
-
-  loclstr[0]='\0';
-  /* Do the conversion.  */
-  nconv = iconv(params->cd_ucs2_to_locale, &stringp, &convlen, &locp, &convmax);
-  if (nconv == (size_t) -1) {
-    // Return partial string anyway.
-    *locp = '\0';
-  }
-  loclstr[STRING_BUFFER_LENGTH*3] = '\0';
+  size_t n = ucs2_strlen(unicstr);
+  size_t size;
+  char *ret;
+
   // Strip off any BOM, it's totally useless...
-  if ((uint8_t) loclstr[0] == 0xEFU && (uint8_t) loclstr[1] == 0xBBU && (uint8_t) loclstr[2] == 0xBFU) {
-    return strdup(loclstr+3);
+  if (n > 0 && get_utf16_unit(unicstr, 0, 1) == 0xFEFFU) {
+    unicstr++;
+    n--;
   }
-  return strdup(loclstr);
+  // Measure first, so the result is allocated at its exact size
+  size = convert_utf16_to_utf8(unicstr, n, 1, NULL);
+  ret = malloc(size + 1);
+  if (ret == NULL)
+    return NULL;
+  convert_utf16_to_utf8(unicstr, n, 1, ret);
+  ret[size] = '\0';
+  return ret;
 }
 
 /**
- * Converts a UTF-8 string to a big-endian UTF-16 2-byte string
- * Actually just a UCS-2 internal conversion.
+ * Converts a UTF-8 string to a little-endian UTF-16 string. Invalid
+ * UTF-8 becomes the replacement character U+FFFD.
  *
  * @param device a pointer to the current device.
  * @param localstr the UTF-8 unicode string to convert
- * @return a UTF-16 string.
+ * @return a UTF-16 string, or NULL if out of memory.
  */
 uint16_t *utf8_to_utf16(LIBMTP_mtpdevice_t *device, const char *localstr)
 {
-  PTPParams *params = (PTPParams *) device->params;
-  char *stringp = (char *) localstr; // cast away "const"
-  char unicstr[(STRING_BUFFER_LENGTH+1)*2]; // UCS2 encoding is 2 bytes per UTF-8 char.
-  char *unip = unicstr;
-  size_t nconv = 0;
-  size_t convlen = strlen(localstr)+1; // utf8 bytes, include terminator
-  size_t convmax = STRING_BUFFER_LENGTH*2;
-
-  unicstr[0]='\0';
-  unicstr[1]='\0';
-
-  /* Do the conversion.  */
-  nconv = iconv(params->cd_locale_to_ucs2, &stringp, &convlen, &unip, &convmax);
-
-  if (nconv == (size_t) -1) {
-    // Return partial string anyway.
-    unip[0] = '\0';
-    unip[1] = '\0';
-  }
-  // make sure the string is null terminated
-  unicstr[STRING_BUFFER_LENGTH*2] = '\0';
-  unicstr[STRING_BUFFER_LENGTH*2+1] = '\0';
-
-  // allocate the string to be returned
-  // Note: can't use strdup since every other byte is a null byte
-  int ret_len = ucs2_strlen((uint16_t*)unicstr)*sizeof(uint16_t)+2;
-  uint16_t* ret = malloc(ret_len);
-  memcpy(ret,unicstr,(size_t)ret_len);
+  unsigned char const *str = (unsigned char const *) localstr;
+  size_t units;
+  uint16_t *ret;
+
+  // Measure first, so the result is allocated at its exact size
+  units = convert_utf8_to_utf16(str, 1, NULL);
+  ret = malloc((units + 1) * sizeof(uint16_t));
+  if (ret == NULL)
+    return NULL;
+  convert_utf8_to_utf16(str, 1, ret);
+  put_utf16_unit(ret, units, 0x0000U, 1);
   return ret;
 }
 
@@ -32,9 +32,17 @@
 #ifndef __MTP__UNICODE__H
 #define __MTP__UNICODE__H
 
+#include <stddef.h>
+#include <stdint.h>
+
+/* The PTP layer uses the codec too, without the rest of libmtp.h */
+struct LIBMTP_mtpdevice_struct;
+
 int ucs2_strlen(uint16_t const * const);
-char *utf16_to_utf8(LIBMTP_mtpdevice_t*,const uint16_t*);
-uint16_t *utf8_to_utf16(LIBMTP_mtpdevice_t*, const char*);
+char *utf16_to_utf8(struct LIBMTP_mtpdevice_struct*,const uint16_t*);
+uint16_t *utf8_to_utf16(struct LIBMTP_mtpdevice_struct*, const char*);
+size_t utf16_units_to_utf8(uint16_t const *src, size_t n, char *dest);
+size_t utf8_to_utf16_units(char const *src, uint16_t *dest);
 void strip_7bit_from_utf8(char *str);
 
 #endif /* __MTP__UNICODE__H */
@@ -27,6 +27,9 @@
 #include <sys/time.h>
 #include <unistd.h>
 #endif
+#if defined(__WIN32__) || defined(_MSC_VER)
+#include <windows.h>
+#endif
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -34,6 +37,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string.h>
+#include <time.h>
 #include "config.h"
 #include "libmtp.h"
 #include "util.h"
@@ -150,3 +154,27 @@ char *strndup (const char *s, size_t n)
 }
 #endif
 
+
+/**
+ * This returns a monotonic time in milliseconds, used to measure how
+ * long operations take. Changes to the wall clock do not affect it,
+ * except on systems that lack a monotonic clock.
+ *
+ * @return milliseconds since some arbitrary point in time.
+ */
+uint64_t get_time_msec(void)
+{
+#if defined(__WIN32__) || defined(_MSC_VER)
+  return (uint64_t) GetTickCount64();
+#else
+  struct timeval tv;
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+  gettimeofday(&tv, NULL);
+  return (uint64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+}
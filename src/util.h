@@ -30,6 +30,7 @@ void data_dump_ascii (FILE *f, void *buf, uint32_t n, uint32_t dump_boundry);
 char *strndup (const char *s, size_t n);
 #endif
 void device_unknown(const int dev_number, const int id_vendor, const int id_product);
+uint64_t get_time_msec(void);
 
 /**
  * Info macro